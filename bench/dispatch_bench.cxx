@@ -0,0 +1,90 @@
+/**
+ * Measures the per-request cost of Router::handle: route lookup, the
+ * middleware chain and the handler call, and counts heap allocations
+ * made during dispatch.
+ *
+ * USAGE: dispatch_bench [NUM_REQUESTS]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "http.hxx"
+#include "router.hxx"
+
+using namespace Kleptic;
+
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t n) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(n)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static void run(const char *name, const Router &r, const char *path, int num_requests) {
+  HTTPConn c;
+  c.method = "GET";
+  c.req_path = path;
+
+  uint64_t allocs_before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_requests; ++i) {
+    r.handle(c);
+  }
+  auto dur = std::chrono::steady_clock::now() - start;
+  uint64_t allocs = allocations.load() - allocs_before;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(dur).count();
+  std::cout << name << ": " << static_cast<double>(ns) / num_requests << " ns/req, "
+            << static_cast<double>(allocs) / num_requests << " allocs/req" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  const int num_requests = (argc > 1) ? atoi(argv[1]) : 2000000;
+
+  // captures large enough to live on the heap, like create_static_handler
+  std::string root = "./http-root-dir/htdocs";
+  std::string tmpl = "templates/static.html.ktf";
+  auto handler = [root, tmpl](HTTPConn &c) { c.resp_status = 200; };
+  auto check = [root](HTTPConn &c) { c.auth_type = "Basic"; };
+
+  Router bare;
+  bare.r_get("/", handler);
+  bare.r_get("/stats", handler);
+  for (int i = 0; i < 200; ++i) {
+    bare.r_get("/api/v1/res" + std::to_string(i), handler);
+  }
+
+  Router global;
+  for (int i = 0; i < 3; ++i) {
+    global.add_middleware(check);
+  }
+  global.r_get("/", handler);
+  global.r_get("/stats", handler);
+  for (int i = 0; i < 200; ++i) {
+    global.r_get("/api/v1/res" + std::to_string(i), handler);
+  }
+
+  Router per_route;
+  per_route.r_get("/", handler);
+  per_route.r_get("/stats", handler, check, check, check);
+  for (int i = 0; i < 200; ++i) {
+    per_route.r_get("/api/v1/res" + std::to_string(i), handler);
+  }
+
+  run("no middleware", bare, "/api/v1/res150", num_requests);
+  run("3 global middleware", global, "/api/v1/res150", num_requests);
+  run("3 route middleware, other route", per_route, "/api/v1/res150", num_requests);
+  run("3 route middleware, own route", per_route, "/stats", num_requests);
+  run("not found", global, "/missing", num_requests);
+  return 0;
+}
@@ -0,0 +1,136 @@
+/**
+ * Measures HTTPS file serving throughput on loopback with kernel TLS
+ * offload on and off, and plain HTTP sendfile as the ceiling.
+ *
+ * Each server runs in this process and answers every request with the
+ * same file through HTTPConn::resp_file, the client downloads it over
+ * a new connection each time and decrypts in userspace. whether kTLS
+ * actually engaged is reported from the server's TLS stats: without
+ * the kernel's tls module both TLS runs take the SSL_write path.
+ *
+ * USAGE: ktls_bench [FILE_MB] [NUM_DOWNLOADS]
+ *   run from a directory with priv/cert.pem and priv/key.pem, like httpd -s
+ */
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "concurrency.hxx"
+#include "http.hxx"
+#include "tcp_sock.hxx"
+
+using namespace Kleptic;
+
+static const std::string request = "GET /file HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+/* downloads the file once, returns the bytes received (head included) */
+static size_t download(int port, SSL_CTX *client) {
+  sock_ptr s = tcp_connect("127.0.0.1", port, std::chrono::milliseconds(2000));
+  std::vector<char> buff(1 << 16);
+  size_t total = 0;
+  if (client == nullptr) {
+    s->write(request);
+    int ret;
+    while ((ret = s->read(buff.data(), static_cast<int>(buff.size()))) > 0) {
+      total += ret;
+    }
+    return total;
+  }
+  ssl_t ssl(SSL_new(client), SSL_free);
+  SSL_set_fd(ssl.get(), s->_socket_fd);
+  if (SSL_connect(ssl.get()) != 1) {
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+  SSL_write(ssl.get(), request.data(), static_cast<int>(request.size()));
+  int ret;
+  while ((ret = SSL_read(ssl.get(), buff.data(), static_cast<int>(buff.size()))) > 0) {
+    total += ret;
+  }
+  return total;
+}
+
+static void run(const char *name, int port, SSL_CTX *client, size_t file_size, int downloads) {
+  download(port, client);  // warm up the page cache and the session
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < downloads; ++i) {
+    if (download(port, client) < file_size) {
+      std::cerr << name << ": short download" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  auto dur = std::chrono::steady_clock::now() - start;
+  double secs = std::chrono::duration<double>(dur).count();
+  double mb = static_cast<double>(file_size) * downloads / (1 << 20);
+  std::cout << name << ": " << mb / secs << " MB/s, " << secs * 1000 / downloads
+            << " ms/download" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  const size_t file_mb = (argc > 1) ? atoi(argv[1]) : 64;
+  const int downloads = (argc > 2) ? atoi(argv[2]) : 20;
+
+  char path[] = "/tmp/ktls_bench.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return EXIT_FAILURE;
+  }
+  std::vector<char> chunk(1 << 20);
+  for (size_t i = 0; i < chunk.size(); ++i) {
+    chunk[i] = static_cast<char>(i * 2654435761u >> 24);
+  }
+  for (size_t i = 0; i < file_mb; ++i) {
+    if (::write(fd, chunk.data(), chunk.size()) != static_cast<ssize_t>(chunk.size())) {
+      perror("write");
+      return EXIT_FAILURE;
+    }
+  }
+  close(fd);
+  const size_t file_size = file_mb * chunk.size();
+  const std::string file(path);
+  auto handler = [file](HTTPConn &c) {
+    c.resp_headers["Content-Type"] = "application/octet-stream";
+    c.resp_file = file;
+  };
+
+  Concurrency::runner_t exec = std::make_unique<Concurrency::ThreadPoolRunner>(2);
+  HTTPServer plain("127.0.0.1", 4870, exec, "ktls_bench.log");
+  TLS::HandshakeOptions with_ktls;
+  TLS::HandshakeOptions without_ktls;
+  without_ktls.ktls = false;
+  SecureHTTPServer offload(tls_cert_key_pair("priv/cert.pem", "priv/key.pem"), "127.0.0.1", 4871,
+                           exec, "ktls_bench.log", TLS::SessionOptions(), with_ktls);
+  SecureHTTPServer userspace(tls_cert_key_pair("priv/cert.pem", "priv/key.pem"), "127.0.0.1",
+                             4872, exec, "ktls_bench.log", TLS::SessionOptions(), without_ktls);
+  std::thread([&] { plain.run(handler); }).detach();
+  std::thread([&] { offload.run(handler); }).detach();
+  std::thread([&] { userspace.run(handler); }).detach();
+
+  ssl_ctx_t client(SSL_CTX_new(TLS_client_method()), SSL_CTX_free);
+  SSL_CTX_set_verify(client.get(), SSL_VERIFY_NONE, nullptr);
+
+  std::cout << downloads << " downloads of " << file_mb << " MB" << std::endl;
+  run("http sendfile", 4870, nullptr, file_size, downloads);
+  run("https kTLS", 4871, client.get(), file_size, downloads);
+  run("https SSL_write", 4872, client.get(), file_size, downloads);
+  std::cout << "kTLS engaged on " << offload.tls_stats().ktls_connections << "/"
+            << offload.tls_stats().full_handshakes + offload.tls_stats().resumed_handshakes
+            << " connections" << std::endl;
+
+  unlink(path);
+  // the servers never return from run
+  std::cout.flush();
+  _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,97 @@
+/**
+ * Measures what logging a line costs the thread that logs it: a write()
+ * per line under a mutex, the way Logger::record used to, against
+ * LogWriter's per-thread buffers with batched writevs in the background.
+ * Every thread logs the same number of access-log sized lines, the
+ * file is checked for all of them afterwards.
+ *
+ * USAGE: log_bench [THREADS] [LINES_PER_THREAD]
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log_writer.hxx"
+
+using namespace Kleptic;
+
+static const char *path = "/tmp/log_bench.log";
+
+static size_t count_lines() {
+  std::ifstream in(path);
+  return std::count(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>(), '\n');
+}
+
+template <typename F>
+static void run(const std::string &name, int threads, int lines, F log) {
+  std::vector<std::thread> workers;
+  std::vector<std::vector<int64_t>> lat(threads);
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      std::string line = "127.0.0.1 /index.html " + std::to_string(t) + " 200 1234 0.42ms";
+      lat[t].reserve(lines);
+      for (int i = 0; i < lines; ++i) {
+        auto s = std::chrono::steady_clock::now();
+        log(line);
+        lat[t].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now() - s)
+                             .count());
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  auto dur = std::chrono::steady_clock::now() - start;
+
+  std::vector<int64_t> all;
+  for (auto &l : lat) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  std::sort(all.begin(), all.end());
+  double secs = std::chrono::duration<double>(dur).count();
+  std::cout << name << ": " << all.size() / secs / 1000 << "K lines/s ; per line p50 "
+            << all[all.size() / 2] << "ns, p99 " << all[all.size() * 99 / 100] << "ns, max "
+            << all.back() << "ns" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  const int threads = (argc > 1) ? atoi(argv[1]) : 4;
+  const int lines = (argc > 2) ? atoi(argv[2]) : 200000;
+  const size_t expected = static_cast<size_t>(threads) * lines;
+
+  unlink(path);
+  {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    std::mutex m;
+    run("write per line", threads, lines, [&](const std::string &line) {
+      std::string s = line + "\n";
+      std::lock_guard<std::mutex> l(m);
+      ::write(fd, s.c_str(), s.size());
+    });
+    close(fd);
+  }
+  std::cout << "  " << count_lines() << "/" << expected << " lines written" << std::endl;
+
+  unlink(path);
+  uint64_t dropped;
+  {
+    LogWriter w(path);
+    run("LogWriter", threads, lines, [&](const std::string &line) { w.append(line); });
+    dropped = w.dropped();
+  }
+  std::cout << "  " << count_lines() << "/" << expected << " lines written, " << dropped
+            << " dropped" << std::endl;
+  unlink(path);
+}
@@ -0,0 +1,89 @@
+/**
+ * Measures recording a request's stats from many threads at once: the
+ * count, min and max in a map behind a mutex, the way httpd kept them,
+ * against a Metrics::Registry counter and latency histogram, both looked
+ * up by labels per request the way HTTPServer::observe does and through
+ * handles held by the caller. Totals are checked afterwards.
+ *
+ * USAGE: metrics_bench [THREADS] [REQUESTS_PER_THREAD]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hxx"
+
+using namespace Kleptic;
+
+template <typename F>
+static void run(const std::string &name, int threads, int requests, F record) {
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      for (int i = 0; i < requests; ++i) {
+        // a made up service time between 50us and ~3ms
+        record(t, 50000 + (static_cast<uint64_t>(i) * 7919 % 3000000));
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double total = static_cast<double>(threads) * requests;
+  std::cout << name << ": " << total / secs / 1e6 << "M req/s ; " << secs * 1e9 / total
+            << "ns per request" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  const int threads = (argc > 1) ? atoi(argv[1]) : 4;
+  const int requests = (argc > 2) ? atoi(argv[2]) : 1000000;
+  const uint64_t expected = static_cast<uint64_t>(threads) * requests;
+
+  {
+    std::mutex m;
+    std::map<std::string, double> nd;
+    run("mutex map", threads, requests, [&](int, uint64_t ns) {
+      std::lock_guard<std::mutex> l(m);
+      nd["NUM_REQ"] += 1;
+      if (nd.find("MAX_REQ_TIME") == nd.end() || ns > nd["MAX_REQ_TIME"]) {
+        nd["MAX_REQ_TIME"] = ns;
+      }
+      if (nd["MIN_REQ_TIME"] == 0 || ns < nd["MIN_REQ_TIME"]) {
+        nd["MIN_REQ_TIME"] = ns;
+      }
+    });
+    std::cout << "  " << nd["NUM_REQ"] << "/" << expected << " counted" << std::endl;
+  }
+
+  {
+    Metrics::Registry reg;
+    run("Registry, lookup per request", threads, requests, [&](int, uint64_t ns) {
+      const Metrics::labels_t labels = {{"route", "/"}, {"method", "GET"}, {"code", "200"}};
+      reg.counter("http_requests_total", labels).inc();
+      reg.histogram("http_request_duration_seconds", labels).observe(ns);
+    });
+    Metrics::HistogramSnapshot h = reg.histogram_total("http_request_duration_seconds");
+    std::cout << "  " << reg.counter_total("http_requests_total") << "/" << expected
+              << " counted ; p50 " << h.quantile(0.5) << "ns, p99 " << h.quantile(0.99) << "ns"
+              << std::endl;
+  }
+
+  {
+    Metrics::Registry reg;
+    Metrics::Counter c = reg.counter("http_requests_total");
+    Metrics::Histogram hist = reg.histogram("http_request_duration_seconds");
+    run("Registry, held handles", threads, requests, [&](int, uint64_t ns) {
+      c.inc();
+      hist.observe(ns);
+    });
+    std::cout << "  " << c.value() << "/" << expected << " counted" << std::endl;
+  }
+}
@@ -0,0 +1,76 @@
+/**
+ * Compares BlockingQueue and MPMCQueue under contention. Every round runs
+ * the same number of producer and consumer threads passing integers
+ * through a queue of the given capacity.
+ *
+ * USAGE: queue_bench [ITEMS_PER_PRODUCER] [CAPACITY]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bqueue.hxx"
+#include "mpmc_queue.hxx"
+
+using namespace Kleptic;
+
+template <typename Q>
+static void run(const std::string &name, int threads, int items, size_t cap) {
+  Q q(cap);
+  std::vector<std::thread> producers;
+  std::vector<std::thread> consumers;
+  std::vector<uint64_t> sums(threads, 0);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < threads; ++i) {
+    consumers.emplace_back([&q, &sums, i, items] {
+      uint64_t sum = 0;
+      for (int n = 0; n < items; ++n) {
+        sum += q.pop();
+      }
+      sums[i] = sum;
+    });
+  }
+  for (int i = 0; i < threads; ++i) {
+    producers.emplace_back([&q, items] {
+      for (int n = 1; n <= items; ++n) {
+        q.push(n);
+      }
+    });
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+  for (auto &t : consumers) {
+    t.join();
+  }
+  auto dur = std::chrono::steady_clock::now() - start;
+
+  uint64_t total = 0;
+  for (auto s : sums) {
+    total += s;
+  }
+  uint64_t expected = static_cast<uint64_t>(threads) * items * (items + 1ull) / 2;
+
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(dur).count();
+  uint64_t ops = static_cast<uint64_t>(threads) * items;
+  std::cout << name << " " << threads << "P/" << threads << "C: " << ops * 1e9 / ns
+            << " items/s (" << ns / 1e6 << " ms)" << (total == expected ? "" : " CHECKSUM MISMATCH")
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  const int items = (argc > 1) ? atoi(argv[1]) : 1000000;
+  const size_t cap = (argc > 2) ? atoi(argv[2]) : 1024;
+
+  std::cout << items << " items per producer, capacity " << cap << std::endl;
+  for (int threads : {1, 2, 4, 8}) {
+    run<BlockingQueue<uint64_t>>("BlockingQueue", threads, items, cap);
+    run<MPMCQueue<uint64_t>>("MPMCQueue    ", threads, items, cap);
+  }
+  return 0;
+}
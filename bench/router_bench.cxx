@@ -0,0 +1,74 @@
+/**
+ * Measures Router::match over a table of a few thousand routes mixing
+ * static paths, :param captures and *wildcard tails.
+ *
+ * USAGE: router_bench [NUM_ROUTES] [NUM_LOOKUPS]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "http.hxx"
+#include "router.hxx"
+
+using namespace Kleptic;
+
+int main(int argc, char **argv) {
+  const int num_routes = (argc > 1) ? atoi(argv[1]) : 5000;
+  const int num_lookups = (argc > 2) ? atoi(argv[2]) : 2000000;
+
+  Router r;
+  std::vector<std::string> paths;
+  auto noop = [](HTTPConn &) {};
+
+  for (int i = 0; i < num_routes; ++i) {
+    std::string svc = "/api/v" + std::to_string(i % 4) + "/svc" + std::to_string(i / 4);
+    switch (i % 4) {
+      case 0:
+        r.r_get(svc, noop);
+        paths.push_back(svc);
+        break;
+      case 1:
+        r.r_get(svc + "/users/:id", noop);
+        paths.push_back(svc + "/users/" + std::to_string(i));
+        break;
+      case 2:
+        r.r_post(svc + "/users/:id/posts/:post", noop);
+        paths.push_back(svc + "/users/42/posts/" + std::to_string(i));
+        break;
+      default:
+        r.r_get(svc + "/static/*file", noop);
+        paths.push_back(svc + "/static/css/site" + std::to_string(i) + ".css");
+        break;
+    }
+  }
+
+  std::mt19937 rng(1234);
+  std::uniform_int_distribution<size_t> pick(0, paths.size() - 1);
+  std::vector<size_t> order(num_lookups);
+  for (auto &o : order) {
+    o = pick(rng);
+  }
+
+  size_t found = 0;
+  size_t params = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t idx : order) {
+    RouteMatch m = r.match(paths[idx]);
+    found += m.found();
+    params += m.num_params;
+  }
+  auto dur = std::chrono::steady_clock::now() - start;
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(dur).count();
+
+  std::cout << "routes: " << num_routes << std::endl;
+  std::cout << "lookups: " << num_lookups << " (" << found << " matched, " << params
+            << " params captured)" << std::endl;
+  std::cout << "ns/lookup: " << static_cast<double>(ns) / num_lookups << std::endl;
+  std::cout << "lookups/s: " << num_lookups * 1e9 / ns << std::endl;
+  return (found == static_cast<size_t>(num_lookups)) ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+/**
+ * Compares ThreadPoolRunner and WorkStealingRunner.
+ *
+ * "external" dispatches every task from one thread, the way
+ * SocketServer::run hands off connections. "fan-out" has tasks dispatch
+ * their own children, which only the work-stealing runner supports
+ * (pool workers pushing into their own full queue would deadlock).
+ *
+ * USAGE: runner_bench [NUM_THREADS] [NUM_TASKS] [WORK_PER_TASK]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "concurrency.hxx"
+
+using namespace Kleptic;
+
+static std::atomic<uint64_t> done{0};
+static std::atomic<uint64_t> sink{0};
+
+static void busy_work(int units) {
+  uint64_t x = 0;
+  for (int i = 0; i < units; ++i) {
+    x += static_cast<uint64_t>(i) * 2654435761u;
+  }
+  sink.fetch_add(x, std::memory_order_relaxed);
+}
+
+static void wait_for(uint64_t target) {
+  while (done.load(std::memory_order_acquire) < target) {
+    std::this_thread::yield();
+  }
+}
+
+static void report(const std::string &name, uint64_t tasks,
+                   std::chrono::steady_clock::duration dur) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(dur).count();
+  std::cout << name << ": " << tasks * 1e9 / ns << " tasks/s (" << ns / 1e6 << " ms)" << std::endl;
+}
+
+static void external(const std::string &name, Concurrency::ConcurrentRunner &r, int tasks,
+                     int work) {
+  done = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < tasks; ++i) {
+    r.dispatch(Concurrency::task_t([work] {
+      busy_work(work);
+      done.fetch_add(1, std::memory_order_release);
+    }));
+  }
+  wait_for(tasks);
+  report(name + " external", tasks, std::chrono::steady_clock::now() - start);
+}
+
+static void fan_out(const std::string &name, Concurrency::ConcurrentRunner &r, int tasks,
+                    int work) {
+  const int children = 64;
+  const int roots = tasks / children;
+  done = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < roots; ++i) {
+    r.dispatch(Concurrency::task_t([&r, work, children] {
+      for (int c = 0; c < children; ++c) {
+        r.dispatch(Concurrency::task_t([work] {
+          busy_work(work);
+          done.fetch_add(1, std::memory_order_release);
+        }));
+      }
+    }));
+  }
+  wait_for(static_cast<uint64_t>(roots) * children);
+  report(name + " fan-out", static_cast<uint64_t>(roots) * children,
+         std::chrono::steady_clock::now() - start);
+}
+
+int main(int argc, char **argv) {
+  const int threads = (argc > 1) ? atoi(argv[1]) : std::thread::hardware_concurrency();
+  const int tasks = (argc > 2) ? atoi(argv[2]) : 500000;
+  const int work = (argc > 3) ? atoi(argv[3]) : 200;
+
+  std::cout << threads << " threads, " << tasks << " tasks, " << work << " work units"
+            << std::endl;
+
+  {
+    // pool workers are detached and never exit, so this one is leaked
+    auto *pool = new Concurrency::ThreadPoolRunner(threads);
+    external("ThreadPoolRunner", *pool, tasks, work);
+  }
+
+  {
+    Concurrency::WorkStealingRunner ws(threads);
+    external("WorkStealingRunner", ws, tasks, work);
+    fan_out("WorkStealingRunner", ws, tasks, work);
+    ws.shutdown();
+
+    int id = 0;
+    for (const auto &s : ws.stats()) {
+      std::cout << "  worker " << id++ << ": executed " << s.executed << ", stolen " << s.stolen
+                << ", parked " << s.parked << std::endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+#include <chrono>
+#include <iostream>
+
+#include "event_loop.hxx"
+#include "handler.hxx"
+#include "http.hxx"
+#include "router.hxx"
+
+using namespace Kleptic;
+using namespace std::chrono_literals;
+
+Async::task<void> slow(HTTPConn &c) {
+  // holds no thread while it waits
+  co_await Async::sleep_for(200ms);
+  c.resp_headers["Content-Type"] = "text/plain";
+  c.resp_body << "done waiting" << std::endl;
+}
+
+Async::task<void> show_file(HTTPConn &c) {
+  try {
+    c.resp_body << co_await Async::read_file("async_server.log");
+    c.resp_headers["Content-Type"] = "text/plain";
+  } catch (AsyncException &) {
+    Handler::not_found_handler(c);
+  }
+}
+
+int main() {
+  HTTPServer server("0.0.0.0", 4858, "async_server.log");
+
+  Router r;
+  // plain handlers still work and run inline on the loop
+  r.r_get("/hello", [](HTTPConn &c) {
+    c.resp_headers["Content-Type"] = "text/plain";
+    c.resp_body << "hello from a plain handler" << std::endl;
+  });
+  r.r_get("/slow", slow);
+  r.r_get("/log", show_file);
+  // blocking handlers can be pushed off the loop
+  r.r_get("/", Handler::offload_handler(Handler::derive_http_handler(
+                         Handler::create_static_handler("./http-root-dir/htdocs"))));
+  r.r_get("/cgi-bin", Handler::create_async_cgi_handler("./http-root-dir/"));
+
+  server.run_async([&r](HTTPConn &c) { return r.handle_async(c); });
+}
@@ -0,0 +1,42 @@
+/**
+ * Prints an event log, what Logger::set_event_log writes, as text.
+ *
+ * USAGE: event_log FILE
+ */
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include "error.hxx"
+#include "logger.hxx"
+
+using namespace Kleptic;
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    std::cerr << "USAGE: event_log FILE" << std::endl;
+    return 1;
+  }
+  std::ifstream in(argv[1], std::ios::binary);
+  if (!in) {
+    std::cerr << "Can't open " << argv[1] << std::endl;
+    return 1;
+  }
+  const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  LogEvent ev;
+  std::string_view rest(data);
+  try {
+    while (!rest.empty()) {
+      rest.remove_prefix(ev.decode(rest));
+      std::cout << ev.serialize().str() << std::endl;
+    }
+  } catch (ParseException &ex) {
+    std::cerr << ex.what() << " at byte " << data.size() - rest.size() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -13,7 +13,9 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
+#include "cache.hxx"
 #include "concurrency.hxx"
 #include "handler.hxx"
 #include "http.hxx"
@@ -21,13 +23,18 @@
 #include "router.hxx"
 
 #define LOGFILE "httpd.log"
+#define EVENTLOG "httpd.events"
 namespace k = Kleptic;
 
 enum concurrency_mode {
   E_NO_CONCURRENCY = 0,
   E_FORK_PER_REQUEST = 'f',
   E_THREAD_PER_REQUEST = 't',
-  E_THREAD_POOL = 'p'
+  E_THREAD_POOL = 'p',
+  E_PREFORK = 'w',
+  E_PER_CORE = 'c',
+  E_ELASTIC_POOL = 'e',
+  E_QOS_POOL = 'q'
 };
 
 extern "C" void signal_handler(int) { exit(0); }
@@ -54,8 +61,14 @@ int main(int argc, char **argv) {
   char use_https = 0;
   int port_no = 0;
   int num_threads = 0;  // for use when running in pool of threads mode
+  int num_workers = 0;  // for use when running in prefork mode
+  k::Concurrency::ElasticOptions elastic_opts;  // for use when running in elastic pool mode
+  std::vector<int> cpus;  // for use when running in thread per core mode
 
-  char usage[] = "USAGE: myhttpd [-f|-t|-pNUM_THREADS] [-s] [-h] PORT_NO\n";
+  char usage[] =
+      "USAGE: myhttpd [-f|-t|-pNUM_THREADS|-qNUM_THREADS|-eMIN-MAX|-wNUM_WORKERS|-cCPU_LIST] "
+      "[-s] [-h] "
+      "PORT_NO\n";
 
   if (argc == 1) {
     fputs(usage, stdout);
@@ -63,7 +76,7 @@ int main(int argc, char **argv) {
   }
 
   int c;
-  while ((c = getopt(argc, argv, "hftp:s")) != -1) {
+  while ((c = getopt(argc, argv, "hftp:q:e:w:c:s")) != -1) {
     switch (c) {
       case 'h':
         fputs(usage, stdout);
@@ -71,14 +84,36 @@ int main(int argc, char **argv) {
       case 'f':
       case 't':
       case 'p':
+      case 'w':
+      case 'c':
+      case 'e':
+      case 'q':
         if (mode != E_NO_CONCURRENCY) {
           fputs("Multiple concurrency modes specified\n", stdout);
           fputs(usage, stderr);
           return -1;
         }
         mode = (enum concurrency_mode) c;
-        if (mode == E_THREAD_POOL) {
+        if (mode == E_THREAD_POOL || mode == E_QOS_POOL) {
           num_threads = stoi(std::string(optarg));
+        } else if (mode == E_ELASTIC_POOL) {
+          if (sscanf(optarg, "%d-%d", &elastic_opts.min_workers, &elastic_opts.max_workers) != 2) {
+            fputs(usage, stderr);
+            return 1;
+          }
+        } else if (mode == E_PREFORK) {
+          num_workers = stoi(std::string(optarg));
+        } else if (mode == E_PER_CORE) {
+          // "all" pins one thread to every cpu we may run on
+          try {
+            if (std::string(optarg) != "all") {
+              cpus = k::PerCore::parse_cpu_list(optarg);
+            }
+          } catch (k::ConcurrencyException &ex) {
+            std::cerr << ex.what() << std::endl;
+            fputs(usage, stderr);
+            return 1;
+          }
         }
         break;
       case 's':
@@ -110,6 +145,8 @@ int main(int argc, char **argv) {
   printf("%d %d %d %d\n", mode, use_https, port_no, num_threads);
 
   k::Concurrency::runner_t exec;
+  k::Concurrency::ElasticRunner *elastic = nullptr;
+  k::Concurrency::QoSRunner *qos = nullptr;
   switch (mode) {
     case E_FORK_PER_REQUEST:
       exec = std::make_unique<k::Concurrency::ForkRunner>();
@@ -118,53 +155,70 @@ int main(int argc, char **argv) {
       exec = std::make_unique<k::Concurrency::ThreadRunner>();
       break;
     case E_THREAD_POOL:
-      exec = std::make_unique<k::Concurrency::ThreadPoolRunner>(num_threads);
+      exec = std::make_unique<k::Concurrency::WorkStealingRunner>(num_threads);
+      break;
+    case E_QOS_POOL:
+      exec = std::make_unique<k::Concurrency::QoSRunner>(num_threads);
+      qos = static_cast<k::Concurrency::QoSRunner *>(exec.get());
+      break;
+    case E_ELASTIC_POOL:
+      exec = std::make_unique<k::Concurrency::ElasticRunner>(elastic_opts);
+      elastic = static_cast<k::Concurrency::ElasticRunner *>(exec.get());
+      break;
+    case E_PREFORK:
+      exec = std::make_unique<k::Concurrency::PreforkRunner>(num_workers);
       break;
     default:
       exec = std::make_unique<k::Concurrency::SingleRunner>();
       break;
   }
   std::unique_ptr<k::HTTPServer> server;
+  k::PerCoreHTTPServer *per_core = nullptr;
+  k::SecureHTTPServer *secure = nullptr;
 
-  if (use_https) {
-    server = std::make_unique<k::SecureHTTPServer>(
-        k::tls_cert_key_pair("priv/cert.pem", "priv/key.pem"), "0.0.0.0", port_no, exec, LOGFILE);
+  if (mode == E_PER_CORE) {
+    if (use_https) {
+      std::cerr << "HTTPS is not supported in thread per core mode" << std::endl;
+      return 1;
+    }
+    auto pc = std::make_unique<k::PerCoreHTTPServer>(cpus, "0.0.0.0", port_no, LOGFILE);
+    per_core = pc.get();
+    server = std::move(pc);
+  } else if (use_https) {
+    k::TLS::SessionOptions sessions;
+    // worker processes accept on their own, they resume each other's sessions
+    if (mode == E_PREFORK || mode == E_FORK_PER_REQUEST) {
+      sessions.cache = k::TLS::CACHE_SHARED;
+    }
+    auto ss = std::make_unique<k::SecureHTTPServer>(
+        k::tls_cert_key_pair("priv/cert.pem", "priv/key.pem"), "0.0.0.0", port_no, exec, LOGFILE,
+        sessions);
+    secure = ss.get();
+    server = std::move(ss);
   } else {
     server = std::make_unique<k::HTTPServer>("0.0.0.0", port_no, exec, LOGFILE);
   }
 
   k::Logger &logger = server->logger;
-
-  logger.on_ev_end([&](k::LogEvent &e) {
-    // std::cout << e.get_name() << std::endl;
-
-    if (e.get_name().compare("HTTP_REQ_EV")) {
-      return;
-    }
-
-    // std::cout << " hiya " << std::endl;
-    logger.with_num_data([&](auto nd) {
-      nd.get()["NUM_REQ"] += 1;
-      if (nd.get().find("MAX_REQ_TIME") == nd.get().end()) {
-        nd.get()["MAX_REQ_TIME"] = e.get_duration();
-
-        logger.with_str_data([&](auto sd) { sd.get()["MAX_REQ"] = e.str_data["req_path"]; });
-      } else if (e.get_duration() > nd.get()["MAX_REQ_TIME"]) {
-        nd.get()["MAX_REQ_TIME"] = e.get_duration();
-
-        logger.with_str_data([&](auto sd) { sd.get()["MAX_REQ"] = e.str_data["req_path"]; });
-      }
-      if (nd.get()["MIN_REQ_TIME"] == 0) {
-        nd.get()["MIN_REQ_TIME"] = e.get_duration();
-
-        logger.with_str_data([&](auto sd) { sd.get()["MIN_REQ"] = e.str_data["req_path"]; });
-      } else if (e.get_duration() < nd.get()["MIN_REQ_TIME"]) {
-        nd.get()["MIN_REQ_TIME"] = e.get_duration();
-
-        logger.with_str_data([&](auto sd) { sd.get()["MIN_REQ"] = e.str_data["req_path"]; });
-      }
+  // a new file daily or every 64 MB, kill -HUP the logger process after moving it by hand
+  logger.set_rotation(64 << 20, std::chrono::hours(24), 5);
+  k::LogWriter::reopen_on_sighup();
+  // every request's event in binary, example/event_log prints them
+  logger.set_event_log(EVENTLOG);
+
+  if (elastic) {
+    elastic->on_sample([&](const k::Concurrency::ElasticStats &s) {
+      logger.with_num_data([&](auto nd) {
+        nd.get()["POOL_QUEUE_DEPTH"] = s.queue_depth;
+        nd.get()["POOL_WORKERS"] = s.workers;
+        nd.get()["POOL_ACTIVE"] = s.active;
+        nd.get()["POOL_BLOCKED"] = s.blocked;
+        nd.get()["POOL_WAIT_P50_US"] = s.wait_p50_us;
+        nd.get()["POOL_WAIT_P90_US"] = s.wait_p90_us;
+        nd.get()["POOL_WAIT_P99_US"] = s.wait_p99_us;
+      });
     });
-  });
+  }
 
   const std::map<const std::string, const std::string> auth = {{"rao96", "thisismine"}};
 
@@ -178,36 +232,137 @@ int main(int argc, char **argv) {
 
   auto stats_handler = [&](k::HTTPConn &c) {
     c.req_headers["Content-Type"] = "text/plain";
+    // every user behind auth sees the same stats, stats_cache may share them
+    c.resp_headers["Cache-Control"] = "s-maxage=1";
     c.resp_body << "Krithik Rao" << std::endl;
     auto curr_t = std::chrono::system_clock::now();
     auto dur = curr_t - server->start_t;
     auto uptime = std::chrono::duration_cast<std::chrono::seconds>(dur).count();
     c.resp_body << "Uptime (s): " << uptime << std::endl;
-    c.resp_body << "Num Requests: " << logger.get_num_data("NUM_REQ") << std::endl;
-    c.resp_body << "Max Srvc Time: " << logger.get_num_data("MAX_REQ_TIME") << "ms ; "
-                << logger.get_str_data("MAX_REQ") << std::endl;
-    c.resp_body << "Min Srvc Time: " << logger.get_num_data("MIN_REQ_TIME") << "ms ; "
-                << logger.get_str_data("MIN_REQ") << std::endl;
+    c.resp_body << "Num Requests: " << server->metrics.counter_total("http_requests_total")
+                << std::endl;
+    // bucket edges, within 1/8 of the real value
+    k::Metrics::HistogramSnapshot h =
+        server->metrics.histogram_total("http_request_duration_seconds");
+    c.resp_body << "Srvc Time (ms): p50 " << h.quantile(0.5) / 1e6 << " ; p90 "
+                << h.quantile(0.9) / 1e6 << " ; p99 " << h.quantile(0.99) / 1e6 << " ; max "
+                << h.quantile(1) / 1e6 << std::endl;
+    c.resp_body << "Log Records Dropped: " << logger.dropped_records() << " ; Log Lines Dropped: "
+                << logger.get_num_data("LOG_LINES_DROPPED") << std::endl;
+    if (elastic) {
+      c.resp_body << "Pool Workers: " << logger.get_num_data("POOL_WORKERS") << " ; "
+                  << logger.get_num_data("POOL_ACTIVE") << " active, "
+                  << logger.get_num_data("POOL_BLOCKED") << " blocked" << std::endl;
+      c.resp_body << "Pool Queue Depth: " << logger.get_num_data("POOL_QUEUE_DEPTH") << std::endl;
+      c.resp_body << "Pool Queue Wait (us): p50 " << logger.get_num_data("POOL_WAIT_P50_US")
+                  << " ; p90 " << logger.get_num_data("POOL_WAIT_P90_US") << " ; p99 "
+                  << logger.get_num_data("POOL_WAIT_P99_US") << std::endl;
+    }
+    if (secure) {
+      k::TLS::Stats ts = secure->tls_stats();
+      c.resp_body << "TLS Handshakes: " << ts.full_handshakes << " full ; "
+                  << ts.resumed_handshakes << " resumed ; " << ts.failed_handshakes << " failed ; "
+                  << ts.handshake_timeouts << " timed out ; " << ts.refused_handshakes
+                  << " refused" << std::endl;
+      c.resp_body << "TLS Session Cache: " << ts.cache_hits << " hits ; " << ts.cache_misses
+                  << " misses ; " << ts.ticket_key_rotations << " ticket key rotations"
+                  << std::endl;
+      c.resp_body << "TLS Kernel Offload: " << ts.ktls_connections << " connections" << std::endl;
+    }
+    if (qos) {
+      auto classes = qos->stats();
+      for (int i = 0; i < k::QoS::COUNT; ++i) {
+        const auto &cs = classes[i];
+        c.resp_body << "Class " << k::QoS::to_string(static_cast<k::QoS::class_t>(i)) << ": "
+                    << cs.executed << " done, " << cs.per_sec << "/s, " << cs.queued
+                    << " queued, " << cs.running << " running ; wait (us) p50 " << cs.wait_p50_us
+                    << " ; p99 " << cs.wait_p99_us << std::endl;
+      }
+    }
     c.send();
   };
 
-  k::Router r;
+  // per core servers keep their stats on the cores, they are gathered by message
+  auto core_stats_handler = [&](k::HTTPConn &c) -> k::Async::task<void> {
+    std::vector<k::PerCore::CoreMetrics> cores = co_await per_core->core_stats();
+    k::PerCore::CoreMetrics total;
+    for (const auto &m : cores) {
+      total.merge(m);
+    }
+    c.req_headers["Content-Type"] = "text/plain";
+    c.resp_body << "Krithik Rao" << std::endl;
+    auto dur = std::chrono::system_clock::now() - server->start_t;
+    auto uptime = std::chrono::duration_cast<std::chrono::seconds>(dur).count();
+    c.resp_body << "Uptime (s): " << uptime << std::endl;
+    c.resp_body << "Num Requests: " << total.requests << std::endl;
+    c.resp_body << "Max Srvc Time: " << total.max_req_us / 1000.0 << "ms ; " << total.max_req
+                << std::endl;
+    c.resp_body << "Min Srvc Time: " << total.min_req_us / 1000.0 << "ms ; " << total.min_req
+                << std::endl;
+    for (size_t i = 0; i < cores.size(); ++i) {
+      c.resp_body << "Core " << i << ": " << cores[i].connections << " conns, "
+                  << cores[i].requests << " reqs, " << cores[i].errors << " errors, "
+                  << cores[i].bytes_in << "B in, " << cores[i].bytes_out << "B out" << std::endl;
+    }
+    c.send();
+  };
 
-  r.add_middleware(auth_handle);
+  k::Router r;
 
-  r.r_get("/", static_handle);
+  // auth is attached per route so unmatched requests skip it
+  r.r_get("/", static_handle, auth_handle);
+
+  r.r_get("/logs", log_handler, auth_handle);
+  r.r_get("/metrics", k::Handler::create_metrics_handler(server->metrics), auth_handle);
+  // stats are recomputed at most once a second
+  k::Cache::ResponseCache stats_cache;
+  // fastcgi apps stay up between requests, a child forked per request would leave them behind
+  if (mode != E_FORK_PER_REQUEST) {
+    auto fastcgi_handler = k::Handler::create_fastcgi_handler("./http-root-dir/");
+    if (per_core) {
+      auto async_fastcgi_handler = k::Handler::offload_handler(fastcgi_handler);
+      r.r_get("/fcgi-bin", async_fastcgi_handler, auth_handle);
+      r.r_post("/fcgi-bin", async_fastcgi_handler, auth_handle);
+    } else {
+      r.r_get("/fcgi-bin", fastcgi_handler, auth_handle, k::QoS::BULK);
+      r.r_post("/fcgi-bin", fastcgi_handler, auth_handle, k::QoS::BULK);
+    }
+  }
+  if (per_core) {
+    r.r_get("/stats", core_stats_handler, auth_handle);
 
-  r.r_get("/logs", log_handler);
-  r.r_get("/stats", stats_handler);
+    // cgi output is read on the core's loop instead of blocking it
+    auto async_cgi_handler = k::Handler::create_async_cgi_handler("./http-root-dir/");
+    r.r_get("/cgi-bin", async_cgi_handler, auth_handle);
+    r.r_post("/cgi-bin", async_cgi_handler, auth_handle);
+  } else {
+    r.r_get("/stats", stats_handler, auth_handle, stats_cache, k::QoS::INTERACTIVE);
 
-  r.r_get("/cgi-bin", cgi_handler);
-  r.r_post("/cgi-bin", cgi_handler);
+    // cgi forks and waits, keep it from filling every worker
+    r.r_get("/cgi-bin", cgi_handler, auth_handle, k::QoS::BULK);
+    r.r_post("/cgi-bin", cgi_handler, auth_handle, k::QoS::BULK);
+  }
   // r.r_get("/stats", stat_handler);
   //
-  if (mode == E_FORK_PER_REQUEST) {
+  if (mode == E_FORK_PER_REQUEST || mode == E_PREFORK) {
     logger.start_mp();
   }
 
+  if (per_core) {
+    per_core->run_async([&r](k::HTTPConn &c) { return r.handle_async(c); });
+    return 0;
+  }
+
+  if (qos) {
+    server->run(
+        [&](k::HTTPConn &c) {
+          std::cout << c.get_request() << std::endl;
+          r.handle(c);
+        },
+        [&r](const k::HTTPConn &c) { return r.classify(c); });
+    return 0;
+  }
+
   server->run([&](k::HTTPConn &c) {
     std::cout << c.get_request() << std::endl;
     r.handle(c);
@@ -0,0 +1,133 @@
+/*
+ * reverse_proxy
+ *
+ * a proxy on port 4860 in front of two upstreams running in the same
+ * process on ports 4861 and 4862. the upstreams are plain TCPServers
+ * that keep connections alive, answer with chunked bodies on /chunked,
+ * set two cookies on /cookies and stop answering /health when started
+ * with a "down" argument for that port, e.g. reverse_proxy 4862.
+ *
+ *   curl localhost:4860/hello
+ *   curl localhost:4860/chunked
+ *   curl -i localhost:4860/cookies
+ *   curl localhost:4860/stats
+ */
+#include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "concurrency.hxx"
+#include "handler.hxx"
+#include "http.hxx"
+#include "router.hxx"
+#include "server.hxx"
+#include "strutil.hxx"
+
+using namespace Kleptic;
+
+/* reads one request head and its body off conn, false at EOF */
+static bool read_request(Socket &s, std::string &buff, std::string &head) {
+  char chunk[TCP_BUFF_SIZE];
+  size_t end;
+  while ((end = buff.find("\r\n\r\n")) == std::string::npos) {
+    int ret = s.read(chunk, sizeof(chunk));
+    if (ret <= 0) {
+      return false;
+    }
+    buff.append(chunk, ret);
+  }
+  head = buff.substr(0, end);
+  size_t body_len = 0;
+  std::string lower = Util::to_lower(head);
+  size_t pos = lower.find("\r\ncontent-length:");
+  if (pos != std::string::npos) {
+    body_len = std::stoul(lower.substr(pos + 17));
+  }
+  while (buff.size() < end + 4 + body_len) {
+    int ret = s.read(chunk, sizeof(chunk));
+    if (ret <= 0) {
+      return false;
+    }
+    buff.append(chunk, ret);
+  }
+  buff.erase(0, end + 4 + body_len);
+  return true;
+}
+
+static void upstream(int port, bool down) {
+  Concurrency::runner_t exec = std::make_unique<Concurrency::ThreadRunner>();
+  TCPServer server("127.0.0.1", port, exec);
+  server.run([port, down](conn_t conn) {
+    std::string buff;
+    std::string head;
+    int served = 0;
+    // one thread per connection, serving requests until the proxy closes it
+    while (read_request(*conn->socket, buff, head)) {
+      std::string path = head.substr(head.find(' ') + 1);
+      path = path.substr(0, path.find(' '));
+      ++served;
+      std::stringstream body;
+      body << "upstream " << port << " : " << path << " (request " << served
+           << " on this connection)\n";
+
+      std::stringstream resp;
+      if (path == "/health" && down) {
+        resp << "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+      } else if (path == "/cookies") {
+        resp << "HTTP/1.1 200 OK\r\nSet-Cookie: a=1; Path=/\r\nSet-Cookie: b=2; Path=/\r\n"
+             << "Content-Length: " << body.str().size() << "\r\n\r\n"
+             << body.str();
+      } else if (path == "/chunked") {
+        resp << "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n\r\n";
+        for (int i = 0; i < 3; ++i) {
+          std::string piece = "piece " + std::to_string(i) + " from " + std::to_string(port) + "\n";
+          resp << std::hex << piece.size() << std::dec << "\r\n" << piece << "\r\n";
+        }
+        resp << "0\r\n\r\n";
+      } else {
+        resp << "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: "
+             << body.str().size() << "\r\n\r\n"
+             << body.str();
+      }
+      conn->socket->write(resp.str());
+    }
+  });
+}
+
+int main(int argc, char **argv) {
+  std::set<int> down;
+  for (int i = 1; i < argc; ++i) {
+    down.insert(std::stoi(argv[i]));
+  }
+  std::vector<std::thread> upstreams;
+  for (int port : {4861, 4862}) {
+    upstreams.emplace_back(upstream, port, down.count(port) > 0);
+  }
+
+  Proxy::ProxyOptions opts;
+  opts.health_path = "/health";
+  opts.health_interval = std::chrono::milliseconds(1000);
+  auto balancer = std::make_shared<Proxy::Balancer>(
+      std::vector<Proxy::Upstream>{{"127.0.0.1", 4861}, {"127.0.0.1", 4862}}, opts);
+
+  Router r;
+  r.r_get("/stats", [balancer](HTTPConn &c) {
+    c.resp_headers["Content-Type"] = "text/plain";
+    for (const auto &s : balancer->stats()) {
+      c.resp_body << s.name << " : " << (s.healthy ? "up" : "down") << ", " << s.requests
+                  << " requests, " << s.failures << " failures, " << s.outstanding
+                  << " in flight, " << s.idle << " idle" << std::endl;
+    }
+  });
+  auto forward = [balancer](HTTPConn &c) { balancer->forward(c); };
+  r.r_get("/", forward);
+  r.r_post("/", forward);
+
+  Concurrency::runner_t exec = std::make_unique<Concurrency::ThreadPoolRunner>(8);
+  HTTPServer server("0.0.0.0", 4860, exec, "reverse_proxy.log");
+  server.run([&r](HTTPConn &c) { r.handle(c); });
+}
@@ -0,0 +1,47 @@
+#include <iostream>
+#include <memory>
+
+#include "concurrency.hxx"
+#include "http.hxx"
+#include "router.hxx"
+#include "static_router.hxx"
+
+using namespace Kleptic;
+
+static constexpr char root_path[] = "/";
+static constexpr char ping_path[] = "/ping";
+static constexpr char echo_path[] = "/echo";
+
+void ping(HTTPConn &c) {
+  c.resp_headers["Content-Type"] = "text/plain";
+  c.resp_body << "pong" << std::endl;
+}
+
+void echo(HTTPConn &c) {
+  c.resp_headers["Content-Type"] = "text/plain";
+  c.resp_body << c.req_body.str();
+}
+
+void api_index(HTTPConn &c) {
+  c.resp_headers["Content-Type"] = "text/plain";
+  c.resp_body << "static api root, unparsed: " << c.route_unparsed_path << std::endl;
+}
+
+using api = Static::StaticRouter<Static::Get<root_path, api_index>, Static::Get<ping_path, ping>,
+                                 Static::Post<echo_path, echo>>;
+
+int main() {
+  Concurrency::runner_t exec = std::make_unique<Concurrency::ThreadPoolRunner>(4);
+  HTTPServer server("0.0.0.0", 4858, exec, "static_routes.log");
+
+  Router r;
+  r.r_get("/", [](HTTPConn &c) {
+    c.resp_headers["Content-Type"] = "text/plain";
+    c.resp_body << "dynamic root" << std::endl;
+  });
+  // the static table serves everything below /api
+  r.r_get("/api", api{});
+  r.r_post("/api", api{});
+
+  server.run([&](HTTPConn &c) { r.handle(c); });
+}
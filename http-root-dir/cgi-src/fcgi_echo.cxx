@@ -0,0 +1,132 @@
+/*
+ * fcgi_echo
+ *
+ * minimal FastCGI responder for trying out the FastCGI pool. answers
+ * every request with its parameters, its pid and how many requests it
+ * has served. ?sleep=MS delays the answer and ?crash=1 exits mid request.
+ */
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+#include "error.hxx"
+#include "fastcgi.hxx"
+
+namespace fcgi = Kleptic::FastCGI;
+
+static bool write_all(int fd, const std::string &out) {
+  size_t written = 0;
+  while (written < out.size()) {
+    ssize_t ret = write(fd, out.data() + written, out.size() - written);
+    if (ret <= 0) {
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+
+static std::string query_value(const std::string &query, const std::string &key) {
+  std::stringstream ss(query);
+  std::string item;
+  while (std::getline(ss, item, '&')) {
+    if (item.rfind(key + "=", 0) == 0) {
+      return item.substr(key.size() + 1);
+    }
+  }
+  return "";
+}
+
+static std::string respond(const fcgi::params_t &params, const std::string &in, int served) {
+  std::stringstream body;
+  body << "pid " << getpid() << ", request " << served << "\n";
+  for (const auto &[name, value] : params) {
+    body << name << "=" << value << "\n";
+  }
+  if (!in.empty()) {
+    body << "\n" << in << "\n";
+  }
+  return "Content-Type: text/plain\r\n\r\n" + body.str();
+}
+
+/* serves requests on one connection until the server closes it */
+static void serve(int fd, int &served) {
+  fcgi::RecordReader reader;
+  fcgi::Record rec;
+  std::string params_data;
+  std::string in;
+  bool keep_conn = false;
+  char buff[8192];
+
+  ssize_t ret;
+  while ((ret = read(fd, buff, sizeof(buff))) > 0) {
+    reader.feed(buff, ret);
+    while (reader.next(rec)) {
+      std::string out;
+      switch (rec.type) {
+        case fcgi::GET_VALUES: {
+          fcgi::params_t values = {
+              {"FCGI_MAX_CONNS", "1"}, {"FCGI_MAX_REQS", "1"}, {"FCGI_MPXS_CONNS", "0"}};
+          fcgi::append_record(out, fcgi::GET_VALUES_RESULT, 0, fcgi::encode_pairs(values));
+          break;
+        }
+        case fcgi::BEGIN_REQUEST:
+          keep_conn = rec.content.size() > 2 && (rec.content[2] & fcgi::KEEP_CONN);
+          params_data.clear();
+          in.clear();
+          break;
+        case fcgi::PARAMS:
+          params_data += rec.content;
+          break;
+        case fcgi::STDIN: {
+          if (!rec.content.empty()) {
+            in += rec.content;
+            break;
+          }
+          // empty STDIN record, the request is complete
+          fcgi::params_t params = fcgi::decode_pairs(params_data);
+          std::string query = params["QUERY_STRING"];
+          if (query_value(query, "crash") == "1") {
+            _exit(1);
+          }
+          int sleep_ms = std::atoi(query_value(query, "sleep").c_str());
+          if (sleep_ms > 0) {
+            usleep(sleep_ms * 1000);
+          }
+          fcgi::append_stream(out, fcgi::STDOUT, rec.id, respond(params, in, ++served));
+          fcgi::append_end_request(out, rec.id, 0, fcgi::REQUEST_COMPLETE);
+          break;
+        }
+        default: {
+          const char body[8] = {static_cast<char>(rec.type)};
+          fcgi::append_record(out, fcgi::UNKNOWN_TYPE, 0, std::string(body, sizeof(body)));
+        }
+      }
+      if (!out.empty() && !write_all(fd, out)) {
+        return;
+      }
+      if (rec.type == fcgi::STDIN && rec.content.empty() && !keep_conn) {
+        return;
+      }
+    }
+  }
+}
+
+int main() {
+  int served = 0;
+  while (true) {
+    int fd = accept(KLEPTIC_FCGI_LISTENSOCK_FILENO, nullptr, nullptr);
+    if (fd < 0) {
+      return 1;
+    }
+    try {
+      serve(fd, served);
+    } catch (Kleptic::FastCGIException &e) {
+      // bad record, drop the connection
+    }
+    close(fd);
+  }
+}
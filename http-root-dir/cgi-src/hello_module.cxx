@@ -0,0 +1,29 @@
+/*
+ * hello_module
+ *
+ * .so CGI module called in the server process. answers with its CGI
+ * environment, the request body and how many requests this copy of the
+ * module has served, which starts over when the module is reloaded.
+ */
+#include <atomic>
+#include <string>
+
+#include "cgi_module.hxx"
+
+static std::atomic<int> served{0};
+
+extern "C" int httprun_io(const kleptic_module_io *io) {
+  std::string out = "Content-Type: text/plain\r\n\r\n";
+  out += "hello from a module, request " + std::to_string(++served) + "\n";
+  for (const char *const *var = io->env; *var != nullptr; ++var) {
+    out += *var;
+    out += "\n";
+  }
+  if (io->body_len > 0) {
+    out += "\n";
+    out.append(io->body, io->body_len);
+    out += "\n";
+  }
+  io->write(io->out_ctx, out.data(), out.size());
+  return 0;
+}
@@ -1,7 +1,8 @@
 #ifndef KLEPTIC_BQUEUE_HXX_
 #define KLEPTIC_BQUEUE_HXX_
 
-#include <future>
+#include <condition_variable>
+#include <mutex>
 #include <queue>
 #include <utility>
 
@@ -15,34 +16,51 @@ class BlockingQueue {
   const size_t _max_size;
   std::condition_variable _full_var;
   std::condition_variable _empty_var;
+  // threads blocked on each condition, so wakeups skip the syscall when idle
+  size_t _full_waiters = 0;
+  size_t _empty_waiters = 0;
+
+  template <typename... Args>
+  void put(Args &&... args) {
+    std::unique_lock<std::mutex> l(_m);
+    if (q.size() >= _max_size) {
+      ++_full_waiters;
+      _full_var.wait(l, [this] { return (q.size() < _max_size); });
+      --_full_waiters;
+    }
+    q.emplace(std::forward<Args>(args)...);
+    bool wake = _empty_waiters > 0;
+    l.unlock();
+    if (wake) {
+      _empty_var.notify_one();
+    }
+  }
 
  public:
   explicit BlockingQueue(int max_cap) : _max_size(max_cap) {}
 
   T pop() {
     std::unique_lock<std::mutex> l(_m);
-    _empty_var.wait(l, [this] { return !q.empty(); });
+    if (q.empty()) {
+      ++_empty_waiters;
+      _empty_var.wait(l, [this] { return !q.empty(); });
+      --_empty_waiters;
+    }
     auto item = std::move(q.front());
     q.pop();
+    bool wake = _full_waiters > 0;
     l.unlock();
-    _full_var.notify_one();
-    return std::move(item);
+    if (wake) {
+      _full_var.notify_one();
+    }
+    return item;
   }
 
-  void push(T item) {
-    std::unique_lock<std::mutex> l(_m);
-    _full_var.wait(l, [this] { return (q.size() < _max_size); });
-    q.push(std::move(item));
-    l.unlock();
-    _empty_var.notify_one();
-  }
+  void push(T item) { put(std::move(item)); }
 
-  void emplace(T item) {
-    std::unique_lock<std::mutex> l(_m);
-    _full_var.wait(l, [this] { return (q.size() < _max_size); });
-    q.emplace(std::forward(item));
-    l.unlock();
-    _empty_var.notify_one();
+  template <typename... Args>
+  void emplace(Args &&... args) {
+    put(std::forward<Args>(args)...);
   }
 };
 
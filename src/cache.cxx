@@ -0,0 +1,432 @@
+#include "cache.hxx"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "socket.hxx"
+#include "strutil.hxx"
+
+namespace Kleptic::Cache {
+
+struct CacheDirectives {
+  bool no_store = false;
+  bool no_cache = false;
+  bool is_private = false;
+  /* one of these lets a shared cache store a response to a request with Authorization */
+  bool is_public = false;
+  bool must_revalidate = false;
+  bool s_maxage = false;
+  int64_t max_age = -1;
+  int64_t stale_while_revalidate = -1;
+};
+
+static bool iequals(const std::string &a, const std::string &b) {
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return std::tolower(x) == std::tolower(y);
+         });
+}
+
+static std::string find_header(const std::map<std::string, std::string> &headers,
+                               const std::string &name) {
+  for (const auto &[key, val] : headers) {
+    if (iequals(key, name)) {
+      return val;
+    }
+  }
+  return "";
+}
+
+/*
+ * std::string find_raw_header(const std::string &, const std::string &)
+ *
+ * looks up a header in a pre-rendered response.
+ */
+static std::string find_raw_header(const std::string &raw, const std::string &name) {
+  size_t hdr_end = raw.find("\r\n\r\n");
+  size_t pos = raw.find("\r\n");
+  while (pos != std::string::npos && pos < hdr_end) {
+    size_t line_start = pos + 2;
+    size_t line_end = raw.find("\r\n", line_start);
+    std::string line = raw.substr(line_start, line_end - line_start);
+    size_t colon = line.find(':');
+    if (colon != std::string::npos && iequals(Util::trim(line.substr(0, colon)), name)) {
+      return Util::trim(line.substr(colon + 1));
+    }
+    pos = line_end;
+  }
+  return "";
+}
+
+static int raw_status(const std::string &raw) {
+  size_t sp = raw.find(' ');
+  if (sp == std::string::npos) {
+    return 0;
+  }
+  return atoi(raw.c_str() + sp + 1);
+}
+
+static CacheDirectives parse_cache_control(const std::string &value) {
+  CacheDirectives d;
+  std::stringstream ss(value);
+  std::string token;
+  while (std::getline(ss, token, ',')) {
+    token = Util::trim(token);
+    std::transform(token.begin(), token.end(), token.begin(),
+                   [](unsigned char ch) { return std::tolower(ch); });
+    std::string arg;
+    size_t eq = token.find('=');
+    if (eq != std::string::npos) {
+      arg = token.substr(eq + 1);
+      token = token.substr(0, eq);
+    }
+    if (token == "no-store") {
+      d.no_store = true;
+    } else if (token == "no-cache") {
+      d.no_cache = true;
+    } else if (token == "private") {
+      d.is_private = true;
+    } else if (token == "public") {
+      d.is_public = true;
+    } else if (token == "must-revalidate") {
+      d.must_revalidate = true;
+    } else if ((token == "max-age" || token == "s-maxage") && !arg.empty()) {
+      // s-maxage wins for a shared cache
+      if (token == "s-maxage") {
+        d.s_maxage = true;
+        d.max_age = atoll(arg.c_str());
+      } else if (!d.s_maxage) {
+        d.max_age = atoll(arg.c_str());
+      }
+    } else if (token == "stale-while-revalidate" && !arg.empty()) {
+      d.stale_while_revalidate = atoll(arg.c_str());
+    }
+  }
+  return d;
+}
+
+static bool cacheable_status(int status) {
+  switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 404:
+    case 410:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static std::unique_ptr<HTTPConn> clone_request(const HTTPConn &c) {
+  auto n = std::make_unique<HTTPConn>();
+  n->host_ip = c.host_ip;
+  n->host_port = c.host_port;
+  n->remote_ip = c.remote_ip;
+  n->method = "GET";
+  n->uri = c.uri;
+  n->http_ver = c.http_ver;
+  n->host = c.host;
+  n->req_path = c.req_path;
+  n->http_protocol = c.http_protocol;
+  n->route_unparsed_path = c.route_unparsed_path;
+  n->route_params = c.route_params;
+  n->req_headers = c.req_headers;
+  n->raw_query_string = c.raw_query_string;
+  n->query_params = c.query_params;
+  n->body_params = c.body_params;
+  n->req_body << c.req_body.str();
+  n->auth_type = c.auth_type;
+  n->user = c.user;
+  return n;
+}
+
+static void serve(HTTPConn &c, const CachedResponse &entry) {
+  if (!entry.raw.empty()) {
+    if (c.method == "HEAD") {
+      size_t end = entry.raw.find("\r\n\r\n");
+      c.send(entry.raw.substr(0, end == std::string::npos ? end : end + 4));
+    } else {
+      c.send(entry.raw);
+    }
+    return;
+  }
+  auto age = std::chrono::duration_cast<std::chrono::seconds>(cache_clock::now() - entry.stored_at);
+  c.resp_status = entry.status;
+  for (const auto &[key, val] : entry.headers) {
+    c.resp_headers[key] = val;
+  }
+  c.resp_headers["Age"] = std::to_string(age.count());
+  c.resp_body.str("");
+  c.resp_body << entry.body;
+  c.send();
+}
+
+size_t CachedResponse::size() const {
+  size_t total = sizeof(CachedResponse) + body.size() + raw.size();
+  for (const auto &[key, val] : headers) {
+    total += key.size() + val.size();
+  }
+  return total;
+}
+
+ResponseCache::State::~State() {
+  {
+    std::lock_guard<std::mutex> l(refresh_m);
+    stopping = true;
+  }
+  refresh_cv.notify_one();
+  if (refresher.joinable()) {
+    refresher.join();
+  }
+}
+
+ResponseCache::ResponseCache(CacheOptions opts) : state(std::make_shared<State>(std::move(opts))) {}
+
+void ResponseCache::operator()(HTTPConn &c, const HTTPConnHandler &next) const {
+  run(state, c, next);
+}
+
+HTTPConnHandler ResponseCache::wrap(HTTPConnHandler handler) const {
+  auto s = state;
+  return [s, handler](HTTPConn &c) { run(s, c, handler); };
+}
+
+ResponseCache::Shard &ResponseCache::shard_for(State &s, const std::string &key) {
+  return s.shards[std::hash<std::string>{}(key) % s.shards.size()];
+}
+
+std::string ResponseCache::make_key(const State &s, HTTPConn &c) {
+  // HEAD is answered from the GET entry, only GET stores it
+  std::string key = "GET " + c.req_path;
+  if (s.opts.key_query) {
+    key += "?" + c.raw_query_string;
+  }
+  for (const auto &hdr : s.opts.vary_headers) {
+    key += "\n" + hdr + ": " + find_header(c.req_headers, hdr);
+  }
+  return key;
+}
+
+void ResponseCache::run(const std::shared_ptr<State> &s, HTTPConn &c,
+                        const HTTPConnHandler &next) {
+  if (c.method.compare("GET") && c.method.compare("HEAD")) {
+    next(c);
+    return;
+  }
+
+  auto req_cc = parse_cache_control(find_header(c.req_headers, "Cache-Control"));
+  if (req_cc.no_store) {
+    s->stats.bypassed++;
+    next(c);
+    return;
+  }
+
+  std::string key = make_key(*s, c);
+  const bool authorized = !find_header(c.req_headers, "Authorization").empty();
+
+  if (!req_cc.no_cache && req_cc.max_age != 0) {
+    cached_response_t hit;
+    bool stale = false;
+    bool start_refresh = false;
+    {
+      Shard &sh = shard_for(*s, key);
+      std::lock_guard<std::mutex> l(sh.m);
+      auto it = sh.index.find(key);
+      if (it != sh.index.end()) {
+        auto now = cache_clock::now();
+        cached_response_t entry = it->second->second;
+        if (now < entry->fresh_until) {
+          hit = entry;
+        } else if (now < entry->stale_until) {
+          hit = entry;
+          stale = true;
+          start_refresh = !entry->refreshing;
+          entry->refreshing = true;
+        } else {
+          sh.bytes -= entry->size();
+          sh.lru.erase(it->second);
+          sh.index.erase(it);
+        }
+        if (hit) {
+          sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+        }
+      }
+    }
+
+    if (hit) {
+      if (start_refresh) {
+        s->stats.refreshes++;
+        schedule_refresh(*s, Refresh{key, clone_request(c), next});
+      }
+      (stale ? s->stats.stale_hits : s->stats.hits)++;
+      serve(c, *hit);
+      return;
+    }
+  }
+
+  s->stats.misses++;
+  next(c);
+  if (c.method == "GET") {
+    store(*s, key, c, authorized);
+  }
+}
+
+void ResponseCache::schedule_refresh(State &s, Refresh r) {
+  std::lock_guard<std::mutex> l(s.refresh_m);
+  if (s.stopping) {
+    return;
+  }
+  s.refreshes.push_back(std::move(r));
+  if (!s.refresher.joinable()) {
+    s.refresher = std::thread(refresh_loop, std::ref(s));
+  }
+  s.refresh_cv.notify_one();
+}
+
+/*
+ * void refresh_loop(State &)
+ *
+ * the refresher thread, runs the queued refreshes in order until the
+ * cache goes away. the ones still queued then are dropped.
+ */
+void ResponseCache::refresh_loop(State &s) {
+  std::unique_lock<std::mutex> l(s.refresh_m);
+  while (1) {
+    s.refresh_cv.wait(l, [&s] { return s.stopping || !s.refreshes.empty(); });
+    if (s.stopping) {
+      return;
+    }
+    Refresh r = std::move(s.refreshes.front());
+    s.refreshes.pop_front();
+    l.unlock();
+    refresh(s, r);
+    l.lock();
+  }
+}
+
+void ResponseCache::refresh(State &s, Refresh &r) {
+  const std::string &key = r.key;
+  bool stored = false;
+  bool failed = false;
+  // no client is waiting, what the handler streams or writes itself is caught here
+  BufferSocket capture;
+  r.c->sock = &capture;
+  try {
+    const bool authorized = !find_header(r.c->req_headers, "Authorization").empty();
+    r.next(*r.c);
+    stored = store(s, key, *r.c, authorized);
+  } catch (...) {
+    failed = true;
+  }
+
+  if (stored) {
+    return;
+  }
+
+  Shard &sh = shard_for(s, key);
+  std::lock_guard<std::mutex> l(sh.m);
+  auto it = sh.index.find(key);
+  if (it == sh.index.end()) {
+    return;
+  }
+  if (failed) {
+    // keep serving the stale copy, the next request retries
+    it->second->second->refreshing = false;
+  } else {
+    sh.bytes -= it->second->second->size();
+    sh.lru.erase(it->second);
+    sh.index.erase(it);
+  }
+}
+
+bool ResponseCache::store(State &s, const std::string &key, HTTPConn &c, bool authorized) {
+  if (c.is_streaming() || c.async_handler || !c.resp_extra_headers.empty()) {
+    // already went out to the client, a coroutine route hasn't answered yet,
+    // or it sets cookies (the entry only keeps one value per header)
+    return false;
+  }
+  auto entry = std::make_shared<CachedResponse>();
+  std::string cc;
+  if (c.is_set()) {
+    entry->raw = c.get_response();
+    entry->status = raw_status(entry->raw);
+    cc = find_raw_header(entry->raw, "Cache-Control");
+  } else {
+    // a cached file is served from memory
+    c.inline_file();
+    entry->status = c.resp_status;
+    entry->headers = c.resp_headers;
+    entry->headers.erase("Date");
+    entry->headers.erase("Content-Length");
+    entry->body = c.resp_body.str();
+    cc = find_header(entry->headers, "Cache-Control");
+  }
+
+  auto resp_cc = parse_cache_control(cc);
+  auto ttl = (resp_cc.max_age >= 0) ? std::chrono::milliseconds(resp_cc.max_age * 1000) : s.opts.ttl;
+  auto stale_ttl = (resp_cc.stale_while_revalidate >= 0)
+                       ? std::chrono::milliseconds(resp_cc.stale_while_revalidate * 1000)
+                       : s.opts.stale_ttl;
+  bool shared = !authorized || resp_cc.is_public || resp_cc.s_maxage || resp_cc.must_revalidate;
+  bool cacheable = cacheable_status(entry->status) && !resp_cc.no_store && !resp_cc.no_cache &&
+                   !resp_cc.is_private && shared && ttl.count() > 0;
+  size_t entry_size = entry->size();
+  if (!cacheable || entry_size > s.opts.max_entry_bytes) {
+    return false;
+  }
+
+  entry->stored_at = cache_clock::now();
+  entry->fresh_until = entry->stored_at + ttl;
+  entry->stale_until = entry->fresh_until + stale_ttl;
+
+  Shard &sh = shard_for(s, key);
+  size_t shard_limit = s.opts.max_bytes / s.shards.size();
+  std::lock_guard<std::mutex> l(sh.m);
+  auto it = sh.index.find(key);
+  if (it != sh.index.end()) {
+    sh.bytes -= it->second->second->size();
+    sh.lru.erase(it->second);
+    sh.index.erase(it);
+  }
+  sh.lru.emplace_front(key, entry);
+  sh.index[key] = sh.lru.begin();
+  sh.bytes += entry_size;
+
+  while (sh.bytes > shard_limit && !sh.lru.empty()) {
+    auto &victim = sh.lru.back();
+    sh.bytes -= victim.second->size();
+    sh.index.erase(victim.first);
+    sh.lru.pop_back();
+    s.stats.evictions++;
+  }
+  return true;
+}
+
+void ResponseCache::clear() {
+  for (auto &sh : state->shards) {
+    std::lock_guard<std::mutex> l(sh.m);
+    sh.lru.clear();
+    sh.index.clear();
+    sh.bytes = 0;
+  }
+}
+
+size_t ResponseCache::size_bytes() const {
+  size_t total = 0;
+  for (auto &sh : state->shards) {
+    std::lock_guard<std::mutex> l(sh.m);
+    total += sh.bytes;
+  }
+  return total;
+}
+
+}  // namespace Kleptic::Cache
@@ -0,0 +1,133 @@
+#ifndef KLEPTIC_CACHE_HXX_
+#define KLEPTIC_CACHE_HXX_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "http.hxx"
+
+namespace Kleptic::Cache {
+
+typedef std::chrono::steady_clock cache_clock;
+
+struct CacheOptions {
+  /* how long a stored response is served as fresh */
+  std::chrono::milliseconds ttl{1000};
+  /* how long after ttl a stale copy is served while one refresh runs */
+  std::chrono::milliseconds stale_ttl{10000};
+  size_t max_bytes = 32 * 1024 * 1024;
+  size_t max_entry_bytes = 1024 * 1024;
+  size_t shards = 16;
+  /* request headers that are part of the key */
+  std::vector<std::string> vary_headers = {};
+  bool key_query = true;
+};
+
+struct CachedResponse {
+  int status = 200;
+  std::map<std::string, std::string> headers;
+  std::string body;
+  /* set when the handler sent a pre-rendered response */
+  std::string raw;
+
+  cache_clock::time_point stored_at;
+  cache_clock::time_point fresh_until;
+  cache_clock::time_point stale_until;
+  bool refreshing = false;
+
+  size_t size() const;
+};
+
+typedef std::shared_ptr<CachedResponse> cached_response_t;
+
+struct CacheStats {
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> stale_hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> bypassed{0};
+  std::atomic<uint64_t> refreshes{0};
+  std::atomic<uint64_t> evictions{0};
+};
+
+/*
+ * ResponseCache
+ *
+ * in memory cache of finished responses, sharded by key hash.
+ * it is a HTTPConnMiddleware so it can be added with Router::add_middleware,
+ * or put in front of a single handler with wrap().
+ *
+ * GET responses are stored and HEAD is answered from them. responses to
+ * requests with Authorization are only stored when they allow a shared
+ * cache to (public, s-maxage or must-revalidate). stale entries are
+ * refreshed one at a time on the cache's refresher thread, the handler's
+ * socket is a BufferSocket there and a streamed refresh isn't stored.
+ *
+ * copies share the same store.
+ */
+class ResponseCache {
+  struct Shard {
+    typedef std::list<std::pair<std::string, cached_response_t>> lru_list;
+    std::mutex m;
+    lru_list lru;
+    std::unordered_map<std::string, lru_list::iterator> index;
+    size_t bytes = 0;
+  };
+
+  struct Refresh {
+    std::string key;
+    std::unique_ptr<HTTPConn> c;
+    HTTPConnHandler next;
+  };
+
+  struct State {
+    CacheOptions opts;
+    std::vector<Shard> shards;
+    CacheStats stats;
+
+    /* stale entries waiting for the refresher, started with the first one */
+    std::mutex refresh_m;
+    std::condition_variable refresh_cv;
+    std::deque<Refresh> refreshes;
+    bool stopping = false;
+    std::thread refresher;
+
+    explicit State(CacheOptions o) : opts(std::move(o)), shards(opts.shards ? opts.shards : 1) {}
+    ~State();
+  };
+
+  std::shared_ptr<State> state;
+
+  static void run(const std::shared_ptr<State> &s, HTTPConn &c, const HTTPConnHandler &next);
+  static void schedule_refresh(State &s, Refresh r);
+  static void refresh_loop(State &s);
+  static void refresh(State &s, Refresh &r);
+  static bool store(State &s, const std::string &key, HTTPConn &c, bool authorized);
+  static Shard &shard_for(State &s, const std::string &key);
+  static std::string make_key(const State &s, HTTPConn &c);
+
+ public:
+  explicit ResponseCache(CacheOptions opts = CacheOptions());
+
+  void operator()(HTTPConn &c, const HTTPConnHandler &next) const;
+  HTTPConnHandler wrap(HTTPConnHandler handler) const;
+
+  void clear();
+  size_t size_bytes() const;
+  const CacheStats &stats() const { return state->stats; }
+};
+
+}  // namespace Kleptic::Cache
+
+#endif  // KLEPTIC_CACHE_HXX_
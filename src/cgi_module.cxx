@@ -0,0 +1,214 @@
+#include "cgi_module.hxx"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <system_error>
+#include <utility>
+
+#include "error.hxx"
+
+namespace Kleptic::CGIModule {
+
+Registry::Loaded::~Loaded() {
+  if (lib != nullptr) {
+    dlclose(lib);
+  }
+}
+
+static void copy_fd(int from, int to, const fs::path &path) {
+  char buff[65536];
+  ssize_t ret;
+  while ((ret = read(from, buff, sizeof(buff))) != 0) {
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw ModuleException("Failed to read " + path.string() + " : " + strerror(errno));
+    }
+    for (ssize_t written = 0; written < ret;) {
+      ssize_t n = write(to, buff + written, ret - written);
+      if (n < 0) {
+        throw ModuleException("Failed to copy " + path.string() + " : " + strerror(errno));
+      }
+      written += n;
+    }
+  }
+}
+
+/*
+ * string module_dir()
+ *
+ * fresh private directory to load a copy from, removed once it's loaded.
+ */
+static std::string module_dir() {
+  const char *tmp = getenv("TMPDIR");
+  std::string tmpl = std::string(tmp != nullptr ? tmp : "/tmp") + "/kleptic-module-XXXXXX";
+  if (mkdtemp(tmpl.data()) == nullptr) {
+    throw ModuleException("Failed to create module directory : " + std::string(strerror(errno)));
+  }
+  return tmpl;
+}
+
+std::unique_ptr<Registry::Loaded> Registry::load(const fs::path &path, fs::file_time_type mtime) {
+  static std::atomic<uint64_t> seq{0};
+  auto loaded = std::make_unique<Loaded>();
+  loaded->mtime = mtime;
+
+  // the loader hands back an already loaded object by name, and modules
+  // with unique symbols never really unload, so every copy gets a new one
+  int src = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0) {
+    throw ModuleException("Failed to open " + path.string() + " : " + strerror(errno));
+  }
+  std::string dir;
+  try {
+    dir = module_dir();
+  } catch (...) {
+    close(src);
+    throw;
+  }
+  const std::string copy = dir + "/" + path.filename().string() + "." +
+                           std::to_string(seq.fetch_add(1, std::memory_order_relaxed));
+  int dst = open(copy.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0700);
+  if (dst < 0) {
+    std::string err = strerror(errno);
+    close(src);
+    rmdir(dir.c_str());
+    throw ModuleException("Failed to create module copy : " + err);
+  }
+  try {
+    copy_fd(src, dst, path);
+  } catch (...) {
+    close(src);
+    close(dst);
+    unlink(copy.c_str());
+    rmdir(dir.c_str());
+    throw;
+  }
+  close(src);
+  close(dst);
+
+  loaded->lib = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+  // mapped now, the file isn't needed anymore
+  unlink(copy.c_str());
+  rmdir(dir.c_str());
+  if (loaded->lib == nullptr) {
+    throw ModuleException("Failed to load " + path.string() + " : " + dlerror());
+  }
+
+  loaded->io_entry =
+      reinterpret_cast<kleptic_httprun_io_t>(dlsym(loaded->lib, KLEPTIC_MODULE_IO_SYMBOL));
+  if (loaded->io_entry == nullptr) {
+    loaded->fd_entry =
+        reinterpret_cast<void (*)(int, const char *)>(dlsym(loaded->lib, KLEPTIC_MODULE_FD_SYMBOL));
+  }
+  if (loaded->io_entry == nullptr && loaded->fd_entry == nullptr) {
+    throw ModuleException(path.string() + " exports neither " KLEPTIC_MODULE_IO_SYMBOL
+                                          " nor " KLEPTIC_MODULE_FD_SYMBOL);
+  }
+  return loaded;
+}
+
+Registry::Module &Registry::module(const std::string &path) {
+  std::lock_guard<std::mutex> l(m);
+  auto &slot = modules[path];
+  if (!slot) {
+    slot = std::make_unique<Module>();
+  }
+  return *slot;
+}
+
+void Registry::refresh(Module &mod, const fs::path &path, fs::file_time_type mtime) {
+  std::lock_guard<std::mutex> r(mod.reload);
+  {
+    std::shared_lock<std::shared_mutex> l(mod.drain);
+    if (mod.current && mod.current->mtime == mtime) {
+      // another call reloaded it while we waited
+      return;
+    }
+  }
+
+  std::unique_ptr<Loaded> next;
+  try {
+    // the old version keeps serving while the new one loads
+    next = load(path, mtime);
+  } catch (ModuleException &e) {
+    std::unique_lock<std::shared_mutex> l(mod.drain);
+    if (!mod.current) {
+      throw;
+    }
+    fprintf(stderr, "%s, still serving the previous version\n", e.what());
+    mod.failed = mtime;
+    return;
+  }
+
+  std::unique_ptr<Loaded> old;
+  {
+    // waits for the calls running on the old version
+    std::unique_lock<std::shared_mutex> l(mod.drain);
+    old = std::exchange(mod.current, std::move(next));
+    if (old) {
+      mod.reloads++;
+    }
+  }
+  // nothing can be running in old anymore, unloaded here
+}
+
+static void append_out(void *out_ctx, const char *data, size_t len) {
+  static_cast<std::string *>(out_ctx)->append(data, len);
+}
+
+bool Registry::call(const fs::path &path, const std::vector<std::string> &env,
+                    const std::string &query_string, const std::string &body, std::string &out,
+                    int &result) {
+  std::error_code ec;
+  fs::file_time_type mtime = fs::last_write_time(path, ec);
+  if (ec) {
+    throw ModuleException("Failed to stat " + path.string() + " : " + ec.message());
+  }
+  Module &mod = module(path);
+
+  while (true) {
+    {
+      std::shared_lock<std::shared_mutex> l(mod.drain);
+      Loaded *cur = mod.current.get();
+      if (cur != nullptr && (cur->mtime == mtime || mod.failed == mtime)) {
+        if (cur->io_entry == nullptr) {
+          // the old entry reads the request from getenv and stdin, the server's own here
+          return false;
+        }
+        std::vector<const char *> envp;
+        for (const auto &var : env) {
+          envp.push_back(var.c_str());
+        }
+        envp.push_back(nullptr);
+        const kleptic_module_io io = {envp.data(), query_string.c_str(), body.data(),
+                                      body.size(),  &out,                append_out};
+        result = cur->io_entry(&io);
+        return true;
+      }
+    }
+    refresh(mod, path, mtime);
+  }
+}
+
+uint64_t Registry::reloads(const std::string &path) {
+  Module &mod = module(path);
+  std::shared_lock<std::shared_mutex> l(mod.drain);
+  return mod.reloads;
+}
+
+Registry &registry() {
+  // never destroyed, worker threads may still be inside a module at exit
+  static Registry *r = new Registry();
+  return *r;
+}
+
+}  // namespace Kleptic::CGIModule
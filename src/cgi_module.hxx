@@ -0,0 +1,109 @@
+#ifndef KLEPTIC_CGI_MODULE_HXX_
+#define KLEPTIC_CGI_MODULE_HXX_
+
+#include <cstddef>
+#include <experimental/filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+/* the entry point a module exports for buffer based I/O */
+#define KLEPTIC_MODULE_IO_SYMBOL "httprun_io"
+/* the old entry point, void httprun(int fd, const char *query_string) */
+#define KLEPTIC_MODULE_FD_SYMBOL "httprun"
+
+extern "C" {
+/*
+ * what a module gets to serve one request with. env holds the CGI
+ * meta-variables as NAME=value strings, NULL terminated. the module
+ * writes its output (CGI headers and body) through write. it runs on a
+ * server thread, possibly alongside other calls, so no stdio, no
+ * setenv/getenv for request data and no global state without locking.
+ */
+struct kleptic_module_io {
+  const char *const *env;
+  const char *query_string;
+  const char *body;
+  size_t body_len;
+  void *out_ctx;
+  void (*write)(void *out_ctx, const char *data, size_t len);
+};
+
+/* returns 0 on success, anything else turns into a 500 */
+typedef int (*kleptic_httprun_io_t)(const struct kleptic_module_io *io);
+}
+
+namespace Kleptic::CGIModule {
+
+namespace fs = std::experimental::filesystem;
+
+/*
+ * Registry
+ *
+ * .so CGI modules loaded once and called in the server process, the
+ * ones exporting KLEPTIC_MODULE_IO_SYMBOL that is. a module
+ * is reloaded when its mtime changes: the new version is loaded next to
+ * the old one, calls already running on the old one drain, then it is
+ * swapped in and the old one unloaded. if the new version fails to load
+ * the old one keeps serving.
+ *
+ * every load goes through a private copy of the file, so replacing or
+ * rewriting the .so on disk never touches code that is mapped. build
+ * modules with -fno-gnu-unique, a module with unique symbols can't be
+ * unloaded and every reload keeps the old copy in memory.
+ */
+class Registry {
+  struct Loaded {
+    void *lib = nullptr;
+    kleptic_httprun_io_t io_entry = nullptr;
+    void (*fd_entry)(int, const char *) = nullptr;
+    fs::file_time_type mtime;
+
+    ~Loaded();
+  };
+
+  struct Module {
+    /* calls hold it shared, swapping versions takes it exclusively */
+    std::shared_mutex drain;
+    /* one reload at a time */
+    std::mutex reload;
+    std::unique_ptr<Loaded> current;
+    /* mtime of a version that failed to load, not retried until it changes */
+    fs::file_time_type failed;
+    uint64_t reloads = 0;
+  };
+
+  std::mutex m;
+  std::map<std::string, std::unique_ptr<Module>> modules;
+
+  static std::unique_ptr<Loaded> load(const fs::path &path, fs::file_time_type mtime);
+  Module &module(const std::string &path);
+  void refresh(Module &mod, const fs::path &path, fs::file_time_type mtime);
+
+ public:
+  /*
+   * bool call(path, env, query_string, body, std::string &out, int &result)
+   *
+   * runs the module's entry point, loading or reloading it first when
+   * needed, appends what it wrote to out and sets result to what it
+   * returned. false for a module with only the old entry point, which
+   * is left to a process of its own (kleptic_module_loader). throws
+   * ModuleException when the module can't be loaded.
+   */
+  bool call(const fs::path &path, const std::vector<std::string> &env,
+            const std::string &query_string, const std::string &body, std::string &out,
+            int &result);
+
+  /* number of times path was swapped for a newer version */
+  uint64_t reloads(const std::string &path);
+};
+
+/* the registry CGI handlers share, modules are process wide anyway */
+Registry &registry();
+
+}  // namespace Kleptic::CGIModule
+
+#endif  // KLEPTIC_CGI_MODULE_HXX_
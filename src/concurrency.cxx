@@ -1,12 +1,25 @@
 #include "concurrency.hxx"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <utility>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <system_error>
 #include <thread>
+#include <utility>
+#include <vector>
+
+#include "error.hxx"
 
 namespace Kleptic::Concurrency {
 
@@ -70,4 +83,814 @@ ThreadPoolRunner::ThreadPoolRunner(int worker_threads) : q(worker_threads) {
   }
 }
 void ThreadPoolRunner::dispatch(task_t task) { q.push(std::move(task)); }
+
+namespace {
+struct WorkerContext {
+  const WorkStealingRunner *runner = nullptr;
+  size_t id = 0;
+};
+thread_local WorkerContext current_worker;
+
+uint64_t xorshift(uint64_t &state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+}  // namespace
+
+WorkStealingRunner::WorkStealingRunner(int worker_threads, size_t max_queue) {
+  max_queue = std::clamp<size_t>(max_queue, 1, no_slot - 1);
+  slots = std::make_unique<Slot[]>(max_queue);
+  for (size_t i = 0; i + 1 < max_queue; ++i) {
+    slots[i].next.store(i + 1, std::memory_order_relaxed);
+  }
+  free_top.store(0, std::memory_order_relaxed);
+
+  worker_threads = std::max(worker_threads, 1);
+  for (int i = 0; i < worker_threads; ++i) {
+    auto w = std::make_unique<Worker>();
+    w->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+    workers.push_back(std::move(w));
+  }
+  for (size_t i = 0; i < workers.size(); ++i) {
+    workers[i]->thread = std::thread([this, i] { worker_loop(i); });
+  }
+}
+
+WorkStealingRunner::~WorkStealingRunner() { shutdown(); }
+
+uint32_t WorkStealingRunner::take_slot() {
+  uint64_t top = free_top.load(std::memory_order_acquire);
+  while (true) {
+    const uint32_t i = static_cast<uint32_t>(top);
+    if (i == no_slot) {
+      return no_slot;
+    }
+    const uint64_t next = ((top >> 32) + 1) << 32 | slots[i].next.load(std::memory_order_relaxed);
+    if (free_top.compare_exchange_weak(top, next, std::memory_order_acquire,
+                                       std::memory_order_acquire)) {
+      return i;
+    }
+  }
+}
+
+void WorkStealingRunner::free_slot(uint32_t i) {
+  uint64_t top = free_top.load(std::memory_order_relaxed);
+  uint64_t next;
+  do {
+    slots[i].next.store(static_cast<uint32_t>(top), std::memory_order_relaxed);
+    next = ((top >> 32) + 1) << 32 | i;
+  } while (!free_top.compare_exchange_weak(top, next, std::memory_order_release,
+                                           std::memory_order_relaxed));
+  slot_freed.notify_one();
+}
+
+/* the slot is free again before the task runs, so the task may dispatch into it */
+void WorkStealingRunner::run_slot(uint32_t i) {
+  task_t t = std::move(slots[i].task);
+  free_slot(i);
+  t();
+}
+
+void WorkStealingRunner::dispatch(task_t task) {
+  if (stopping.load(std::memory_order_acquire)) {
+    // the workers are gone or going, run it here
+    task();
+    return;
+  }
+
+  const bool on_worker = current_worker.runner == this;
+  uint32_t i = take_slot();
+  while (i == no_slot) {
+    if (on_worker) {
+      task();
+      return;
+    }
+    auto key = slot_freed.prepare_wait();
+    i = take_slot();
+    if (i != no_slot) {
+      slot_freed.cancel_wait();
+      break;
+    }
+    if (stopping.load(std::memory_order_acquire)) {
+      slot_freed.cancel_wait();
+      task();
+      return;
+    }
+    slot_freed.wait(key);
+    i = take_slot();
+  }
+  slots[i].task = std::move(task);
+
+  if (on_worker) {
+    workers[current_worker.id]->deque.push(i);
+  } else {
+    Worker &w = *workers[next_inbox.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+    std::unique_lock<std::mutex> l(w.inbox_m);
+    // shutdown drains the inboxes under this lock after setting stopping,
+    // so either it sees this push or we see stopping and nobody reads the inbox
+    if (stopping.load(std::memory_order_acquire)) {
+      l.unlock();
+      run_slot(i);
+      return;
+    }
+    w.inbox.push_back(i);
+    w.inbox_size.store(w.inbox.size(), std::memory_order_release);
+  }
+  wake();
+}
+
+void WorkStealingRunner::wake() {
+  epoch.fetch_add(1, std::memory_order_seq_cst);
+  if (num_parked.load(std::memory_order_seq_cst) > 0) {
+    // pairs with the predicate check in worker_loop so the wakeup can't be lost
+    { std::lock_guard<std::mutex> l(park_m); }
+    park_cv.notify_one();
+  }
+}
+
+bool WorkStealingRunner::has_work() const {
+  for (const auto &w : workers) {
+    if (!w->deque.empty() || w->inbox_size.load(std::memory_order_acquire) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t WorkStealingRunner::find_task(size_t id) {
+  Worker &self = *workers[id];
+  uint32_t t = no_slot;
+  if (self.deque.pop(t)) {
+    return t;
+  }
+
+  if (self.inbox_size.load(std::memory_order_acquire) > 0) {
+    {
+      std::lock_guard<std::mutex> l(self.inbox_m);
+      self.drained.swap(self.inbox);
+      self.inbox_size.store(0, std::memory_order_release);
+    }
+    if (!self.drained.empty()) {
+      // oldest first for us, the newer ones become stealable
+      t = self.drained.front();
+      for (size_t i = self.drained.size() - 1; i > 0; --i) {
+        self.deque.push(self.drained[i]);
+      }
+      self.drained.clear();
+      return t;
+    }
+  }
+
+  const size_t n = workers.size();
+  for (size_t attempt = 0; attempt < n; ++attempt) {
+    size_t victim_id = xorshift(self.rng) % n;
+    if (victim_id == id) {
+      continue;
+    }
+    Worker &victim = *workers[victim_id];
+    if (victim.deque.steal(t)) {
+      self.stolen.fetch_add(1, std::memory_order_relaxed);
+      return t;
+    }
+    if (victim.inbox_size.load(std::memory_order_acquire) > 0) {
+      std::unique_lock<std::mutex> l(victim.inbox_m, std::try_to_lock);
+      if (l.owns_lock() && !victim.inbox.empty()) {
+        t = victim.inbox.back();
+        victim.inbox.pop_back();
+        victim.inbox_size.store(victim.inbox.size(), std::memory_order_release);
+        self.stolen.fetch_add(1, std::memory_order_relaxed);
+        return t;
+      }
+    }
+  }
+  return no_slot;
+}
+
+void WorkStealingRunner::worker_loop(size_t id) {
+  current_worker = {this, id};
+  Worker &self = *workers[id];
+  int idle_rounds = 0;
+
+  while (true) {
+    uint32_t t = find_task(id);
+    if (t != no_slot) {
+      idle_rounds = 0;
+      run_slot(t);
+      self.executed.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    if (stopping.load(std::memory_order_acquire)) {
+      if (!has_work()) {
+        break;
+      }
+      continue;
+    }
+
+    if (++idle_rounds < spin_rounds) {
+      if (idle_rounds > spin_rounds / 2) {
+        std::this_thread::yield();
+      }
+      continue;
+    }
+
+    num_parked.fetch_add(1, std::memory_order_seq_cst);
+    uint64_t seen = epoch.load(std::memory_order_seq_cst);
+    if (!has_work() && !stopping.load(std::memory_order_acquire)) {
+      self.parked.fetch_add(1, std::memory_order_relaxed);
+      std::unique_lock<std::mutex> l(park_m);
+      park_cv.wait(l, [&] {
+        return epoch.load(std::memory_order_seq_cst) != seen ||
+               stopping.load(std::memory_order_acquire);
+      });
+    }
+    num_parked.fetch_sub(1, std::memory_order_seq_cst);
+    idle_rounds = 0;
+  }
+
+  current_worker = {};
+}
+
+void WorkStealingRunner::shutdown() {
+  if (stopping.exchange(true)) {
+    return;
+  }
+  { std::lock_guard<std::mutex> l(park_m); }
+  park_cv.notify_all();
+  // dispatchers waiting for a slot run their task themselves
+  slot_freed.notify_all();
+  for (auto &w : workers) {
+    if (w->thread.joinable()) {
+      w->thread.join();
+    }
+  }
+
+  // anything that raced with shutdown runs on the calling thread
+  for (auto &w : workers) {
+    uint32_t t = no_slot;
+    while (w->deque.steal(t)) {
+      run_slot(t);
+    }
+    std::vector<uint32_t> inbox;
+    {
+      std::lock_guard<std::mutex> l(w->inbox_m);
+      inbox.swap(w->inbox);
+      w->inbox_size.store(0, std::memory_order_release);
+    }
+    for (uint32_t it : inbox) {
+      run_slot(it);
+    }
+  }
+}
+
+std::vector<WorkerStats> WorkStealingRunner::stats() const {
+  std::vector<WorkerStats> out;
+  for (const auto &w : workers) {
+    WorkerStats s;
+    s.executed = w->executed.load(std::memory_order_relaxed);
+    s.stolen = w->stolen.load(std::memory_order_relaxed);
+    s.parked = w->parked.load(std::memory_order_relaxed);
+    out.push_back(s);
+  }
+  return out;
+}
+
+static ElasticOptions checked(ElasticOptions o) {
+  o.min_workers = std::max(o.min_workers, 1);
+  o.max_workers = std::max(o.max_workers, o.min_workers);
+  o.max_queue = std::max<size_t>(o.max_queue, 1);
+  return o;
+}
+
+ElasticRunner::ElasticRunner(ElasticOptions o) : opts(checked(o)) {
+  waits.reserve(wait_samples);
+  {
+    std::lock_guard<std::mutex> l(m);
+    spawn(opts.min_workers);
+  }
+  supervisor = std::thread([this] { supervise(); });
+}
+
+ElasticRunner::~ElasticRunner() {
+  {
+    std::lock_guard<std::mutex> l(m);
+    stopping = true;
+  }
+  not_empty.notify_all();
+  not_full.notify_all();
+  tick_cv.notify_all();
+  if (supervisor.joinable()) {
+    supervisor.join();
+  }
+
+  // workers run what is queued before they exit
+  std::unique_lock<std::mutex> l(m);
+  exited_cv.wait(l, [this] { return workers.empty(); });
+  auto done = std::move(exited);
+  l.unlock();
+  for (auto &w : done) {
+    w->thread.join();
+  }
+}
+
+/* m must be held */
+void ElasticRunner::spawn(size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    auto w = std::make_unique<Worker>();
+    Worker *self = w.get();
+    try {
+      self->thread = std::thread([this, self] { worker_loop(self); });
+    } catch (const std::system_error &e) {
+      fprintf(stderr, "ElasticRunner failed to start a worker : %s\n", e.what());
+      return;
+    }
+    workers.push_back(std::move(w));
+  }
+}
+
+void ElasticRunner::dispatch(task_t task) {
+  std::unique_lock<std::mutex> l(m);
+  if (stopping) {
+    l.unlock();
+    task();
+    return;
+  }
+  if (q.size() >= opts.max_queue) {
+    // a full queue is the strongest signal there is, grow before blocking the acceptor
+    if (idle == 0 && workers.size() < static_cast<size_t>(opts.max_workers)) {
+      spawn(1);
+      grown++;
+    }
+    ++full_waiters;
+    not_full.wait(l, [this] { return q.size() < opts.max_queue || stopping; });
+    --full_waiters;
+  }
+  q.push_back({std::move(task), clock::now()});
+  bool wake = idle > 0;
+  l.unlock();
+  if (wake) {
+    not_empty.notify_one();
+  }
+}
+
+void ElasticRunner::worker_loop(Worker *self) {
+  std::unique_lock<std::mutex> l(m);
+  self->tid = gettid();
+  while (true) {
+    if (q.empty()) {
+      ++idle;
+      bool woken = not_empty.wait_for(l, opts.idle_cooldown,
+                                      [this] { return stopping || !q.empty(); });
+      --idle;
+      if (q.empty()) {
+        if (stopping) {
+          break;
+        }
+        if (!woken && workers.size() > static_cast<size_t>(opts.min_workers)) {
+          retired++;
+          break;
+        }
+        continue;
+      }
+    }
+
+    Queued item = std::move(q.front());
+    q.pop_front();
+    auto waited = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - item.enqueued);
+    uint32_t us = static_cast<uint32_t>(std::min<int64_t>(waited.count(), UINT32_MAX));
+    if (waits.size() < wait_samples) {
+      waits.push_back(us);
+    } else {
+      waits[next_wait] = us;
+    }
+    next_wait = (next_wait + 1) % wait_samples;
+    bool wake = full_waiters > 0;
+    self->busy = true;
+    l.unlock();
+    if (wake) {
+      not_full.notify_one();
+    }
+
+    item.task();
+
+    l.lock();
+    self->busy = false;
+    executed++;
+  }
+
+  // hand our thread to whoever joins, the supervisor or the destructor
+  auto it = std::find_if(workers.begin(), workers.end(),
+                         [self](const std::unique_ptr<Worker> &w) { return w.get() == self; });
+  exited.push_back(std::move(*it));
+  workers.erase(it);
+  if (workers.empty()) {
+    exited_cv.notify_all();
+  }
+}
+
+/* m must be held */
+std::vector<pid_t> ElasticRunner::busy_tids() const {
+  std::vector<pid_t> tids;
+  for (const auto &w : workers) {
+    if (w->busy) {
+      tids.push_back(w->tid);
+    }
+  }
+  return tids;
+}
+
+/*
+ * int count_blocked(vector<pid_t>)
+ *
+ * counts the threads the kernel has asleep (S) or in uninterruptible
+ * wait (D). a busy worker in either state is not using its cpu.
+ */
+int ElasticRunner::count_blocked(const std::vector<pid_t> &tids) {
+  int blocked = 0;
+  char path[64];
+  char buff[256];
+  for (pid_t tid : tids) {
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    ssize_t n = ::read(fd, buff, sizeof(buff) - 1);
+    close(fd);
+    if (n <= 0) {
+      continue;
+    }
+    buff[n] = '\0';
+    // the name is in parens and may hold spaces, the state follows the last one
+    const char *paren = strrchr(buff, ')');
+    if (paren != nullptr && paren[1] != '\0' && (paren[2] == 'S' || paren[2] == 'D')) {
+      blocked++;
+    }
+  }
+  return blocked;
+}
+
+ElasticStats ElasticRunner::snapshot(std::unique_lock<std::mutex> &l) {
+  ElasticStats s;
+  s.queue_depth = q.size();
+  s.workers = static_cast<int>(workers.size());
+  s.executed = executed;
+  s.grown = grown;
+  s.retired = retired;
+  std::vector<pid_t> tids = busy_tids();
+  s.active = static_cast<int>(tids.size());
+  std::vector<uint32_t> sorted = waits;
+  l.unlock();
+
+  s.blocked = count_blocked(tids);
+  if (!sorted.empty()) {
+    std::sort(sorted.begin(), sorted.end());
+    auto at = [&sorted](double p) { return sorted[static_cast<size_t>(p * (sorted.size() - 1))]; };
+    s.wait_p50_us = at(0.50);
+    s.wait_p90_us = at(0.90);
+    s.wait_p99_us = at(0.99);
+    s.wait_max_us = sorted.back();
+  }
+  l.lock();
+  return s;
+}
+
+ElasticStats ElasticRunner::stats() {
+  std::unique_lock<std::mutex> l(m);
+  return snapshot(l);
+}
+
+void ElasticRunner::on_sample(std::function<void(const ElasticStats &)> listener) {
+  std::lock_guard<std::mutex> l(m);
+  listeners.push_back(std::move(listener));
+}
+
+void ElasticRunner::supervise() {
+  auto next_report = clock::now() + opts.report_interval;
+  std::unique_lock<std::mutex> l(m);
+  while (!tick_cv.wait_for(l, opts.tick, [this] { return stopping; })) {
+    auto done = std::move(exited);
+    exited.clear();
+
+    const size_t room = opts.max_workers - workers.size();
+    if (!q.empty() && idle == 0 && room > 0) {
+      bool grow = clock::now() - q.front().enqueued > opts.grow_wait;
+      if (!grow) {
+        // only look at thread states when there is something to grow for
+        std::vector<pid_t> tids = busy_tids();
+        l.unlock();
+        int blocked = count_blocked(tids);
+        l.lock();
+        grow = blocked > opts.grow_blocked;
+      }
+      if (grow && !stopping && idle == 0) {
+        // enough threads for what is queued right now
+        size_t n = std::min(room, q.size());
+        spawn(n);
+        grown += n;
+      }
+    }
+
+    if (clock::now() >= next_report) {
+      next_report = clock::now() + opts.report_interval;
+      if (!listeners.empty()) {
+        ElasticStats s = snapshot(l);
+        auto report = listeners;
+        l.unlock();
+        for (const auto &listener : report) {
+          listener(s);
+        }
+        l.lock();
+      }
+    }
+
+    if (!done.empty()) {
+      l.unlock();
+      for (auto &w : done) {
+        w->thread.join();
+      }
+      l.lock();
+    }
+  }
+}
+
+namespace {
+thread_local const QoSRunner *current_qos = nullptr;
+}
+
+class_options QoSRunner::default_classes(int worker_threads) {
+  class_options opts;
+  opts[QoS::INTERACTIVE].weight = 8;
+  opts[QoS::STANDARD].weight = 4;
+  opts[QoS::BULK].weight = 1;
+  if (worker_threads > 1) {
+    opts[QoS::INTERACTIVE].reserved = 1;
+    opts[QoS::BULK].max_concurrent = std::max(worker_threads / 2, 1);
+  }
+  return opts;
+}
+
+QoSRunner::QoSRunner(int worker_threads)
+    : QoSRunner(worker_threads, default_classes(std::max(worker_threads, 1))) {}
+
+QoSRunner::QoSRunner(int worker_threads, class_options opts)
+    : num_workers(std::max(worker_threads, 1)), sec_start(clock::now()) {
+  int reserved = 0;
+  for (int i = 0; i < QoS::COUNT; ++i) {
+    classes[i].opts = opts[i];
+    classes[i].opts.weight = std::max(opts[i].weight, 1u);
+    classes[i].waits.reserve(wait_samples);
+    reserved += std::max(opts[i].reserved, 0);
+  }
+  if (reserved >= num_workers) {
+    throw ConcurrencyException("QoSRunner reserves " + std::to_string(reserved) + " of " +
+                               std::to_string(num_workers) + " workers, nothing is left to share");
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    workers.emplace_back([this] { worker_loop(); });
+  }
+}
+
+QoSRunner::~QoSRunner() {
+  {
+    std::lock_guard<std::mutex> l(m);
+    stopping = true;
+  }
+  has_work.notify_all();
+  not_full.notify_all();
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+void QoSRunner::dispatch(task_t task) { dispatch(QoS::INTERACTIVE, std::move(task)); }
+
+void QoSRunner::dispatch(QoS::class_t c, task_t task) {
+  if (c >= QoS::COUNT) {
+    c = QoS::STANDARD;
+  }
+  std::unique_lock<std::mutex> l(m);
+  Class &k = classes[c];
+  // workers never wait here, they are what empties the queues
+  if (current_qos != this && k.q.size() >= k.opts.max_queue) {
+    ++full_waiters;
+    not_full.wait(l, [&] { return k.q.size() < k.opts.max_queue || stopping; });
+    --full_waiters;
+  }
+  if (stopping) {
+    l.unlock();
+    task();
+    return;
+  }
+  // a class coming back from idle starts at the current virtual time, not with credit
+  if (k.q.empty() && k.running == 0) {
+    k.pass = std::max(k.pass, vtime);
+  }
+  k.q.push_back({std::move(task), clock::now()});
+  bool wake = idle > 0 && can_start(c);
+  l.unlock();
+  if (wake) {
+    has_work.notify_one();
+  }
+}
+
+/* m must be held */
+bool QoSRunner::can_start(int c) const {
+  const Class &k = classes[c];
+  if (k.q.empty()) {
+    return false;
+  }
+  if (k.opts.max_concurrent > 0 && k.running >= k.opts.max_concurrent) {
+    return false;
+  }
+  int held = 0;
+  for (int i = 0; i < QoS::COUNT; ++i) {
+    if (i != c) {
+      held += std::max(classes[i].opts.reserved - classes[i].running, 0);
+    }
+  }
+  return num_workers - running - 1 >= held;
+}
+
+/* m must be held, -1 if nothing can start */
+int QoSRunner::pick() const {
+  int best = -1;
+  for (int i = 0; i < QoS::COUNT; ++i) {
+    if (can_start(i) && (best < 0 || classes[i].pass < classes[best].pass)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+/* m must be held */
+void QoSRunner::roll_second(clock::time_point now) {
+  auto elapsed = now - sec_start;
+  if (elapsed < std::chrono::seconds(1)) {
+    return;
+  }
+  for (auto &k : classes) {
+    k.last_sec = (elapsed < std::chrono::seconds(2)) ? k.this_sec : 0;
+    k.this_sec = 0;
+  }
+  sec_start = now;
+}
+
+void QoSRunner::worker_loop() {
+  current_qos = this;
+  std::unique_lock<std::mutex> l(m);
+  while (true) {
+    int c = pick();
+    if (c < 0) {
+      bool queued = std::any_of(classes.begin(), classes.end(),
+                                [](const Class &k) { return !k.q.empty(); });
+      if (stopping && !queued) {
+        break;
+      }
+      ++idle;
+      has_work.wait(l);
+      --idle;
+      continue;
+    }
+
+    Class &k = classes[c];
+    Queued item = std::move(k.q.front());
+    k.q.pop_front();
+    vtime = k.pass;
+    k.pass += stride_unit / k.opts.weight;
+
+    auto waited = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - item.enqueued);
+    uint32_t us = static_cast<uint32_t>(std::min<int64_t>(waited.count(), UINT32_MAX));
+    if (k.waits.size() < wait_samples) {
+      k.waits.push_back(us);
+    } else {
+      k.waits[k.next_wait] = us;
+    }
+    k.next_wait = (k.next_wait + 1) % wait_samples;
+
+    k.running++;
+    running++;
+    bool wake = full_waiters > 0;
+    l.unlock();
+    if (wake) {
+      not_full.notify_all();
+    }
+
+    item.task();
+
+    l.lock();
+    k.running--;
+    running--;
+    k.executed++;
+    roll_second(clock::now());
+    k.this_sec++;
+    // the slot we free may be what a capped or reserved class was waiting for,
+    // we take it ourselves on the next pick, anything beyond that needs a hand
+    if (idle > 0 && pick() >= 0) {
+      has_work.notify_one();
+    }
+  }
+  current_qos = nullptr;
+}
+
+std::array<ClassStats, QoS::COUNT> QoSRunner::stats() {
+  std::array<ClassStats, QoS::COUNT> out;
+  std::array<std::vector<uint32_t>, QoS::COUNT> waits;
+  {
+    std::lock_guard<std::mutex> l(m);
+    roll_second(clock::now());
+    for (int i = 0; i < QoS::COUNT; ++i) {
+      out[i].queued = classes[i].q.size();
+      out[i].running = classes[i].running;
+      out[i].executed = classes[i].executed;
+      out[i].per_sec = classes[i].last_sec;
+      waits[i] = classes[i].waits;
+    }
+  }
+  for (int i = 0; i < QoS::COUNT; ++i) {
+    auto &w = waits[i];
+    if (w.empty()) {
+      continue;
+    }
+    std::sort(w.begin(), w.end());
+    out[i].wait_p50_us = w[(w.size() - 1) / 2];
+    out[i].wait_p99_us = w[static_cast<size_t>(0.99 * (w.size() - 1))];
+    out[i].wait_max_us = w.back();
+  }
+  return out;
+}
+
+PreforkRunner::PreforkRunner(int worker_procs, uint64_t max_requests)
+    : num_workers(std::max(worker_procs, 1)), max_requests(max_requests) {}
+
+pid_t PreforkRunner::spawn(const std::function<void()> &accept_loop) {
+  pid_t master = getpid();
+  pid_t pid;
+  while ((pid = fork()) < 0) {
+    perror("Prefork");
+    sleep(1);
+  }
+  if (pid > 0) {
+    return pid;
+  }
+
+  // workers go down with the master
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != master) {
+    exit(0);
+  }
+  accept_loop();
+  exit(0);
+}
+
+void PreforkRunner::serve(const std::function<void()> &accept_loop) {
+  for (int i = 0; i < num_workers; ++i) {
+    workers.push_back({spawn(accept_loop), std::chrono::steady_clock::now()});
+  }
+
+  while (1) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Prefork");
+      return;
+    }
+
+    auto w = std::find_if(workers.begin(), workers.end(),
+                          [pid](const Worker &x) { return x.pid == pid; });
+    if (w == workers.end()) {
+      // not ours, e.g. the logger process
+      continue;
+    }
+
+    bool crashed = false;
+    if (WIFSIGNALED(status)) {
+      fprintf(stderr, "Prefork worker %d killed by signal %d\n", pid, WTERMSIG(status));
+      crashed = true;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Prefork worker %d exited with %d\n", pid, WEXITSTATUS(status));
+      crashed = true;
+    }
+    // don't fork in a tight loop when workers die on startup
+    if (crashed && std::chrono::steady_clock::now() - w->started < std::chrono::seconds(1)) {
+      sleep(1);
+    }
+
+    w->pid = spawn(accept_loop);
+    w->started = std::chrono::steady_clock::now();
+  }
+}
+
+void PreforkRunner::dispatch(task_t task) {
+  task();
+  // recycle the worker, the master forks a fresh one
+  if (++served >= max_requests) {
+    exit(0);
+  }
+}
 }  // namespace Kleptic::Concurrency
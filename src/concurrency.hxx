@@ -1,26 +1,64 @@
 #ifndef KLEPTIC_CONCURRENCY_HXX_
 #define KLEPTIC_CONCURRENCY_HXX_
 
+#include <sys/types.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <future>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "bqueue.hxx"
+#include "eventcount.hxx"
+#include "qos.hxx"
+#include "unique_function.hxx"
+#include "wsdeque.hxx"
 
 namespace Kleptic::Concurrency {
 
-enum ConcurrencyMode { THR_SINGLE, THR_POOL, THR_PER_REQ, FORK_PER_REQ };
+enum ConcurrencyMode { THR_SINGLE, THR_POOL, THR_PER_REQ, FORK_PER_REQ, PREFORK };
 
-typedef std::packaged_task<void()> task_t;
+/* exceptions escaping a task end the process, as with std::thread */
+typedef unique_function<void()> task_t;
 
 class ConcurrentRunner {
  public:
   virtual void dispatch(task_t) = 0;
+  /* runners without scheduling classes treat every class the same */
+  virtual void dispatch(QoS::class_t, task_t task) { dispatch(std::move(task)); }
+  /* runs the accept loop, runners that accept in several processes override it */
+  virtual void serve(const std::function<void()> &accept_loop) { accept_loop(); }
+  /* true if dispatch hands tasks to other threads of this process, not inline or to a child */
+  virtual bool threaded() const { return false; }
   virtual ~ConcurrentRunner() = default;
 };
 
 typedef std::unique_ptr<ConcurrentRunner> runner_t;
 
+/*
+ * future<R> submit(ConcurrentRunner &, F fn)
+ *
+ * for callers that want fn's result or exception back. costs the shared
+ * state of a packaged_task, which plain dispatch no longer pays.
+ */
+template <typename F>
+auto submit(ConcurrentRunner &r, F fn) {
+  std::packaged_task<std::invoke_result_t<F>()> pt(std::move(fn));
+  auto f = pt.get_future();
+  r.dispatch(task_t(std::move(pt)));
+  return f;
+}
+
 class SingleRunner : public ConcurrentRunner {
  public:
   SingleRunner() = default;
@@ -32,6 +70,7 @@ class ThreadRunner : public ConcurrentRunner {
  public:
   ThreadRunner() = default;
   void dispatch(task_t) override;
+  bool threaded() const override { return true; }
   ~ThreadRunner() = default;
 };
 
@@ -42,9 +81,275 @@ class ThreadPoolRunner : public ConcurrentRunner {
  public:
   explicit ThreadPoolRunner(int worker_threads = std::thread::hardware_concurrency());
   void dispatch(task_t) override;
+  bool threaded() const override { return true; }
   ~ThreadPoolRunner() = default;
 };
 
+struct WorkerStats {
+  uint64_t executed = 0;
+  uint64_t stolen = 0;
+  uint64_t parked = 0;
+};
+
+/*
+ * WorkStealingRunner
+ *
+ * every worker owns a Chase-Lev deque and an inbox. dispatch from outside
+ * the pool round-robins over the inboxes, dispatch from a worker pushes on
+ * its own deque. idle workers steal from random victims, spin for a while
+ * and then park until new work shows up.
+ *
+ * tasks wait in a fixed array of max_queue slots, the deques and inboxes
+ * only pass slot numbers around. once every slot is taken dispatch from
+ * outside blocks until one frees up, and a worker dispatching runs the
+ * task itself, since it might be the one the others wait on.
+ */
+class WorkStealingRunner : public ConcurrentRunner {
+  static constexpr uint32_t no_slot = UINT32_MAX;
+
+  struct Slot {
+    task_t task;
+    /* the next free slot while this one is free */
+    std::atomic<uint32_t> next{no_slot};
+  };
+
+  struct alignas(KLEPTIC_CACHE_LINE) Worker {
+    WorkStealingDeque<uint32_t> deque;
+    std::mutex inbox_m;
+    std::vector<uint32_t> inbox;
+    std::vector<uint32_t> drained;
+    std::atomic<size_t> inbox_size{0};
+
+    std::atomic<uint64_t> executed{0};
+    std::atomic<uint64_t> stolen{0};
+    std::atomic<uint64_t> parked{0};
+    uint64_t rng;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::atomic<size_t> next_inbox{0};
+
+  std::unique_ptr<Slot[]> slots;
+  /* top of the free slot stack, a change count above the slot number against ABA */
+  alignas(KLEPTIC_CACHE_LINE) std::atomic<uint64_t> free_top;
+  EventCount slot_freed;
+
+  std::mutex park_m;
+  std::condition_variable park_cv;
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<int> num_parked{0};
+  std::atomic<bool> stopping{false};
+
+  uint32_t take_slot();
+  void free_slot(uint32_t i);
+  void run_slot(uint32_t i);
+  void worker_loop(size_t id);
+  uint32_t find_task(size_t id);
+  bool has_work() const;
+  void wake();
+
+ public:
+  static constexpr int spin_rounds = 64;
+
+  explicit WorkStealingRunner(int worker_threads = std::thread::hardware_concurrency(),
+                              size_t max_queue = 4096);
+  void dispatch(task_t) override;
+  bool threaded() const override { return true; }
+
+  /* runs what is already queued, then joins the workers */
+  void shutdown();
+  std::vector<WorkerStats> stats() const;
+  ~WorkStealingRunner();
+};
+
+struct ElasticOptions {
+  int min_workers = 2;
+  int max_workers = 64;
+  /* dispatch blocks once this many tasks wait and no worker can be added */
+  size_t max_queue = 1024;
+  /* grow when the oldest queued task has waited longer than this */
+  std::chrono::microseconds grow_wait{5000};
+  /* or when more busy workers than this are blocked in a syscall */
+  int grow_blocked = 0;
+  /* workers above min_workers exit after idling this long */
+  std::chrono::milliseconds idle_cooldown{10000};
+  /* how often the supervisor checks the queue */
+  std::chrono::milliseconds tick{10};
+  /* how often on_sample listeners are called */
+  std::chrono::milliseconds report_interval{1000};
+};
+
+struct ElasticStats {
+  size_t queue_depth = 0;
+  int workers = 0;
+  int active = 0;
+  int blocked = 0;
+  /* queue wait of the recent tasks */
+  uint64_t wait_p50_us = 0;
+  uint64_t wait_p90_us = 0;
+  uint64_t wait_p99_us = 0;
+  uint64_t wait_max_us = 0;
+  uint64_t executed = 0;
+  uint64_t grown = 0;
+  uint64_t retired = 0;
+};
+
+/*
+ * ElasticRunner
+ *
+ * thread pool that keeps between min_workers and max_workers threads.
+ * a supervisor grows it while queued tasks wait too long, or while the
+ * busy workers are blocked (sleeping in a syscall, e.g. waiting on a CGI
+ * child) and none are idle. workers retire after idle_cooldown.
+ */
+class ElasticRunner : public ConcurrentRunner {
+  typedef std::chrono::steady_clock clock;
+
+  struct Queued {
+    task_t task;
+    clock::time_point enqueued;
+  };
+
+  struct Worker {
+    std::thread thread;
+    pid_t tid = 0;
+    bool busy = false;
+  };
+
+  static constexpr size_t wait_samples = 1024;
+
+  const ElasticOptions opts;
+
+  std::mutex m;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::condition_variable tick_cv;
+  std::condition_variable exited_cv;
+  std::deque<Queued> q;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::unique_ptr<Worker>> exited;
+  int idle = 0;
+  int full_waiters = 0;
+  bool stopping = false;
+
+  std::vector<uint32_t> waits;
+  size_t next_wait = 0;
+  uint64_t executed = 0;
+  uint64_t grown = 0;
+  uint64_t retired = 0;
+
+  std::vector<std::function<void(const ElasticStats &)>> listeners;
+  std::thread supervisor;
+
+  void spawn(size_t n);
+  void worker_loop(Worker *self);
+  void supervise();
+  ElasticStats snapshot(std::unique_lock<std::mutex> &l);
+  std::vector<pid_t> busy_tids() const;
+  static int count_blocked(const std::vector<pid_t> &tids);
+
+ public:
+  explicit ElasticRunner(ElasticOptions opts = ElasticOptions());
+  void dispatch(task_t) override;
+  bool threaded() const override { return true; }
+
+  /* called from the supervisor every report_interval */
+  void on_sample(std::function<void(const ElasticStats &)> listener);
+  ElasticStats stats();
+  ~ElasticRunner();
+};
+
+struct ClassOptions {
+  /* share of the workers while several classes have work queued */
+  unsigned weight = 1;
+  /* most workers the class may use at once, 0 for no cap */
+  int max_concurrent = 0;
+  /* workers kept free for the class, other classes can't take them */
+  int reserved = 0;
+  /* dispatch from outside the pool blocks once this many tasks wait */
+  size_t max_queue = 1024;
+};
+
+struct ClassStats {
+  size_t queued = 0;
+  int running = 0;
+  uint64_t executed = 0;
+  /* tasks finished during the last full second */
+  uint64_t per_sec = 0;
+  /* queue wait of the recent tasks */
+  uint64_t wait_p50_us = 0;
+  uint64_t wait_p99_us = 0;
+  uint64_t wait_max_us = 0;
+};
+
+typedef std::array<ClassOptions, QoS::COUNT> class_options;
+
+/*
+ * QoSRunner
+ *
+ * thread pool with a queue per scheduling class. a free worker takes
+ * from the class with the lowest virtual time among those under their
+ * concurrency cap, and every task started advances its class's clock by
+ * 1/weight, so queued classes share the workers by weight. untagged work
+ * (dispatch(task_t)), e.g. reading and routing requests, is INTERACTIVE.
+ */
+class QoSRunner : public ConcurrentRunner {
+  typedef std::chrono::steady_clock clock;
+
+  struct Queued {
+    task_t task;
+    clock::time_point enqueued;
+  };
+
+  struct Class {
+    ClassOptions opts;
+    std::deque<Queued> q;
+    uint64_t pass = 0;
+    int running = 0;
+    uint64_t executed = 0;
+    uint64_t this_sec = 0;
+    uint64_t last_sec = 0;
+    std::vector<uint32_t> waits;
+    size_t next_wait = 0;
+  };
+
+  static constexpr size_t wait_samples = 256;
+  static constexpr uint64_t stride_unit = 1 << 20;
+
+  const int num_workers;
+  std::mutex m;
+  std::condition_variable has_work;
+  std::condition_variable not_full;
+  std::array<Class, QoS::COUNT> classes;
+  clock::time_point sec_start;
+  /* pass of the last class started, where classes coming back from idle resume */
+  uint64_t vtime = 0;
+  int running = 0;
+  int idle = 0;
+  int full_waiters = 0;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  bool can_start(int c) const;
+  int pick() const;
+  void roll_second(clock::time_point now);
+  void worker_loop();
+
+ public:
+  /* 8:4:1 weights, BULK capped at half the workers and 1 worker held for INTERACTIVE */
+  static class_options default_classes(int worker_threads);
+
+  explicit QoSRunner(int worker_threads = std::thread::hardware_concurrency());
+  QoSRunner(int worker_threads, class_options opts);
+  void dispatch(task_t) override;
+  void dispatch(QoS::class_t, task_t) override;
+  bool threaded() const override { return true; }
+
+  std::array<ClassStats, QoS::COUNT> stats();
+  ~QoSRunner();
+};
+
 class ForkRunner : public ConcurrentRunner {
  public:
   ForkRunner();
@@ -52,6 +357,37 @@ class ForkRunner : public ConcurrentRunner {
   ~ForkRunner() = default;
 };
 
+/*
+ * PreforkRunner
+ *
+ * the master forks num_workers processes up front and only supervises
+ * them. each worker accepts from the inherited listening socket and runs
+ * its connections inline, then exits after max_requests so leaks stay
+ * contained. workers that exit or crash are respawned.
+ */
+class PreforkRunner : public ConcurrentRunner {
+  struct Worker {
+    pid_t pid;
+    std::chrono::steady_clock::time_point started;
+  };
+
+  const int num_workers;
+  const uint64_t max_requests;
+  uint64_t served = 0;
+  std::vector<Worker> workers;
+
+  pid_t spawn(const std::function<void()> &accept_loop);
+
+ public:
+  static constexpr uint64_t default_max_requests = 10000;
+
+  explicit PreforkRunner(int worker_procs = std::thread::hardware_concurrency(),
+                         uint64_t max_requests = default_max_requests);
+  void serve(const std::function<void()> &accept_loop) override;
+  void dispatch(task_t) override;
+  ~PreforkRunner() = default;
+};
+
 }  // namespace Kleptic::Concurrency
 
 #endif  // KLEPTIC_CONCURRENCY_HXX_
@@ -3,6 +3,7 @@
 
 // TODO MOVE INTO CXX
 
+#include <cstdint>
 #include <exception>
 #include <string>
 
@@ -43,6 +44,70 @@ class TemplateException : public std::exception {
   }
 };
 
+class RouteException : public std::exception {
+ protected:
+  std::string err_msg;
+
+ public:
+  RouteException(std::string msg, std::string route) : err_msg("Route " + route + " : " + msg) {}
+
+  virtual const char *what() const throw() { return err_msg.c_str(); }
+};
+
+class AsyncException : public std::exception {
+ protected:
+  std::string err_msg;
+
+ public:
+  explicit AsyncException(std::string msg) : err_msg(msg) {}
+
+  virtual const char *what() const throw() { return err_msg.c_str(); }
+};
+
+class ConcurrencyException : public std::exception {
+ protected:
+  std::string err_msg;
+
+ public:
+  explicit ConcurrencyException(std::string msg) : err_msg(msg) {}
+
+  virtual const char *what() const throw() { return err_msg.c_str(); }
+};
+
+class FastCGIException : public std::exception {
+ protected:
+  std::string err_msg;
+
+ public:
+  explicit FastCGIException(std::string msg) : err_msg(msg) {}
+
+  virtual const char *what() const throw() { return err_msg.c_str(); }
+};
+
+class ModuleException : public std::exception {
+ protected:
+  std::string err_msg;
+
+ public:
+  explicit ModuleException(std::string msg) : err_msg(msg) {}
+
+  virtual const char *what() const throw() { return err_msg.c_str(); }
+};
+
+class HTTP2Exception : public std::exception {
+ protected:
+  std::string err_msg;
+
+ public:
+  /* an HTTP/2 error code, and the stream it ends, 0 when it ends the connection */
+  uint32_t err_code;
+  uint32_t stream_id;
+  HTTP2Exception(std::string msg, uint32_t code, uint32_t stream_id = 0)
+      : err_msg(msg), err_code(code), stream_id(stream_id) {}
+
+  virtual const char *what() const throw() { return err_msg.c_str(); }
+};
+
 }  // namespace Kleptic
 
 #endif  // KLEPTIC_ERROR_HXX_
@@ -0,0 +1,349 @@
+#include "event_loop.hxx"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "error.hxx"
+
+namespace Kleptic::Async {
+
+static thread_local EventLoop *current_loop = nullptr;
+
+EventLoop::EventLoop(int offload_threads)
+    : epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+      wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      offload_threads(std::max(offload_threads, 1)) {
+  if (epoll_fd < 0 || wake_fd < 0) {
+    throw AsyncException("Failed to create event loop : " + std::string(strerror(errno)));
+  }
+  struct epoll_event e = {};
+  e.events = EPOLLIN;
+  e.data.fd = wake_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &e) < 0) {
+    throw AsyncException("Failed to watch wakeup fd : " + std::string(strerror(errno)));
+  }
+}
+
+EventLoop::~EventLoop() {
+  if (pool) {
+    pool->shutdown();
+  }
+  close(wake_fd);
+  close(epoll_fd);
+}
+
+EventLoop &EventLoop::current() {
+  if (current_loop == nullptr) {
+    throw AsyncException("Not running on an event loop");
+  }
+  return *current_loop;
+}
+
+bool EventLoop::on_loop() { return current_loop != nullptr; }
+
+/*
+ * void arm(int fd, const IoWaiters &)
+ *
+ * (re)registers fd for whatever its waiters need. one shot interest is
+ * disabled after it fires, so MOD is the usual case and ADD the first.
+ */
+void EventLoop::arm(int fd, const IoWaiters &w) {
+  struct epoll_event e = {};
+  e.events = EPOLLONESHOT;
+  if (w.reader) {
+    e.events |= EPOLLIN;
+  }
+  if (w.writer) {
+    e.events |= EPOLLOUT;
+  }
+  e.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &e) == 0) {
+    return;
+  }
+  if (errno == ENOENT && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &e) == 0) {
+    return;
+  }
+  throw AsyncException("Failed to watch fd " + std::to_string(fd) + " : " +
+                       std::string(strerror(errno)));
+}
+
+void EventLoop::watch(int fd, uint32_t events, std::coroutine_handle<> h) {
+  IoWaiters &w = io[fd];
+  std::coroutine_handle<> &slot = (events & EPOLLIN) ? w.reader : w.writer;
+  if (slot) {
+    throw AsyncException("fd " + std::to_string(fd) + " already has a waiter");
+  }
+  slot = h;
+  try {
+    arm(fd, w);
+  } catch (...) {
+    slot = nullptr;
+    if (!w.reader && !w.writer) {
+      io.erase(fd);
+    }
+    throw;
+  }
+}
+
+void EventLoop::dispatch_io(const struct epoll_event &e) {
+  auto it = io.find(e.data.fd);
+  if (it == io.end()) {
+    return;
+  }
+  IoWaiters &w = it->second;
+  // errors wake both sides, the next read/write reports them
+  const uint32_t err = EPOLLERR | EPOLLHUP;
+  if (w.reader && (e.events & (EPOLLIN | EPOLLRDHUP | err))) {
+    ready.push_back(std::exchange(w.reader, nullptr));
+  }
+  if (w.writer && (e.events & (EPOLLOUT | err))) {
+    ready.push_back(std::exchange(w.writer, nullptr));
+  }
+
+  if (!w.reader && !w.writer) {
+    io.erase(it);
+  } else {
+    arm(e.data.fd, w);
+  }
+}
+
+void EventLoop::forget(int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  io.erase(fd);
+}
+
+void EventLoop::post(std::coroutine_handle<> h) {
+  {
+    std::lock_guard<std::mutex> l(post_m);
+    posted.push_back(h);
+  }
+  uint64_t one = 1;
+  if (::write(wake_fd, &one, sizeof(one)) < 0) {
+    // counter saturated, the loop is already due to wake up
+  }
+}
+
+void EventLoop::stop() {
+  stopping.store(true, std::memory_order_release);
+  uint64_t one = 1;
+  if (::write(wake_fd, &one, sizeof(one)) < 0) {
+    // as in post
+  }
+}
+
+detail::detached EventLoop::start_detached(EventLoop *loop, task<void> t) {
+  co_await loop->schedule();
+  try {
+    co_await std::move(t);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Unhandled exception in async task : %s\n", e.what());
+  } catch (...) {
+    fprintf(stderr, "Unhandled exception in async task\n");
+  }
+}
+
+void EventLoop::spawn(task<void> t) { start_detached(this, std::move(t)); }
+
+Concurrency::ConcurrentRunner &EventLoop::offload_runner() {
+  if (!pool) {
+    pool = std::make_unique<Concurrency::WorkStealingRunner>(offload_threads);
+  }
+  return *pool;
+}
+
+void EventLoop::run() {
+  const bool never = false;
+  run_until(never);
+}
+
+void EventLoop::run_until(const bool &done) {
+  EventLoop *prev = current_loop;
+  current_loop = this;
+  const bool was_running = std::exchange(running, true);
+
+  std::vector<std::coroutine_handle<>> batch;
+  struct epoll_event events[KLEPTIC_LOOP_MAX_EVENTS];
+
+  while (!stopping.load(std::memory_order_acquire) && !done) {
+    batch.swap(ready);
+    for (auto h : batch) {
+      h.resume();
+    }
+    batch.clear();
+    if (stopping.load(std::memory_order_acquire) || done) {
+      break;
+    }
+
+    int timeout = -1;
+    if (!ready.empty()) {
+      timeout = 0;
+    } else if (!timers.empty()) {
+      auto wait = std::chrono::ceil<std::chrono::milliseconds>(timers.top().deadline - clock::now());
+      timeout = static_cast<int>(std::max<int64_t>(wait.count(), 0));
+    }
+
+    int n = epoll_wait(epoll_fd, events, KLEPTIC_LOOP_MAX_EVENTS, timeout);
+    if (n < 0 && errno != EINTR) {
+      current_loop = prev;
+      running = was_running;
+      throw AsyncException("epoll_wait failed : " + std::string(strerror(errno)));
+    }
+
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.fd == wake_fd) {
+        uint64_t count;
+        if (::read(wake_fd, &count, sizeof(count)) < 0) {
+          // nothing pending, spurious wakeup
+        }
+        std::lock_guard<std::mutex> l(post_m);
+        ready.insert(ready.end(), posted.begin(), posted.end());
+        posted.clear();
+      } else {
+        dispatch_io(events[i]);
+      }
+    }
+
+    auto now = clock::now();
+    while (!timers.empty() && timers.top().deadline <= now) {
+      ready.push_back(timers.top().h);
+      timers.pop();
+    }
+  }
+
+  current_loop = prev;
+  running = was_running;
+}
+
+EventLoop &EventLoop::for_thread() {
+  thread_local std::unique_ptr<EventLoop> loop;
+  thread_local pid_t owner = 0;
+  if (owner != getpid()) {
+    // one inherited through fork shares its epoll set with the parent and lost its pool
+    // threads, it is left alone
+    static_cast<void>(loop.release());
+    loop = std::make_unique<EventLoop>();
+    owner = getpid();
+  }
+  return *loop;
+}
+
+task<int> read_some(Socket &s, char *buff, int size) {
+  while (true) {
+    int ret = s.try_read(buff, size);
+    if (ret >= 0) {
+      co_return ret;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      throw SocketException("unable to read : " + std::string(strerror(errno)));
+    }
+    co_await readable(s._socket_fd);
+  }
+}
+
+/*
+ * task<void> handshake_watchdog(fd, done, deadline)
+ *
+ * waits on the loop can't time out, so at the deadline the socket is
+ * shut down, the pending wait wakes up and the next step fails. done is
+ * set before the socket can be closed, fd is never reused by then.
+ */
+static task<void> handshake_watchdog(int fd, std::shared_ptr<bool> done,
+                                     EventLoop::clock::time_point deadline) {
+  co_await EventLoop::current().sleep_until(deadline);
+  if (!*done) {
+    shutdown(fd, SHUT_RDWR);
+  }
+}
+
+task<bool> handshake(Socket &s) {
+  handshake_t step = s.try_handshake();
+  if (step == HANDSHAKE_DONE || step == HANDSHAKE_FAILED) {
+    co_return step == HANDSHAKE_DONE;
+  }
+  auto done = std::make_shared<bool>(false);
+  // set however this frame ends, a throw included, before the caller can close the socket
+  struct set_done {
+    std::shared_ptr<bool> &done;
+    ~set_done() { *done = true; }
+  } guard{done};
+  if (s.handshake_deadline != EventLoop::clock::time_point::max()) {
+    spawn(handshake_watchdog(s._socket_fd, done, s.handshake_deadline));
+  }
+  while (step == HANDSHAKE_WANT_READ || step == HANDSHAKE_WANT_WRITE) {
+    if (step == HANDSHAKE_WANT_READ) {
+      co_await readable(s._socket_fd);
+    } else {
+      co_await writable(s._socket_fd);
+    }
+    step = s.try_handshake();
+  }
+  co_return step == HANDSHAKE_DONE;
+}
+
+task<void> write_all(Socket &s, std::string data) {
+  const char *p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    int ret = s.try_write(p, static_cast<int>(left));
+    if (ret >= 0) {
+      p += ret;
+      left -= ret;
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      throw SocketException("failed to write characters due to : " +
+                            std::string(strerror(errno)));
+    }
+    co_await writable(s._socket_fd);
+  }
+}
+
+task<int> read_some(int fd, char *buff, int size) {
+  while (true) {
+    co_await readable(fd);
+    int ret = ::read(fd, buff, size);
+    if (ret >= 0) {
+      co_return ret;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      throw SocketException("unable to read : " + std::string(strerror(errno)));
+    }
+  }
+}
+
+task<std::string> read_file(std::string path) {
+  auto load = [path] {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+      throw AsyncException("Unable to open " + path);
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+  };
+  std::string data = co_await offload(std::move(load));
+  co_return data;
+}
+
+task<void> write_file(std::string path, std::string data) {
+  auto store = [path, data = std::move(data)] {
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    if (!f.write(data.data(), data.size())) {
+      throw AsyncException("Unable to write " + path);
+    }
+  };
+  co_await offload(std::move(store));
+}
+
+}  // namespace Kleptic::Async
@@ -0,0 +1,336 @@
+#ifndef KLEPTIC_EVENT_LOOP_HXX_
+#define KLEPTIC_EVENT_LOOP_HXX_
+
+#include <sys/epoll.h>
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "concurrency.hxx"
+#include "socket.hxx"
+#include "task.hxx"
+
+#define KLEPTIC_LOOP_MAX_EVENTS 64
+#define KLEPTIC_LOOP_OFFLOAD_THREADS 4
+
+namespace Kleptic::Async {
+
+namespace detail {
+
+/* fire and forget coroutine, its frame frees itself when it finishes */
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+template <typename T>
+struct outcome {
+  std::optional<T> value;
+  std::exception_ptr error;
+
+  template <typename F>
+  void run(F &fn) {
+    try {
+      value.emplace(fn());
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  T get() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return std::move(*value);
+  }
+};
+
+template <>
+struct outcome<void> {
+  std::exception_ptr error;
+
+  template <typename F>
+  void run(F &fn) {
+    try {
+      fn();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  void get() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+}  // namespace detail
+
+/*
+ * EventLoop
+ *
+ * single threaded, readiness driven scheduler for coroutines. a coroutine
+ * waiting on an fd is parked in an epoll interest set (one shot, so every
+ * wait re-arms), timers sit in a heap and blocking work is offloaded to a
+ * small thread pool that posts the coroutine back when it is done.
+ *
+ * post, spawn and stop may be called from any thread, everything else
+ * belongs to the thread inside run().
+ */
+class EventLoop {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+ private:
+  struct IoWaiters {
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+  };
+
+  struct Timer {
+    clock::time_point deadline;
+    uint64_t seq;
+    std::coroutine_handle<> h;
+    bool operator>(const Timer &o) const {
+      return (deadline != o.deadline) ? deadline > o.deadline : seq > o.seq;
+    }
+  };
+
+  const int epoll_fd;
+  const int wake_fd;
+  std::atomic<bool> stopping{false};
+  /* inside run or run_until */
+  bool running = false;
+
+  std::vector<std::coroutine_handle<>> ready;
+  std::unordered_map<int, IoWaiters> io;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+  uint64_t timer_seq = 0;
+
+  std::mutex post_m;
+  std::vector<std::coroutine_handle<>> posted;
+
+  const int offload_threads;
+  // last so it is joined before the queues it posts into go away
+  std::unique_ptr<Concurrency::WorkStealingRunner> pool;
+
+  void watch(int fd, uint32_t events, std::coroutine_handle<> h);
+  void arm(int fd, const IoWaiters &w);
+  void dispatch_io(const struct epoll_event &e);
+  Concurrency::ConcurrentRunner &offload_runner();
+  static detail::detached start_detached(EventLoop *loop, task<void> t);
+
+ public:
+  explicit EventLoop(int offload_threads = KLEPTIC_LOOP_OFFLOAD_THREADS);
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+  ~EventLoop();
+
+  /* the loop running on this thread, throws AsyncException off a loop */
+  static EventLoop &current();
+  static bool on_loop();
+
+  /* runs until stop() */
+  void run();
+  void stop();
+  /*
+   * void run_until(const bool &done)
+   *
+   * runs until one of the loop's coroutines sets done. unlike after
+   * stop() the loop can be run again, whatever is still waiting on it
+   * carries on then.
+   */
+  void run_until(const bool &done);
+  bool is_running() const { return running; }
+
+  /* a loop kept for sync_wait on this thread, created on first use and after a fork */
+  static EventLoop &for_thread();
+
+  void post(std::coroutine_handle<> h);
+  /* starts t on the loop, exceptions escaping it are reported and dropped */
+  void spawn(task<void> t);
+
+  /* drops fd from the interest set, only needed if it is closed while waited on */
+  void forget(int fd);
+
+  auto schedule() {
+    struct awaiter {
+      EventLoop &loop;
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { loop.post(h); }
+      void await_resume() noexcept {}
+    };
+    return awaiter{*this};
+  }
+
+  auto readable(int fd) {
+    struct awaiter {
+      EventLoop &loop;
+      int fd;
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { loop.watch(fd, EPOLLIN, h); }
+      void await_resume() noexcept {}
+    };
+    return awaiter{*this, fd};
+  }
+
+  auto writable(int fd) {
+    struct awaiter {
+      EventLoop &loop;
+      int fd;
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { loop.watch(fd, EPOLLOUT, h); }
+      void await_resume() noexcept {}
+    };
+    return awaiter{*this, fd};
+  }
+
+  auto sleep_until(clock::time_point deadline) {
+    struct awaiter {
+      EventLoop &loop;
+      clock::time_point deadline;
+      bool await_ready() noexcept { return deadline <= clock::now(); }
+      void await_suspend(std::coroutine_handle<> h) {
+        loop.timers.push({deadline, loop.timer_seq++, h});
+      }
+      void await_resume() noexcept {}
+    };
+    return awaiter{*this, deadline};
+  }
+
+  template <typename Rep, typename Period>
+  auto sleep_for(std::chrono::duration<Rep, Period> d) {
+    return sleep_until(clock::now() + std::chrono::duration_cast<clock::duration>(d));
+  }
+
+  /*
+   * runs fn on the offload threads and resumes with its result. bind a
+   * capturing lambda to a name first, gcc 12 destroys closure temporaries
+   * inside a co_await expression twice.
+   */
+  template <typename F>
+  auto offload(F fn) {
+    typedef std::invoke_result_t<F> result_t;
+    struct awaiter {
+      EventLoop &loop;
+      F fn;
+      detail::outcome<result_t> out;
+      awaiter(EventLoop &loop, F fn) : loop(loop), fn(std::move(fn)) {}
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        loop.offload_runner().dispatch(Concurrency::task_t([this, h] {
+          out.run(fn);
+          loop.post(h);
+        }));
+      }
+      result_t await_resume() { return out.get(); }
+    };
+    return awaiter(*this, std::move(fn));
+  }
+};
+
+/*
+ * shorthands for the loop running the calling coroutine
+ */
+inline auto readable(int fd) { return EventLoop::current().readable(fd); }
+inline auto writable(int fd) { return EventLoop::current().writable(fd); }
+template <typename Rep, typename Period>
+auto sleep_for(std::chrono::duration<Rep, Period> d) {
+  return EventLoop::current().sleep_for(d);
+}
+template <typename F>
+auto offload(F fn) {
+  return EventLoop::current().offload(std::move(fn));
+}
+inline void spawn(task<void> t) { EventLoop::current().spawn(std::move(t)); }
+
+/*
+ * task<int> read_some(Socket &, char *buff, int size)
+ *
+ * reads what is available, waiting for the socket to become readable if
+ * nothing is. returns 0 at EOF, throws SocketException on errors.
+ */
+task<int> read_some(Socket &s, char *buff, int size);
+
+/*
+ * task<void> write_all(Socket &, string)
+ *
+ * writes all of data, waiting whenever the send buffer is full.
+ */
+task<void> write_all(Socket &s, std::string data);
+
+/*
+ * task<bool> handshake(Socket &)
+ *
+ * drives s.try_handshake to the end on the loop, false if it failed or
+ * its deadline passed.
+ */
+task<bool> handshake(Socket &s);
+
+/*
+ * task<int> read_some(int fd, char *buff, int size)
+ *
+ * same for pipes and other pollable fds, e.g. a CGI child's output.
+ */
+task<int> read_some(int fd, char *buff, int size);
+
+/*
+ * regular files are always "ready" to epoll, so these go through offload
+ */
+task<std::string> read_file(std::string path);
+task<void> write_file(std::string path, std::string data);
+
+/*
+ * T sync_wait(task<T>)
+ *
+ * runs t to completion on the calling thread's own loop. this is how
+ * synchronous code calls coroutine handlers, it blocks the caller. a
+ * sync_wait nested in one already running there gets a private loop.
+ */
+template <typename T>
+T sync_wait(task<T> t) {
+  std::unique_ptr<EventLoop> nested;
+  EventLoop *loop = &EventLoop::for_thread();
+  if (loop->is_running()) {
+    nested = std::make_unique<EventLoop>();
+    loop = nested.get();
+  }
+  detail::outcome<T> out;
+  bool done = false;
+  auto runner = [](task<T> t, detail::outcome<T> &out, bool &done) -> task<void> {
+    try {
+      if constexpr (std::is_void_v<T>) {
+        co_await std::move(t);
+      } else {
+        out.value.emplace(co_await std::move(t));
+      }
+    } catch (...) {
+      out.error = std::current_exception();
+    }
+    done = true;
+  };
+  loop->spawn(runner(std::move(t), out, done));
+  loop->run_until(done);
+  return out.get();
+}
+
+}  // namespace Kleptic::Async
+
+#endif  // KLEPTIC_EVENT_LOOP_HXX_
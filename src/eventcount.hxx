@@ -0,0 +1,85 @@
+#ifndef KLEPTIC_EVENTCOUNT_HXX_
+#define KLEPTIC_EVENTCOUNT_HXX_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+
+namespace Kleptic {
+
+/*
+ * EventCount
+ *
+ * lets lock-free structures block idle threads on a futex. a waiter takes
+ * a key, re-checks its condition and only then sleeps, a notifier bumps
+ * the epoch and only makes a syscall when somebody is waiting.
+ *
+ *   auto key = ec.prepare_wait();
+ *   if (ready()) { ec.cancel_wait(); } else { ec.wait(key); }
+ *
+ * with process_shared set the futex works across processes sharing the
+ * memory the EventCount lives in.
+ */
+class EventCount {
+  std::atomic<uint32_t> epoch{0};
+  std::atomic<uint32_t> waiters{0};
+  const int futex_flags;
+
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain word");
+
+  uint32_t *word() { return reinterpret_cast<uint32_t *>(&epoch); }
+
+ public:
+  explicit EventCount(bool process_shared = false)
+      : futex_flags(process_shared ? 0 : FUTEX_PRIVATE_FLAG) {}
+
+  EventCount(const EventCount &) = delete;
+  EventCount &operator=(const EventCount &) = delete;
+
+  uint32_t prepare_wait() {
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return epoch.load(std::memory_order_seq_cst);
+  }
+
+  void cancel_wait() { waiters.fetch_sub(1, std::memory_order_seq_cst); }
+
+  void wait(uint32_t key) {
+    while (epoch.load(std::memory_order_acquire) == key) {
+      syscall(SYS_futex, word(), FUTEX_WAIT | futex_flags, key, nullptr, nullptr, 0);
+    }
+    waiters.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  /* returns false when the wait timed out */
+  bool wait_for(uint32_t key, const struct timespec &timeout) {
+    bool woken = true;
+    if (epoch.load(std::memory_order_acquire) == key) {
+      syscall(SYS_futex, word(), FUTEX_WAIT | futex_flags, key, &timeout, nullptr, 0);
+      woken = epoch.load(std::memory_order_acquire) != key;
+    }
+    waiters.fetch_sub(1, std::memory_order_seq_cst);
+    return woken;
+  }
+
+  void notify_one() { notify(1); }
+  void notify_all() { notify(INT_MAX); }
+
+  void notify(int n) {
+    // orders the caller's publish before the waiter check
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_seq_cst) == 0) {
+      return;
+    }
+    epoch.fetch_add(1, std::memory_order_seq_cst);
+    syscall(SYS_futex, word(), FUTEX_WAKE | futex_flags, n, nullptr, nullptr, 0);
+  }
+};
+
+}  // namespace Kleptic
+
+#endif  // KLEPTIC_EVENTCOUNT_HXX_
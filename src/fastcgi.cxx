@@ -0,0 +1,580 @@
+#include "fastcgi.hxx"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "error.hxx"
+
+namespace Kleptic::FastCGI {
+
+using std::chrono::steady_clock;
+
+/* the pool runs one request per connection, so every request can use the same id */
+static const uint16_t request_id = 1;
+
+void append_record(std::string &out, uint8_t type, uint16_t id, std::string_view content) {
+  // keep records 8 byte aligned, as the spec recommends
+  const uint8_t padding = (8 - content.size() % 8) % 8;
+  const char header[KLEPTIC_FCGI_HEADER_LEN] = {
+      KLEPTIC_FCGI_VERSION,
+      static_cast<char>(type),
+      static_cast<char>(id >> 8),
+      static_cast<char>(id & 0xff),
+      static_cast<char>(content.size() >> 8),
+      static_cast<char>(content.size() & 0xff),
+      static_cast<char>(padding),
+      0};
+  out.append(header, sizeof(header));
+  out.append(content);
+  out.append(padding, '\0');
+}
+
+void append_stream(std::string &out, uint8_t type, uint16_t id, std::string_view data) {
+  while (!data.empty()) {
+    size_t n = std::min<size_t>(data.size(), KLEPTIC_FCGI_MAX_CONTENT);
+    append_record(out, type, id, data.substr(0, n));
+    data.remove_prefix(n);
+  }
+  append_record(out, type, id, {});
+}
+
+void append_begin_request(std::string &out, uint16_t id, role_t role, uint8_t flags) {
+  const char body[8] = {static_cast<char>(role >> 8), static_cast<char>(role & 0xff),
+                        static_cast<char>(flags), 0, 0, 0, 0, 0};
+  append_record(out, BEGIN_REQUEST, id, std::string_view(body, sizeof(body)));
+}
+
+void append_end_request(std::string &out, uint16_t id, uint32_t app_status,
+                        protocol_status_t status) {
+  const char body[8] = {static_cast<char>(app_status >> 24),
+                        static_cast<char>((app_status >> 16) & 0xff),
+                        static_cast<char>((app_status >> 8) & 0xff),
+                        static_cast<char>(app_status & 0xff),
+                        static_cast<char>(status),
+                        0,
+                        0,
+                        0};
+  append_record(out, END_REQUEST, id, std::string_view(body, sizeof(body)));
+}
+
+static void append_length(std::string &out, size_t len) {
+  if (len < 128) {
+    out.push_back(static_cast<char>(len));
+    return;
+  }
+  out.push_back(static_cast<char>(((len >> 24) & 0x7f) | 0x80));
+  out.push_back(static_cast<char>((len >> 16) & 0xff));
+  out.push_back(static_cast<char>((len >> 8) & 0xff));
+  out.push_back(static_cast<char>(len & 0xff));
+}
+
+std::string encode_pairs(const params_t &pairs) {
+  std::string out;
+  for (const auto &[name, value] : pairs) {
+    append_length(out, name.size());
+    append_length(out, value.size());
+    out += name;
+    out += value;
+  }
+  return out;
+}
+
+static size_t read_length(std::string_view &data) {
+  if (data.empty()) {
+    throw FastCGIException("truncated name-value pair");
+  }
+  const uint8_t b0 = data[0];
+  if (!(b0 & 0x80)) {
+    data.remove_prefix(1);
+    return b0;
+  }
+  if (data.size() < 4) {
+    throw FastCGIException("truncated name-value pair");
+  }
+  size_t len = (static_cast<size_t>(b0 & 0x7f) << 24) |
+               (static_cast<size_t>(static_cast<uint8_t>(data[1])) << 16) |
+               (static_cast<size_t>(static_cast<uint8_t>(data[2])) << 8) |
+               static_cast<uint8_t>(data[3]);
+  data.remove_prefix(4);
+  return len;
+}
+
+params_t decode_pairs(std::string_view data) {
+  params_t pairs;
+  while (!data.empty()) {
+    size_t name_len = read_length(data);
+    size_t value_len = read_length(data);
+    if (data.size() < name_len + value_len) {
+      throw FastCGIException("truncated name-value pair");
+    }
+    pairs[std::string(data.substr(0, name_len))] = std::string(data.substr(name_len, value_len));
+    data.remove_prefix(name_len + value_len);
+  }
+  return pairs;
+}
+
+void RecordReader::feed(const char *data, size_t len) {
+  if (pos == buff.size()) {
+    buff.clear();
+    pos = 0;
+  } else if (pos > KLEPTIC_FCGI_MAX_CONTENT) {
+    buff.erase(0, pos);
+    pos = 0;
+  }
+  buff.append(data, len);
+}
+
+bool RecordReader::next(Record &r) {
+  if (buff.size() - pos < KLEPTIC_FCGI_HEADER_LEN) {
+    return false;
+  }
+  const auto *h = reinterpret_cast<const uint8_t *>(buff.data() + pos);
+  if (h[0] != KLEPTIC_FCGI_VERSION) {
+    throw FastCGIException("unsupported FastCGI version " + std::to_string(h[0]));
+  }
+  const size_t len = (h[4] << 8) | h[5];
+  const size_t padding = h[6];
+  if (buff.size() - pos < KLEPTIC_FCGI_HEADER_LEN + len + padding) {
+    return false;
+  }
+  r.type = h[1];
+  r.id = static_cast<uint16_t>((h[2] << 8) | h[3]);
+  r.content.assign(buff, pos + KLEPTIC_FCGI_HEADER_LEN, len);
+  pos += KLEPTIC_FCGI_HEADER_LEN + len + padding;
+  return true;
+}
+
+/*
+ * void transact(int fd, string_view out, deadline, on_record, bool &sent)
+ *
+ * writes out while reading records back, until on_record says the reply
+ * is complete. reading and writing together keeps a large request body
+ * from deadlocking against an app that answers before it reads it all.
+ * sent is set once all of out is written.
+ */
+static void transact(int fd, std::string_view out, steady_clock::time_point deadline,
+                     const std::function<bool(Record &)> &on_record, bool &sent) {
+  size_t written = 0;
+  RecordReader reader;
+  Record rec;
+  char buff[8192];
+
+  while (true) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - steady_clock::now());
+    if (left.count() <= 0) {
+      throw FastCGIException("timed out");
+    }
+    struct pollfd p = {fd, POLLIN, 0};
+    if (written < out.size()) {
+      p.events |= POLLOUT;
+    }
+    int n = poll(&p, 1, static_cast<int>(left.count()));
+    if (n < 0 && errno != EINTR) {
+      throw FastCGIException("poll failed : " + std::string(strerror(errno)));
+    }
+    if (n <= 0) {
+      continue;
+    }
+
+    if (p.revents & POLLOUT) {
+      ssize_t ret = send(fd, out.data() + written, out.size() - written, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+        throw FastCGIException("write failed : " + std::string(strerror(errno)));
+      }
+      written += std::max<ssize_t>(ret, 0);
+      sent = written == out.size();
+    }
+
+    if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t ret = recv(fd, buff, sizeof(buff), MSG_DONTWAIT);
+      if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+        throw FastCGIException("read failed : " + std::string(strerror(errno)));
+      }
+      if (ret == 0) {
+        throw FastCGIException("app closed the connection");
+      }
+      reader.feed(buff, std::max<ssize_t>(ret, 0));
+      while (reader.next(rec)) {
+        if (on_record(rec)) {
+          return;
+        }
+      }
+    }
+  }
+}
+
+namespace {
+
+/*
+ * Spawner
+ *
+ * forks every app from one thread that lives as long as the process.
+ * PR_SET_PDEATHSIG fires when the thread that forked exits, not the
+ * process, so an app forked from a request or health thread would be
+ * killed as soon as that thread retired. a process forked from the
+ * server (prefork workers) starts its own spawner on first use.
+ */
+class Spawner {
+  struct Job {
+    const char *path;
+    int lfd;
+    pid_t pid = -1;
+    int err = 0;
+    bool done = false;
+  };
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<Job *> jobs;
+  pid_t owner = -1;
+
+  void loop() {
+    std::unique_lock<std::mutex> l(m);
+    while (1) {
+      cv.wait(l, [this] { return !jobs.empty(); });
+      Job *j = jobs.front();
+      jobs.pop_front();
+      l.unlock();
+      pid_t pid = fork();
+      if (pid == 0) {
+        // only async signal safe calls between fork and exec, other threads may hold locks
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        dup2(j->lfd, KLEPTIC_FCGI_LISTENSOCK_FILENO);
+        close_range(3, ~0U, 0);
+        execl(j->path, j->path, static_cast<char *>(nullptr));
+        _exit(127);
+      }
+      const int err = errno;
+      l.lock();
+      j->pid = pid;
+      j->err = err;
+      j->done = true;
+      cv.notify_all();
+    }
+  }
+
+ public:
+  /* forks path with lfd as its fd 0, -1 and errno if the fork failed */
+  pid_t spawn(const char *path, int lfd) {
+    Job j{path, lfd};
+    std::unique_lock<std::mutex> l(m);
+    if (owner != getpid()) {
+      owner = getpid();
+      std::thread([this] { loop(); }).detach();
+    }
+    jobs.push_back(&j);
+    cv.notify_all();
+    cv.wait(l, [&j] { return j.done; });
+    errno = j.err;
+    return j.pid;
+  }
+
+  static Spawner &get() {
+    // never destroyed, its thread may still be waiting at exit
+    static Spawner *s = new Spawner;
+    return *s;
+  }
+};
+
+}  // namespace
+
+Pool::Pool(std::string app_path, PoolOptions o) : app(std::move(app_path)), opts(o) {
+  workers.resize(std::max<size_t>(opts.workers, 1));
+  try {
+    for (auto &w : workers) {
+      start(w);
+    }
+  } catch (...) {
+    for (auto &w : workers) {
+      stop(w);
+    }
+    throw;
+  }
+  health = std::thread([this] { health_loop(); });
+}
+
+Pool::~Pool() {
+  {
+    std::lock_guard<std::mutex> l(m);
+    stopping = true;
+  }
+  health_cv.notify_all();
+  idle_cv.notify_all();
+  if (health.joinable()) {
+    health.join();
+  }
+  for (auto &w : workers) {
+    stop(w);
+  }
+}
+
+/*
+ * void start(Worker &)
+ *
+ * binds a listening socket in the abstract namespace (nothing to clean
+ * up on disk), execs the app with it as fd 0 and connects to it. the
+ * connection queues in the backlog until the app gets to accept.
+ */
+void Pool::start(Worker &w) {
+  static std::atomic<uint64_t> seq{0};
+  const std::string name = "kleptic-fcgi-" + std::to_string(getpid()) + "-" +
+                           std::to_string(seq.fetch_add(1, std::memory_order_relaxed));
+
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path + 1, name.data(), name.size());
+  const socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + name.size();
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lfd < 0 || bind(lfd, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0 ||
+      listen(lfd, 8) < 0) {
+    std::string err = strerror(errno);
+    if (lfd >= 0) {
+      close(lfd);
+    }
+    throw FastCGIException("Failed to listen for " + app + " : " + err);
+  }
+
+  // the app goes down with the server, see Spawner
+  pid_t pid = Spawner::get().spawn(app.c_str(), lfd);
+  if (pid < 0) {
+    std::string err = strerror(errno);
+    close(lfd);
+    throw FastCGIException("Failed to start " + app + " : " + err);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0) {
+    std::string err = strerror(errno);
+    if (fd >= 0) {
+      close(fd);
+    }
+    close(lfd);
+    w.pid = pid;
+    stop(w);
+    throw FastCGIException("Failed to connect to " + app + " : " + err);
+  }
+  close(lfd);
+
+  w.pid = pid;
+  w.fd = fd;
+  w.started = steady_clock::now();
+}
+
+void Pool::stop(Worker &w) {
+  if (w.fd >= 0) {
+    close(w.fd);
+    w.fd = -1;
+  }
+  if (w.pid <= 0) {
+    return;
+  }
+  // a second to exit on its own, then it is killed
+  kill(w.pid, SIGTERM);
+  for (int i = 0; i < 100; ++i) {
+    pid_t ret = waitpid(w.pid, nullptr, WNOHANG);
+    if (ret != 0) {
+      // reaped, or a SIGCHLD handler got to it first
+      w.pid = -1;
+      return;
+    }
+    usleep(10000);
+  }
+  kill(w.pid, SIGKILL);
+  waitpid(w.pid, nullptr, 0);
+  w.pid = -1;
+}
+
+void Pool::restart(Worker &w) {
+  stop(w);
+  {
+    std::lock_guard<std::mutex> l(m);
+    restarts++;
+  }
+  start(w);
+}
+
+Pool::Worker &Pool::acquire() {
+  std::unique_lock<std::mutex> l(m);
+  while (true) {
+    if (stopping) {
+      throw FastCGIException(app + " is shutting down");
+    }
+    bool any_busy = false;
+    for (auto &w : workers) {
+      if (!w.busy && w.fd >= 0) {
+        w.busy = true;
+        return w;
+      }
+      any_busy = any_busy || w.busy;
+    }
+    if (!any_busy) {
+      // every app is down and nobody is bringing one back right now
+      throw FastCGIException(app + " is not running");
+    }
+    idle_cv.wait(l);
+  }
+}
+
+void Pool::release(Worker &w) {
+  {
+    std::lock_guard<std::mutex> l(m);
+    w.busy = false;
+  }
+  idle_cv.notify_one();
+}
+
+Response Pool::exchange(Worker &w, const params_t &params, std::string_view in, bool &sent) {
+  std::string out;
+  append_begin_request(out, request_id, RESPONDER, KEEP_CONN);
+  append_stream(out, PARAMS, request_id, encode_pairs(params));
+  append_stream(out, STDIN, request_id, in);
+
+  Response resp;
+  auto on_record = [&resp, this](Record &rec) {
+    if (rec.id != request_id) {
+      return false;
+    }
+    switch (rec.type) {
+      case STDOUT:
+        resp.out += rec.content;
+        return false;
+      case STDERR:
+        resp.err += rec.content;
+        return false;
+      case END_REQUEST: {
+        if (rec.content.size() < 8) {
+          throw FastCGIException("short END_REQUEST from " + app);
+        }
+        const auto *b = reinterpret_cast<const uint8_t *>(rec.content.data());
+        resp.app_status = (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+        if (b[4] != REQUEST_COMPLETE) {
+          throw FastCGIException(app + " rejected the request (" + std::to_string(b[4]) + ")");
+        }
+        return true;
+      }
+      default:
+        return false;
+    }
+  };
+  transact(w.fd, out, steady_clock::now() + opts.timeout, on_record, sent);
+  return resp;
+}
+
+Response Pool::request(const params_t &params, std::string_view in) {
+  Worker &w = acquire();
+  for (int attempt = 0;; ++attempt) {
+    bool sent = false;
+    try {
+      Response resp = exchange(w, params, in, sent);
+      {
+        std::lock_guard<std::mutex> l(m);
+        requests++;
+      }
+      release(w);
+      return resp;
+    } catch (FastCGIException &e) {
+      // the connection is in an unknown state, the app goes either way
+      try {
+        restart(w);
+      } catch (FastCGIException &) {
+        release(w);
+        throw;
+      }
+      if (sent || attempt > 0) {
+        release(w);
+        throw FastCGIException(app + " : " + e.what());
+      }
+    }
+  }
+}
+
+/*
+ * bool probe(Worker &)
+ *
+ * health check, the app must still be running and answer GET_VALUES
+ * over its connection in time.
+ */
+bool Pool::probe(Worker &w) {
+  if (w.fd < 0) {
+    return false;
+  }
+  if (waitpid(w.pid, nullptr, WNOHANG) != 0) {
+    // reaped here or by a SIGCHLD handler, the pid may belong to someone else by now
+    w.pid = -1;
+    return false;
+  }
+  std::string out;
+  append_record(out, GET_VALUES, 0,
+                encode_pairs({{"FCGI_MAX_CONNS", ""}, {"FCGI_MAX_REQS", ""}, {"FCGI_MPXS_CONNS", ""}}));
+  auto on_record = [](Record &rec) { return rec.id == 0 && rec.type == GET_VALUES_RESULT; };
+  bool sent = false;
+  try {
+    auto wait = std::min<std::chrono::milliseconds>(opts.timeout, std::chrono::seconds(1));
+    transact(w.fd, out, steady_clock::now() + wait, on_record, sent);
+  } catch (FastCGIException &) {
+    return false;
+  }
+  return true;
+}
+
+void Pool::health_loop() {
+  std::unique_lock<std::mutex> l(m);
+  while (!health_cv.wait_for(l, opts.health_interval, [this] { return stopping; })) {
+    for (auto &w : workers) {
+      if (w.busy) {
+        continue;
+      }
+      w.busy = true;
+      l.unlock();
+      if (!probe(w)) {
+        fprintf(stderr, "FastCGI app %s (pid %d) failed its health check, restarting\n",
+                app.c_str(), w.pid);
+        try {
+          restart(w);
+        } catch (FastCGIException &e) {
+          fprintf(stderr, "%s\n", e.what());
+        }
+      }
+      l.lock();
+      w.busy = false;
+      idle_cv.notify_one();
+      if (stopping) {
+        break;
+      }
+    }
+  }
+}
+
+PoolStats Pool::stats() {
+  std::lock_guard<std::mutex> l(m);
+  PoolStats s;
+  for (const auto &w : workers) {
+    s.workers += (w.fd >= 0);
+    s.busy += w.busy;
+  }
+  s.requests = requests;
+  s.restarts = restarts;
+  return s;
+}
+
+}  // namespace Kleptic::FastCGI
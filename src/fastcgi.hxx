@@ -0,0 +1,162 @@
+#ifndef KLEPTIC_FASTCGI_HXX_
+#define KLEPTIC_FASTCGI_HXX_
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define KLEPTIC_FCGI_VERSION 1
+#define KLEPTIC_FCGI_HEADER_LEN 8
+#define KLEPTIC_FCGI_MAX_CONTENT 65535
+/* FastCGI apps accept on the listening socket they are given as fd 0 */
+#define KLEPTIC_FCGI_LISTENSOCK_FILENO 0
+
+namespace Kleptic::FastCGI {
+
+enum record_t : uint8_t {
+  BEGIN_REQUEST = 1,
+  ABORT_REQUEST,
+  END_REQUEST,
+  PARAMS,
+  STDIN,
+  STDOUT,
+  STDERR,
+  DATA,
+  GET_VALUES,
+  GET_VALUES_RESULT,
+  UNKNOWN_TYPE
+};
+
+enum role_t : uint16_t { RESPONDER = 1, AUTHORIZER, FILTER };
+enum protocol_status_t : uint8_t { REQUEST_COMPLETE = 0, CANT_MPX_CONN, OVERLOADED, UNKNOWN_ROLE };
+/* BEGIN_REQUEST flag, the app keeps the connection open after the request */
+constexpr uint8_t KEEP_CONN = 1;
+
+typedef std::map<std::string, std::string> params_t;
+
+struct Record {
+  uint8_t type = 0;
+  uint16_t id = 0;
+  std::string content;
+};
+
+/*
+ * record encoding. streams (PARAMS, STDIN, STDOUT, ...) are split into
+ * records of at most KLEPTIC_FCGI_MAX_CONTENT and closed by an empty one.
+ */
+void append_record(std::string &out, uint8_t type, uint16_t id, std::string_view content);
+void append_stream(std::string &out, uint8_t type, uint16_t id, std::string_view data);
+void append_begin_request(std::string &out, uint16_t id, role_t role, uint8_t flags);
+void append_end_request(std::string &out, uint16_t id, uint32_t app_status,
+                        protocol_status_t status);
+
+std::string encode_pairs(const params_t &pairs);
+/* throws FastCGIException on a truncated pair */
+params_t decode_pairs(std::string_view data);
+
+/*
+ * RecordReader
+ *
+ * reassembles records from whatever the socket hands over, feed bytes in
+ * and take complete records out.
+ */
+class RecordReader {
+  std::string buff;
+  size_t pos = 0;
+
+ public:
+  void feed(const char *data, size_t len);
+  /* throws FastCGIException on an unknown protocol version */
+  bool next(Record &r);
+};
+
+struct Response {
+  std::string out;
+  std::string err;
+  uint32_t app_status = 0;
+};
+
+struct PoolOptions {
+  /* app processes kept running */
+  size_t workers = 2;
+  /* longest a request may take before the app is considered stuck */
+  std::chrono::milliseconds timeout{30000};
+  /* how often idle apps are probed with GET_VALUES */
+  std::chrono::milliseconds health_interval{5000};
+};
+
+struct PoolStats {
+  size_t workers = 0;
+  size_t busy = 0;
+  uint64_t requests = 0;
+  uint64_t restarts = 0;
+};
+
+/*
+ * Pool
+ *
+ * keeps opts.workers copies of a FastCGI app running. each one gets its
+ * own listening unix socket as fd 0 and the pool holds one kept alive
+ * connection to it, so a request is a BEGIN_REQUEST/PARAMS/STDIN exchange
+ * with an already running process instead of a fork and exec. each app
+ * serves one request at a time, concurrent requests spread over the apps.
+ *
+ * apps that crash, time out or fail a health check are restarted.
+ */
+class Pool {
+  struct Worker {
+    pid_t pid = -1;
+    int fd = -1;
+    bool busy = false;
+    std::chrono::steady_clock::time_point started;
+  };
+
+  const std::string app;
+  const PoolOptions opts;
+
+  std::mutex m;
+  std::condition_variable idle_cv;
+  std::condition_variable health_cv;
+  std::vector<Worker> workers;
+  bool stopping = false;
+  uint64_t requests = 0;
+  uint64_t restarts = 0;
+  std::thread health;
+
+  void start(Worker &w);
+  void stop(Worker &w);
+  void restart(Worker &w);
+  Worker &acquire();
+  void release(Worker &w);
+  bool probe(Worker &w);
+  void health_loop();
+  Response exchange(Worker &w, const params_t &params, std::string_view in, bool &sent);
+
+ public:
+  Pool(std::string app, PoolOptions opts = PoolOptions());
+  Pool(const Pool &) = delete;
+  Pool &operator=(const Pool &) = delete;
+  ~Pool();
+
+  /*
+   * Response request(params, stdin)
+   *
+   * runs one RESPONDER request on a free app, waiting for one if all are
+   * busy. a request that fails before the app saw it is retried once on a
+   * restarted app, otherwise FastCGIException is thrown.
+   */
+  Response request(const params_t &params, std::string_view in);
+  PoolStats stats();
+};
+
+}  // namespace Kleptic::FastCGI
+
+#endif  // KLEPTIC_FASTCGI_HXX_
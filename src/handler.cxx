@@ -1,20 +1,36 @@
 #include "handler.hxx"
 
-#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <wait.h>
 
+#include <algorithm>
 #include <chrono>
-#include <fstream>
+#include <cstdlib>
+#include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
+#include "cgi_module.hxx"
+#include "error.hxx"
+#include "event_loop.hxx"
 #include "mime_types.hxx"
+#include "strutil.hxx"
 #include "template.hxx"
 
 #define KLEPTIC_CGI_VER "CGI/1.1"
 
-#define KLEPTIC_CGI_PIPE_BUFFER_SIZE 1024
+#define KLEPTIC_CGI_PIPE_BUFFER_SIZE 16384
+/* the only PATH scripts see, nothing else is inherited from the server */
+#define KLEPTIC_CGI_PATH "/usr/local/bin:/usr/bin:/bin"
 
 namespace Kleptic::Handler {
 
@@ -118,110 +134,602 @@ HTTPConnFSHandler create_static_handler(const std::string root_dir,
   };
 }
 
-HTTPConnHandler create_cgi_handler(const std::string root_dir) {
-  return [root_dir](HTTPConn &c) {
-    fs::path root_path(root_dir);
-    fs::path full_req_path(root_dir);
-    full_req_path /= c.req_path;
-    // std::cout << "Handling CGI" << std::endl;
+/*
+ * bool cgi_resolve(root_dir, HTTPConn &, fs::path &)
+ *
+ * maps the request onto a script below root_dir. answers the request
+ * itself (403/404) and returns false when there is nothing to run.
+ */
+static bool cgi_resolve(const std::string &root_dir, HTTPConn &c, fs::path &full_req_path) {
+  fs::path root_path(root_dir);
+  full_req_path = root_dir;
+  full_req_path /= c.req_path;
+  // std::cout << "Handling CGI" << std::endl;
+
+  if (!is_subdirectory(root_path, full_req_path)) {
+    c.resp_status = 403;
+    c.send();
+    return false;
+  }
 
-    if (!is_subdirectory(root_path, full_req_path)) {
-      c.resp_status = 403;
-      c.send();
-      return;
+  if (!fs::is_regular_file(full_req_path)) {
+    not_found_handler(c);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * params_t cgi_env(HTTPConn &, const fs::path &)
+ *
+ * the CGI/1.1 meta-variables for a request, empty ones left out.
+ */
+static FastCGI::params_t cgi_env(HTTPConn &c, const fs::path &full_req_path) {
+  FastCGI::params_t cgi_args = {
+      {"SERVER_SOFTWARE", KLEPTIC_HTTP_SERVER_NAME},
+      {"SERVER_NAME", c.host_ip},
+      {"GATEWAY_INTERFACE", "CGI/1.1"},
+      {"SERVER_PROTOCOL", c.http_protocol},
+      {"SERVER_PORT", std::to_string(c.host_port)},
+      {"REQUEST_METHOD", c.method},
+      {"HTTP_ACCEPT", c.req_headers["Accept"]},
+      {"PATH_INFO", ""},        // TODO ADD PATH INFO
+      {"PATH_TRANSLATED", ""},  // TODO ADD PATH TRANSLATED
+      {"SCRIPT_NAME", full_req_path.filename()},
+      {"QUERY_STRING", c.raw_query_string},
+      {"REMOTE_HOST", ""},  // TODO Reverse DNS Lookup
+      {"REMOTE_ADDR", c.remote_ip},
+      {"REMOTE_USER", c.user},
+      {"AUTH_TYPE", c.auth_type},
+      {"CONTENT_TYPE", c.req_headers["Content-Type"]},
+      {"CONTENT_LENGTH", std::to_string(c.req_body.str().size())}
+  };
+  std::erase_if(cgi_args, [](const auto &arg) { return arg.second.empty(); });
+  return cgi_args;
+}
+
+/*
+ * size_t cgi_header_end(const std::string &out, size_t &body_start)
+ *
+ * where the CGI header block in out ends, npos while it is incomplete.
+ * scripts end it with a blank line in either line ending.
+ */
+static size_t cgi_header_end(const std::string &out, size_t &body_start) {
+  size_t crlf = out.find("\r\n\r\n");
+  size_t lf = out.find("\n\n");
+  if (crlf == std::string::npos && lf == std::string::npos) {
+    return std::string::npos;
+  }
+  if (lf < crlf) {
+    body_start = lf + 2;
+    return lf;
+  }
+  body_start = crlf + 4;
+  return crlf;
+}
+
+/*
+ * void cgi_apply_headers(HTTPConn &, const std::string &headers)
+ *
+ * Status sets the response code, every other header is passed on. a
+ * Location without a Status is a redirect.
+ */
+static void cgi_apply_headers(HTTPConn &c, const std::string &headers) {
+  std::stringstream ss(headers);
+  std::string line;
+  bool has_status = false;
+  while (std::getline(ss, line)) {
+    line = Util::trim(line);
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = Util::trim(line.substr(0, colon));
+    std::string value = Util::trim(line.substr(colon + 1));
+    if (name == "Status") {
+      c.resp_status = std::atoi(value.c_str());
+      has_status = true;
+    } else {
+      c.resp_headers[name] = value;
     }
+  }
+  if (!has_status && c.resp_headers.count("Location")) {
+    c.resp_status = 302;
+  }
+}
 
-    if (!fs::is_regular_file(full_req_path)) {
-      not_found_handler(c);
+/*
+ * bool cgi_parse_response(const std::string &out, HTTPConn &)
+ *
+ * takes a complete CGI response as the HTTP response. false if there is
+ * no header block at all.
+ */
+static bool cgi_parse_response(const std::string &out, HTTPConn &c) {
+  size_t body_start;
+  size_t end = cgi_header_end(out, body_start);
+  if (end == std::string::npos) {
+    return false;
+  }
+  cgi_apply_headers(c, out.substr(0, end));
+  c.resp_body << out.substr(body_start);
+  return true;
+}
+
+/*
+ * pid_t cgi_spawn(HTTPConn &, const fs::path &, const CGIOptions &, int &in_fd, int &out_fd)
+ *
+ * starts the script with the CGI environment and nothing else. in_fd is
+ * the write end of its stdin, out_fd the read end of its stdout, both
+ * non blocking. everything goes through posix_spawn, which doesn't copy
+ * the server's address space. an isolated .so module is run by the
+ * module loader, which loads it after exec. the child leads its own
+ * process group, so killing it takes whatever it started along.
+ */
+static pid_t cgi_spawn(HTTPConn &c, const fs::path &full_req_path, const CGIOptions &opts,
+                       int &in_fd, int &out_fd) {
+  std::vector<std::string> env;
+  for (const auto &[name, value] : cgi_env(c, full_req_path)) {
+    env.push_back(name + "=" + value);
+  }
+  env.push_back("PATH=" KLEPTIC_CGI_PATH);
+  std::vector<char *> envp;
+  for (auto &var : env) {
+    envp.push_back(var.data());
+  }
+  envp.push_back(nullptr);
+
+  std::string script = full_req_path;
+  std::string loader = opts.module_loader.empty() ? KLEPTIC_MODULE_LOADER : opts.module_loader;
+  std::vector<char *> argv;
+  if (full_req_path.extension() == ".so") {
+    argv.push_back(loader.data());
+  }
+  argv.push_back(script.data());
+  argv.push_back(nullptr);
+
+  int in_pipe[2];
+  int out_pipe[2];
+  if (pipe2(in_pipe, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return -1;
+  }
+  if (pipe2(out_pipe, O_CLOEXEC) < 0) {
+    perror("pipe");
+    close(in_pipe[0]);
+    close(in_pipe[1]);
+    return -1;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attr, 0);
+  pid_t pid = -1;
+  int err = posix_spawn(&pid, argv[0], &actions, &attr, argv.data(), envp.data());
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    errno = err;
+    pid = -1;
+  }
+
+  close(in_pipe[0]);
+  close(out_pipe[1]);
+  if (pid < 0) {
+    perror("cgi");
+    close(in_pipe[1]);
+    close(out_pipe[0]);
+    return -1;
+  }
+  fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
+  fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+  in_fd = in_pipe[1];
+  out_fd = out_pipe[0];
+  return pid;
+}
+
+/* an fd that turns readable when pid exits, -1 if the kernel has none */
+static int cgi_pidfd(pid_t pid) {
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+/*
+ * void cgi_reap(pid_t, deadline)
+ *
+ * waits for a child whose output is closed, killing it if it is still
+ * around at deadline.
+ */
+static void cgi_reap(pid_t pid, std::chrono::steady_clock::time_point deadline) {
+  int pidfd = cgi_pidfd(pid);
+  if (pidfd >= 0) {
+    struct pollfd p = {pidfd, POLLIN, 0};
+    int n;
+    do {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      n = poll(&p, 1, static_cast<int>(std::max<int64_t>(left.count(), 0)));
+    } while (n < 0 && errno == EINTR);
+    close(pidfd);
+  }
+  if (waitpid(pid, NULL, WNOHANG) == 0) {
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+/*
+ * bool cgi_output(HTTPConn &, std::string &head, data, len, opts)
+ *
+ * takes the next piece of script output. it collects in head until the
+ * CGI headers are complete, then the response starts streaming and the
+ * rest goes straight to the client. false if the headers run too long.
+ */
+static bool cgi_output(HTTPConn &c, std::string &head, const char *data, size_t len,
+                       const CGIOptions &opts) {
+  if (c.is_streaming()) {
+    c.stream(data, len);
+    return true;
+  }
+  head.append(data, len);
+  size_t body_start;
+  size_t end = cgi_header_end(head, body_start);
+  if (end == std::string::npos) {
+    return head.size() <= opts.max_header_size;
+  }
+  cgi_apply_headers(c, head.substr(0, end));
+  c.stream(head.data() + body_start, head.size() - body_start);
+  head.clear();
+  return true;
+}
+
+/*
+ * void cgi_run(HTTPConn &, const fs::path &, const CGIOptions &)
+ *
+ * feeds the request body to the child and streams its output to the
+ * client as it comes, in one poll loop so neither side can stall the
+ * other. the child is killed when it runs past opts.timeout.
+ */
+static void cgi_run(HTTPConn &c, const fs::path &full_req_path, const CGIOptions &opts) {
+  const auto deadline = std::chrono::steady_clock::now() + opts.timeout;
+  int in_fd;
+  int out_fd;
+  pid_t pid = cgi_spawn(c, full_req_path, opts, in_fd, out_fd);
+  if (pid < 0) {
+    c.resp_status = 500;
+    c.send();
+    return;
+  }
+
+  const std::string body = c.req_body.str();
+  size_t written = 0;
+  if (body.empty()) {
+    close(in_fd);
+    in_fd = -1;
+  }
+
+  std::string head;
+  char buffer[KLEPTIC_CGI_PIPE_BUFFER_SIZE];
+  bool timed_out = false;
+  bool bad_output = false;
+  try {
+    while (true) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0) {
+        timed_out = true;
+        break;
+      }
+      struct pollfd fds[2] = {{out_fd, POLLIN, 0}, {in_fd, POLLOUT, 0}};
+      int n = poll(fds, (in_fd >= 0) ? 2 : 1, static_cast<int>(left.count()));
+      if (n <= 0) {
+        continue;
+      }
+
+      if (in_fd >= 0 && fds[1].revents) {
+        ssize_t ret = write(in_fd, body.data() + written, body.size() - written);
+        written += std::max<ssize_t>(ret, 0);
+        // all of it went in, or the script stopped reading
+        if (written == body.size() || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+          close(in_fd);
+          in_fd = -1;
+        }
+      }
+
+      if (fds[0].revents) {
+        ssize_t ret = read(out_fd, buffer, sizeof(buffer));
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+          continue;
+        }
+        if (ret <= 0) {
+          break;
+        }
+        if (!cgi_output(c, head, buffer, ret, opts)) {
+          bad_output = true;
+          break;
+        }
+      }
+    }
+  } catch (SocketException &) {
+    // the client went away, so does the script
+    kill(-pid, SIGKILL);
+    timed_out = true;
+  }
+
+  if (in_fd >= 0) {
+    close(in_fd);
+  }
+  close(out_fd);
+  if (timed_out || bad_output) {
+    kill(-pid, SIGKILL);
+  }
+  cgi_reap(pid, deadline);
+
+  if (!c.is_streaming()) {
+    if (timed_out) {
+      std::cerr << full_req_path << " timed out" << std::endl;
+    }
+    c.resp_status = timed_out ? 504 : 502;
+    c.send();
+  }
+}
+
+/*
+ * bool module_run(HTTPConn &, const fs::path &)
+ *
+ * answers the request from a .so module called in this process. false,
+ * with nothing sent, for a module with only the old httprun entry, it
+ * goes through the module loader like an isolated one.
+ */
+static bool module_run(HTTPConn &c, const fs::path &full_req_path) {
+  std::vector<std::string> env;
+  for (const auto &[name, value] : cgi_env(c, full_req_path)) {
+    env.push_back(name + "=" + value);
+  }
+
+  std::string out;
+  int result;
+  try {
+    if (!CGIModule::registry().call(full_req_path, env, c.raw_query_string, c.req_body.str(),
+                                    out, result)) {
+      return false;
+    }
+  } catch (ModuleException &e) {
+    std::cerr << e.what() << std::endl;
+    result = -1;
+  }
+  if (result != 0) {
+    c.resp_status = 500;
+    c.send();
+    return true;
+  }
+
+  if (!cgi_parse_response(out, c)) {
+    c.resp_status = 502;
+    c.send();
+  }
+  return true;
+}
+
+HTTPConnHandler create_cgi_handler(const std::string root_dir, CGIOptions opts) {
+  return [root_dir, opts](HTTPConn &c) {
+    fs::path full_req_path;
+    if (!cgi_resolve(root_dir, c, full_req_path)) {
+      return;
+    }
+    if (!opts.isolate_modules && full_req_path.extension() == ".so" &&
+        module_run(c, full_req_path)) {
       return;
     }
+    cgi_run(c, full_req_path, opts);
+  };
+}
 
-    std::stringstream ss;
-
-    // Setup Header
-    ss << c.http_ver << " " << c.resp_status << HTTPConn::default_status_reasons[c.resp_status]
-       << "\r\n";
-
-    const std::map<const std::string, const std::string> cgi_args = {
-        {"SERVER_SOFTWARE", KLEPTIC_HTTP_SERVER_NAME},
-        {"SERVER_NAME", c.host_ip},
-        {"GATEWAY_INTERFACE", "CGI/1.1"},
-        {"SERVER_PROTOCOL", c.http_protocol},
-        {"SERVER_PORT", std::to_string(c.host_port)},
-        {"REQUEST_METHOD", c.method},
-        {"HTTP_ACCEPT", c.req_headers["Accept"]},
-        {"PATH_INFO", ""},        // TODO ADD PATH INFO
-        {"PATH_TRANSLATED", ""},  // TODO ADD PATH TRANSLATED
-        {"SCRIPT_NAME", full_req_path.filename()},
-        {"QUERY_STRING", c.raw_query_string},
-        {"REMOTE_HOST", ""},  // TODO Reverse DNS Lookup
-        {"REMOTE_ADDR", c.remote_ip},
-        {"REMOTE_USER", c.user},
-        {"AUTH_TYPE", c.auth_type},
-        {"CONTENT_TYPE", c.req_headers["Content-Type"]},
-        {"CONTENT_LENGTH", std::to_string(c.req_body.str().size())}
-    };
-
-    int pipe_sock[2];
-    socketpair(PF_LOCAL, SOCK_STREAM, 0, pipe_sock);
-
-    pid_t pid = fork();
-    if (pid == 0) {
-      // in child process
-      for (auto &[key, val] : cgi_args) {
-        if (val.compare("")) {
-          setenv(key.c_str(), val.c_str(), true);
-        }
+/*
+ * task<void> cgi_feed(int in_fd, string body)
+ *
+ * writes the request body to a script's stdin alongside the output
+ * being read, then closes it.
+ */
+static Async::task<void> cgi_feed(int in_fd, std::string body) {
+  size_t written = 0;
+  while (written < body.size()) {
+    co_await Async::writable(in_fd);
+    ssize_t ret = write(in_fd, body.data() + written, body.size() - written);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
       }
-      close(pipe_sock[0]);
-      dup2(pipe_sock[1], STDOUT_FILENO);
-      dup2(pipe_sock[1], STDIN_FILENO);
-      close(pipe_sock[1]);
+      break;  // the script stopped reading
+    }
+    written += ret;
+  }
+  close(in_fd);
+}
 
-      if (!full_req_path.extension().compare(".so")) {
-        void *lib = dlopen(full_req_path.c_str(), RTLD_LAZY);
+struct cgi_watch_t {
+  bool done = false;
+  bool timed_out = false;
+};
+
+static Async::task<void> cgi_watchdog(pid_t pid, std::shared_ptr<cgi_watch_t> watch,
+                                      std::chrono::milliseconds timeout) {
+  co_await Async::sleep_for(timeout);
+  if (!watch->done) {
+    // its output closes, which ends the read loop
+    watch->timed_out = true;
+    kill(-pid, SIGKILL);
+  }
+}
 
-        if (lib == NULL) {
-          perror("dlopen");
-          exit(1);
-        }
+static Async::task<void> run_async_cgi(std::string root_dir, CGIOptions opts, HTTPConn &c) {
+  fs::path full_req_path;
+  if (!cgi_resolve(root_dir, c, full_req_path)) {
+    co_return;
+  }
+  if (!opts.isolate_modules && full_req_path.extension() == ".so") {
+    auto run = [&c, &full_req_path] { return module_run(c, full_req_path); };
+    if (co_await Async::offload(run)) {
+      co_return;
+    }
+  }
 
-        cgi_func_ptr fn_handler = reinterpret_cast<cgi_func_ptr>(dlsym(lib, "httprun"));
+  const auto deadline = std::chrono::steady_clock::now() + opts.timeout;
+  int in_fd;
+  int out_fd;
+  pid_t pid = cgi_spawn(c, full_req_path, opts, in_fd, out_fd);
+  if (pid < 0) {
+    c.resp_status = 500;
+    c.send();
+    co_return;
+  }
 
-        fn_handler(STDOUT_FILENO, c.raw_query_string.c_str());
+  auto watch = std::make_shared<cgi_watch_t>();
+  Async::spawn(cgi_watchdog(pid, watch, opts.timeout));
+  std::string body = c.req_body.str();
+  if (body.empty()) {
+    close(in_fd);
+  } else {
+    Async::spawn(cgi_feed(in_fd, std::move(body)));
+  }
 
-      } else {
-        dup2(pipe_sock[1], STDOUT_FILENO);
-        close(pipe_sock[1]);
-        execl(full_req_path.c_str(), full_req_path.filename().c_str());
+  const bool send_body = c.method.compare("HEAD");
+  std::string head;
+  char buffer[KLEPTIC_CGI_PIPE_BUFFER_SIZE];
+  bool failed = false;
+  try {
+    int ret;
+    while ((ret = co_await Async::read_some(out_fd, buffer, sizeof(buffer))) > 0) {
+      if (c.is_streaming()) {
+        if (send_body) {
+          co_await Async::write_all(*c.sock, std::string(buffer, ret));
+        }
+        continue;
       }
-      exit(0);
-    } else if (pid > 0) {
-      close(pipe_sock[1]);
-
-      write(pipe_sock[0], c.req_body.str().c_str(), c.req_body.str().size());
-      char buffer[KLEPTIC_CGI_PIPE_BUFFER_SIZE];
-      int read_size = KLEPTIC_CGI_PIPE_BUFFER_SIZE - 1;
-      int ret = 0;
-
-      do {
-        ret = read(pipe_sock[0], buffer, read_size);
-        if (ret == 0) {
+      head.append(buffer, ret);
+      size_t body_start;
+      size_t end = cgi_header_end(head, body_start);
+      if (end == std::string::npos) {
+        if (head.size() > opts.max_header_size) {
+          failed = true;
           break;
         }
-        buffer[ret] = '\0';
-        // std::cout << buffer << std::endl;
-        ss << std::string(buffer);
-      } while (true);
-
-      close(pipe_sock[0]);
-    } else {
-      perror("fork");
+        continue;
+      }
+      cgi_apply_headers(c, head.substr(0, end));
+      std::string out = c.start_stream();
+      if (send_body) {
+        out.append(head, body_start);
+      }
+      co_await Async::write_all(*c.sock, std::move(out));
+      head.clear();
     }
+  } catch (SocketException &) {
+    // the client went away, so does the script
+    failed = true;
+  }
+  close(out_fd);
+  if (failed) {
+    kill(-pid, SIGKILL);
+  }
+  // the watchdog still kills it at the deadline while the loop waits for the exit
+  int pidfd = cgi_pidfd(pid);
+  if (pidfd >= 0) {
+    co_await Async::readable(pidfd);
+    close(pidfd);
+    watch->done = true;
     waitpid(pid, NULL, 0);
+  } else {
+    watch->done = true;
+    auto reap = [pid, deadline] { cgi_reap(pid, deadline); };
+    co_await Async::offload(reap);
+  }
+
+  if (!c.is_streaming()) {
+    c.resp_status = watch->timed_out ? 504 : 502;
+    c.send();
+  }
+}
 
-    c.send(ss.str());
+HTTPConnAsyncHandler create_async_cgi_handler(const std::string root_dir, CGIOptions opts) {
+  return [root_dir, opts](HTTPConn &c) { return run_async_cgi(root_dir, opts, c); };
+}
+
+HTTPConnHandler create_fastcgi_handler(const std::string root_dir, FastCGI::PoolOptions defaults,
+                                       std::map<std::string, FastCGI::PoolOptions> per_script) {
+  struct pools_t {
+    std::mutex m;
+    std::map<std::string, std::unique_ptr<FastCGI::Pool>> pools;
   };
+  auto shared = std::make_shared<pools_t>();
+
+  return [root_dir, defaults, per_script, shared](HTTPConn &c) {
+    fs::path full_req_path;
+    if (!cgi_resolve(root_dir, c, full_req_path)) {
+      return;
+    }
+
+    FastCGI::Pool *pool = nullptr;
+    {
+      // apps start on their first request and stay up from then on
+      std::lock_guard<std::mutex> l(shared->m);
+      auto &slot = shared->pools[c.req_path];
+      if (!slot) {
+        auto opts = per_script.find(c.req_path);
+        try {
+          slot = std::make_unique<FastCGI::Pool>(
+              full_req_path, opts == per_script.end() ? defaults : opts->second);
+        } catch (FastCGIException &e) {
+          std::cerr << e.what() << std::endl;
+        }
+      }
+      pool = slot.get();
+    }
+    if (pool == nullptr) {
+      c.resp_status = 502;
+      c.send();
+      return;
+    }
+
+    FastCGI::params_t params = cgi_env(c, full_req_path);
+    params["SCRIPT_FILENAME"] = full_req_path;
+
+    FastCGI::Response resp;
+    try {
+      resp = pool->request(params, c.req_body.str());
+    } catch (FastCGIException &e) {
+      std::cerr << e.what() << std::endl;
+      c.resp_status = 502;
+      c.send();
+      return;
+    }
+
+    if (!resp.err.empty()) {
+      std::cerr << full_req_path.filename() << " : " << resp.err;
+    }
+    if (!cgi_parse_response(resp.out, c)) {
+      c.resp_status = 502;
+      c.send();
+    }
+  };
+}
+
+HTTPConnHandler create_proxy_handler(std::vector<Proxy::Upstream> upstreams,
+                                     Proxy::ProxyOptions opts) {
+  auto balancer = std::make_shared<Proxy::Balancer>(std::move(upstreams), std::move(opts));
+  return [balancer](HTTPConn &c) { balancer->forward(c); };
+}
+
+static Async::task<void> run_offloaded(HTTPConnHandler h, HTTPConn &c) {
+  auto run = [&h, &c] { h(c); };
+  co_await Async::offload(run);
+}
+
+HTTPConnAsyncHandler offload_handler(HTTPConnHandler h) {
+  return [h](HTTPConn &c) { return run_offloaded(h, c); };
 }
 
 HTTPConnHandler derive_http_handler(HTTPConnFSHandler fshandler) {
@@ -242,13 +750,29 @@ HTTPConnHandler derive_http_handler(HTTPConnFSHandler fshandler) {
       c.resp_headers["Content-Type"] = Util::get_content_type(ext.erase(0, 1));
     }
 
-    std::ifstream file(path, std::ios::binary);
-    c.resp_body << file.rdbuf();
-    file.close();
+    // sent from the file as the response goes out
+    c.resp_file = path;
   };
 }
 HTTPConnHandler derive_http_handler(HTTPConnHandler h) { return h; }
 
+HTTPConnHandler create_metrics_handler(const Metrics::Registry &registry) {
+  return [&registry](HTTPConn &c) {
+    c.resp_headers["Content-Type"] = "text/plain; version=0.0.4";
+    c.resp_body << registry.scrape();
+    c.send();
+  };
+}
+
+HTTPConnMiddleware wrap_middleware(HTTPConnHandler h) {
+  return [h](HTTPConn &c, const HTTPConnHandler &next) {
+    h(c);
+    if (!c.is_set()) {
+      next(c);
+    }
+  };
+}
+
 void not_found_handler(HTTPConn &c) {
   c.resp_status = 404;
   c.resp_headers["Content-Type"] = "text/plain";
@@ -256,4 +780,9 @@ void not_found_handler(HTTPConn &c) {
   c.send();
 }
 
+void not_implemented_handler(HTTPConn &c) {
+  c.resp_status = 501;
+  c.send();
+}
+
 }  // namespace Kleptic::Handler
@@ -1,15 +1,20 @@
 #ifndef KLEPTIC_HANDLER_HXX_
 #define KLEPTIC_HANDLER_HXX_
 
+#include <chrono>
 #include <experimental/filesystem>
 #include <functional>
 #include <map>
 #include <string>
+#include <vector>
 
 #define KLEPTIC_STATIC_DIR_TEMPLATE_PATH "templates/static.html.ktf"
+#define KLEPTIC_CGI_TIMEOUT_MS 30000
 
 #include "base64.hxx"
+#include "fastcgi.hxx"
 #include "http.hxx"
+#include "proxy.hxx"
 
 namespace fs = std::experimental::filesystem;
 
@@ -25,13 +30,62 @@ HTTPConnFSHandler create_static_handler(
 
 typedef std::function<void(int ssock, const char *querystring)> cgi_func;
 typedef void (*cgi_func_ptr)(int ssock, const char* querystring);
-HTTPConnHandler create_cgi_handler(const std::string path);
+struct CGIOptions {
+  /* run .so modules in a child process per request instead of in process */
+  bool isolate_modules = false;
+  /* the program isolated modules are run with, empty for the one built with the server */
+  std::string module_loader;
+  /* scripts running longer are killed, with a 504 if nothing was sent yet */
+  std::chrono::milliseconds timeout{KLEPTIC_CGI_TIMEOUT_MS};
+  /* most output taken before the CGI headers have to be complete */
+  size_t max_header_size = 64 * 1024;
+};
+
+/*
+ * scripts are spawned per request and their output streams to the
+ * client as it comes. .so modules are loaded once and called in the
+ * server process, reloaded when they change on disk, unless
+ * opts.isolate_modules asks for a child process per request as well.
+ * modules with only the old httprun entry always get the child process.
+ */
+HTTPConnHandler create_cgi_handler(const std::string path, CGIOptions opts = CGIOptions());
+/* same, but the child's output is read without blocking the event loop */
+HTTPConnAsyncHandler create_async_cgi_handler(const std::string path,
+                                              CGIOptions opts = CGIOptions());
+/*
+ * runs FastCGI apps below path from pools kept running between requests,
+ * sized by defaults or by the per_script entry for the request path.
+ */
+HTTPConnHandler create_fastcgi_handler(
+    const std::string path, FastCGI::PoolOptions defaults = FastCGI::PoolOptions(),
+    std::map<std::string, FastCGI::PoolOptions> per_script = {});
+
+/*
+ * forwards requests to the least busy healthy upstream over pooled
+ * keep-alive connections and streams the responses back. the request
+ * path goes upstream as is.
+ */
+HTTPConnHandler create_proxy_handler(std::vector<Proxy::Upstream> upstreams,
+                                     Proxy::ProxyOptions opts = Proxy::ProxyOptions());
+
+/*
+ * serves every series of registry in the Prometheus text format, for
+ * a scraper's GET /metrics. the registry has to outlive the handler.
+ */
+HTTPConnHandler create_metrics_handler(const Metrics::Registry &registry);
 
 void not_found_handler(HTTPConn &);
+/* 501, for a method the server doesn't know */
+void not_implemented_handler(HTTPConn &);
 
 HTTPConnHandler derive_http_handler(HTTPConnFSHandler);
 HTTPConnHandler derive_http_handler(HTTPConnHandler);
 
+HTTPConnMiddleware wrap_middleware(HTTPConnHandler);
+
+/* runs a blocking handler on the event loop's offload threads */
+HTTPConnAsyncHandler offload_handler(HTTPConnHandler);
+
 }  // namespace Kleptic::Handler
 
 #endif  // KLEPTIC_HANDLER_HXX_
@@ -0,0 +1,499 @@
+#include "hpack.hxx"
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+
+#include "error.hxx"
+#include "http2.hxx"
+
+namespace Kleptic::HPACK {
+
+const header_t Table::static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+namespace {
+
+struct code_t {
+  uint32_t bits;
+  int len;
+};
+
+/* code of every byte value, then EOS */
+const code_t huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+/* decoding tree, a child > 0 is an inner node and < 0 the leaf of symbol -child - 1 */
+struct node_t {
+  int16_t child[2] = {0, 0};
+};
+
+const std::vector<node_t> &huffman_tree() {
+  static const std::vector<node_t> tree = [] {
+    std::vector<node_t> t(1);
+    for (int sym = 0; sym < 257; ++sym) {
+      size_t node = 0;
+      for (int i = huffman_codes[sym].len - 1; i >= 0; --i) {
+        const int bit = (huffman_codes[sym].bits >> i) & 1;
+        if (i == 0) {
+          t[node].child[bit] = static_cast<int16_t>(-sym - 1);
+        } else {
+          if (t[node].child[bit] == 0) {
+            t[node].child[bit] = static_cast<int16_t>(t.size());
+            t.emplace_back();
+          }
+          node = t[node].child[bit];
+        }
+      }
+    }
+    return t;
+  }();
+  return tree;
+}
+
+HTTP2Exception compression_error(const std::string &msg) {
+  return HTTP2Exception("HPACK : " + msg, HTTP2::COMPRESSION_ERROR);
+}
+
+std::string decode_string(const uint8_t *&p, const uint8_t *end) {
+  if (p == end) {
+    throw compression_error("truncated string");
+  }
+  const bool huffman = *p & 0x80;
+  const size_t len = decode_int(p, end, 7);
+  if (len > static_cast<size_t>(end - p)) {
+    throw compression_error("string runs past the header block");
+  }
+  std::string s = huffman ? huffman_decode(p, len) : std::string(reinterpret_cast<const char *>(p), len);
+  p += len;
+  return s;
+}
+
+void encode_string(std::string &out, const std::string &s) {
+  const size_t coded = huffman_length(s);
+  if (coded < s.size()) {
+    encode_int(out, 0x80, 7, coded);
+    out += huffman_encode(s);
+  } else {
+    encode_int(out, 0, 7, s.size());
+    out += s;
+  }
+}
+
+/* changes with every response, indexing it would only churn the table */
+bool volatile_header(const std::string &name) {
+  return name == "content-length" || name == "date" || name == "age" || name == "etag" ||
+         name == "last-modified";
+}
+
+/* kept out of every table along the way, so they can't be probed for */
+bool sensitive_header(const std::string &name) {
+  return name == "authorization" || name == "proxy-authorization" || name == "cookie" ||
+         name == "set-cookie";
+}
+
+}  // namespace
+
+/* integers */
+
+void encode_int(std::string &out, uint8_t first, int prefix, size_t value) {
+  const size_t max = (1u << prefix) - 1;
+  if (value < max) {
+    out.push_back(static_cast<char>(first | value));
+    return;
+  }
+  out.push_back(static_cast<char>(first | max));
+  value -= max;
+  while (value >= 128) {
+    out.push_back(static_cast<char>(value % 128 + 128));
+    value /= 128;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+size_t decode_int(const uint8_t *&p, const uint8_t *end, int prefix) {
+  if (p == end) {
+    throw compression_error("truncated integer");
+  }
+  const size_t max = (1u << prefix) - 1;
+  size_t value = *p++ & max;
+  if (value < max) {
+    return value;
+  }
+  // 2^35 is plenty for any index, length or table size
+  for (int shift = 0; shift <= 28; shift += 7) {
+    if (p == end) {
+      throw compression_error("truncated integer");
+    }
+    const uint8_t b = *p++;
+    value += static_cast<size_t>(b & 127) << shift;
+    if (!(b & 128)) {
+      return value;
+    }
+  }
+  throw compression_error("integer too large");
+}
+
+/* huffman */
+
+size_t huffman_length(const std::string &s) {
+  size_t bits = 0;
+  for (unsigned char c : s) {
+    bits += huffman_codes[c].len;
+  }
+  return (bits + 7) / 8;
+}
+
+std::string huffman_encode(const std::string &s) {
+  std::string out;
+  out.reserve(huffman_length(s));
+  uint64_t bits = 0;
+  int n = 0;
+  for (unsigned char c : s) {
+    bits = (bits << huffman_codes[c].len) | huffman_codes[c].bits;
+    n += huffman_codes[c].len;
+    while (n >= 8) {
+      n -= 8;
+      out.push_back(static_cast<char>(bits >> n));
+    }
+    bits &= (uint64_t(1) << n) - 1;
+  }
+  if (n > 0) {
+    // padded with the most significant bits of EOS, all ones
+    out.push_back(static_cast<char>((bits << (8 - n)) | (0xff >> n)));
+  }
+  return out;
+}
+
+std::string huffman_decode(const uint8_t *data, size_t len) {
+  const std::vector<node_t> &tree = huffman_tree();
+  std::string out;
+  out.reserve(len * 8 / 5);
+  size_t node = 0;
+  int depth = 0;
+  bool ones = true;
+  for (size_t i = 0; i < len; ++i) {
+    for (int shift = 7; shift >= 0; --shift) {
+      const int bit = (data[i] >> shift) & 1;
+      const int16_t next = tree[node].child[bit];
+      if (next < 0) {
+        if (next == -257) {
+          throw compression_error("EOS in a Huffman string");
+        }
+        out.push_back(static_cast<char>(-next - 1));
+        node = 0;
+        depth = 0;
+        ones = true;
+        continue;
+      }
+      node = next;
+      ++depth;
+      ones = ones && bit;
+    }
+  }
+  // what's left has to be a prefix of EOS shorter than a byte
+  if (depth > 7 || !ones) {
+    throw compression_error("bad Huffman padding");
+  }
+  return out;
+}
+
+/* tables */
+
+const header_t *Table::get(size_t index) const {
+  if (index == 0) {
+    return nullptr;
+  }
+  if (index <= static_size) {
+    return &static_table[index - 1];
+  }
+  index -= static_size + 1;
+  return index < dynamic.size() ? &dynamic[index] : nullptr;
+}
+
+void Table::evict(size_t limit) {
+  while (size > limit) {
+    size -= entry_size(dynamic.back());
+    dynamic.pop_back();
+  }
+}
+
+void Table::add(header_t h) {
+  const size_t es = entry_size(h);
+  if (es > max_size) {
+    // too big for any table, it empties it instead
+    evict(0);
+    return;
+  }
+  evict(max_size - es);
+  dynamic.push_front(std::move(h));
+  size += es;
+}
+
+void Table::resize(size_t max) {
+  max_size = max;
+  evict(max_size);
+}
+
+size_t Table::find(const std::string &name, const std::string &value, bool &exact) const {
+  size_t name_match = 0;
+  exact = false;
+  for (size_t i = 0; i < static_size; ++i) {
+    if (static_table[i].first == name) {
+      if (static_table[i].second == value) {
+        exact = true;
+        return i + 1;
+      }
+      name_match = name_match ? name_match : i + 1;
+    }
+  }
+  for (size_t i = 0; i < dynamic.size(); ++i) {
+    if (dynamic[i].first == name) {
+      if (dynamic[i].second == value) {
+        exact = true;
+        return static_size + 1 + i;
+      }
+      name_match = name_match ? name_match : static_size + 1 + i;
+    }
+  }
+  return name_match;
+}
+
+/* decoding */
+
+header_list Decoder::decode(const uint8_t *data, size_t len, size_t max_list_size) {
+  header_list headers;
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  // indexed references are a byte each but copy whole entries, count before copying
+  size_t list_size = 0;
+  auto account = [&](const header_t &h) {
+    list_size += Table::entry_size(h);
+    if (list_size > max_list_size) {
+      throw HTTP2Exception("HPACK : header list past " + std::to_string(max_list_size) + " bytes",
+                           HTTP2::ENHANCE_YOUR_CALM);
+    }
+  };
+  auto literal = [&](int prefix) {
+    const size_t index = decode_int(p, end, prefix);
+    header_t h;
+    if (index == 0) {
+      h.first = decode_string(p, end);
+    } else if (const header_t *named = table.get(index)) {
+      h.first = named->first;
+    } else {
+      throw compression_error("no header at index " + std::to_string(index));
+    }
+    h.second = decode_string(p, end);
+    return h;
+  };
+
+  while (p < end) {
+    const uint8_t b = *p;
+    if (b & 0x80) {
+      const size_t index = decode_int(p, end, 7);
+      const header_t *h = table.get(index);
+      if (h == nullptr) {
+        throw compression_error("no header at index " + std::to_string(index));
+      }
+      account(*h);
+      headers.push_back(*h);
+    } else if ((b & 0xc0) == 0x40) {
+      header_t h = literal(6);
+      account(h);
+      headers.push_back(h);
+      table.add(std::move(h));
+    } else if ((b & 0xe0) == 0x20) {
+      if (!headers.empty()) {
+        throw compression_error("table size update after a header");
+      }
+      const size_t size = decode_int(p, end, 5);
+      if (size > max_table_size) {
+        throw compression_error("table size update past the advertised size");
+      }
+      table.resize(size);
+    } else {
+      // without indexing or never indexed, the same to a decoder
+      header_t h = literal(4);
+      account(h);
+      headers.push_back(std::move(h));
+    }
+  }
+  return headers;
+}
+
+/* encoding */
+
+void Encoder::set_max_table_size(size_t max) {
+  const size_t size = std::min(max, default_table_size);
+  // the smallest size since the last block is signalled too, the peer evicts down to it
+  low = resized ? std::min(low, size) : size;
+  resized = true;
+  table.resize(low);
+  table.resize(size);
+}
+
+std::string Encoder::encode(const header_list &headers) {
+  std::string out;
+  if (resized) {
+    if (low < table.capacity()) {
+      encode_int(out, 0x20, 5, low);
+    }
+    encode_int(out, 0x20, 5, table.capacity());
+    resized = false;
+  }
+  for (const auto &h : headers) {
+    bool exact = false;
+    const size_t index = table.find(h.first, h.second, exact);
+    if (exact) {
+      encode_int(out, 0x80, 7, index);
+      continue;
+    }
+    const bool indexed = !sensitive_header(h.first) && !volatile_header(h.first) &&
+                         Table::entry_size(h) <= table.capacity() / 2;
+    if (indexed) {
+      encode_int(out, 0x40, 6, index);
+    } else if (sensitive_header(h.first)) {
+      encode_int(out, 0x10, 4, index);
+    } else {
+      encode_int(out, 0x00, 4, index);
+    }
+    if (index == 0) {
+      encode_string(out, h.first);
+    }
+    encode_string(out, h.second);
+    if (indexed) {
+      table.add(h);
+    }
+  }
+  return out;
+}
+
+}  // namespace Kleptic::HPACK
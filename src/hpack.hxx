@@ -0,0 +1,107 @@
+#ifndef KLEPTIC_HPACK_HXX_
+#define KLEPTIC_HPACK_HXX_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Kleptic::HPACK {
+
+typedef std::pair<std::string, std::string> header_t;
+typedef std::vector<header_t> header_list;
+
+/* size of the dynamic table both ends start with */
+constexpr size_t default_table_size = 4096;
+
+/*
+ * Table
+ *
+ * the static table followed by a dynamic one, indexed from 1 the way
+ * RFC 7541 numbers them: 1-61 static, then the newest dynamic entry
+ * first. adding past max_size evicts the oldest entries.
+ */
+class Table {
+  std::deque<header_t> dynamic;
+  size_t size = 0;
+  size_t max_size;
+
+  void evict(size_t limit);
+
+ public:
+  static const header_t static_table[];
+  static constexpr size_t static_size = 61;
+
+  explicit Table(size_t max_size = default_table_size) : max_size(max_size) {}
+  /* nullptr if there is no such index */
+  const header_t *get(size_t index) const;
+  void add(header_t h);
+  void resize(size_t max);
+  size_t capacity() const { return max_size; }
+  /* the index of name: value, or of name alone with exact false, 0 for none */
+  size_t find(const std::string &name, const std::string &value, bool &exact) const;
+
+  /* what an entry counts against the table size */
+  static size_t entry_size(const header_t &h) { return h.first.size() + h.second.size() + 32; }
+};
+
+/*
+ * Decoder
+ *
+ * turns header blocks back into header lists, keeping the dynamic
+ * table they update across a connection. the peer can't grow the table
+ * past max_table_size, what we advertise as SETTINGS_HEADER_TABLE_SIZE.
+ * throws HTTP2Exception (COMPRESSION_ERROR), after which the
+ * connection's table is unusable.
+ */
+class Decoder {
+  Table table;
+  const size_t max_table_size;
+
+ public:
+  explicit Decoder(size_t max_table_size = default_table_size)
+      : table(max_table_size), max_table_size(max_table_size) {}
+  /*
+   * stops with ENHANCE_YOUR_CALM as soon as the decoded list passes
+   * max_list_size, counted like SETTINGS_MAX_HEADER_LIST_SIZE (name,
+   * value and 32 per field), so a short block of references to a big
+   * entry can't expand without bound. the table is unusable after that
+   * as well.
+   */
+  header_list decode(const uint8_t *data, size_t len, size_t max_list_size = SIZE_MAX);
+};
+
+/*
+ * Encoder
+ *
+ * header lists into header blocks. values that change on every response
+ * (dates, lengths) are sent without indexing, credentials are never
+ * indexed, everything else goes into the dynamic table. strings are
+ * Huffman coded when that's shorter.
+ */
+class Encoder {
+  Table table;
+  /* the next block starts with a table size update, low is the smallest since the last */
+  bool resized = false;
+  size_t low = default_table_size;
+
+ public:
+  std::string encode(const header_list &headers);
+  /* the peer's SETTINGS_HEADER_TABLE_SIZE, the table never grows past the default */
+  void set_max_table_size(size_t max);
+};
+
+/* prefix coded integers, decode throws past what a size_t holds */
+void encode_int(std::string &out, uint8_t first, int prefix, size_t value);
+size_t decode_int(const uint8_t *&p, const uint8_t *end, int prefix);
+
+/* the Huffman code of RFC 7541 appendix B */
+std::string huffman_encode(const std::string &s);
+size_t huffman_length(const std::string &s);
+std::string huffman_decode(const uint8_t *data, size_t len);
+
+}  // namespace Kleptic::HPACK
+
+#endif  // KLEPTIC_HPACK_HXX_
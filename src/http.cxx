@@ -1,15 +1,29 @@
 #include "http.hxx"
 
+#include <fcntl.h>
 #include <signal.h>
-
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <ctime>
+#include <fstream>
 #include <map>
 #include <memory>
+#include <memory_resource>
 #include <regex>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 #include "error.hxx"
+#include "event_loop.hxx"
 #include "strutil.hxx"
 
 namespace Kleptic {
@@ -63,6 +77,7 @@ void HTTPConn::parse(std::stringstream &ss) {
   } else {
     throw ParseException("Invalid Request URI");
   }
+  route_unparsed_path = req_path;
 
   /* parse parameters */
   stringstream query_stream(raw_query_string);
@@ -128,10 +143,7 @@ string HTTPConn::get_request() {
   return ss.str();
 }
 
-string HTTPConn::get_response() {
-  if (is_set()) {
-    return final_resp;
-  }
+string HTTPConn::head() {
   stringstream ss;
   ss << http_ver << " " << resp_status << " " << HTTPConn::default_status_reasons[resp_status]
      << "\r\n";
@@ -143,17 +155,31 @@ string HTTPConn::get_response() {
   strftime(date_buff, RFC1123_TIME_LEN + 1, date_format_str.c_str(), now_tm);
 
   resp_headers["Date"] = std::string(date_buff);
+  for (auto const &[key, val] : resp_headers) {
+    ss << key << ": " << val << "\r\n";
+  }
+  for (auto const &[key, val] : resp_extra_headers) {
+    ss << key << ": " << val << "\r\n";
+  }
+  ss << "\r\n";
+  return ss.str();
+}
+
+string HTTPConn::get_response() {
+  if (is_set()) {
+    return final_resp;
+  }
+  inline_file();
   /*auto content_length =
    * std::distance(std::istream_iterator<std::string>(resp_body),
    * std::istream_iterator<std::string>()); */
   string resp_str = resp_body.str();
   resp_headers["Content-Length"] = std::to_string(resp_str.size());
-  for (auto const &[key, val] : resp_headers) {
-    ss << key << ": " << val << "\r\n";
+  string resp = head();
+  if (method.compare("HEAD")) {
+    resp += resp_str;
   }
-  ss << "\r\n";
-  ss << resp_str;
-  return ss.str();
+  return resp;
 }
 
 void HTTPConn::send() { send(get_response()); }
@@ -166,13 +192,91 @@ void HTTPConn::send(string s) {
   final_resp = s;
 }
 
+void HTTPConn::respond(Socket &s) {
+  if (is_set() || resp_file.empty()) {
+    s.write(get_response());
+    return;
+  }
+  int fd = open(resp_file.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    // inline_file answers with the 404
+    s.write(get_response());
+    return;
+  }
+  resp_headers["Content-Length"] = std::to_string(st.st_size);
+  try {
+    s.write(head());
+    if (method.compare("HEAD") && st.st_size > 0) {
+      s.send_file(fd, 0, st.st_size);
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
+
+void HTTPConn::inline_file() {
+  if (resp_file.empty()) {
+    return;
+  }
+  std::ifstream file(resp_file, std::ios::binary);
+  resp_file.clear();
+  resp_body.str("");
+  if (!file) {
+    resp_status = 404;
+    resp_headers["Content-Type"] = "text/plain";
+    resp_body << "File not found";
+    return;
+  }
+  resp_body << file.rdbuf();
+}
+
+string HTTPConn::start_stream() {
+  if (is_set()) {
+    return "";
+  }
+  // the body runs until the connection closes
+  resp_headers.erase("Content-Length");
+  resp_headers["Connection"] = "close";
+  string h = head();
+  send("");
+  streaming = true;
+  return h;
+}
+
+void HTTPConn::stream(const char *data, size_t len) {
+  if (sock == nullptr) {
+    throw SocketException("No socket to stream the response to");
+  }
+  if (!streaming) {
+    sock->write(start_stream());
+  }
+  if (len > 0 && method.compare("HEAD")) {
+    sock->write(data, static_cast<int>(len));
+  }
+}
+
+bool HTTPConn::is_streaming() const { return streaming; }
+
 bool HTTPConn::is_set() const { return (status == HTTPConn::SET); }
 
 void HTTPServer::sigpipe_handler(int) {}
 
 HTTPConn HTTPServer::upgrade_http(const conn_t &conn) {
-  HTTPConn c;
   stringstream ss = conn->socket->read_all();
+  return upgrade_http(conn, ss);
+}
+
+HTTPConn HTTPServer::upgrade_http(const conn_t &conn, stringstream &ss) {
+  HTTPConn c;
+  start_timing(c, *conn);
+  c.timing.mark(RequestTiming::READ);
   c.remote_ip = conn->getIP4();
   try {
     c.parse(ss);
@@ -180,9 +284,93 @@ HTTPConn HTTPServer::upgrade_http(const conn_t &conn) {
     c.resp_status = ex.err_code;
     c.send();
   }
+  c.timing.mark(RequestTiming::PARSED);
   return c;
 }
 
+const char *const RequestTiming::phase_names[num_phases] = {
+    "queue", "handshake", "read", "parse", "dispatch", "route", "middleware", "handler", "write"};
+
+std::array<int64_t, RequestTiming::num_phases> RequestTiming::phases() const {
+  std::array<int64_t, COUNT> a = at;
+  if (a[ROUTED] == 0 && a[HANDLER] == 0 && a[DISPATCHED] != 0) {
+    // no router, the whole call was the handler
+    a[HANDLER] = a[DISPATCHED];
+    a[DISPATCHED] = 0;
+  }
+  std::array<int64_t, num_phases> out;
+  out.fill(-1);
+  for (size_t i = 0; i < num_phases; ++i) {
+    if (a[i] == 0) {
+      continue;
+    }
+    for (size_t j = i + 1; j < COUNT; ++j) {
+      if (a[j] != 0) {
+        out[i] = std::max<int64_t>(a[j] - a[i], 0);
+        break;
+      }
+    }
+  }
+  return out;
+}
+
+/*
+ * bool sample(double)
+ *
+ * true for about rate of the calls. a per thread xorshift, no shared
+ * state to contend on.
+ */
+static bool sample(double rate) {
+  if (rate >= 1) {
+    return true;
+  }
+  if (rate <= 0) {
+    return false;
+  }
+  thread_local uint64_t x = reinterpret_cast<uintptr_t>(&x) ^
+                            std::chrono::steady_clock::now().time_since_epoch().count() ^
+                            0x9e3779b97f4a7c15ULL;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return static_cast<double>(x >> 11) < rate * static_cast<double>(1ULL << 53);
+}
+
+void HTTPServer::start_timing(HTTPConn &c, const Conn &conn) const {
+  c.timing.sampled = sample(timing_sample_rate);
+  if (!c.timing.sampled) {
+    return;
+  }
+  // a default stamp is a server that didn't take it, the phase is skipped
+  const std::chrono::steady_clock::time_point unset;
+  auto stamp = [&](RequestTiming::mark_t m, std::chrono::steady_clock::time_point t) {
+    c.timing.at[m] = (t == unset) ? 0 : RequestTiming::ns(t);
+  };
+  stamp(RequestTiming::ACCEPTED, conn.accepted_at);
+  stamp(RequestTiming::STARTED, conn.started_at);
+  stamp(RequestTiming::HANDSHAKEN, conn.handshaken_at);
+}
+
+void HTTPServer::record_timing(const HTTPConn &c, LogEvent *ev) {
+  if (!c.timing.sampled) {
+    return;
+  }
+  const auto phases = c.timing.phases();
+  std::string field;
+  for (size_t i = 0; i < RequestTiming::num_phases; ++i) {
+    if (phases[i] < 0) {
+      continue;
+    }
+    field = RequestTiming::phase_names[i];
+    field += "_ns";
+    if (ev != nullptr) {
+      ev->num_data[field] = static_cast<double>(phases[i]);
+    }
+    metrics.histogram("http_request_phase_seconds", {{"phase", RequestTiming::phase_names[i]}})
+        .observe(static_cast<uint64_t>(phases[i]));
+  }
+}
+
 HTTPServer::HTTPServer(std::string ip, int port, string logfile)
     : HTTPServer(ip, port, HTTPServer::default_runner, logfile) {}
 
@@ -203,34 +391,332 @@ HTTPServer::HTTPServer(socket_server_t server, std::string logfile)
   });
 }
 
+/*
+ * std::string_view method_label(const string &)
+ *
+ * anything but the standard methods is counted as OTHER, clients don't
+ * get to make up label values.
+ */
+static std::string_view method_label(const string &m) {
+  static const char *known[] = {"GET",     "HEAD",    "POST",  "PUT",  "DELETE",
+                                "OPTIONS", "CONNECT", "TRACE", "PATCH"};
+  for (const char *k : known) {
+    if (m == k) {
+      return k;
+    }
+  }
+  return "OTHER";
+}
+
+void HTTPServer::observe(const HTTPConn &c, std::chrono::steady_clock::duration d) {
+  char code[4];
+  snprintf(code, sizeof(code), "%03d",
+           (c.resp_status > 0 && c.resp_status < 1000) ? c.resp_status : 0);
+  // unmatched paths share one series, the path itself isn't bounded
+  const std::string_view route = c.route.empty() ? std::string_view("unrouted") : c.route;
+  const Metrics::labels_t labels = {
+      {"route", route}, {"method", method_label(c.method)}, {"code", code}};
+  metrics.counter("http_requests_total", labels).inc();
+  metrics.histogram("http_request_duration_seconds", labels).observe(d);
+}
+
+void HTTPServer::serve_http2(const conn_t &conn, const HTTPConnHandler &handle,
+                             const HTTPConnClassifier &classify) {
+  // a runner that forks or runs inline couldn't hand the response back, streams are handled here
+  HTTP2::Connection::spawner_t spawn;
+  Concurrency::ConcurrentRunner &runner = s->runner();
+  if (runner.threaded()) {
+    spawn = [&runner, classify](const HTTPConn &hconn, unique_function<void()> run) {
+      if (!classify) {
+        runner.dispatch(Concurrency::task_t(std::move(run)));
+        return;
+      }
+      // parse errors are answered right away
+      runner.dispatch(hconn.is_set() ? QoS::INTERACTIVE : classify(hconn),
+                      Concurrency::task_t(std::move(run)));
+    };
+  }
+  HTTP2::Connection h2(
+      *conn->socket, conn->getIP4(),
+      [this, &handle](HTTPConn &hconn) {
+        auto start = std::chrono::steady_clock::now();
+        auto ev = logger.create_event<HTTPRequestEv>();
+        ev->start();
+        // the connection stamped the stream's read and parse, the connection wide
+        // accept and handshake would count every earlier stream against this one
+        hconn.timing.sampled = sample(timing_sample_rate);
+        hconn.host_ip = ip;
+        hconn.host_port = port;
+        ev->str_data["ip"] = hconn.remote_ip;
+        ev->num_data["code"] = hconn.resp_status;
+        ev->str_data["req_path"] = hconn.req_path;
+        if (!hconn.is_set()) {
+          hconn.timing.mark(RequestTiming::DISPATCHED);
+          handle(hconn);
+        }
+        hconn.timing.mark(RequestTiming::HANDLED);
+        // frames of all streams share the socket, there is no write phase of its own
+        record_timing(hconn, ev.get());
+        observe(hconn, std::chrono::steady_clock::now() - start);
+        ev->end();
+      },
+      http2_settings, std::move(spawn));
+  h2.serve();
+}
+
 void HTTPServer::run(HTTPConnHandler handle) {
   start_t = std::chrono::system_clock::now();
+  if (http2) {
+    s->set_protocols({"h2", "http/1.1"});
+  }
   s->run([this, handle](conn_t conn) {
+    if (http2 && HTTP2::negotiated(*conn->socket)) {
+      serve_http2(conn, handle, nullptr);
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
     auto ev = logger.create_event<HTTPRequestEv>();
     ev->start();
     HTTPConn hconn = upgrade_http(conn);
     hconn.host_ip = ip;
     hconn.host_port = port;
+    hconn.sock = conn->socket.get();
     ev->str_data["ip"] = hconn.remote_ip;
     ev->num_data["code"] = hconn.resp_status;
     ev->str_data["req_path"] = hconn.req_path;
     if (!hconn.is_set()) {
+      hconn.timing.mark(RequestTiming::DISPATCHED);
       handle(hconn);
     }
-    conn->socket->write(hconn.get_response());
+    hconn.timing.mark(RequestTiming::HANDLED);
+    hconn.respond(*conn->socket);
+    hconn.timing.mark(RequestTiming::WRITTEN);
+    record_timing(hconn, ev.get());
+    observe(hconn, std::chrono::steady_clock::now() - start);
     ev->end();
   });
 }
 
+void HTTPServer::run(HTTPConnHandler handle, HTTPConnClassifier classify) {
+  start_t = std::chrono::system_clock::now();
+  if (http2) {
+    s->set_protocols({"h2", "http/1.1"});
+  }
+  s->run([this, handle, classify](conn_t conn) {
+    if (http2 && HTTP2::negotiated(*conn->socket)) {
+      serve_http2(conn, handle, classify);
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto ev = logger.create_event<HTTPRequestEv>();
+    ev->start();
+    HTTPConn hconn = upgrade_http(conn);
+    hconn.host_ip = ip;
+    hconn.host_port = port;
+    hconn.sock = conn->socket.get();
+    ev->str_data["ip"] = hconn.remote_ip;
+    ev->num_data["code"] = hconn.resp_status;
+    ev->str_data["req_path"] = hconn.req_path;
+    // parse errors are answered right away
+    QoS::class_t cls = hconn.is_set() ? QoS::INTERACTIVE : classify(hconn);
+
+    auto stage = [this, handle, ev, start, hconn = std::move(hconn),
+                  conn = std::move(conn)]() mutable {
+      try {
+        if (!hconn.is_set()) {
+          hconn.timing.mark(RequestTiming::DISPATCHED);
+          handle(hconn);
+        }
+        hconn.timing.mark(RequestTiming::HANDLED);
+        hconn.respond(*conn->socket);
+        hconn.timing.mark(RequestTiming::WRITTEN);
+        record_timing(hconn, ev.get());
+        observe(hconn, std::chrono::steady_clock::now() - start);
+        ev->end();
+      } catch (SocketException &) {
+        // the client went away, drop the connection
+      } catch (const std::exception &e) {
+        fprintf(stderr, "Unhandled exception serving a connection : %s\n", e.what());
+      }
+    };
+    s->runner().dispatch(cls, Concurrency::task_t(std::move(stage)));
+  });
+}
+
+/*
+ * task<stringstream> read_request(Socket &)
+ *
+ * reads until the end of the headers and then Content-Length bytes of
+ * body (or EOF), yielding to the loop whenever the socket runs dry. the
+ * buffer grows in mr, a core's arena when serving per core.
+ */
+static Async::task<stringstream> read_request(
+    Socket &sock, std::pmr::memory_resource *mr = std::pmr::get_default_resource()) {
+  std::pmr::string buff(mr);
+  char chunk[TCP_BUFF_SIZE];
+  size_t header_end = string::npos;
+  size_t want = string::npos;
+
+  while (buff.size() < want) {
+    int ret = co_await Async::read_some(sock, chunk, sizeof(chunk));
+    if (ret == 0) {
+      break;  // EOF Detected
+    }
+    buff.append(chunk, ret);
+
+    if (header_end == string::npos) {
+      header_end = buff.find("\r\n\r\n");
+      if (header_end == string::npos) {
+        continue;
+      }
+      size_t body_len = 0;
+      string headers = Util::to_lower(string(buff, 0, header_end));
+      size_t pos = headers.find("\ncontent-length:");
+      if (pos != string::npos) {
+        body_len = std::strtoul(headers.c_str() + pos + 16, nullptr, 10);
+      }
+      want = header_end + 4 + body_len;
+    }
+  }
+  co_return stringstream(string(buff));
+}
+
+Async::task<void> HTTPServer::serve_async(conn_t conn, const HTTPConnAsyncHandler &handle) {
+  auto start = std::chrono::steady_clock::now();
+  auto ev = logger.create_event<HTTPRequestEv>();
+  ev->start();
+  stringstream ss = co_await read_request(*conn->socket);
+  HTTPConn hconn = upgrade_http(conn, ss);
+  hconn.host_ip = ip;
+  hconn.host_port = port;
+  hconn.sock = conn->socket.get();
+  ev->str_data["ip"] = hconn.remote_ip;
+  ev->num_data["code"] = hconn.resp_status;
+  ev->str_data["req_path"] = hconn.req_path;
+  if (!hconn.is_set()) {
+    hconn.timing.mark(RequestTiming::DISPATCHED);
+    co_await handle(hconn);
+  }
+  hconn.timing.mark(RequestTiming::HANDLED);
+  string resp = hconn.get_response();
+  co_await Async::write_all(*conn->socket, std::move(resp));
+  hconn.timing.mark(RequestTiming::WRITTEN);
+  record_timing(hconn, ev.get());
+  observe(hconn, std::chrono::steady_clock::now() - start);
+  ev->end();
+}
+
+void HTTPServer::run_async(HTTPConnAsyncHandler handle) {
+  start_t = std::chrono::system_clock::now();
+  Async::EventLoop loop;
+  s->run_async(loop, [this, &handle](conn_t conn) { return serve_async(std::move(conn), handle); });
+}
+
+PerCoreHTTPServer::PerCoreHTTPServer(std::vector<int> cpus, std::string ip, int port,
+                                     string logfile)
+    : HTTPServer(std::make_unique<TCPServer>(ip, port, std::ref(default_runner), true), logfile),
+      runtime(std::move(cpus)) {
+  this->ip = ip;
+  this->port = port;
+  for (size_t i = 1; i < runtime.size(); ++i) {
+    listeners.push_back(std::make_unique<TCPServer>(ip, port, std::ref(default_runner), true));
+  }
+}
+
+Async::task<void> PerCoreHTTPServer::serve_core(conn_t conn, const HTTPConnAsyncHandler &handle) {
+  PerCore::Core &core = PerCore::Core::current();
+  PerCore::CoreMetrics &m = core.metrics();
+  auto start = std::chrono::steady_clock::now();
+  m.connections++;
+  try {
+    stringstream ss = co_await read_request(*conn->socket, core.arena());
+    m.bytes_in += ss.rdbuf()->in_avail();
+    HTTPConn hconn = upgrade_http(conn, ss);
+    hconn.host_ip = ip;
+    hconn.host_port = port;
+    hconn.sock = conn->socket.get();
+    if (!hconn.is_set()) {
+      hconn.timing.mark(RequestTiming::DISPATCHED);
+      co_await handle(hconn);
+    }
+    hconn.timing.mark(RequestTiming::HANDLED);
+    string resp = hconn.get_response();
+    m.bytes_out += resp.size();
+    co_await Async::write_all(*conn->socket, std::move(resp));
+    hconn.timing.mark(RequestTiming::WRITTEN);
+    record_timing(hconn, nullptr);
+
+    auto took = std::chrono::steady_clock::now() - start;
+    observe(hconn, took);
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(took);
+    m.record(hconn.req_path, us.count());
+    if (hconn.resp_status >= 500) {
+      m.errors++;
+    }
+    if (access_log != nullptr) {
+      std::pmr::string line(core.arena());
+      line.append(hconn.remote_ip).append(" ").append(hconn.req_path).append(" ");
+      char code[12];
+      line.append(code, snprintf(code, sizeof(code), "%d", hconn.resp_status));
+      access_log->append(line);
+    }
+  } catch (...) {
+    m.errors++;
+    throw;
+  }
+}
+
+static Async::task<void> run_inline(const HTTPConnHandler &handle, HTTPConn &c) {
+  handle(c);
+  co_return;
+}
+
+void PerCoreHTTPServer::run(HTTPConnHandler handle) {
+  run_async([&handle](HTTPConn &c) { return run_inline(handle, c); });
+}
+
+void PerCoreHTTPServer::run_async(HTTPConnAsyncHandler handle) {
+  start_t = std::chrono::system_clock::now();
+  access_log = logger.local_writer();
+  runtime.run([this, &handle](PerCore::Core &core) {
+    SocketServer &l = (core.id() == 0) ? *s : *listeners[core.id() - 1];
+    l.listen_async(core.loop(),
+                   [this, &handle](conn_t conn) { return serve_core(std::move(conn), handle); });
+  });
+}
+
+void PerCoreHTTPServer::stop() { runtime.stop(); }
+
+Async::task<std::vector<PerCore::CoreMetrics>> PerCoreHTTPServer::core_stats() {
+  auto snapshot = [](PerCore::Core &core) { return core.metrics(); };
+  std::vector<PerCore::CoreMetrics> out = co_await runtime.gather(std::move(snapshot));
+  co_return out;
+}
+
+Async::task<PerCore::CoreMetrics> PerCoreHTTPServer::stats() {
+  PerCore::CoreMetrics total;
+  std::vector<PerCore::CoreMetrics> per_core = co_await core_stats();
+  for (const auto &m : per_core) {
+    total.merge(m);
+  }
+  co_return total;
+}
+
 SecureHTTPServer::SecureHTTPServer(tls_cert_key_pair conf, std::string ip, int port, string logfile)
     : SecureHTTPServer(conf, ip, port, default_runner, logfile) {}
 SecureHTTPServer::SecureHTTPServer(tls_cert_key_pair conf, std::string ip, int port,
-                                   const Concurrency::runner_t &r, std::string logfile)
-    : HTTPServer(std::make_unique<TLSServer>(ip, port, std::ref(r), conf), logfile) {
+                                   const Concurrency::runner_t &r, std::string logfile,
+                                   TLS::SessionOptions sessions, TLS::HandshakeOptions handshakes)
+    : HTTPServer(std::make_unique<TLSServer>(ip, port, std::ref(r), conf, sessions, handshakes),
+                 logfile) {
   this->ip = ip;
   this->port = port;
 }
 
+TLS::Stats SecureHTTPServer::tls_stats() const {
+  return static_cast<const TLSServer &>(*s).tls_stats();
+}
+
 HTTPRequestEv::HTTPRequestEv() { ev_name = "HTTP_REQ_EV"; }
 // std::string HTTPRequestEv::get_name() const { return "HTTP_REQ_EV"; }
 
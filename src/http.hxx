@@ -1,15 +1,25 @@
 #ifndef KLEPTIC_HTTP_HXX_
 #define KLEPTIC_HTTP_HXX_
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "concurrency.hxx"
+#include "http2.hxx"
 #include "logger.hxx"
+#include "metrics.hxx"
+#include "per_core.hxx"
+#include "qos.hxx"
 #include "server.hxx"
+#include "task.hxx"
 
 #define KLEPTIC_LOCALHOST "127.0.0.1"
 #define KLEPTIC_ANYADDR "0.0.0.0"
@@ -23,6 +33,62 @@ namespace Kleptic {
 using std::string;
 using std::stringstream;
 
+struct HTTPConn;
+/* coroutine handler, may co_await socket, file and timer operations */
+typedef std::function<Async::task<void>(HTTPConn &)> HTTPConnAsyncHandler;
+
+/*
+ * RequestTiming
+ *
+ * monotonic ns timestamps of the boundaries a request passes, 0 for the
+ * ones it didn't. a phase runs from its mark to the next one taken:
+ *
+ *   ACCEPTED    queue       waiting for a worker
+ *   STARTED     handshake   TLS, nothing for plain sockets
+ *   HANDSHAKEN  read        reading the request
+ *   READ        parse
+ *   PARSED      dispatch    the class queue of a two stage run
+ *   DISPATCHED  route       up to the router's match, code in front of it included
+ *   ROUTED      middleware  auth and the like
+ *   HANDLER     handler
+ *   HANDLED     write       sending the response
+ *   WRITTEN
+ *
+ * without a router everything handle does is the handler. only sampled
+ * requests read the clock, mark is a branch for the rest.
+ */
+struct RequestTiming {
+  enum mark_t {
+    ACCEPTED = 0,
+    STARTED,
+    HANDSHAKEN,
+    READ,
+    PARSED,
+    DISPATCHED,
+    ROUTED,
+    HANDLER,
+    HANDLED,
+    WRITTEN,
+    COUNT
+  };
+  static constexpr size_t num_phases = COUNT - 1;
+  static const char *const phase_names[num_phases];
+
+  bool sampled = false;
+  std::array<int64_t, COUNT> at{};
+
+  static int64_t ns(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+  }
+  void mark(mark_t m) {
+    if (sampled) {
+      at[m] = ns(std::chrono::steady_clock::now());
+    }
+  }
+  /* ns spent in each phase, -1 for the ones the request skipped */
+  std::array<int64_t, num_phases> phases() const;
+};
+
 struct HTTPConn {
   static std::map<const int, const string> default_status_reasons;
   enum ConnStatus { UNSET, SET };
@@ -43,7 +109,14 @@ struct HTTPConn {
   string req_path;
   string http_protocol;
 
+  /* path left to route, the router replaces it with the unmatched tail */
   string route_unparsed_path;
+  std::map<string, string> route_params;
+  /* pattern of the matched route, e.g. "/users/:id", a view into the router */
+  std::string_view route;
+
+  /* phase boundaries, if the request was sampled */
+  RequestTiming timing;
 
   /* headers */
   std::map<string, string> req_headers;
@@ -63,14 +136,28 @@ struct HTTPConn {
 
   /* response headers */
   std::map<string, string> resp_headers = {};
+  /* headers sent once per value after resp_headers, e.g. each Set-Cookie */
+  std::vector<std::pair<string, string>> resp_extra_headers;
 
   /* response body */
   stringstream resp_body;
+  /*
+   * a file to answer with instead of resp_body. respond() sends it
+   * straight from the file (sendfile, over kTLS for TLS sockets), the
+   * other paths read it into resp_body first, see inline_file.
+   */
+  string resp_file;
 
   /* if authenticated */
   string auth_type;
   string user;
 
+  /* coroutine handler the router matched, left for handle/handle_async to run */
+  std::shared_ptr<const HTTPConnAsyncHandler> async_handler;
+
+  /* the client's socket, for handlers that stream their response */
+  Socket *sock = nullptr;
+
   void parse(stringstream &ss);
   void set_resp_code(int);
 
@@ -80,11 +167,37 @@ struct HTTPConn {
   void send();
   void send(string s);
 
+  /*
+   * void respond(Socket &)
+   *
+   * writes the response to s, blocking. a resp_file goes out with
+   * Socket::send_file after the head, anything else as get_response().
+   */
+  void respond(Socket &s);
+  /* reads resp_file into resp_body, 404 if it can't be opened */
+  void inline_file();
+
+  /*
+   * streaming, for responses produced bit by bit. start_stream returns
+   * the status line and headers and marks the response sent. the body
+   * then goes straight to sock and ends when the connection closes, so
+   * there is no Content-Length. stream() writes to sock blocking and
+   * starts the stream on its first call. coroutine handlers write
+   * start_stream() and the body themselves with Async::write_all.
+   */
+  string start_stream();
+  void stream(const char *data, size_t len);
+  bool is_streaming() const;
+
   bool is_set() const;
 
+  /* the status line and headers, Date filled in */
+  string head();
+
  protected:
   ConnStatus status = UNSET;
   string final_resp;
+  bool streaming = false;
 };
 
 class HTTPRequestEv : public LogEvent {
@@ -102,10 +215,28 @@ class HTTPRequestEv : public LogEvent {
 };
 
 typedef std::function<void(HTTPConn &)> HTTPConnHandler;
+/* middleware that wraps the rest of the chain, it calls next to continue */
+typedef std::function<void(HTTPConn &, const HTTPConnHandler &next)> HTTPConnMiddleware;
+/* picks the scheduling class of a parsed request, e.g. Router::classify */
+typedef std::function<QoS::class_t(const HTTPConn &)> HTTPConnClassifier;
 
 class HTTPServer {
  protected:
   HTTPConn upgrade_http(const conn_t &conn);
+  HTTPConn upgrade_http(const conn_t &conn, stringstream &ss);
+  Async::task<void> serve_async(conn_t conn, const HTTPConnAsyncHandler &handle);
+  /*
+   * every stream of the connection goes to handle, dispatched on a
+   * threaded runner in the class classify picks (untagged without one)
+   */
+  void serve_http2(const conn_t &conn, const HTTPConnHandler &handle,
+                   const HTTPConnClassifier &classify);
+  /* counts a finished request and its service time, by route, method and status */
+  void observe(const HTTPConn &c, std::chrono::steady_clock::duration d);
+  /* samples c for phase timing, taking conn's accept and handshake stamps */
+  void start_timing(HTTPConn &c, const Conn &conn) const;
+  /* a sampled request's phases into http_request_phase_seconds, and on ev if there is one */
+  void record_timing(const HTTPConn &c, LogEvent *ev);
   std::unique_ptr<SocketServer> s;
   HTTPServer(socket_server_t server, std::string logfile);
 
@@ -114,12 +245,37 @@ class HTTPServer {
   std::string ip;
   int port;
   Logger logger;
+  /*
+   * http_requests_total and http_request_duration_seconds of every
+   * request served, shared with the workers of a forking runner
+   */
+  Metrics::Registry metrics;
+  /* share of requests whose phases are timed, see RequestTiming */
+  double timing_sample_rate = 0.01;
+  /*
+   * run also speaks HTTP/2: h2 is offered through ALPN on TLS, and
+   * cleartext clients that open with the preface get h2c
+   */
+  bool http2 = true;
+  HTTP2::Settings http2_settings;
   static void sigpipe_handler(int);
   static const Concurrency::runner_t default_runner;
   HTTPServer(std::string ip = KLEPTIC_ANYADDR, int port = KLEPTIC_HTTP_PORT,
              string logfile = KLEPTIC_HTTP_LOGFILE);
   HTTPServer(std::string ip, int port, const Concurrency::runner_t &r, std::string logfile);
   void run(HTTPConnHandler);
+  /*
+   * two stage: reading and parsing the request is dispatched untagged,
+   * then the handler is dispatched again in the class classify picks, so
+   * a QoSRunner can keep slow routes from starving fast ones. HTTP/2
+   * streams are classified and dispatched the same way, one by one.
+   */
+  void run(HTTPConnHandler, HTTPConnClassifier);
+  /*
+   * serves every connection as a coroutine on an event loop owned by the
+   * calling thread, the runner is not used.
+   */
+  void run_async(HTTPConnAsyncHandler);
 };
 
 class SecureHTTPServer : public HTTPServer {
@@ -127,7 +283,44 @@ class SecureHTTPServer : public HTTPServer {
   SecureHTTPServer(tls_cert_key_pair conf, std::string ip = KLEPTIC_ANYADDR,
                    int port = KLEPTIC_HTTPS_PORT, string logfile = KLEPTIC_HTTP_LOGFILE);
   SecureHTTPServer(tls_cert_key_pair conf, std::string ip, int port, const Concurrency::runner_t &r,
-                   std::string logfile);
+                   std::string logfile, TLS::SessionOptions sessions = TLS::SessionOptions(),
+                   TLS::HandshakeOptions handshakes = TLS::HandshakeOptions());
+  /* full vs resumed handshakes, failures and session cache hits */
+  TLS::Stats tls_stats() const;
+};
+
+/*
+ * PerCoreHTTPServer
+ *
+ * thread per core. every cpu in the list gets a pinned thread with its
+ * own SO_REUSEPORT listener and event loop, and a connection stays on
+ * the core that accepted it. request stats go to that core's metrics
+ * rather than the shared Logger maps, stats() collects them. access
+ * lines go straight to the log writer, so a logger moved to its own
+ * process with start_mp doesn't get them.
+ */
+class PerCoreHTTPServer : public HTTPServer {
+ protected:
+  PerCore::Runtime runtime;
+  /* listeners of cores 1.., core 0 accepts on s */
+  std::vector<socket_server_t> listeners;
+  /* the logger's writer, each core appends its access lines to its own ring of it */
+  LogWriter *access_log = nullptr;
+  Async::task<void> serve_core(conn_t conn, const HTTPConnAsyncHandler &handle);
+
+ public:
+  /* an empty cpu list means every cpu the process may run on */
+  PerCoreHTTPServer(std::vector<int> cpus, std::string ip = KLEPTIC_ANYADDR,
+                    int port = KLEPTIC_HTTP_PORT, string logfile = KLEPTIC_HTTP_LOGFILE);
+  /* blocking handlers run inline on the core that accepted the connection */
+  void run(HTTPConnHandler);
+  void run_async(HTTPConnAsyncHandler);
+  void stop();
+
+  size_t num_cores() const { return runtime.size(); }
+  /* must be awaited on one of this server's cores */
+  Async::task<std::vector<PerCore::CoreMetrics>> core_stats();
+  Async::task<PerCore::CoreMetrics> stats();
 };
 
 }  // namespace Kleptic
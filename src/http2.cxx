@@ -0,0 +1,991 @@
+#include "http2.hxx"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "error.hxx"
+#include "http.hxx"
+#include "strutil.hxx"
+
+namespace Kleptic::HTTP2 {
+
+const std::string preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+namespace {
+
+/* frame flags */
+constexpr uint8_t END_STREAM = 0x1;
+constexpr uint8_t ACK = 0x1;
+constexpr uint8_t END_HEADERS = 0x4;
+constexpr uint8_t PADDED = 0x8;
+constexpr uint8_t PRIORITY_INFO = 0x20;
+
+enum setting_t : uint16_t {
+  HEADER_TABLE_SIZE = 0x1,
+  ENABLE_PUSH = 0x2,
+  MAX_CONCURRENT_STREAMS = 0x3,
+  INITIAL_WINDOW_SIZE = 0x4,
+  MAX_FRAME_SIZE = 0x5,
+  MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+constexpr size_t frame_header_size = 9;
+/* the protocol's default, we never advertise more */
+constexpr size_t max_frame_size = 16384;
+constexpr int64_t max_window = 0x7fffffff;
+/* buffered frames are written once there are this many bytes */
+constexpr size_t write_batch = 64 * 1024;
+
+uint32_t get32(const uint8_t *p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+void put16(std::string &out, uint16_t v) {
+  out.push_back(static_cast<char>(v >> 8));
+  out.push_back(static_cast<char>(v));
+}
+
+void put32(std::string &out, uint32_t v) {
+  put16(out, static_cast<uint16_t>(v >> 16));
+  put16(out, static_cast<uint16_t>(v));
+}
+
+HTTP2Exception connection_error(const std::string &msg, error_t code) {
+  return HTTP2Exception("HTTP/2 : " + msg, code);
+}
+
+HTTP2Exception stream_error(uint32_t id, const std::string &msg, error_t code) {
+  return HTTP2Exception("HTTP/2 stream " + std::to_string(id) + " : " + msg, code, id);
+}
+
+/* headers that only mean something to one HTTP/1 connection */
+bool connection_specific(const std::string &lower) {
+  return lower == "connection" || lower == "keep-alive" || lower == "proxy-connection" ||
+         lower == "transfer-encoding" || lower == "upgrade";
+}
+
+/* content-type to Content-Type, the way handlers look request headers up */
+std::string canonical(const std::string &name) {
+  std::string s = name;
+  bool start = true;
+  for (char &ch : s) {
+    if (start) {
+      ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+    }
+    start = ch == '-';
+  }
+  return s;
+}
+
+/* status, headers and body of a response rendered for HTTP/1 */
+void split_response(const std::string &raw, int &status, HPACK::header_list &headers,
+                    std::string &body) {
+  size_t end = raw.find("\r\n\r\n");
+  std::stringstream lines(raw.substr(0, end));
+  std::string line;
+  std::getline(lines, line);
+  std::stringstream status_line(line);
+  std::string version;
+  status = 0;
+  status_line >> version >> status;
+  if (status < 200 || status > 999) {
+    status = 500;
+  }
+  while (std::getline(lines, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = Util::to_lower(Util::trim(line.substr(0, colon)));
+    if (!connection_specific(name)) {
+      headers.emplace_back(std::move(name), Util::trim(line.substr(colon + 1)));
+    }
+  }
+  body = end == std::string::npos ? "" : raw.substr(end + 4);
+}
+
+}  // namespace
+
+struct Connection::Stream {
+  const uint32_t id;
+  int64_t send_window;
+  int64_t recv_window;
+
+  /* the request */
+  std::string block;
+  HPACK::header_list headers;
+  std::string body;
+  bool headers_done = false;
+  /* the client sent END_STREAM */
+  bool remote_closed = false;
+  /* over max_concurrent_streams, reset once its header block is decoded */
+  bool refused = false;
+  /* its first HEADERS came in */
+  std::chrono::steady_clock::time_point opened = std::chrono::steady_clock::now();
+
+  /* the response body, data then the file */
+  std::string data;
+  size_t data_off = 0;
+  int fd = -1;
+  off_t file_off = 0;
+  size_t file_left = 0;
+  bool queued = false;
+
+  Stream(uint32_t id, int64_t send_window, int64_t recv_window)
+      : id(id), send_window(send_window), recv_window(recv_window) {}
+  ~Stream() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  size_t left() const { return data.size() - data_off + file_left; }
+};
+
+/* a stream's request and its handler's response, while the handler runs */
+struct Connection::Spawned {
+  const uint32_t id;
+  HTTPConn c;
+  BufferSocket capture;
+  std::chrono::steady_clock::time_point spawned;
+  /* taken by whoever runs the handler, the spawned task or the connection */
+  std::atomic<bool> claimed{false};
+  /* the handler threw, the stream is reset */
+  bool failed = false;
+
+  explicit Spawned(uint32_t id) : id(id) {}
+};
+
+bool negotiated(Socket &s, std::chrono::milliseconds timeout) {
+  const std::string protocol = s.protocol();
+  if (!protocol.empty()) {
+    return protocol == "h2";
+  }
+  char buff[32];
+  const size_t want = preface.size();
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  int lowat = 1;
+  bool h2 = false;
+  while (true) {
+    // the first bytes decide, only a client that starts like the preface is waited for
+    ssize_t n = recv(s._socket_fd, buff, want, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      break;
+    }
+    if (n > 0 && preface.compare(0, n, buff, n) != 0) {
+      break;
+    }
+    if (n > 0 && static_cast<size_t>(n) == want) {
+      h2 = true;
+      break;
+    }
+    if (n > 0 && lowat == 1) {
+      // part of it, the socket doesn't poll readable again until the rest could be there
+      lowat = static_cast<int>(want);
+      setsockopt(s._socket_fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+    }
+    const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0) {
+      break;
+    }
+    struct pollfd p = {s._socket_fd, POLLIN, 0};
+    if (poll(&p, 1, static_cast<int>(left.count())) < 0 && errno != EINTR) {
+      break;
+    }
+  }
+  if (lowat != 1) {
+    lowat = 1;
+    setsockopt(s._socket_fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+  }
+  return h2;
+}
+
+Connection::Connection(Socket &s, std::string remote_ip, handler_t handle,
+                       const Settings &settings, spawner_t spawn)
+    : s(s),
+      remote_ip(std::move(remote_ip)),
+      handle(std::move(handle)),
+      spawn(std::move(spawn)),
+      settings(settings) {
+  if (this->spawn) {
+    // without it handlers run here, as if there were no spawner
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  }
+}
+
+Connection::~Connection() {
+  // handlers still queued never run, the ones running use this and are waited for
+  std::erase_if(spawned, [](const std::shared_ptr<Spawned> &job) {
+    return !job->claimed.exchange(true, std::memory_order_acq_rel);
+  });
+  while (!spawned.empty()) {
+    {
+      std::lock_guard<std::mutex> l(finished_m);
+      uint64_t n;
+      ssize_t ret = read(wake_fd, &n, sizeof(n));
+      (void)ret;
+      for (const auto &job : finished) {
+        spawned.erase(std::find(spawned.begin(), spawned.end(), job));
+      }
+      finished.clear();
+    }
+    if (!spawned.empty()) {
+      struct pollfd p = {wake_fd, POLLIN, 0};
+      poll(&p, 1, -1);
+    }
+  }
+  if (wake_fd >= 0) {
+    std::lock_guard<std::mutex> l(finished_m);
+    close(wake_fd);
+  }
+}
+
+void Connection::serve() {
+  // our settings go out first, the client needn't wait for them to start
+  std::string local;
+  put16(local, MAX_CONCURRENT_STREAMS);
+  put32(local, settings.max_concurrent_streams);
+  put16(local, INITIAL_WINDOW_SIZE);
+  put32(local, settings.initial_window_size);
+  put16(local, MAX_HEADER_LIST_SIZE);
+  put32(local, settings.max_header_list_size);
+  frame(SETTINGS, 0, 0, local.data(), local.size());
+  if (settings.connection_window_size > recv_window) {
+    std::string inc;
+    put32(inc, static_cast<uint32_t>(settings.connection_window_size - recv_window));
+    frame(WINDOW_UPDATE, 0, 0, inc.data(), inc.size());
+    recv_window = settings.connection_window_size;
+  }
+  write_out();
+
+  try {
+    while (in.size() < preface.size()) {
+      if (!read_some()) {
+        return;
+      }
+    }
+    if (in.compare(0, preface.size(), preface) != 0) {
+      throw connection_error("bad connection preface", PROTOCOL_ERROR);
+    }
+    in.erase(0, preface.size());
+
+    bool open = true;
+    while (open) {
+      process();
+      collect();
+      flush_data();
+      if (closing && streams.empty()) {
+        go_away(NO_ERROR);
+        open = false;
+      }
+      write_out();
+      open = open && read_some();
+    }
+  } catch (HTTP2Exception &e) {
+    go_away(static_cast<error_t>(e.err_code));
+    write_out();
+  }
+}
+
+/*
+ * bool read_some()
+ *
+ * waits for the client and appends what it sent to in, or for spawned
+ * handlers to finish. false once the client closed the connection, or
+ * idled past the timeout with no handler running (the client gets a
+ * GOAWAY then).
+ */
+bool Connection::read_some() {
+  char buff[max_frame_size];
+  while (1) {
+    int ret = s.try_read(buff, sizeof(buff));
+    if (ret > 0) {
+      in.append(buff, ret);
+      return true;
+    }
+    if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      return false;
+    }
+    if (collect()) {
+      return true;
+    }
+    struct pollfd p[2] = {{s._socket_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+    const auto timeout = spawned.empty() ? settings.idle_timeout : settings.spawn_grace;
+    if (poll(p, wake_fd >= 0 ? 2 : 1, static_cast<int>(timeout.count())) == 0) {
+      if (spawned.empty()) {
+        go_away(NO_ERROR);
+        write_out();
+        return false;
+      }
+      if (run_stalled()) {
+        return true;
+      }
+    }
+  }
+}
+
+void Connection::process() {
+  size_t off = 0;
+  while (in.size() - off >= frame_header_size) {
+    const uint8_t *h = reinterpret_cast<const uint8_t *>(in.data()) + off;
+    const size_t len = (size_t(h[0]) << 16) | (size_t(h[1]) << 8) | h[2];
+    if (len > max_frame_size) {
+      throw connection_error("frame of " + std::to_string(len) + " bytes", FRAME_SIZE_ERROR);
+    }
+    if (in.size() - off < frame_header_size + len) {
+      break;
+    }
+    off += frame_header_size + len;
+    try {
+      on_frame(h[3], h[4], get32(h + 5) & 0x7fffffff, h + frame_header_size, len);
+    } catch (HTTP2Exception &e) {
+      if (e.stream_id == 0) {
+        throw;
+      }
+      reset(e.stream_id, static_cast<error_t>(e.err_code));
+    }
+  }
+  in.erase(0, off);
+}
+
+void Connection::on_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+  if (continuation != 0 && (type != CONTINUATION || id != continuation)) {
+    throw connection_error("header block interrupted", PROTOCOL_ERROR);
+  }
+  switch (type) {
+    case DATA:
+      on_data(flags, id, p, len);
+      break;
+    case HEADERS:
+      on_headers(flags, id, p, len);
+      break;
+    case PRIORITY:
+      // streams are answered in turn, priorities aren't kept
+      if (id == 0) {
+        throw connection_error("PRIORITY on stream 0", PROTOCOL_ERROR);
+      }
+      if (len != 5) {
+        throw stream_error(id, "PRIORITY of " + std::to_string(len) + " bytes", FRAME_SIZE_ERROR);
+      }
+      break;
+    case RST_STREAM:
+      if (id == 0 || id > last_stream) {
+        throw connection_error("RST_STREAM on an idle stream", PROTOCOL_ERROR);
+      }
+      if (len != 4) {
+        throw connection_error("RST_STREAM of " + std::to_string(len) + " bytes", FRAME_SIZE_ERROR);
+      }
+      streams.erase(id);
+      break;
+    case SETTINGS:
+      if (id != 0) {
+        throw connection_error("SETTINGS on a stream", PROTOCOL_ERROR);
+      }
+      on_settings(flags, p, len);
+      break;
+    case PUSH_PROMISE:
+      throw connection_error("PUSH_PROMISE from a client", PROTOCOL_ERROR);
+    case PING:
+      if (id != 0) {
+        throw connection_error("PING on a stream", PROTOCOL_ERROR);
+      }
+      if (len != 8) {
+        throw connection_error("PING of " + std::to_string(len) + " bytes", FRAME_SIZE_ERROR);
+      }
+      if (!(flags & ACK)) {
+        frame(PING, ACK, 0, reinterpret_cast<const char *>(p), len);
+      }
+      break;
+    case GOAWAY:
+      if (id != 0) {
+        throw connection_error("GOAWAY on a stream", PROTOCOL_ERROR);
+      }
+      closing = true;
+      break;
+    case WINDOW_UPDATE:
+      on_window_update(id, p, len);
+      break;
+    case CONTINUATION: {
+      if (continuation == 0) {
+        throw connection_error("CONTINUATION without HEADERS", PROTOCOL_ERROR);
+      }
+      Stream &st = *streams.at(id);
+      st.block.append(reinterpret_cast<const char *>(p), len);
+      if (st.block.size() > 2 * settings.max_header_list_size) {
+        throw connection_error("header block too large", ENHANCE_YOUR_CALM);
+      }
+      if (flags & END_HEADERS) {
+        continuation = 0;
+        end_headers(st);
+      }
+      break;
+    }
+    default:
+      // unknown frame types are ignored
+      break;
+  }
+}
+
+void Connection::on_headers(uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+  if (id == 0 || id % 2 == 0) {
+    throw connection_error("HEADERS on stream " + std::to_string(id), PROTOCOL_ERROR);
+  }
+  size_t off = 0;
+  size_t pad = 0;
+  if (flags & PADDED) {
+    pad = len > 0 ? p[0] : len + 1;
+    off = 1;
+  }
+  if (flags & PRIORITY_INFO) {
+    off += 5;
+  }
+  if (off + pad > len) {
+    throw connection_error("HEADERS padding past the frame", PROTOCOL_ERROR);
+  }
+
+  Stream *st;
+  auto it = streams.find(id);
+  if (it != streams.end()) {
+    // trailers, decoded for the table's sake and dropped
+    if (it->second->remote_closed || !(flags & END_STREAM)) {
+      throw connection_error("HEADERS on a closed stream", STREAM_CLOSED);
+    }
+    st = it->second.get();
+  } else {
+    if (id <= last_stream) {
+      throw connection_error("HEADERS on a closed stream", STREAM_CLOSED);
+    }
+    last_stream = id;
+    st = streams.emplace(id, std::make_unique<Stream>(id, peer_initial_window,
+                                                      settings.initial_window_size))
+             .first->second.get();
+    // past a GOAWAY of ours the client was told this stream won't be processed
+    st->refused = gone_away || streams.size() > settings.max_concurrent_streams;
+  }
+
+  st->block.append(reinterpret_cast<const char *>(p) + off, len - off - pad);
+  if (flags & END_STREAM) {
+    st->remote_closed = true;
+  }
+  if (flags & END_HEADERS) {
+    end_headers(*st);
+  } else {
+    continuation = id;
+  }
+}
+
+void Connection::end_headers(Stream &st) {
+  HPACK::header_list headers =
+      decoder.decode(reinterpret_cast<const uint8_t *>(st.block.data()), st.block.size(),
+                     settings.max_header_list_size);
+  st.block = std::string();
+  if (st.refused) {
+    reset(st.id, REFUSED_STREAM);
+    return;
+  }
+  if (!st.headers_done) {
+    st.headers = std::move(headers);
+    st.headers_done = true;
+  }
+  if (st.remote_closed) {
+    dispatch(st);
+  }
+}
+
+void Connection::on_data(uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+  if (id == 0) {
+    throw connection_error("DATA on stream 0", PROTOCOL_ERROR);
+  }
+  // the whole frame counts against the windows, padding too
+  recv_window -= len;
+  if (recv_window < 0) {
+    throw connection_error("DATA past the connection window", FLOW_CONTROL_ERROR);
+  }
+  if (recv_window < settings.connection_window_size / 2) {
+    std::string inc;
+    put32(inc, static_cast<uint32_t>(settings.connection_window_size - recv_window));
+    frame(WINDOW_UPDATE, 0, 0, inc.data(), inc.size());
+    recv_window = settings.connection_window_size;
+  }
+
+  size_t off = 0;
+  size_t pad = 0;
+  if (flags & PADDED) {
+    pad = len > 0 ? p[0] : len + 1;
+    off = 1;
+  }
+  if (off + pad > len) {
+    throw connection_error("DATA padding past the frame", PROTOCOL_ERROR);
+  }
+  auto it = streams.find(id);
+  if (it == streams.end()) {
+    if (id > last_stream) {
+      throw connection_error("DATA on an idle stream", PROTOCOL_ERROR);
+    }
+    throw stream_error(id, "DATA on a closed stream", STREAM_CLOSED);
+  }
+  Stream &st = *it->second;
+  if (st.remote_closed) {
+    throw stream_error(id, "DATA after END_STREAM", STREAM_CLOSED);
+  }
+  st.recv_window -= len;
+  if (st.recv_window < 0) {
+    throw stream_error(id, "DATA past the stream window", FLOW_CONTROL_ERROR);
+  }
+  st.body.append(reinterpret_cast<const char *>(p) + off, len - off - pad);
+  if (flags & END_STREAM) {
+    st.remote_closed = true;
+    dispatch(st);
+    return;
+  }
+  if (st.recv_window < settings.initial_window_size / 2) {
+    std::string inc;
+    put32(inc, static_cast<uint32_t>(settings.initial_window_size - st.recv_window));
+    frame(WINDOW_UPDATE, 0, id, inc.data(), inc.size());
+    st.recv_window = settings.initial_window_size;
+  }
+}
+
+void Connection::on_settings(uint8_t flags, const uint8_t *p, size_t len) {
+  if (flags & ACK) {
+    if (len != 0) {
+      throw connection_error("SETTINGS ack with a payload", FRAME_SIZE_ERROR);
+    }
+    return;
+  }
+  if (len % 6 != 0) {
+    throw connection_error("SETTINGS of " + std::to_string(len) + " bytes", FRAME_SIZE_ERROR);
+  }
+  for (size_t i = 0; i < len; i += 6) {
+    const uint16_t setting = static_cast<uint16_t>((p[i] << 8) | p[i + 1]);
+    const uint32_t value = get32(p + i + 2);
+    switch (setting) {
+      case HEADER_TABLE_SIZE:
+        encoder.set_max_table_size(value);
+        break;
+      case ENABLE_PUSH:
+        if (value > 1) {
+          throw connection_error("SETTINGS_ENABLE_PUSH of " + std::to_string(value), PROTOCOL_ERROR);
+        }
+        break;
+      case INITIAL_WINDOW_SIZE: {
+        if (value > max_window) {
+          throw connection_error("SETTINGS_INITIAL_WINDOW_SIZE too large", FLOW_CONTROL_ERROR);
+        }
+        // open streams' windows move by the difference
+        const int64_t delta = static_cast<int64_t>(value) - peer_initial_window;
+        peer_initial_window = value;
+        for (auto &[sid, st] : streams) {
+          st->send_window += delta;
+          if (st->send_window > max_window) {
+            throw connection_error("stream window past 2^31-1", FLOW_CONTROL_ERROR);
+          }
+          schedule(*st);
+        }
+        break;
+      }
+      case MAX_FRAME_SIZE:
+        if (value < 16384 || value > 16777215) {
+          throw connection_error("SETTINGS_MAX_FRAME_SIZE of " + std::to_string(value),
+                                 PROTOCOL_ERROR);
+        }
+        peer_max_frame = value;
+        break;
+      default:
+        // MAX_CONCURRENT_STREAMS and MAX_HEADER_LIST_SIZE don't bind a server that never pushes
+        break;
+    }
+  }
+  frame(SETTINGS, ACK, 0, nullptr, 0);
+}
+
+void Connection::on_window_update(uint32_t id, const uint8_t *p, size_t len) {
+  if (len != 4) {
+    throw connection_error("WINDOW_UPDATE of " + std::to_string(len) + " bytes", FRAME_SIZE_ERROR);
+  }
+  const uint32_t inc = get32(p) & 0x7fffffff;
+  if (id == 0) {
+    if (inc == 0) {
+      throw connection_error("WINDOW_UPDATE of 0", PROTOCOL_ERROR);
+    }
+    send_window += inc;
+    if (send_window > max_window) {
+      throw connection_error("connection window past 2^31-1", FLOW_CONTROL_ERROR);
+    }
+    return;
+  }
+  if (inc == 0) {
+    throw stream_error(id, "WINDOW_UPDATE of 0", PROTOCOL_ERROR);
+  }
+  auto it = streams.find(id);
+  if (it == streams.end()) {
+    // the stream may have just ended on our side
+    return;
+  }
+  Stream &st = *it->second;
+  st.send_window += inc;
+  if (st.send_window > max_window) {
+    throw stream_error(id, "stream window past 2^31-1", FLOW_CONTROL_ERROR);
+  }
+  schedule(st);
+}
+
+/*
+ * void dispatch(Stream &)
+ *
+ * the request is complete: it's checked against HTTP/2's rules, turned
+ * into an HTTPConn and handled, here or through spawn, and complete
+ * queues the response.
+ */
+void Connection::dispatch(Stream &st) {
+  std::string method;
+  std::string path;
+  std::string scheme;
+  std::string authority;
+  std::map<std::string, std::string> fields;
+  bool regular = false;
+  for (const auto &[name, value] : st.headers) {
+    if (name.empty() || std::any_of(name.begin(), name.end(), [](char ch) { return std::isupper(ch); })) {
+      throw stream_error(st.id, "bad header name " + name, PROTOCOL_ERROR);
+    }
+    if (value.find_first_of(std::string("\r\n\0", 3)) != std::string::npos) {
+      throw stream_error(st.id, "bad value for " + name, PROTOCOL_ERROR);
+    }
+    if (name[0] == ':') {
+      std::string *pseudo = name == ":method"      ? &method
+                            : name == ":path"      ? &path
+                            : name == ":scheme"    ? &scheme
+                            : name == ":authority" ? &authority
+                                                   : nullptr;
+      if (regular || pseudo == nullptr || !pseudo->empty()) {
+        throw stream_error(st.id, "bad pseudo header " + name, PROTOCOL_ERROR);
+      }
+      *pseudo = value;
+      continue;
+    }
+    regular = true;
+    if (connection_specific(name) || (name == "te" && value != "trailers")) {
+      throw stream_error(st.id, "connection specific header " + name, PROTOCOL_ERROR);
+    }
+    // repeated fields are joined, cookies split up for compression too
+    auto [it, added] = fields.emplace(canonical(name), value);
+    if (!added) {
+      it->second += (name == "cookie" ? "; " : ", ") + value;
+    }
+  }
+  if (method.empty() || path.empty() || scheme.empty()) {
+    throw stream_error(st.id, "missing pseudo headers", PROTOCOL_ERROR);
+  }
+  auto length = fields.find("Content-Length");
+  if (length != fields.end() && length->second != std::to_string(st.body.size())) {
+    throw stream_error(st.id, "body doesn't match Content-Length", PROTOCOL_ERROR);
+  }
+
+  // the request as HTTP/1.1 would have sent it, so it parses the same way
+  std::stringstream req;
+  req << method << " " << path << " HTTP/2\r\n";
+  if (!authority.empty()) {
+    fields.emplace("Host", authority);
+  }
+  for (const auto &[name, value] : fields) {
+    req << name << ": " << value << "\r\n";
+  }
+  req << "\r\n" << st.body;
+  st.body = std::string();
+
+  auto job = std::make_shared<Spawned>(st.id);
+  HTTPConn &c = job->c;
+  c.remote_ip = remote_ip;
+  // the stream opening stands in for the handshake, so read runs from HEADERS to END_STREAM.
+  // the server decides whether the request is sampled, the marks are cheap enough to take
+  c.timing.at[RequestTiming::HANDSHAKEN] = RequestTiming::ns(st.opened);
+  c.timing.at[RequestTiming::READ] = RequestTiming::ns(std::chrono::steady_clock::now());
+  try {
+    c.parse(req);
+  } catch (ParseException &ex) {
+    c.resp_status = ex.err_code;
+    c.send();
+  }
+  c.timing.at[RequestTiming::PARSED] = RequestTiming::ns(std::chrono::steady_clock::now());
+  c.http_protocol = scheme;
+  c.sock = &job->capture;
+  if (!spawn || wake_fd < 0) {
+    run_handler(*job);
+    complete(*job);
+    return;
+  }
+
+  job->spawned = std::chrono::steady_clock::now();
+  spawned.push_back(job);
+  spawn(c, [this, job] {
+    if (job->claimed.exchange(true, std::memory_order_acq_rel)) {
+      // the connection ran it itself, or is gone
+      return;
+    }
+    run_handler(*job);
+    // the wakeup is written under the lock, the connection closes wake_fd under it too
+    std::lock_guard<std::mutex> l(finished_m);
+    finished.push_back(job);
+    uint64_t one = 1;
+    ssize_t ret = write(wake_fd, &one, sizeof(one));
+    (void)ret;
+  });
+}
+
+void Connection::run_handler(Spawned &job) {
+  try {
+    handle(job.c);
+  } catch (SocketException &) {
+    job.failed = true;
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Unhandled exception serving a stream : %s\n", e.what());
+    job.failed = true;
+  }
+}
+
+/*
+ * void complete(Spawned &)
+ *
+ * queues the response of a handler that returned. the stream is gone
+ * afterwards unless it still has body to send, and a stream the client
+ * reset while its handler ran is left alone.
+ */
+void Connection::complete(Spawned &job) {
+  auto it = streams.find(job.id);
+  if (it == streams.end()) {
+    return;
+  }
+  Stream &st = *it->second;
+  if (job.failed) {
+    reset(st.id, INTERNAL_ERROR);
+    return;
+  }
+
+  HTTPConn &c = job.c;
+  std::string raw;
+  if (c.is_streaming()) {
+    raw = std::move(job.capture.data);
+  } else if (!c.is_set() && !c.resp_file.empty()) {
+    // the file is read as the windows open, not all at once
+    int fd = open(c.resp_file.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat stat_buf;
+    if (fd >= 0 && fstat(fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode)) {
+      c.resp_headers["Content-Length"] = std::to_string(stat_buf.st_size);
+      raw = c.head();
+      if (c.method.compare("HEAD")) {
+        st.fd = fd;
+        st.file_left = stat_buf.st_size;
+        fd = -1;
+      }
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  if (raw.empty()) {
+    raw = c.get_response();
+  }
+  respond(st, raw);
+}
+
+/*
+ * bool collect()
+ *
+ * completes the spawned handlers that finished, true if there were any.
+ */
+bool Connection::collect() {
+  if (spawned.empty()) {
+    return false;
+  }
+  std::vector<std::shared_ptr<Spawned>> done;
+  {
+    std::lock_guard<std::mutex> l(finished_m);
+    uint64_t n;
+    ssize_t ret = read(wake_fd, &n, sizeof(n));
+    (void)ret;
+    done.swap(finished);
+  }
+  for (const auto &job : done) {
+    spawned.erase(std::find(spawned.begin(), spawned.end(), job));
+    complete(*job);
+  }
+  return !done.empty();
+}
+
+/*
+ * bool run_stalled()
+ *
+ * takes back the spawned handlers that haven't started within
+ * spawn_grace and runs them here, true if there were any.
+ */
+bool Connection::run_stalled() {
+  const auto now = std::chrono::steady_clock::now();
+  bool ran = false;
+  for (size_t i = 0; i < spawned.size();) {
+    std::shared_ptr<Spawned> job = spawned[i];
+    if (now - job->spawned < settings.spawn_grace ||
+        job->claimed.exchange(true, std::memory_order_acq_rel)) {
+      ++i;
+      continue;
+    }
+    spawned.erase(spawned.begin() + i);
+    run_handler(*job);
+    complete(*job);
+    ran = true;
+  }
+  return ran;
+}
+
+void Connection::respond(Stream &st, const std::string &raw) {
+  int status;
+  HPACK::header_list headers;
+  headers.emplace_back(":status", "");
+  split_response(raw, status, headers, st.data);
+  headers[0].second = std::to_string(status);
+
+  const std::string block = encoder.encode(headers);
+  size_t off = 0;
+  do {
+    const size_t n = std::min(block.size() - off, peer_max_frame);
+    uint8_t flags = off + n == block.size() ? END_HEADERS : 0;
+    if (off == 0 && st.left() == 0) {
+      flags |= END_STREAM;
+    }
+    frame(off == 0 ? HEADERS : CONTINUATION, flags, st.id, block.data() + off, n);
+    off += n;
+  } while (off < block.size());
+
+  if (st.left() == 0) {
+    streams.erase(st.id);
+  } else {
+    schedule(st);
+  }
+}
+
+void Connection::schedule(Stream &st) {
+  if (!st.queued && st.headers_done && st.remote_closed && st.left() > 0 && st.send_window > 0) {
+    st.queued = true;
+    sending.push_back(st.id);
+  }
+}
+
+/*
+ * void flush_data()
+ *
+ * sends DATA frames while the connection window lasts, one for each
+ * queued stream in turn. a stream whose own window runs out waits for
+ * its WINDOW_UPDATE.
+ */
+void Connection::flush_data() {
+  while (send_window > 0 && !sending.empty()) {
+    const uint32_t id = sending.front();
+    sending.pop_front();
+    auto it = streams.find(id);
+    if (it == streams.end()) {
+      continue;
+    }
+    Stream &st = *it->second;
+    st.queued = false;
+    if (st.send_window <= 0) {
+      continue;
+    }
+    const size_t left = st.left();
+    const size_t n = std::min({left, peer_max_frame, static_cast<size_t>(send_window),
+                               static_cast<size_t>(st.send_window)});
+    const size_t frame_start = out.size();
+    frame(DATA, n == left ? END_STREAM : 0, id, nullptr, 0);
+    // the length is patched in once the payload is there
+    out[frame_start] = static_cast<char>(n >> 16);
+    out[frame_start + 1] = static_cast<char>(n >> 8);
+    out[frame_start + 2] = static_cast<char>(n);
+
+    const size_t from_data = std::min(n, st.data.size() - st.data_off);
+    out.append(st.data, st.data_off, from_data);
+    st.data_off += from_data;
+    size_t from_file = n - from_data;
+    while (from_file > 0) {
+      const size_t at = out.size();
+      out.resize(at + from_file);
+      ssize_t ret = pread(st.fd, out.data() + at, from_file, st.file_off);
+      if (ret <= 0) {
+        if (ret < 0 && errno == EINTR) {
+          out.resize(at);
+          continue;
+        }
+        // the headers are out, all that's left is to end the stream
+        out.resize(frame_start);
+        reset(id, INTERNAL_ERROR);
+        break;
+      }
+      out.resize(at + ret);
+      st.file_off += ret;
+      st.file_left -= ret;
+      from_file -= ret;
+    }
+    if (from_file > 0) {
+      continue;
+    }
+
+    send_window -= n;
+    st.send_window -= n;
+    if (n == left) {
+      streams.erase(it);
+    } else {
+      schedule(st);
+    }
+    if (out.size() >= write_batch) {
+      write_out();
+    }
+  }
+}
+
+void Connection::frame(uint8_t type, uint8_t flags, uint32_t id, const char *payload, size_t len) {
+  out.push_back(static_cast<char>(len >> 16));
+  out.push_back(static_cast<char>(len >> 8));
+  out.push_back(static_cast<char>(len));
+  out.push_back(static_cast<char>(type));
+  out.push_back(static_cast<char>(flags));
+  put32(out, id);
+  if (len > 0) {
+    out.append(payload, len);
+  }
+}
+
+void Connection::reset(uint32_t id, error_t code) {
+  std::string payload;
+  put32(payload, code);
+  frame(RST_STREAM, 0, id, payload.data(), payload.size());
+  streams.erase(id);
+}
+
+void Connection::go_away(error_t code) {
+  if (!gone_away) {
+    gone_away = true;
+    goaway_stream = last_stream;
+  }
+  std::string payload;
+  put32(payload, goaway_stream);
+  put32(payload, code);
+  frame(GOAWAY, 0, 0, payload.data(), payload.size());
+}
+
+void Connection::write_out() {
+  if (!out.empty()) {
+    s.write(out);
+    out.clear();
+  }
+}
+
+}  // namespace Kleptic::HTTP2
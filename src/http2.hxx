@@ -0,0 +1,192 @@
+#ifndef KLEPTIC_HTTP2_HXX_
+#define KLEPTIC_HTTP2_HXX_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "hpack.hxx"
+#include "socket.hxx"
+#include "unique_function.hxx"
+
+namespace Kleptic {
+
+struct HTTPConn;
+
+namespace HTTP2 {
+
+enum frame_t : uint8_t {
+  DATA = 0x0,
+  HEADERS = 0x1,
+  PRIORITY = 0x2,
+  RST_STREAM = 0x3,
+  SETTINGS = 0x4,
+  PUSH_PROMISE = 0x5,
+  PING = 0x6,
+  GOAWAY = 0x7,
+  WINDOW_UPDATE = 0x8,
+  CONTINUATION = 0x9,
+};
+
+enum error_t : uint32_t {
+  NO_ERROR = 0x0,
+  PROTOCOL_ERROR = 0x1,
+  INTERNAL_ERROR = 0x2,
+  FLOW_CONTROL_ERROR = 0x3,
+  SETTINGS_TIMEOUT = 0x4,
+  STREAM_CLOSED = 0x5,
+  FRAME_SIZE_ERROR = 0x6,
+  REFUSED_STREAM = 0x7,
+  CANCEL = 0x8,
+  COMPRESSION_ERROR = 0x9,
+  CONNECT_ERROR = 0xa,
+  ENHANCE_YOUR_CALM = 0xb,
+  INADEQUATE_SECURITY = 0xc,
+  HTTP_1_1_REQUIRED = 0xd,
+};
+
+/* what a client sends before its first frame */
+extern const std::string preface;
+
+struct Settings {
+  /* streams a client may have open at once, more are refused */
+  uint32_t max_concurrent_streams = 100;
+  /* how much request body a stream may send ahead of the handler */
+  uint32_t initial_window_size = 256 * 1024;
+  /* the same for all streams together */
+  uint32_t connection_window_size = 1024 * 1024;
+  /* largest decoded request header list, a larger one ends the connection */
+  uint32_t max_header_list_size = 64 * 1024;
+  /* no frame from the client for this long and the connection is closed */
+  std::chrono::milliseconds idle_timeout{60000};
+  /*
+   * a handler spawned elsewhere that hasn't started after this long is
+   * run on the connection's thread, so connections holding every worker
+   * of a pool can't all wait on handlers queued behind them
+   */
+  std::chrono::milliseconds spawn_grace{200};
+};
+
+/*
+ * bool negotiated(Socket &)
+ *
+ * true if the client on s speaks HTTP/2: ALPN picked h2, or the socket
+ * negotiated nothing and the client opened with the connection preface
+ * (h2c with prior knowledge). the preface is only peeked at, a client
+ * that sent part of it gets until timeout to send the rest.
+ */
+bool negotiated(Socket &s, std::chrono::milliseconds timeout = std::chrono::milliseconds(5000));
+
+/*
+ * Connection
+ *
+ * serves one HTTP/2 connection on the calling thread. every stream
+ * becomes an HTTPConn, parsed the way an HTTP/1.1 request would be, and
+ * goes to the handler once its request is complete. without a spawner
+ * handlers run one at a time on this thread, with one each handler is
+ * handed to the spawner (e.g. a runner, in the request's class) and its
+ * response picked up when it finishes. the responses are interleaved:
+ * each stream with data to send gets a frame in turn, as far as the
+ * client's flow control windows allow, while the client keeps opening
+ * new streams. what a handler streams through HTTPConn::sock is
+ * collected and sent when it returns, resp_file is read as the window
+ * opens.
+ */
+class Connection {
+ public:
+  typedef std::function<void(HTTPConn &)> handler_t;
+  /* runs run somewhere else, c is the parsed request it will handle */
+  typedef std::function<void(const HTTPConn &c, unique_function<void()> run)> spawner_t;
+
+ private:
+  struct Stream;
+  struct Spawned;
+
+  Socket &s;
+  const std::string remote_ip;
+  const handler_t handle;
+  const spawner_t spawn;
+  const Settings settings;
+
+  HPACK::Decoder decoder;
+  HPACK::Encoder encoder;
+  std::map<uint32_t, std::unique_ptr<Stream>> streams;
+  /* streams with response data the windows allow, a frame each in turn */
+  std::deque<uint32_t> sending;
+
+  std::string in;
+  std::string out;
+  /* highest stream the client opened, and the one whose header block is open */
+  uint32_t last_stream = 0;
+  uint32_t continuation = 0;
+
+  int64_t send_window = 65535;
+  int64_t recv_window = 65535;
+  /* the client's settings */
+  int64_t peer_initial_window = 65535;
+  size_t peer_max_frame = 16384;
+  /* no new streams, close once the open ones are answered */
+  bool closing = false;
+  /* we sent GOAWAY naming goaway_stream, streams the client opens after it are refused */
+  bool gone_away = false;
+  uint32_t goaway_stream = 0;
+
+  /* handlers handed to spawn that haven't been collected */
+  std::vector<std::shared_ptr<Spawned>> spawned;
+  /* the ones that finished, and an eventfd to wake this thread for them */
+  std::mutex finished_m;
+  std::vector<std::shared_ptr<Spawned>> finished;
+  int wake_fd = -1;
+
+  bool read_some();
+  void process();
+  void on_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+  void on_headers(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+  void on_data(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+  void on_settings(uint8_t flags, const uint8_t *p, size_t len);
+  void on_window_update(uint32_t id, const uint8_t *p, size_t len);
+  void end_headers(Stream &st);
+  void dispatch(Stream &st);
+  void run_handler(Spawned &job);
+  void complete(Spawned &job);
+  bool collect();
+  bool run_stalled();
+  void respond(Stream &st, const std::string &raw);
+  void schedule(Stream &st);
+  void flush_data();
+
+  void frame(uint8_t type, uint8_t flags, uint32_t id, const char *payload, size_t len);
+  void reset(uint32_t id, error_t code);
+  void go_away(error_t code);
+  void write_out();
+
+ public:
+  Connection(Socket &s, std::string remote_ip, handler_t handle,
+             const Settings &settings = Settings(), spawner_t spawn = nullptr);
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+  /* waits for spawned handlers that already started, the rest are dropped */
+  ~Connection();
+
+  /*
+   * void serve()
+   *
+   * reads the preface and serves streams until the client closes, goes
+   * away or idles past the timeout. protocol errors end the connection
+   * with a GOAWAY, errors in one stream reset only that stream.
+   * throws SocketException if the socket fails.
+   */
+  void serve();
+};
+
+}  // namespace HTTP2
+}  // namespace Kleptic
+
+#endif  // KLEPTIC_HTTP2_HXX_
@@ -0,0 +1,309 @@
+#include "log_ring.hxx"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace Kleptic::IPC {
+
+namespace {
+
+// a record's header word: flags, the lap it was claimed in, type in bits 32-47, payload length
+// below. the producer's pid follows it. SKIPPED marks words of a gap the consumer gave up on,
+// with the lap of the gap
+constexpr uint64_t COMMITTED = 1ULL << 63;
+constexpr uint64_t PADDING = 1ULL << 62;
+constexpr uint64_t CLAIMED = 1ULL << 61;
+constexpr uint64_t WRITING = 1ULL << 60;
+constexpr uint64_t SKIPPED = 1ULL << 59;
+constexpr int LAP_SHIFT = 48;
+constexpr uint64_t LAP_MASK = 0x7ffULL;
+constexpr uint64_t LENGTH_MASK = 0xffffffffULL;
+constexpr size_t RECORD_HEADER = 2 * sizeof(uint64_t);
+
+/* header words plus the payload, keeping the next header word aligned */
+uint64_t record_size(uint64_t len) { return RECORD_HEADER + ((len + 7) & ~7ULL); }
+
+/* getpid is a syscall, producers read this instead */
+pid_t self_pid = getpid();
+void refresh_pid() { self_pid = getpid(); }
+[[maybe_unused]] const int pid_refresh = pthread_atfork(nullptr, nullptr, refresh_pid);
+
+struct timespec to_timespec(std::chrono::steady_clock::duration d) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+  if (ns < 0) {
+    ns = 0;
+  }
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  return ts;
+}
+
+}  // namespace
+
+LogRing::LogRing(size_t capacity) : capacity(64) {
+  while (this->capacity < capacity) {
+    this->capacity <<= 1;
+  }
+  const size_t header = (sizeof(Shared) + KLEPTIC_CACHE_LINE - 1) / KLEPTIC_CACHE_LINE *
+                        KLEPTIC_CACHE_LINE;
+  map_size = header + this->capacity;
+
+  // mapped before the logger and the workers fork, they all share the same pages
+  int fd = memfd_create("kleptic-log-ring", MFD_CLOEXEC);
+  if (fd < 0) {
+    perror("memfd_create");
+    exit(1);
+  }
+  if (ftruncate(fd, static_cast<off_t>(map_size)) < 0) {
+    perror("ftruncate: log ring");
+    exit(1);
+  }
+  void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap: log ring");
+    exit(1);
+  }
+  shared = new (p) Shared();
+  // a fresh memfd reads as zeroes, no record is claimed yet
+  data = static_cast<unsigned char *>(p) + header;
+}
+
+LogRing::~LogRing() { munmap(shared, map_size); }
+
+std::atomic_ref<uint64_t> LogRing::word(uint64_t pos) const {
+  return std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t *>(data + (pos & (capacity - 1))));
+}
+
+uint64_t LogRing::lap(uint64_t pos) const { return ((pos / capacity) & LAP_MASK) << LAP_SHIFT; }
+
+/*
+ * bool vacant(uint64_t pos, uint64_t w)
+ *
+ * w, read at pos, is no record's header: never written since the space
+ * was released, or a SKIPPED mark left from an earlier lap.
+ */
+bool LogRing::vacant(uint64_t pos, uint64_t w) const {
+  const uint64_t mark_lap = w & (LAP_MASK << LAP_SHIFT);
+  return w == 0 || (w == (SKIPPED | mark_lap) && mark_lap != lap(pos));
+}
+
+/*
+ * bool take(uint64_t pos, uint64_t header)
+ *
+ * puts a header at pos, reserved by the caller. false if the consumer
+ * already skipped the space, the caller took too long to get here.
+ */
+bool LogRing::take(uint64_t pos, uint64_t header) {
+  uint64_t w = word(pos).load(std::memory_order_acquire);
+  while (vacant(pos, w)) {
+    if (word(pos).compare_exchange_weak(w, header, std::memory_order_release,
+                                        std::memory_order_acquire)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * uint64_t skip(uint64_t pos)
+ *
+ * marks SKIPPED every word from pos on that is still vacant, up to the
+ * first header or the reserve position, and returns where it stopped.
+ * that's where the next record starts: a producer only writes past its
+ * header once the header is in, and a producer late to a marked word
+ * finds it taken and drops its record. the marks stay until the space
+ * is used again, zeroing them would let that producer in.
+ */
+uint64_t LogRing::skip(uint64_t pos) {
+  const uint64_t end = shared->reserve.load(std::memory_order_acquire);
+  for (; pos < end; pos += sizeof(uint64_t)) {
+    uint64_t w = word(pos).load(std::memory_order_acquire);
+    bool marked = false;
+    while (!marked && vacant(pos, w)) {
+      marked = word(pos).compare_exchange_weak(w, SKIPPED | lap(pos), std::memory_order_acq_rel,
+                                               std::memory_order_acquire);
+    }
+    if (!marked) {
+      break;
+    }
+  }
+  return pos;
+}
+
+/*
+ * void release(uint64_t pos, uint64_t len)
+ *
+ * zeroes a consumed record and hands its space back. a later header word
+ * may land anywhere in it, so none of the old bytes may look claimed.
+ */
+void LogRing::release(uint64_t pos, uint64_t len) {
+  memset(data + (pos & (capacity - 1)), 0, len);
+  shared->head.store(pos + len, std::memory_order_release);
+  shared->not_full.notify_all();
+}
+
+bool LogRing::push(uint16_t type, std::string_view record) {
+  Claim c = claim(type, record.size());
+  return c && commit(c, record);
+}
+
+LogRing::Claim LogRing::claim(uint16_t type, size_t len) {
+  if (len > capacity / 4) {
+    shared->dropped.fetch_add(1, std::memory_order_relaxed);
+    return Claim();
+  }
+  const uint64_t need = record_size(len);
+  const auto deadline = std::chrono::steady_clock::now() + full_timeout;
+
+  uint64_t pos = shared->reserve.load(std::memory_order_relaxed);
+  uint64_t pad;
+  while (true) {
+    // records never wrap, one that doesn't fit before the end starts over at 0
+    const uint64_t off = pos & (capacity - 1);
+    pad = (off + need > capacity) ? capacity - off : 0;
+    if (pos + pad + need - shared->head.load(std::memory_order_acquire) > capacity) {
+      auto key = shared->not_full.prepare_wait();
+      if (pos + pad + need - shared->head.load(std::memory_order_acquire) <= capacity) {
+        shared->not_full.cancel_wait();
+        continue;
+      }
+      auto left = deadline - std::chrono::steady_clock::now();
+      if (left <= std::chrono::steady_clock::duration::zero()) {
+        shared->not_full.cancel_wait();
+        shared->dropped.fetch_add(1, std::memory_order_relaxed);
+        return Claim();
+      }
+      shared->not_full.wait_for(key, to_timespec(left));
+      pos = shared->reserve.load(std::memory_order_relaxed);
+      continue;
+    }
+    if (shared->reserve.compare_exchange_weak(pos, pos + pad + need,
+                                              std::memory_order_relaxed)) {
+      break;
+    }
+  }
+
+  // the consumer skips our space, and counts it dropped, if we die or stall before the headers
+  if (pad > 0) {
+    if (!take(pos, COMMITTED | PADDING)) {
+      return Claim();
+    }
+    pos += pad;
+  }
+  Claim c;
+  c.pos = pos;
+  c.len = len;
+  c.header = lap(pos) | (static_cast<uint64_t>(type) << 32) | len;
+  if (!take(pos, CLAIMED | c.header)) {
+    return Claim();
+  }
+  // read by the consumer once the header says WRITING, commit's CAS publishes it
+  word(pos + sizeof(uint64_t)).store(static_cast<uint64_t>(self_pid), std::memory_order_relaxed);
+  return c;
+}
+
+bool LogRing::commit(const Claim &c, std::string_view record) {
+  // fails if the consumer gave up on the claim, the space may be someone else's by now
+  uint64_t claimed = CLAIMED | c.header;
+  if (!word(c.pos).compare_exchange_strong(claimed, WRITING | c.header,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_relaxed)) {
+    return false;
+  }
+  memcpy(data + (c.pos & (capacity - 1)) + RECORD_HEADER, record.data(),
+         std::min(record.size(), c.len));
+  word(c.pos).store(COMMITTED | c.header, std::memory_order_release);
+  shared->not_empty.notify_one();
+  return true;
+}
+
+bool LogRing::pop(uint16_t &type, std::string &record, std::chrono::milliseconds timeout) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    const uint64_t pos = shared->head.load(std::memory_order_relaxed);
+    const uint64_t w = word(pos).load(std::memory_order_acquire);
+    if (w & COMMITTED) {
+      stalled_at = UINT64_MAX;
+      if (w & PADDING) {
+        release(pos, capacity - (pos & (capacity - 1)));
+        continue;
+      }
+      const uint64_t len = w & LENGTH_MASK;
+      type = static_cast<uint16_t>(w >> 32);
+      record.assign(reinterpret_cast<const char *>(data + (pos & (capacity - 1))) + RECORD_HEADER,
+                    len);
+      release(pos, record_size(len));
+      return true;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    // space reserved with no header in it yet, the producer may have died right after the CAS
+    const bool headerless =
+        vacant(pos, w) && shared->reserve.load(std::memory_order_acquire) > pos;
+    const bool stalled = headerless || (w & (CLAIMED | WRITING));
+    if (stalled) {
+      // a producer is about to copy its record in, is doing it, or died on the way
+      if (stalled_at != pos) {
+        stalled_at = pos;
+        stalled_since = now;
+      } else if (now - stalled_since >= stall_timeout) {
+        if (headerless) {
+          const uint64_t next = skip(pos);
+          if (next != pos) {
+            stalled_at = UINT64_MAX;
+            shared->dropped.fetch_add(1, std::memory_order_relaxed);
+            shared->head.store(next, std::memory_order_release);
+            shared->not_full.notify_all();
+          }
+          continue;
+        }
+        uint64_t seen = w;
+        bool abandon;
+        if (w & CLAIMED) {
+          // a late producer finds the header changed and drops its record
+          abandon = word(pos).compare_exchange_strong(seen, 0, std::memory_order_acquire,
+                                                      std::memory_order_relaxed);
+        } else {
+          // copying, the space is only safe to hand back once the producer is gone
+          const pid_t pid = static_cast<pid_t>(word(pos + sizeof(uint64_t)).load());
+          abandon = kill(pid, 0) < 0 && errno == ESRCH;
+          stalled_since = now;
+        }
+        if (abandon) {
+          stalled_at = UINT64_MAX;
+          shared->dropped.fetch_add(1, std::memory_order_relaxed);
+          release(pos, record_size(w & LENGTH_MASK));
+        }
+        continue;
+      }
+    }
+
+    auto key = shared->not_empty.prepare_wait();
+    if (word(pos).load(std::memory_order_acquire) & COMMITTED) {
+      shared->not_empty.cancel_wait();
+      continue;
+    }
+    auto left = deadline - now;
+    if (left <= std::chrono::steady_clock::duration::zero()) {
+      shared->not_empty.cancel_wait();
+      return false;
+    }
+    if (stalled) {
+      left = std::min<std::chrono::steady_clock::duration>(left, stall_timeout);
+    }
+    shared->not_empty.wait_for(key, to_timespec(left));
+  }
+}
+
+}  // namespace Kleptic::IPC
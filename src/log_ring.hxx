@@ -0,0 +1,119 @@
+#ifndef KLEPTIC_LOG_RING_HXX_
+#define KLEPTIC_LOG_RING_HXX_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "eventcount.hxx"
+#include "wsdeque.hxx"
+
+namespace Kleptic::IPC {
+
+/*
+ * LogRing
+ *
+ * multi producer / single consumer ring of variable length records in
+ * shared memory, how forked children hand log records and events to the
+ * logger process. it's mapped before anything forks, every process
+ * after inherits the same pages.
+ *
+ * a producer claims its bytes with a CAS on the reserve position, copies
+ * the record in and commits it by setting a bit in the record's header
+ * word. the consumer takes committed records in order and zeroes them
+ * before handing the space back. wakeups go through process shared
+ * EventCounts, so neither side makes a syscall unless the other sleeps.
+ *
+ * a claim that isn't written for stall_timeout is abandoned: the consumer
+ * clears the header with a CAS and moves on. the header carries the lap
+ * of the ring it was claimed in, so a late producer's CAS from claimed to
+ * writing fails, on that record or on a newer one in the same place, and
+ * it drops its record without touching the space. a producer already
+ * copying is only given up on once its process is gone. space that was
+ * reserved but got no header for stall_timeout, a producer dying right
+ * after its CAS, is skipped up to the next header the same way.
+ */
+class LogRing {
+  struct Shared {
+    alignas(KLEPTIC_CACHE_LINE) std::atomic<uint64_t> reserve{0};
+    alignas(KLEPTIC_CACHE_LINE) std::atomic<uint64_t> head{0};
+    alignas(KLEPTIC_CACHE_LINE) EventCount not_empty{true};
+    EventCount not_full{true};
+    std::atomic<uint64_t> dropped{0};
+  };
+
+  Shared *shared;
+  unsigned char *data;
+  size_t capacity;
+  size_t map_size;
+
+  /* consumer side, where a record started without being committed */
+  uint64_t stalled_at = UINT64_MAX;
+  std::chrono::steady_clock::time_point stalled_since;
+
+  std::atomic_ref<uint64_t> word(uint64_t pos) const;
+  /* pos's lap of the ring, shifted into place in a header */
+  uint64_t lap(uint64_t pos) const;
+  bool vacant(uint64_t pos, uint64_t w) const;
+  bool take(uint64_t pos, uint64_t header);
+  uint64_t skip(uint64_t pos);
+  void release(uint64_t pos, uint64_t len);
+
+ public:
+  /* a record claimed and not written yet, see claim */
+  struct Claim {
+    uint64_t pos = UINT64_MAX;
+    uint64_t header = 0;
+    size_t len = 0;
+
+    explicit operator bool() const { return pos != UINT64_MAX; }
+  };
+
+  /* a full ring makes producers wait this long, then the record is dropped */
+  static constexpr std::chrono::milliseconds full_timeout{100};
+  /* a record claimed but not written for this long is abandoned */
+  static constexpr std::chrono::milliseconds stall_timeout{1000};
+
+  /* capacity is rounded up to a power of two */
+  explicit LogRing(size_t capacity = 1 << 20);
+  LogRing(const LogRing &) = delete;
+  LogRing &operator=(const LogRing &) = delete;
+  ~LogRing();
+
+  /*
+   * bool push(uint16_t type, std::string_view record)
+   *
+   * from any process or thread. false if the record was dropped, it's
+   * larger than a quarter of the ring or the ring stayed full.
+   */
+  bool push(uint16_t type, std::string_view record);
+
+  /*
+   * Claim claim(uint16_t type, size_t len)
+   * bool commit(const Claim &, std::string_view record)
+   *
+   * push in its two steps. claim takes the space, empty under the same
+   * conditions push returns false. commit copies record in, len bytes
+   * of it, and false means the claim sat too long and was abandoned.
+   */
+  Claim claim(uint16_t type, size_t len);
+  bool commit(const Claim &c, std::string_view record);
+
+  /*
+   * bool pop(uint16_t &type, std::string &record, std::chrono::milliseconds timeout)
+   *
+   * from the one consumer. waits up to timeout for the next record,
+   * false if none came.
+   */
+  bool pop(uint16_t &type, std::string &record, std::chrono::milliseconds timeout);
+
+  /* records producers gave up on, and ones abandoned or skipped after a producer died */
+  uint64_t dropped() const { return shared->dropped.load(std::memory_order_relaxed); }
+};
+
+}  // namespace Kleptic::IPC
+
+#endif  // KLEPTIC_LOG_RING_HXX_
@@ -0,0 +1,282 @@
+#include "log_writer.hxx"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+
+namespace Kleptic {
+
+namespace {
+
+// bumped by SIGHUP, every writer reopens once it sees a new value
+std::atomic<uint32_t> reopen_requests{0};
+
+extern "C" void on_sighup(int) { reopen_requests.fetch_add(1, std::memory_order_relaxed); }
+
+std::atomic<uint64_t> next_writer_id{1};
+
+}  // namespace
+
+/*
+ * Buffer
+ *
+ * one thread's ring of pending bytes. the thread moves tail, the writer
+ * moves head once the bytes before it are on disk.
+ */
+struct LogWriter::Buffer {
+  const size_t size;
+  std::unique_ptr<char[]> data;
+  alignas(KLEPTIC_CACHE_LINE) std::atomic<uint64_t> tail{0};
+  alignas(KLEPTIC_CACHE_LINE) std::atomic<uint64_t> head{0};
+
+  explicit Buffer(size_t size) : size(size), data(new char[size]) {}
+};
+
+LogWriter::LogWriter(std::string path, const LogWriterOptions &opts)
+    : path(std::move(path)),
+      opts(opts),
+      id(next_writer_id.fetch_add(1, std::memory_order_relaxed)),
+      owner(getpid()),
+      max_bytes(opts.max_bytes),
+      max_age_s(opts.max_age.count()),
+      keep(opts.keep),
+      reopens_seen(reopen_requests.load(std::memory_order_relaxed)) {
+  open_file();
+  thread = std::make_unique<std::thread>([this] { run(); });
+}
+
+LogWriter::~LogWriter() {
+  if (getpid() != owner) {
+    // the thread and the other threads' lines stayed with the parent
+    (void)thread.release();
+  } else {
+    stopping.store(true, std::memory_order_relaxed);
+    wake.notify_all();
+    thread->join();
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/*
+ * Buffer &local()
+ *
+ * the calling thread's buffer for this writer, registered the first
+ * time it logs. the thread keeps a reference, once it exits and the
+ * buffer is drained the writer lets go of it too.
+ */
+LogWriter::Buffer &LogWriter::local() {
+  thread_local std::vector<std::pair<uint64_t, std::shared_ptr<Buffer>>> mine;
+  for (auto &[writer, buffer] : mine) {
+    if (writer == id) {
+      return *buffer;
+    }
+  }
+  auto buffer = std::make_shared<Buffer>(opts.buffer_size);
+  {
+    std::lock_guard<std::mutex> l(buffers_mut);
+    buffers.push_back(buffer);
+  }
+  mine.emplace_back(id, buffer);
+  return *buffer;
+}
+
+bool LogWriter::append(std::string_view line) { return put(line, true); }
+
+bool LogWriter::write(std::string_view bytes) { return put(bytes, false); }
+
+bool LogWriter::put(std::string_view bytes, bool newline) {
+  Buffer &b = local();
+  const uint64_t tail = b.tail.load(std::memory_order_relaxed);
+  const uint64_t head = b.head.load(std::memory_order_acquire);
+  const size_t need = bytes.size() + (newline ? 1 : 0);
+  if (need > b.size - (tail - head)) {
+    dropped_lines.fetch_add(1, std::memory_order_relaxed);
+    wake.notify_one();
+    return false;
+  }
+
+  const size_t off = tail % b.size;
+  const size_t first = std::min(bytes.size(), b.size - off);
+  memcpy(b.data.get() + off, bytes.data(), first);
+  memcpy(b.data.get(), bytes.data() + first, bytes.size() - first);
+  if (newline) {
+    b.data[(tail + bytes.size()) % b.size] = '\n';
+  }
+  b.tail.store(tail + need, std::memory_order_release);
+
+  if (tail + need - head >= opts.flush_bytes) {
+    wake.notify_one();
+  }
+  return true;
+}
+
+void LogWriter::set_rotation(size_t max_bytes, std::chrono::seconds max_age, int keep) {
+  this->max_bytes.store(max_bytes, std::memory_order_relaxed);
+  this->max_age_s.store(max_age.count(), std::memory_order_relaxed);
+  this->keep.store(keep, std::memory_order_relaxed);
+}
+
+void LogWriter::reopen_on_sighup() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sighup;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGHUP, &sa, nullptr)) {
+    perror("sigaction: SIGHUP");
+  }
+}
+
+void LogWriter::run() {
+  const auto interval = std::chrono::duration_cast<std::chrono::nanoseconds>(opts.flush_interval);
+  struct timespec ts;
+  ts.tv_sec = interval.count() / 1000000000;
+  ts.tv_nsec = interval.count() % 1000000000;
+  while (!stopping.load(std::memory_order_relaxed)) {
+    auto key = wake.prepare_wait();
+    if (stopping.load(std::memory_order_relaxed)) {
+      wake.cancel_wait();
+      break;
+    }
+    wake.wait_for(key, ts);
+    flush_once();
+  }
+  flush_once();
+}
+
+/*
+ * void flush_once()
+ *
+ * writes everything the buffers hold, at most IOV_MAX pieces per writev.
+ * a buffer that wrapped gives two. rotation and reopening happen between
+ * batches, never in the middle of a line.
+ */
+void LogWriter::flush_once() {
+  const uint32_t reopens = reopen_requests.load(std::memory_order_relaxed);
+  if (reopens != reopens_seen) {
+    reopens_seen = reopens;
+    open_file();
+  }
+  const int64_t age = max_age_s.load(std::memory_order_relaxed);
+  if (age > 0 && file_bytes > 0 &&
+      std::chrono::steady_clock::now() - opened_at >= std::chrono::seconds(age)) {
+    rotate();
+  }
+
+  std::vector<struct iovec> iov;
+  std::vector<std::pair<Buffer *, uint64_t>> done;
+  while (true) {
+    iov.clear();
+    done.clear();
+    {
+      std::lock_guard<std::mutex> l(buffers_mut);
+      for (auto it = buffers.begin(); it != buffers.end();) {
+        Buffer &b = **it;
+        const uint64_t head = b.head.load(std::memory_order_relaxed);
+        const uint64_t tail = b.tail.load(std::memory_order_acquire);
+        if (head == tail) {
+          // empty, and nobody left to fill it
+          it = (it->use_count() == 1) ? buffers.erase(it) : it + 1;
+          continue;
+        }
+        if (iov.size() + 2 > IOV_MAX) {
+          break;
+        }
+        const size_t off = head % b.size;
+        const size_t len = tail - head;
+        const size_t first = std::min(len, b.size - off);
+        iov.push_back({b.data.get() + off, first});
+        if (len > first) {
+          iov.push_back({b.data.get(), len - first});
+        }
+        done.emplace_back(&b, tail);
+        ++it;
+      }
+    }
+    if (iov.empty()) {
+      return;
+    }
+
+    size_t bytes = 0;
+    struct iovec *v = iov.data();
+    int n = static_cast<int>(iov.size());
+    while (n > 0 && fd >= 0) {
+      ssize_t ret = writev(fd, v, n);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret < 0) {
+        perror("writev: log");
+        break;
+      }
+      bytes += ret;
+      // a short write, resume where it stopped
+      while (n > 0 && static_cast<size_t>(ret) >= v->iov_len) {
+        ret -= v->iov_len;
+        ++v;
+        --n;
+      }
+      if (n > 0) {
+        v->iov_base = static_cast<char *>(v->iov_base) + ret;
+        v->iov_len -= ret;
+      }
+    }
+    for (auto &[b, tail] : done) {
+      b->head.store(tail, std::memory_order_release);
+    }
+
+    file_bytes += bytes;
+    const size_t limit = max_bytes.load(std::memory_order_relaxed);
+    if (limit > 0 && file_bytes >= limit) {
+      rotate();
+    }
+  }
+}
+
+void LogWriter::open_file() {
+  int nfd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (nfd < 0) {
+    perror(("open: " + path).c_str());
+    return;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  fd = nfd;
+  struct stat st;
+  file_bytes = (fstat(fd, &st) == 0) ? st.st_size : 0;
+  opened_at = std::chrono::steady_clock::now();
+}
+
+/*
+ * void rotate()
+ *
+ * path.N-1 becomes path.N and so on down to path becoming path.1, the
+ * oldest falls off. then a fresh path is opened.
+ */
+void LogWriter::rotate() {
+  const int n = keep.load(std::memory_order_relaxed);
+  if (n <= 0) {
+    unlink(path.c_str());
+  } else {
+    for (int i = n - 1; i >= 1; --i) {
+      rename((path + "." + std::to_string(i)).c_str(), (path + "." + std::to_string(i + 1)).c_str());
+    }
+    rename(path.c_str(), (path + ".1").c_str());
+  }
+  open_file();
+}
+
+}  // namespace Kleptic
@@ -0,0 +1,118 @@
+#ifndef KLEPTIC_LOG_WRITER_HXX_
+#define KLEPTIC_LOG_WRITER_HXX_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "eventcount.hxx"
+#include "wsdeque.hxx"
+
+namespace Kleptic {
+
+struct LogWriterOptions {
+  /* each logging thread's buffer, lines that don't fit are dropped */
+  size_t buffer_size = 256 * 1024;
+  /* a buffer holding this much wakes the writer early */
+  size_t flush_bytes = 64 * 1024;
+  /* the writer's longest sleep, lines wait about this long for the disk */
+  std::chrono::milliseconds flush_interval{5};
+  /* rotate once the file reaches max_bytes or turns max_age old, 0 for never */
+  size_t max_bytes = 0;
+  std::chrono::seconds max_age{0};
+  /* rotated files kept as path.1 (newest) to path.keep */
+  int keep = 5;
+};
+
+/*
+ * LogWriter
+ *
+ * appends lines to a log file from a background thread. every thread
+ * logging gets its own single producer ring, append only copies the line
+ * in and never blocks or makes a syscall unless the ring is getting
+ * full. the writer wakes every flush_interval, or sooner once a ring
+ * holds flush_bytes, and writes what all of them hold with one writev.
+ * lines of one thread stay in order, lines of different threads are
+ * ordered only from one batch to the next.
+ *
+ * belongs to the process that created it: a forked child has no writer
+ * thread, and destroying the copy there neither flushes nor joins.
+ */
+class LogWriter {
+  struct Buffer;
+
+  const std::string path;
+  const LogWriterOptions opts;
+  const uint64_t id;
+  const pid_t owner;
+
+  std::atomic<size_t> max_bytes;
+  std::atomic<int64_t> max_age_s;
+  std::atomic<int> keep;
+
+  std::mutex buffers_mut;
+  std::vector<std::shared_ptr<Buffer>> buffers;
+
+  EventCount wake;
+  std::atomic<bool> stopping{false};
+  std::atomic<uint64_t> dropped_lines{0};
+  std::unique_ptr<std::thread> thread;
+
+  /* writer thread only */
+  int fd = -1;
+  size_t file_bytes = 0;
+  std::chrono::steady_clock::time_point opened_at;
+  uint32_t reopens_seen;
+
+  Buffer &local();
+  bool put(std::string_view bytes, bool newline);
+  void run();
+  void flush_once();
+  void open_file();
+  void rotate();
+
+ public:
+  explicit LogWriter(std::string path, const LogWriterOptions &opts = LogWriterOptions());
+  LogWriter(const LogWriter &) = delete;
+  LogWriter &operator=(const LogWriter &) = delete;
+  /* writes what's left and stops the thread */
+  ~LogWriter();
+
+  /*
+   * bool append(std::string_view line)
+   *
+   * queues line and a newline, false if the calling thread's buffer had
+   * no room and the line was dropped.
+   */
+  bool append(std::string_view line);
+
+  /* the same for bytes that carry their own framing, like encoded LogEvents */
+  bool write(std::string_view bytes);
+
+  /* lines dropped for a full buffer */
+  uint64_t dropped() const { return dropped_lines.load(std::memory_order_relaxed); }
+
+  /* changes the rotation limits, takes effect with the next batch */
+  void set_rotation(size_t max_bytes, std::chrono::seconds max_age, int keep);
+
+  /*
+   * static void reopen_on_sighup()
+   *
+   * installs a SIGHUP handler that makes every writer in the process
+   * close and reopen its file with its next batch, for logrotate.
+   */
+  static void reopen_on_sighup();
+};
+
+}  // namespace Kleptic
+
+#endif  // KLEPTIC_LOG_WRITER_HXX_
@@ -3,10 +3,11 @@
 #include <unistd.h>
 
 #include <chrono>
+#include <cstring>
 #include <iostream>
-#include <regex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 
@@ -45,26 +46,11 @@ void LogEvent::end() {
 
 bool LogEvent::is_complete() { return completed; }
 
-auto LogEvent::get_start_time() {
-  if (deserialized) {
-    std::time_t secsSinceEpoch = static_cast<int64_t>(num_data["EVT_START"]);
-    return std::chrono::system_clock::from_time_t(secsSinceEpoch);
-  }
-  return start_t;
-}
+auto LogEvent::get_start_time() { return start_t; }
 
-auto LogEvent::get_end_time() {
-  if (deserialized) {
-    std::time_t secsSinceEpoch = static_cast<int64_t>(num_data["EVT_END"]);
-    return std::chrono::system_clock::from_time_t(secsSinceEpoch);
-  }
-  return end_t;
-}
+auto LogEvent::get_end_time() { return end_t; }
 
 int64_t LogEvent::get_duration() {
-  if (deserialized) {
-    return static_cast<int64_t>(num_data["EVT_DUR"]);
-  }
   auto dur = std::chrono::system_clock::now() - get_start_time();
   if (completed) {
     dur = get_end_time() - get_start_time();
@@ -96,42 +82,248 @@ std::stringstream LogEvent::serialize() {
   for (const auto &[key, val] : str_data) {
     ss << key << "=\"" << val << "\"" << std::endl;
   }
+  // whole ns counts print in full
+  ss.precision(15);
   for (const auto &[key, val] : num_data) {
     ss << key << "=" << val << std::endl;
   }
   return ss;
 }
 
-// Deserializing constructor
-
-LogEvent::LogEvent(std::stringstream ss) : completed(true), deserialized(true) {
-  std::regex str_data_re("^\\s*(\\S+)\\s*=\\s*\"(.*)\"\\s*$");
-  std::regex num_data_re("^\\s*(\\S+)\\s*=\\s*([+-]?(?:[0-9]*[.])?[0-9]+)\\s*$");
-  if (!getline(ss, ev_name)) {
-    throw ParseException("Logger Event has no data");
-  }
-  std::string line;
-  std::smatch match_pair;
-  while (getline(ss, line)) {
-    if (std::regex_search(line, match_pair, str_data_re)) {
-      auto key = match_pair[1];
-      auto val = match_pair[2];
-      str_data[key] = val;
-    } else if (std::regex_search(line, match_pair, num_data_re)) {
-      auto key = match_pair[1];
-      auto val = match_pair[2];
-      num_data[key] = std::stod(val);
+namespace {
+
+void put_varint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+void put_svarint(std::string &out, int64_t v) {
+  put_varint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+void put_bytes(std::string &out, std::string_view s) {
+  put_varint(out, s.size());
+  out.append(s);
+}
+
+/* bounds checked reads over one encoded event */
+struct Reader {
+  const char *p;
+  const char *end;
+
+  void need(size_t n) const {
+    if (static_cast<size_t>(end - p) < n) {
+      throw ParseException("Log event is truncated");
+    }
+  }
+
+  uint64_t varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      need(1);
+      const auto b = static_cast<uint8_t>(*p++);
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) {
+        return v;
+      }
+    }
+    throw ParseException("Log event has an overlong varint");
+  }
+
+  int64_t svarint() {
+    const uint64_t v = varint();
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+  }
+
+  std::string_view bytes() {
+    const uint64_t n = varint();
+    need(n);
+    std::string_view s(p, n);
+    p += n;
+    return s;
+  }
+
+  uint8_t byte() {
+    need(1);
+    return static_cast<uint8_t>(*p++);
+  }
+};
+
+enum field_t : uint8_t { FIELD_INT = 0, FIELD_DOUBLE = 1 };
+constexpr uint8_t FLAG_COMPLETED = 1;
+
+/*
+ * walks a map alongside the decoded keys, both in key order: entries
+ * the event no longer has are erased, ones it still has keep their node
+ * and get the new value assigned.
+ */
+template <typename M, typename F>
+void merge_fields(M &m, Reader &r, F read_value) {
+  const uint64_t n = r.varint();
+  auto it = m.begin();
+  std::string_view prev;
+  for (uint64_t i = 0; i < n; ++i) {
+    std::string_view key = r.bytes();
+    if (i > 0 && key <= prev) {
+      throw ParseException("Log event fields are out of order");
+    }
+    prev = key;
+    while (it != m.end() && std::string_view(it->first) < key) {
+      it = m.erase(it);
+    }
+    if (it == m.end() || std::string_view(it->first) != key) {
+      it = m.emplace_hint(it, std::string(key), typename M::mapped_type());
+    }
+    read_value(r, it->second);
+    ++it;
+  }
+  m.erase(it, m.end());
+}
+
+}  // namespace
+
+void LogEvent::encode(std::string &out) const {
+  thread_local std::string body;
+  body.clear();
+  put_bytes(body, ev_name);
+  const int64_t start_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(start_t.time_since_epoch()).count();
+  const int64_t end_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end_t.time_since_epoch()).count();
+  put_svarint(body, start_ns);
+  put_svarint(body, end_ns - start_ns);
+  body.push_back(static_cast<char>(completed ? FLAG_COMPLETED : 0));
+
+  put_varint(body, str_data.size());
+  for (const auto &[key, val] : str_data) {
+    put_bytes(body, key);
+    put_bytes(body, val);
+  }
+  put_varint(body, num_data.size());
+  for (const auto &[key, val] : num_data) {
+    put_bytes(body, key);
+    // status codes, counts and sizes are whole, most numbers fit a byte or two
+    if (val >= -9.2e18 && val <= 9.2e18 && val == static_cast<double>(static_cast<int64_t>(val))) {
+      body.push_back(static_cast<char>(FIELD_INT));
+      put_svarint(body, static_cast<int64_t>(val));
     } else {
-      // throw ParseException("Invalid key value format for logger event");
+      body.push_back(static_cast<char>(FIELD_DOUBLE));
+      uint64_t bits;
+      memcpy(&bits, &val, sizeof(bits));
+      for (int i = 0; i < 8; ++i) {
+        body.push_back(static_cast<char>(bits >> (8 * i)));
+      }
     }
   }
+
+  out.push_back(static_cast<char>(encoding_version));
+  put_varint(out, body.size());
+  out += body;
+}
+
+std::string LogEvent::encode() const {
+  std::string out;
+  encode(out);
+  return out;
 }
 
-Logger::Logger(std::string p) : _origin_pid(getpid()), logfile(p) {
+size_t LogEvent::decode(std::string_view data) {
+  Reader r{data.data(), data.data() + data.size()};
+  const uint8_t version = r.byte();
+  if (version != encoding_version) {
+    throw ParseException("Unknown log event encoding version " + std::to_string(version));
+  }
+  const uint64_t len = r.varint();
+  r.need(len);
+  r.end = r.p + len;
+  const size_t consumed = r.end - data.data();
+
+  ev_name.assign(r.bytes());
+  const int64_t start_ns = r.svarint();
+  const int64_t dur_ns = r.svarint();
+  start_t = std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::nanoseconds(start_ns)));
+  end_t = start_t + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                        std::chrono::nanoseconds(dur_ns));
+  completed = (r.byte() & FLAG_COMPLETED) != 0;
+
+  merge_fields(str_data, r, [](Reader &r, std::string &val) { val.assign(r.bytes()); });
+  merge_fields(num_data, r, [](Reader &r, double &val) {
+    const uint8_t type = r.byte();
+    if (type == FIELD_INT) {
+      val = static_cast<double>(r.svarint());
+    } else if (type == FIELD_DOUBLE) {
+      r.need(8);
+      uint64_t bits = 0;
+      for (int i = 0; i < 8; ++i) {
+        bits |= static_cast<uint64_t>(static_cast<uint8_t>(r.p[i])) << (8 * i);
+      }
+      r.p += 8;
+      memcpy(&val, &bits, sizeof(val));
+    } else {
+      throw ParseException("Unknown log event field type " + std::to_string(type));
+    }
+  });
+  return consumed;
+}
+
+Logger::Logger(std::string p, const LogWriterOptions &opts)
+    : _origin_pid(getpid()), logfile(p), writer_opts(opts) {
   if (p.empty()) {
     return;
   }
-  log_fd = open(p.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+  writer = std::make_unique<LogWriter>(logfile, writer_opts);
+}
+
+void Logger::set_event_log(const std::string &path) {
+  event_log_path = path;
+  event_log = std::make_unique<LogWriter>(event_log_path, writer_opts);
+}
+
+void Logger::event_started(LogEvent &ev) {
+  if (getpid() != _origin_pid) {
+    thread_local std::string buf;
+    buf.clear();
+    ev.encode(buf);
+    broadcast_ipc(EVT_START, buf);
+    return;
+  }
+  for (const auto &listener : event_start_listeners) {
+    listener(ev);
+  }
+}
+
+void Logger::event_ended(LogEvent &ev) {
+  const bool origin = getpid() == _origin_pid;
+  if (!origin || event_log) {
+    thread_local std::string buf;
+    buf.clear();
+    ev.encode(buf);
+    if (!origin) {
+      broadcast_ipc(EVT_END, buf);
+      return;
+    }
+    event_log->write(buf);
+  }
+  for (const auto &listener : event_end_listeners) {
+    listener(ev);
+  }
+}
+
+void Logger::set_rotation(size_t max_bytes, std::chrono::seconds max_age, int keep) {
+  writer_opts.max_bytes = max_bytes;
+  writer_opts.max_age = max_age;
+  writer_opts.keep = keep;
+  if (writer) {
+    writer->set_rotation(max_bytes, max_age, keep);
+  }
+  if (event_log) {
+    event_log->set_rotation(max_bytes, max_age, keep);
+  }
 }
 
 void Logger::on_ev_start(log_event_listener listener) {
@@ -154,6 +346,7 @@ std::string Logger::get_str_data(std::string key) {
     IPC::close_queue(c_id);
     return resp_body;
   }
+  std::lock_guard<std::mutex> l(str_data_mut);
   return str_data[key];
 }
 
@@ -169,28 +362,59 @@ double Logger::get_num_data(std::string key) {
     IPC::close_queue(c_id);
     return std::stod(resp_body);
   }
+  if (key == "LOG_LINES_DROPPED") {
+    return writer ? static_cast<double>(writer->dropped()) : 0;
+  }
+  std::lock_guard<std::mutex> l(num_data_mut);
   return num_data[key];
 }
 
 void Logger::start_mp() {
   ipc_id = IPC::get_queue(logfile, LOGGER_ID);
+  ring = std::make_unique<IPC::LogRing>();
+
+  // the logger process takes the files over, ours are flushed and closed first so that
+  // only it writes, rotates and reopens them
+  const bool files = writer != nullptr;
+  const bool events = event_log != nullptr;
+  writer.reset();
+  event_log.reset();
 
   pid_t pid = fork();
-  if (pid < 0) {
-    perror("Logger Fork");
+  if (pid == 0) {
+    _origin_pid = getpid();
+  } else if (pid > 0) {
+    _origin_pid = pid;
     return;
+  } else {
+    perror("Logger Fork");
   }
-  if (pid > 0) {
-    _origin_pid = pid;
+
+  if (files) {
+    writer = std::make_unique<LogWriter>(logfile, writer_opts);
+  }
+  if (events) {
+    event_log = std::make_unique<LogWriter>(event_log_path, writer_opts);
+  }
+  if (pid < 0) {
+    ring.reset();
     return;
   }
-  _origin_pid = getpid();
   // child process stuff
 
-  // potentially multithread this
+  // queries block their client until answered, they get their own thread
+  std::thread([this] {
+    while (true) {
+      handle_ipc(IPC::recv_ipc(ipc_id));
+    }
+  }).detach();
+
+  uint16_t msg_type;
+  std::string msg;
   while (true) {
-    auto client_req = IPC::recv_ipc(ipc_id);
-    handle_ipc(client_req);
+    if (ring->pop(msg_type, msg, std::chrono::milliseconds(1000))) {
+      handle_record(msg_type, msg);
+    }
   }
 }
 
@@ -202,20 +426,10 @@ void Logger::handle_ipc(std::tuple<int, int64_t, std::string> client_req) {
   // std::cout << req_body << std::endl;
   switch (msg_type) {
     case RECORD:
-      record(req_body);
+    case EVT_START:
+    case EVT_END:
+      handle_record(msg_type, req_body);
       break;
-    case EVT_START: {
-      auto ev = LogEvent(std::stringstream(req_body));
-      for (const auto &listener : event_start_listeners) {
-        listener(ev);
-      }
-    } break;
-    case EVT_END: {
-      auto ev = LogEvent(std::stringstream(req_body));
-      for (const auto &listener : event_end_listeners) {
-        listener(ev);
-      }
-    } break;
     case GET_STR: {
       auto val = get_str_data(req_body);
       IPC::send_ipc(ipc_id, client_id, GET_STR, val);
@@ -227,12 +441,36 @@ void Logger::handle_ipc(std::tuple<int, int64_t, std::string> client_req) {
   }
 }
 
-void Logger::broadcast_ipc(int64_t msg_type, std::string s) {
-  int c_id = IPC::create_client();
-  IPC::send_ipc(c_id, ipc_id, msg_type, s);
-  IPC::close_queue(c_id);
+void Logger::handle_record(int64_t msg_type, std::string_view body) {
+  if (msg_type == RECORD) {
+    if (writer) {
+      writer->append(body);
+    }
+    return;
+  }
+  try {
+    ipc_event.decode(body);
+  } catch (ParseException &ex) {
+    std::cerr << "Dropping log event : " << ex.what() << std::endl;
+    return;
+  }
+  const auto &listeners = (msg_type == EVT_START) ? event_start_listeners : event_end_listeners;
+  if (msg_type == EVT_END && event_log) {
+    event_log->write(body);
+  }
+  for (const auto &listener : listeners) {
+    listener(ipc_event);
+  }
 }
 
+void Logger::broadcast_ipc(int64_t msg_type, std::string_view s) {
+  if (ring) {
+    ring->push(static_cast<uint16_t>(msg_type), s);
+  }
+}
+
+LogWriter *Logger::local_writer() { return getpid() == _origin_pid ? writer.get() : nullptr; }
+
 void Logger::record(std::string s) {
   // std::cout << "we're here" << std::endl;
   if (getpid() != _origin_pid) {
@@ -240,18 +478,8 @@ void Logger::record(std::string s) {
     return;
   }
 
-  s += "\n";
-  if (log_fd) {
-    std::lock_guard<std::mutex> l(file_mut);
-    // I don't know if I need this
-    // i'm wondering if cross process locks should take care of this
-    // lockf(log_fd, F_LOCK, 0);
-    // fseek(log_fd, 0, SEEK_END); // I don't think this is necessary
-    // Children and parent file descriptors point to same location
-    // and cross thread support should be built in ... in theory
-
-    write(log_fd, s.c_str(), s.size());
-    // lockf(log_fd, F_ULOCK, 0);
+  if (writer) {
+    writer->append(s);
   }
 }
 
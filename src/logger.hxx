@@ -6,6 +6,7 @@
 #include <unistd.h>
 
 #include <chrono>
+#include <cstdint>
 #include <fstream>
 #include <functional>
 #include <map>
@@ -13,10 +14,13 @@
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <utility>
 #include <vector>
 
+#include "log_ring.hxx"
+#include "log_writer.hxx"
 #include "sysv_ipc.hxx"
 
 #define LOGGER_ID 'N'
@@ -26,18 +30,17 @@ namespace Kleptic {
 class LogEvent {
  protected:
   bool completed = false;
-  const bool deserialized = false;
   std::chrono::time_point<std::chrono::system_clock> start_t;
   std::chrono::time_point<std::chrono::system_clock> end_t;
   std::vector<std::function<void(LogEvent &)>> on_complete_listeners;
   std::vector<std::function<void(LogEvent &)>> on_start_listeners;
 
  public:
-  std::map<std::string, std::string> str_data;
-  std::map<std::string, double> num_data;
+  // transparent, decode looks keys up without building a string
+  std::map<std::string, std::string, std::less<>> str_data;
+  std::map<std::string, double, std::less<>> num_data;
   std::string ev_name = "GENERIC_EVENT";
   LogEvent() = default;
-  explicit LogEvent(std::stringstream ss);
 
   void on_start(std::function<void(LogEvent &)> listener);
   void on_complete(std::function<void(LogEvent &)> listener);
@@ -50,15 +53,10 @@ class LogEvent {
   auto get_start_time();
   auto get_end_time();
 
-  operator std::string() const {
-    if (deserialized) {
-      return str_data.find("EVT_STRING")->second;
-    } else {
-      return "GENERIC_EVENT_STR";
-    }
-  }
+  operator std::string() const { return "GENERIC_EVENT_STR"; }
   inline std::string get_name() const { return ev_name; }
 
+  /* text for people to read, there's no parsing it back */
   std::stringstream serialize();
   // HOW DOES EVENT SERIALIZATION WORK
   //
@@ -67,6 +65,34 @@ class LogEvent {
   // EVT_END=INT
   // OTHER_EVT_DATA ( number / str )
   // EVT_STRING="STR"
+
+  /*
+   * void encode(std::string &out) const
+   *
+   * appends the binary form, what goes between processes and into event
+   * logs. events are self delimiting, a log is one after the other:
+   *
+   *   version (1 byte) | body length (varint) | body
+   *   body: name, start (ns since the epoch), end - start (ns), flags,
+   *         string fields, then numeric fields, each in key order
+   *
+   * strings are a varint length and the bytes, numbers are zigzag
+   * varints when they're whole and 8 byte doubles when they aren't.
+   */
+  static constexpr uint8_t encoding_version = 1;
+  void encode(std::string &out) const;
+  std::string encode() const;
+
+  /*
+   * size_t decode(std::string_view data)
+   *
+   * replaces this event with the first one in data and returns how many
+   * bytes it took. the strings and map nodes already there are reused,
+   * decoding events with the same fields over and over doesn't allocate.
+   * listeners are left alone. throws ParseException on a truncated or
+   * malformed event, or a version it doesn't know.
+   */
+  size_t decode(std::string_view data);
 };
 
 typedef std::shared_ptr<LogEvent> log_event_t;
@@ -78,9 +104,18 @@ class Logger {
  protected:
   int ipc_id = 0;
   pid_t _origin_pid;
+  /* records and events from other processes, queries still go over ipc_id */
+  std::unique_ptr<IPC::LogRing> ring;
 
-  int log_fd = 0;
   const std::string logfile;
+  LogWriterOptions writer_opts;
+  /* appends records to logfile in the process that keeps them */
+  std::unique_ptr<LogWriter> writer;
+  /* completed events, encoded, if set_event_log was called */
+  std::string event_log_path;
+  std::unique_ptr<LogWriter> event_log;
+  /* events from other processes are decoded into this one, the ring is drained by one thread */
+  LogEvent ipc_event;
 
   std::vector<log_event_listener> event_start_listeners;
   std::vector<log_event_listener> event_end_listeners;
@@ -91,18 +126,43 @@ class Logger {
   std::mutex str_data_mut;
   std::mutex num_data_mut;
 
-  std::mutex file_mut;
-
   void handle_ipc(std::tuple<int, int64_t, std::string> client_req);
+  /* a record or event from the ring */
+  void handle_record(int64_t msg_type, std::string_view body);
+  void event_started(LogEvent &ev);
+  void event_ended(LogEvent &ev);
 
  public:
-  explicit Logger(std::string p = "");
+  explicit Logger(std::string p = "", const LogWriterOptions &opts = LogWriterOptions());
   ~Logger() = default;
   void on_ev_start(log_event_listener listener);
   void on_ev_end(log_event_listener listener);
 
+  /*
+   * void start_mp()
+   *
+   * forks the logger process. records and events from every other process
+   * reach it through a shared memory ring, get_num_data/get_str_data
+   * through the message queue since they wait for a reply. from then on
+   * only the logger process writes, rotates and reopens the log files,
+   * so set_rotation has to come first.
+   */
   void start_mp();
 
+  /* records the ring couldn't take, 0 before start_mp */
+  uint64_t dropped_records() const { return ring ? ring->dropped() : 0; }
+
+  /* see LogWriterOptions, the same limits apply in the logger process */
+  void set_rotation(size_t max_bytes, std::chrono::seconds max_age, int keep);
+
+  /*
+   * void set_event_log(const std::string &path)
+   *
+   * appends every completed event to path in its binary encoding, see
+   * LogEvent::encode. call it before start_mp.
+   */
+  void set_event_log(const std::string &path);
+
   // TODO CREATE EXCEPTIONS FOR THESE
 
   // can only be done in original process
@@ -126,6 +186,7 @@ class Logger {
     fn(std::ref(str_data));
   }
 
+  // "LOG_LINES_DROPPED" reads the writer's count of lines dropped for a full buffer
   double get_num_data(std::string key);
 
   std::string get_str_data(std::string key);
@@ -134,32 +195,26 @@ class Logger {
   std::shared_ptr<E> create_event(Args &&... args) {
     auto event = std::make_shared<E>(std::forward<Args>(args)...);
 
-    event->on_start([this](LogEvent &ev) {
-      if (getpid() != _origin_pid) {
-        broadcast_ipc(EVT_START, ev.serialize().str());
-        return;
-      }
-      for (const auto &listener : event_start_listeners) {
-        listener(ev);
-      }
-    });
-
-    event->on_complete([this](LogEvent &ev) {
-      if (getpid() != _origin_pid) {
-        broadcast_ipc(EVT_END, ev.serialize().str());
-        return;
-      }
-      for (const auto &listener : event_end_listeners) {
-        listener(ev);
-      }
-    });
+    event->on_start([this](LogEvent &ev) { event_started(ev); });
+    event->on_complete([this](LogEvent &ev) { event_ended(ev); });
 
     return event;
   }
 
-  void broadcast_ipc(int64_t msg_type, std::string);
+  /* to the logger process, dropped if start_mp wasn't called since nothing would read it */
+  void broadcast_ipc(int64_t msg_type, std::string_view s);
 
   void record(std::string s);
+
+  /*
+   * LogWriter *local_writer()
+   *
+   * the writer record appends to when this process keeps the log, for
+   * callers that log from a thread of their own and would rather skip
+   * record's checks. nullptr without a log file, and in any process
+   * whose records go to the logger process instead.
+   */
+  LogWriter *local_writer();
 };
 }  // namespace Kleptic
 
@@ -0,0 +1,464 @@
+#include "metrics.hxx"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Kleptic::Metrics {
+
+namespace {
+
+constexpr uint32_t EMPTY = 0;
+constexpr uint32_t CLAIMING = 1;
+constexpr uint32_t READY = 2;
+
+constexpr size_t max_name = 64;
+constexpr size_t max_labels = 192;
+// a series whose data didn't fit in the arena
+constexpr uint64_t NO_DATA = UINT64_MAX;
+
+// bumped in forked children, their threads pick a shard again
+std::atomic<uint32_t> fork_generation{0};
+std::atomic<uint32_t> threads_seen{0};
+// keys a thread's lookup cache, never reused so a stale entry can't match
+std::atomic<uint64_t> next_registry_id{1};
+
+uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/*
+ * the calling thread's shard. threads of one process take turns, and
+ * the pid keeps forked workers, whose threads would count from the same
+ * number, from all landing on the same shards.
+ */
+size_t shard() {
+  thread_local uint32_t generation = UINT32_MAX;
+  thread_local size_t index;
+  const uint32_t g = fork_generation.load(std::memory_order_relaxed);
+  if (generation != g) {
+    generation = g;
+    const uint64_t seed = (static_cast<uint64_t>(getpid()) << 32) |
+                          threads_seen.fetch_add(1, std::memory_order_relaxed);
+    index = mix(seed) & (num_shards - 1);
+  }
+  return index;
+}
+
+uint64_t hash(std::string_view name, std::string_view labels) {
+  return mix(std::hash<std::string_view>()(name) ^ (std::hash<std::string_view>()(labels) << 1));
+}
+
+/* k1="v1",k2="v2" with the values escaped the way the text format wants */
+void format_labels(std::string &out, labels_t labels) {
+  out.clear();
+  for (const auto &[k, v] : labels) {
+    if (!out.empty()) {
+      out.push_back(',');
+    }
+    out.append(k);
+    out.append("=\"");
+    for (char c : v) {
+      if (c == '\\' || c == '"') {
+        out.push_back('\\');
+        out.push_back(c);
+      } else if (c == '\n') {
+        out.append("\\n");
+      } else {
+        out.push_back(c);
+      }
+    }
+    out.push_back('"');
+  }
+}
+
+size_t data_size(type_t type) {
+  switch (type) {
+    case COUNTER:
+      return sizeof(CounterShard) * num_shards;
+    case HISTOGRAM:
+      return sizeof(HistogramShard) * num_shards;
+    default:
+      return KLEPTIC_CACHE_LINE;
+  }
+}
+
+void append_double(std::string &out, double v) {
+  char buff[32];
+  snprintf(buff, sizeof(buff), "%.9g", v);
+  out.append(buff);
+}
+
+}  // namespace
+
+size_t bucket_of(uint64_t ns) {
+  if (ns < sub_count) {
+    return ns;
+  }
+  int e = 63 - __builtin_clzll(ns);
+  if (e > max_exponent) {
+    return num_buckets - 1;
+  }
+  const uint64_t m = (ns >> (e - sub_bits)) & (sub_count - 1);
+  return (e - sub_bits + 1) * sub_count + m;
+}
+
+uint64_t bucket_limit(size_t i) {
+  if (i < sub_count) {
+    return i + 1;
+  }
+  const int e = static_cast<int>(i / sub_count) + sub_bits - 1;
+  const uint64_t m = i % sub_count;
+  return (sub_count + m + 1) << (e - sub_bits);
+}
+
+void Counter::inc(uint64_t n) const {
+  if (shards != nullptr) {
+    shards[shard()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+}
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  if (shards != nullptr) {
+    for (size_t i = 0; i < num_shards; ++i) {
+      total += shards[i].value.load(std::memory_order_relaxed);
+    }
+  }
+  return total;
+}
+
+void Gauge::set(double v) const {
+  if (bits != nullptr) {
+    uint64_t b;
+    memcpy(&b, &v, sizeof(b));
+    bits->store(b, std::memory_order_relaxed);
+  }
+}
+
+void Gauge::add(double v) const {
+  if (bits == nullptr) {
+    return;
+  }
+  uint64_t old = bits->load(std::memory_order_relaxed);
+  uint64_t next;
+  do {
+    double d;
+    memcpy(&d, &old, sizeof(d));
+    d += v;
+    memcpy(&next, &d, sizeof(next));
+  } while (!bits->compare_exchange_weak(old, next, std::memory_order_relaxed));
+}
+
+double Gauge::value() const {
+  double d = 0;
+  if (bits != nullptr) {
+    uint64_t b = bits->load(std::memory_order_relaxed);
+    memcpy(&d, &b, sizeof(d));
+  }
+  return d;
+}
+
+void Histogram::observe(uint64_t ns) const {
+  if (shards != nullptr) {
+    HistogramShard &s = shards[shard()];
+    s.buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    s.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+  }
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+  HistogramSnapshot out;
+  if (shards == nullptr) {
+    return out;
+  }
+  for (size_t i = 0; i < num_shards; ++i) {
+    out.sum_ns += shards[i].sum_ns.load(std::memory_order_relaxed);
+    for (size_t b = 0; b < num_buckets; ++b) {
+      const uint64_t n = shards[i].buckets[b].load(std::memory_order_relaxed);
+      out.buckets[b] += n;
+      out.count += n;
+    }
+  }
+  return out;
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot &o) {
+  count += o.count;
+  sum_ns += o.sum_ns;
+  for (size_t b = 0; b < num_buckets; ++b) {
+    buckets[b] += o.buckets[b];
+  }
+}
+
+uint64_t HistogramSnapshot::quantile(double q) const {
+  if (count == 0) {
+    return 0;
+  }
+  const auto rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < num_buckets; ++b) {
+    seen += buckets[b];
+    if (seen >= rank) {
+      return bucket_limit(b);
+    }
+  }
+  return bucket_limit(num_buckets - 1);
+}
+
+struct Registry::Header {
+  std::atomic<uint64_t> arena_used{0};
+  std::atomic<uint64_t> dropped{0};
+};
+
+struct Registry::Slot {
+  std::atomic<uint32_t> state;
+  type_t type;
+  uint64_t hash;
+  uint64_t offset;
+  char name[max_name];
+  char labels[max_labels];
+};
+
+Registry::Registry(size_t max_series, size_t arena_size)
+    : id(next_registry_id.fetch_add(1, std::memory_order_relaxed)),
+      capacity(2),
+      arena_size(arena_size) {
+  while (capacity < max_series * 2) {
+    capacity <<= 1;
+  }
+  static std::once_flag atfork;
+  std::call_once(atfork, [] {
+    pthread_atfork(nullptr, nullptr,
+                   [] { fork_generation.fetch_add(1, std::memory_order_relaxed); });
+  });
+
+  const size_t table = sizeof(Header) + capacity * sizeof(Slot);
+  const size_t arena_at = (table + KLEPTIC_CACHE_LINE - 1) / KLEPTIC_CACHE_LINE * KLEPTIC_CACHE_LINE;
+  map_size = arena_at + arena_size;
+  // mapped before the runner forks, every worker counts into the same pages.
+  // only the pages series actually touch get memory
+  void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap: metrics");
+    exit(1);
+  }
+  header = new (p) Header();
+  slots = reinterpret_cast<Slot *>(static_cast<char *>(p) + sizeof(Header));
+  arena = static_cast<unsigned char *>(p) + arena_at;
+}
+
+Registry::~Registry() { munmap(header, map_size); }
+
+void *Registry::data(const Slot &s) const {
+  return s.offset == NO_DATA ? nullptr : arena + s.offset;
+}
+
+/*
+ * Slot *find(type_t, std::string_view, labels_t)
+ *
+ * every thread remembers the series it has looked up, keyed by the raw
+ * name and labels, so a handle fetched per request usually costs a hash
+ * and a compare and never walks the shared table.
+ */
+Registry::Slot *Registry::find(type_t type, std::string_view name, labels_t labels) {
+  thread_local std::unordered_map<std::string, Slot *> cache;
+  thread_local std::string key;
+  key.assign(reinterpret_cast<const char *>(&id), sizeof(id));
+  key.push_back(static_cast<char>(type));
+  key.append(name);
+  for (const auto &[k, v] : labels) {
+    key.push_back('\0');
+    key.append(k);
+    key.push_back('\0');
+    key.append(v);
+  }
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    return it->second;
+  }
+  Slot *s = claim(type, name, labels);
+  if (s != nullptr) {
+    cache.emplace(key, s);
+  }
+  return s;
+}
+
+Registry::Slot *Registry::claim(type_t type, std::string_view name, labels_t labels) {
+  thread_local std::string formatted;
+  format_labels(formatted, labels);
+  if (name.size() >= max_name || formatted.size() >= max_labels) {
+    header->dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  const uint64_t h = hash(name, formatted);
+
+  for (size_t i = 0; i < capacity; ++i) {
+    Slot &s = slots[(h + i) & (capacity - 1)];
+    uint32_t state = s.state.load(std::memory_order_acquire);
+    if (state == EMPTY &&
+        s.state.compare_exchange_strong(state, CLAIMING, std::memory_order_acquire)) {
+      s.type = type;
+      s.hash = h;
+      memcpy(s.name, name.data(), name.size());
+      s.name[name.size()] = '\0';
+      memcpy(s.labels, formatted.data(), formatted.size());
+      s.labels[formatted.size()] = '\0';
+      const size_t size = data_size(type);
+      const uint64_t off = header->arena_used.fetch_add(size, std::memory_order_relaxed);
+      if (off + size > arena_size) {
+        header->dropped.fetch_add(1, std::memory_order_relaxed);
+        s.offset = NO_DATA;
+      } else {
+        s.offset = off;
+      }
+      s.state.store(READY, std::memory_order_release);
+      return s.offset == NO_DATA ? nullptr : &s;
+    }
+    while (state == CLAIMING) {
+      std::this_thread::yield();
+      state = s.state.load(std::memory_order_acquire);
+    }
+    if (s.hash == h && s.type == type && name == s.name && formatted == s.labels) {
+      return s.offset == NO_DATA ? nullptr : &s;
+    }
+  }
+  header->dropped.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+Counter Registry::counter(std::string_view name, labels_t labels) {
+  Slot *s = find(COUNTER, name, labels);
+  return Counter(s ? static_cast<CounterShard *>(data(*s)) : nullptr);
+}
+
+Gauge Registry::gauge(std::string_view name, labels_t labels) {
+  Slot *s = find(GAUGE, name, labels);
+  return Gauge(s ? static_cast<std::atomic<uint64_t> *>(data(*s)) : nullptr);
+}
+
+Histogram Registry::histogram(std::string_view name, labels_t labels) {
+  Slot *s = find(HISTOGRAM, name, labels);
+  return Histogram(s ? static_cast<HistogramShard *>(data(*s)) : nullptr);
+}
+
+uint64_t Registry::dropped() const { return header->dropped.load(std::memory_order_relaxed); }
+
+uint64_t Registry::counter_total(std::string_view name) const {
+  uint64_t total = 0;
+  for (size_t i = 0; i < capacity; ++i) {
+    const Slot &s = slots[i];
+    if (s.state.load(std::memory_order_acquire) == READY && s.type == COUNTER &&
+        name == s.name) {
+      total += Counter(static_cast<CounterShard *>(data(s))).value();
+    }
+  }
+  return total;
+}
+
+HistogramSnapshot Registry::histogram_total(std::string_view name) const {
+  HistogramSnapshot total;
+  for (size_t i = 0; i < capacity; ++i) {
+    const Slot &s = slots[i];
+    if (s.state.load(std::memory_order_acquire) == READY && s.type == HISTOGRAM &&
+        name == s.name) {
+      total.merge(Histogram(static_cast<HistogramShard *>(data(s))).snapshot());
+    }
+  }
+  return total;
+}
+
+std::string Registry::scrape() const {
+  std::vector<const Slot *> ready;
+  for (size_t i = 0; i < capacity; ++i) {
+    if (slots[i].state.load(std::memory_order_acquire) == READY && slots[i].offset != NO_DATA) {
+      ready.push_back(&slots[i]);
+    }
+  }
+  std::sort(ready.begin(), ready.end(), [](const Slot *a, const Slot *b) {
+    int c = strcmp(a->name, b->name);
+    return c != 0 ? c < 0 : strcmp(a->labels, b->labels) < 0;
+  });
+
+  std::string out;
+  const char *last = "";
+  for (const Slot *s : ready) {
+    const std::string_view name(s->name);
+    const std::string_view labels(s->labels);
+    if (name != last) {
+      last = s->name;
+      out += "# TYPE ";
+      out += name;
+      out += s->type == COUNTER ? " counter\n" : s->type == GAUGE ? " gauge\n" : " histogram\n";
+    }
+
+    auto series = [&](std::string_view suffix, std::string_view extra) {
+      out += name;
+      out += suffix;
+      if (!labels.empty() || !extra.empty()) {
+        out += '{';
+        out += labels;
+        if (!labels.empty() && !extra.empty()) {
+          out += ',';
+        }
+        out += extra;
+        out += '}';
+      }
+      out += ' ';
+    };
+
+    if (s->type == COUNTER) {
+      series("", "");
+      out += std::to_string(Counter(static_cast<CounterShard *>(data(*s))).value());
+      out += '\n';
+    } else if (s->type == GAUGE) {
+      series("", "");
+      append_double(out, Gauge(static_cast<std::atomic<uint64_t> *>(data(*s))).value());
+      out += '\n';
+    } else {
+      HistogramSnapshot h = Histogram(static_cast<HistogramShard *>(data(*s))).snapshot();
+      // bucket edges fall on powers of two, so every le is exact
+      uint64_t cumulative = 0;
+      size_t b = 0;
+      for (int e = 10; e <= 36; ++e) {
+        const size_t upto = bucket_of(1ULL << e);
+        for (; b < upto; ++b) {
+          cumulative += h.buckets[b];
+        }
+        std::string le = "le=\"";
+        append_double(le, static_cast<double>(1ULL << e) / 1e9);
+        le += '"';
+        series("_bucket", le);
+        out += std::to_string(cumulative);
+        out += '\n';
+      }
+      series("_bucket", "le=\"+Inf\"");
+      out += std::to_string(h.count);
+      out += '\n';
+      series("_sum", "");
+      append_double(out, static_cast<double>(h.sum_ns) / 1e9);
+      out += '\n';
+      series("_count", "");
+      out += std::to_string(h.count);
+      out += '\n';
+    }
+  }
+  return out;
+}
+
+}  // namespace Kleptic::Metrics
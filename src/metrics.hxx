@@ -0,0 +1,157 @@
+#ifndef KLEPTIC_METRICS_HXX_
+#define KLEPTIC_METRICS_HXX_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "wsdeque.hxx"
+
+namespace Kleptic::Metrics {
+
+enum type_t : uint8_t { COUNTER = 1, GAUGE = 2, HISTOGRAM = 3 };
+
+typedef std::initializer_list<std::pair<std::string_view, std::string_view>> labels_t;
+
+/* every counter and histogram is split this many ways, each thread adds to one part */
+constexpr size_t num_shards = 16;
+
+/*
+ * histogram buckets are log-linear like HdrHistogram's: every power of
+ * two is cut into 2^sub_bits equal buckets, so a value's bucket is
+ * within 1/8 of it. values are ns, past 2^max_exponent (~18 minutes)
+ * they share the last bucket.
+ */
+constexpr int sub_bits = 3;
+constexpr uint64_t sub_count = 1 << sub_bits;
+constexpr int max_exponent = 40;
+constexpr size_t num_buckets = (max_exponent - sub_bits + 2) * sub_count;
+
+size_t bucket_of(uint64_t ns);
+/* the smallest value past bucket i */
+uint64_t bucket_limit(size_t i);
+
+struct alignas(KLEPTIC_CACHE_LINE) CounterShard {
+  std::atomic<uint64_t> value;
+};
+
+struct alignas(KLEPTIC_CACHE_LINE) HistogramShard {
+  std::atomic<uint64_t> sum_ns;
+  std::atomic<uint64_t> buckets[num_buckets];
+};
+
+/* handles are pointers into the registry's shared memory, a dropped series gives a no-op one */
+class Counter {
+  CounterShard *shards = nullptr;
+
+ public:
+  Counter() = default;
+  explicit Counter(CounterShard *shards) : shards(shards) {}
+  void inc(uint64_t n = 1) const;
+  uint64_t value() const;
+};
+
+class Gauge {
+  std::atomic<uint64_t> *bits = nullptr;
+
+ public:
+  Gauge() = default;
+  explicit Gauge(std::atomic<uint64_t> *bits) : bits(bits) {}
+  void set(double v) const;
+  void add(double v) const;
+  double value() const;
+};
+
+struct HistogramSnapshot {
+  uint64_t count = 0;
+  uint64_t sum_ns = 0;
+  std::array<uint64_t, num_buckets> buckets{};
+
+  void merge(const HistogramSnapshot &o);
+  /* the upper edge of the bucket holding quantile q, in ns, 0 when empty */
+  uint64_t quantile(double q) const;
+};
+
+class Histogram {
+  HistogramShard *shards = nullptr;
+
+ public:
+  Histogram() = default;
+  explicit Histogram(HistogramShard *shards) : shards(shards) {}
+  void observe(uint64_t ns) const;
+  template <class Rep, class Period>
+  void observe(std::chrono::duration<Rep, Period> d) const {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    observe(static_cast<uint64_t>(ns < 0 ? 0 : ns));
+  }
+  HistogramSnapshot snapshot() const;
+};
+
+/*
+ * Registry
+ *
+ * counters, gauges and histograms, each series a name and a set of
+ * labels. everything lives in one shared mapping made when the registry
+ * is, so worker processes forked later count into the same series and
+ * a scrape from any of them sees all of it.
+ *
+ * recording is a relaxed atomic add to the calling thread's shard of
+ * the series. shards are only summed when somebody reads them: scrape,
+ * counter_total, histogram_total. looking a series up hashes its name
+ * and labels into an open addressed table, new series claim a slot
+ * and a piece of the arena without locks. once either is full further
+ * series are dropped, their handles do nothing. handles stay valid for
+ * the registry's lifetime, hot paths may keep them.
+ */
+class Registry {
+  struct Header;
+  struct Slot;
+
+  const uint64_t id;
+  Header *header;
+  Slot *slots;
+  unsigned char *arena;
+  size_t capacity;
+  size_t arena_size;
+  size_t map_size;
+
+  Slot *find(type_t type, std::string_view name, labels_t labels);
+  Slot *claim(type_t type, std::string_view name, labels_t labels);
+  void *data(const Slot &s) const;
+
+ public:
+  explicit Registry(size_t max_series = 1024, size_t arena_size = 16 << 20);
+  Registry(const Registry &) = delete;
+  Registry &operator=(const Registry &) = delete;
+  ~Registry();
+
+  Counter counter(std::string_view name, labels_t labels = {});
+  Gauge gauge(std::string_view name, labels_t labels = {});
+  Histogram histogram(std::string_view name, labels_t labels = {});
+
+  /* all series of name added up, whatever their labels */
+  uint64_t counter_total(std::string_view name) const;
+  HistogramSnapshot histogram_total(std::string_view name) const;
+
+  /* series that didn't fit */
+  uint64_t dropped() const;
+
+  /*
+   * std::string scrape() const
+   *
+   * every series in the Prometheus text format (0.0.4). histograms are
+   * in seconds with a bucket for every power of two ns from ~1us to
+   * ~68s.
+   */
+  std::string scrape() const;
+};
+
+}  // namespace Kleptic::Metrics
+
+#endif  // KLEPTIC_METRICS_HXX_
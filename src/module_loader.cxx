@@ -0,0 +1,74 @@
+/**
+ * kleptic_module_loader MODULE.so
+ *
+ * runs one request against a .so CGI module in a process of its own, for
+ * CGIOptions::isolate_modules. the CGI handler posix_spawns it like any
+ * other script: the CGI environment in environ, the request body on
+ * stdin, the module's output on stdout. loading the module happens here,
+ * after exec, instead of in a fork of the server where only async signal
+ * safe calls are allowed.
+ */
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "cgi_module.hxx"
+
+extern char **environ;
+
+static void write_out(void *out_ctx, const char *data, size_t len) {
+  int fd = *static_cast<int *>(out_ctx);
+  while (len > 0) {
+    ssize_t ret = write(fd, data, len);
+    if (ret <= 0) {
+      return;
+    }
+    data += ret;
+    len -= ret;
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s MODULE.so\n", argv[0]);
+    return 2;
+  }
+
+  void *lib = dlopen(argv[1], RTLD_LAZY);
+  if (lib == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    return 1;
+  }
+  const char *query = getenv("QUERY_STRING");
+  if (query == NULL) {
+    query = "";
+  }
+
+  auto io_entry = reinterpret_cast<kleptic_httprun_io_t>(dlsym(lib, KLEPTIC_MODULE_IO_SYMBOL));
+  if (io_entry != nullptr) {
+    std::string body;
+    char buffer[16384];
+    ssize_t ret;
+    while ((ret = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+      body.append(buffer, ret);
+    }
+    int out = STDOUT_FILENO;
+    const kleptic_module_io io = {environ, query, body.data(), body.size(), &out, write_out};
+    return io_entry(&io);
+  }
+
+  // the old entry point reads stdin itself if it wants the body
+  typedef void (*fd_entry_t)(int, const char *);
+  auto fd_entry = reinterpret_cast<fd_entry_t>(dlsym(lib, KLEPTIC_MODULE_FD_SYMBOL));
+  if (fd_entry == nullptr) {
+    fprintf(stderr, "%s: no %s or %s\n", argv[1], KLEPTIC_MODULE_IO_SYMBOL,
+            KLEPTIC_MODULE_FD_SYMBOL);
+    return 1;
+  }
+  fd_entry(STDOUT_FILENO, query);
+  return 0;
+}
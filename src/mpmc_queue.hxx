@@ -0,0 +1,258 @@
+#ifndef KLEPTIC_MPMC_QUEUE_HXX_
+#define KLEPTIC_MPMC_QUEUE_HXX_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "eventcount.hxx"
+#include "wsdeque.hxx"
+
+namespace Kleptic {
+
+/*
+ * MPMCQueue
+ *
+ * bounded lock-free multi producer / multi consumer ring (Vyukov). every
+ * cell carries a sequence number telling producers and consumers whose
+ * turn it is, so the only shared writes are the two position counters,
+ * each on its own cache line.
+ *
+ * try_* never block. push/pop block on an EventCount when the queue is
+ * full/empty, so idle threads sleep instead of spinning.
+ */
+template <typename T>
+class MPMCQueue {
+  struct Cell {
+    std::atomic<size_t> seq;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+    T *item() { return std::launder(reinterpret_cast<T *>(&storage)); }
+  };
+
+  const size_t mask;
+  std::unique_ptr<Cell[]> cells;
+
+  alignas(KLEPTIC_CACHE_LINE) std::atomic<size_t> enqueue_pos{0};
+  alignas(KLEPTIC_CACHE_LINE) std::atomic<size_t> dequeue_pos{0};
+  alignas(KLEPTIC_CACHE_LINE) EventCount not_empty;
+  EventCount not_full;
+
+  static constexpr int spin_tries = 32;
+
+  static size_t round_up(size_t n) {
+    size_t cap = 2;
+    while (cap < n) {
+      cap <<= 1;
+    }
+    return cap;
+  }
+
+  /*
+   * claims up to max consecutive cells whose sequence is pos + i + ready,
+   * returns how many were claimed and the first position in pos.
+   */
+  size_t claim(std::atomic<size_t> &counter, size_t max, size_t ready, size_t &pos) {
+    pos = counter.load(std::memory_order_relaxed);
+    while (true) {
+      size_t n = 0;
+      while (n < max) {
+        size_t seq = cells[(pos + n) & mask].seq.load(std::memory_order_acquire);
+        if (seq != pos + n + ready) {
+          break;
+        }
+        ++n;
+      }
+
+      if (n == 0) {
+        size_t seq = cells[pos & mask].seq.load(std::memory_order_acquire);
+        auto dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + ready);
+        if (dif < 0) {
+          return 0;  // full for producers, empty for consumers
+        }
+        pos = counter.load(std::memory_order_relaxed);
+        continue;
+      }
+
+      if (counter.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+        return n;
+      }
+    }
+  }
+
+  template <typename U>
+  void fill(size_t pos, U &&item) {
+    Cell &c = cells[pos & mask];
+    new (&c.storage) T(std::forward<U>(item));
+    c.seq.store(pos + 1, std::memory_order_release);
+  }
+
+  void drain(size_t pos, T &out) {
+    Cell &c = cells[pos & mask];
+    out = std::move(*c.item());
+    c.item()->~T();
+    c.seq.store(pos + mask + 1, std::memory_order_release);
+  }
+
+ public:
+  explicit MPMCQueue(size_t max_cap) : mask(round_up(max_cap) - 1), cells(new Cell[mask + 1]) {
+    for (size_t i = 0; i <= mask; ++i) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MPMCQueue(const MPMCQueue &) = delete;
+  MPMCQueue &operator=(const MPMCQueue &) = delete;
+
+  ~MPMCQueue() {
+    T item;
+    while (try_pop(item)) {
+    }
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+  size_t size_approx() const {
+    size_t head = dequeue_pos.load(std::memory_order_relaxed);
+    size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+    return (tail > head) ? tail - head : 0;
+  }
+
+  /* item is left untouched when the queue is full */
+  template <typename U>
+  bool try_push(U &&item) {
+    size_t pos;
+    if (claim(enqueue_pos, 1, 0, pos) == 0) {
+      return false;
+    }
+    fill(pos, std::forward<U>(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool try_pop(T &out) {
+    size_t pos;
+    if (claim(dequeue_pos, 1, 1, pos) == 0) {
+      return false;
+    }
+    drain(pos, out);
+    not_full.notify_one();
+    return true;
+  }
+
+  /* moves up to n items from first, returns how many went in */
+  template <typename It>
+  size_t try_push_bulk(It first, size_t n) {
+    size_t pos;
+    size_t claimed = claim(enqueue_pos, n, 0, pos);
+    for (size_t i = 0; i < claimed; ++i, ++first) {
+      fill(pos + i, std::move(*first));
+    }
+    if (claimed > 0) {
+      not_empty.notify(static_cast<int>(claimed));
+    }
+    return claimed;
+  }
+
+  /* pops up to max items into out, returns how many came out */
+  template <typename It>
+  size_t try_pop_bulk(It out, size_t max) {
+    size_t pos;
+    size_t claimed = claim(dequeue_pos, max, 1, pos);
+    for (size_t i = 0; i < claimed; ++i, ++out) {
+      drain(pos + i, *out);
+    }
+    if (claimed > 0) {
+      not_full.notify(static_cast<int>(claimed));
+    }
+    return claimed;
+  }
+
+  template <typename U>
+  void push(U &&item) {
+    for (int i = 0; i < spin_tries; ++i) {
+      if (try_push(std::forward<U>(item))) {
+        return;
+      }
+    }
+    while (true) {
+      auto key = not_full.prepare_wait();
+      if (try_push(std::forward<U>(item))) {
+        not_full.cancel_wait();
+        return;
+      }
+      not_full.wait(key);
+      if (try_push(std::forward<U>(item))) {
+        return;
+      }
+    }
+  }
+
+  template <typename... Args>
+  void emplace(Args &&... args) {
+    push(T(std::forward<Args>(args)...));
+  }
+
+  T pop() {
+    T out;
+    for (int i = 0; i < spin_tries; ++i) {
+      if (try_pop(out)) {
+        return out;
+      }
+    }
+    while (true) {
+      auto key = not_empty.prepare_wait();
+      if (try_pop(out)) {
+        not_empty.cancel_wait();
+        return out;
+      }
+      not_empty.wait(key);
+      if (try_pop(out)) {
+        return out;
+      }
+    }
+  }
+
+  template <typename It>
+  void push_bulk(It first, size_t n) {
+    while (n > 0) {
+      size_t pushed = try_push_bulk(first, n);
+      first += pushed;
+      n -= pushed;
+      if (n == 0) {
+        return;
+      }
+      auto key = not_full.prepare_wait();
+      if (size_approx() < capacity()) {
+        not_full.cancel_wait();
+        continue;
+      }
+      not_full.wait(key);
+    }
+  }
+
+  /* blocks until at least one item is available */
+  template <typename It>
+  size_t pop_bulk(It out, size_t max) {
+    while (true) {
+      size_t popped = try_pop_bulk(out, max);
+      if (popped > 0) {
+        return popped;
+      }
+      auto key = not_empty.prepare_wait();
+      popped = try_pop_bulk(out, max);
+      if (popped > 0) {
+        not_empty.cancel_wait();
+        return popped;
+      }
+      not_empty.wait(key);
+    }
+  }
+};
+
+}  // namespace Kleptic
+
+#endif  // KLEPTIC_MPMC_QUEUE_HXX_
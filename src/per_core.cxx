@@ -0,0 +1,245 @@
+#include "per_core.hxx"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <latch>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "error.hxx"
+#include "strutil.hxx"
+
+namespace Kleptic::PerCore {
+
+static thread_local Core *current_core = nullptr;
+
+std::vector<int> allowed_cpus() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+    throw ConcurrencyException("Failed to get cpu affinity : " + std::string(strerror(errno)));
+  }
+  std::vector<int> cpus;
+  for (int i = 0; i < CPU_SETSIZE; ++i) {
+    if (CPU_ISSET(i, &set)) {
+      cpus.push_back(i);
+    }
+  }
+  return cpus;
+}
+
+static int parse_cpu(const std::string &s, const std::string &list) {
+  char *end = nullptr;
+  long cpu = std::strtol(s.c_str(), &end, 10);
+  if (s.empty() || *end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE) {
+    throw ConcurrencyException("Bad cpu list : " + list);
+  }
+  return static_cast<int>(cpu);
+}
+
+std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    item = Util::trim(item);
+    size_t dash = item.find('-');
+    if (dash == std::string::npos) {
+      cpus.push_back(parse_cpu(item, list));
+      continue;
+    }
+    int lo = parse_cpu(item.substr(0, dash), list);
+    int hi = parse_cpu(item.substr(dash + 1), list);
+    if (lo > hi) {
+      throw ConcurrencyException("Bad cpu list : " + list);
+    }
+    for (int cpu = lo; cpu <= hi; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  if (cpus.empty()) {
+    throw ConcurrencyException("Bad cpu list : " + list);
+  }
+  return cpus;
+}
+
+void CoreMetrics::record(const std::string &req_path, uint64_t us) {
+  requests++;
+  total_req_us += us;
+  if (requests == 1 || us > max_req_us) {
+    max_req_us = us;
+    max_req = req_path;
+  }
+  if (requests == 1 || us < min_req_us) {
+    min_req_us = us;
+    min_req = req_path;
+  }
+}
+
+void CoreMetrics::merge(const CoreMetrics &o) {
+  if (o.requests > 0) {
+    if (requests == 0 || o.max_req_us > max_req_us) {
+      max_req_us = o.max_req_us;
+      max_req = o.max_req;
+    }
+    if (requests == 0 || o.min_req_us < min_req_us) {
+      min_req_us = o.min_req_us;
+      min_req = o.min_req;
+    }
+  }
+  connections += o.connections;
+  requests += o.requests;
+  errors += o.errors;
+  bytes_in += o.bytes_in;
+  bytes_out += o.bytes_out;
+  total_req_us += o.total_req_us;
+}
+
+Core::Core(size_t id, int cpu)
+    : _id(id),
+      _cpu(cpu),
+      wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      _loop(KLEPTIC_CORE_OFFLOAD_THREADS),
+      inbox(KLEPTIC_CORE_INBOX_SIZE) {
+  if (wake_fd < 0) {
+    throw ConcurrencyException("Failed to create core inbox : " + std::string(strerror(errno)));
+  }
+}
+
+Core::~Core() { close(wake_fd); }
+
+Core &Core::current() {
+  if (current_core == nullptr) {
+    throw AsyncException("Not running on a core");
+  }
+  return *current_core;
+}
+
+bool Core::on_core() { return current_core != nullptr; }
+
+/*
+ * task<void> drain(Core &)
+ *
+ * runs on every core for its lifetime, waking on the inbox eventfd and
+ * running whatever other cores sent.
+ */
+Async::task<void> Core::drain(Core &core) {
+  message_t m;
+  while (true) {
+    co_await Async::readable(core.wake_fd);
+    uint64_t count;
+    if (::read(core.wake_fd, &count, sizeof(count)) < 0) {
+      // another wakeup already drained it
+    }
+    while (core.inbox.try_pop(m)) {
+      m();
+      m = nullptr;
+    }
+  }
+}
+
+Runtime::Runtime(std::vector<int> cpu_list) : cpus(cpu_list.empty() ? allowed_cpus() : cpu_list) {
+  std::vector<int> allowed = allowed_cpus();
+  for (int cpu : cpus) {
+    if (std::find(allowed.begin(), allowed.end(), cpu) == allowed.end()) {
+      throw ConcurrencyException("cpu " + std::to_string(cpu) + " is not available");
+    }
+  }
+  cores.resize(cpus.size());
+}
+
+Runtime::~Runtime() {
+  stop();
+  for (auto &t : threads) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+}
+
+void Runtime::run(const std::function<void(Core &)> &setup) {
+  std::latch ready(static_cast<ptrdiff_t>(cpus.size()));
+
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    threads.emplace_back([this, i, &setup, &ready] {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i], &set);
+      if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Failed to pin core %zu to cpu %d : %s\n", i, cpus[i], strerror(errno));
+      }
+
+      cores[i] = std::make_unique<Core>(i, cpus[i]);
+      Core &core = *cores[i];
+      current_core = &core;
+      // nobody sends before every inbox exists
+      ready.arrive_and_wait();
+      started.store(true, std::memory_order_seq_cst);
+      if (stopping.load(std::memory_order_seq_cst)) {
+        // stop came before the cores were there to stop, the loop returns at once
+        core._loop.stop();
+      }
+
+      core._loop.spawn(Core::drain(core));
+      setup(core);
+      core._loop.run();
+      current_core = nullptr;
+    });
+  }
+
+  for (auto &t : threads) {
+    t.join();
+  }
+  threads.clear();
+}
+
+void Runtime::stop() {
+  // cores[] is only read once the core threads have filled it, before that they see stopping
+  stopping.store(true, std::memory_order_seq_cst);
+  if (!started.load(std::memory_order_seq_cst)) {
+    return;
+  }
+  for (auto &core : cores) {
+    core->_loop.stop();
+  }
+}
+
+static void wake(int wake_fd) {
+  uint64_t one = 1;
+  if (::write(wake_fd, &one, sizeof(one)) < 0) {
+    // counter saturated, the core is already due to wake up
+  }
+}
+
+void Runtime::send(size_t core, message_t m) {
+  Core &c = *cores.at(core);
+  if (!c.inbox.try_push(std::move(m))) {
+    if (!Core::on_core()) {
+      c.inbox.push(std::move(m));
+    } else {
+      // the target may itself be waiting on our inbox, so ours keeps draining meanwhile
+      Core &self = Core::current();
+      message_t mine;
+      do {
+        wake(c.wake_fd);
+        if (self.inbox.try_pop(mine)) {
+          mine();
+          mine = nullptr;
+        } else {
+          std::this_thread::yield();
+        }
+      } while (!c.inbox.try_push(std::move(m)));
+    }
+  }
+  wake(c.wake_fd);
+}
+
+}  // namespace Kleptic::PerCore
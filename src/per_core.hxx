@@ -0,0 +1,206 @@
+#ifndef KLEPTIC_PER_CORE_HXX_
+#define KLEPTIC_PER_CORE_HXX_
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "event_loop.hxx"
+#include "mpmc_queue.hxx"
+#include "task.hxx"
+
+#define KLEPTIC_CORE_INBOX_SIZE 4096
+#define KLEPTIC_CORE_OFFLOAD_THREADS 1
+
+namespace Kleptic::PerCore {
+
+/* work sent to another core, it runs on that core's loop */
+typedef std::function<void()> message_t;
+
+/* cpus this process may run on */
+std::vector<int> allowed_cpus();
+
+/*
+ * vector<int> parse_cpu_list(string)
+ *
+ * parses a list like "0-3,6,8-9". throws ConcurrencyException on
+ * anything else.
+ */
+std::vector<int> parse_cpu_list(const std::string &list);
+
+/*
+ * CoreMetrics
+ *
+ * request counters of one core. only the owning core touches them, other
+ * cores read them by sending it a message (Runtime::gather).
+ */
+struct CoreMetrics {
+  uint64_t connections = 0;
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+  uint64_t total_req_us = 0;
+  uint64_t max_req_us = 0;
+  uint64_t min_req_us = 0;
+  std::string max_req;
+  std::string min_req;
+
+  void record(const std::string &req_path, uint64_t us);
+  void merge(const CoreMetrics &o);
+};
+
+/*
+ * Core
+ *
+ * everything one pinned thread owns: its event loop, an allocator arena,
+ * its metrics and an inbox other cores post messages to. it is built on
+ * its own thread after pinning, so its memory comes from the local node.
+ */
+class Core {
+  friend class Runtime;
+
+  const size_t _id;
+  const int _cpu;
+  const int wake_fd;
+  Async::EventLoop _loop;
+  std::pmr::unsynchronized_pool_resource _arena;
+  CoreMetrics _metrics;
+  MPMCQueue<message_t> inbox;
+
+  static Async::task<void> drain(Core &core);
+
+ public:
+  Core(size_t id, int cpu);
+  Core(const Core &) = delete;
+  Core &operator=(const Core &) = delete;
+  ~Core();
+
+  /* the core running on this thread, throws AsyncException off a core */
+  static Core &current();
+  static bool on_core();
+
+  size_t id() const { return _id; }
+  int cpu() const { return _cpu; }
+  Async::EventLoop &loop() { return _loop; }
+  /* not thread safe, only for allocations that stay on this core */
+  std::pmr::memory_resource *arena() { return &_arena; }
+  CoreMetrics &metrics() { return _metrics; }
+};
+
+/*
+ * Runtime
+ *
+ * one thread per cpu in the list, each pinned with sched_setaffinity and
+ * running its Core's loop. cores share nothing, they talk only through
+ * send/call, which push onto the target's inbox and kick its eventfd.
+ */
+class Runtime {
+  const std::vector<int> cpus;
+  std::vector<std::unique_ptr<Core>> cores;
+  std::vector<std::thread> threads;
+  /* every core exists, set by the core threads once past their startup latch */
+  std::atomic<bool> started{false};
+  std::atomic<bool> stopping{false};
+
+ public:
+  /* an empty list means every allowed cpu */
+  explicit Runtime(std::vector<int> cpus = {});
+  Runtime(const Runtime &) = delete;
+  Runtime &operator=(const Runtime &) = delete;
+  ~Runtime();
+
+  size_t size() const { return cpus.size(); }
+
+  /*
+   * void run(function<void(Core &)> setup)
+   *
+   * starts the cores, calls setup on each one's thread to spawn its
+   * tasks and runs the loops until stop(). blocks the caller.
+   */
+  void run(const std::function<void(Core &)> &setup);
+  void stop();
+
+  /*
+   * runs m on core. the inbox is bounded: a core sending to a full one
+   * runs its own messages until there is room, so two cores filling each
+   * other's inboxes can't deadlock, any other thread blocks.
+   */
+  void send(size_t core, message_t m);
+
+  /* runs fn on core and resumes the calling coroutine on its own core */
+  template <typename F>
+  auto call(size_t core, F fn) {
+    typedef std::invoke_result_t<F> result_t;
+    struct awaiter {
+      Runtime &rt;
+      size_t target;
+      F fn;
+      Async::detail::outcome<result_t> out;
+      awaiter(Runtime &rt, size_t target, F fn) : rt(rt), target(target), fn(std::move(fn)) {}
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        const size_t origin = Core::current().id();
+        rt.send(target, [this, h, origin] {
+          out.run(fn);
+          rt.send(origin, [h] { h.resume(); });
+        });
+      }
+      result_t await_resume() { return out.get(); }
+    };
+    return awaiter(*this, core, std::move(fn));
+  }
+
+  /* fn(Core &) on every core in turn, results are in core order */
+  template <typename F>
+  Async::task<std::vector<std::invoke_result_t<F, Core &>>> gather(F fn) {
+    std::vector<std::invoke_result_t<F, Core &>> out;
+    for (size_t i = 0; i < size(); ++i) {
+      auto on_core = [&fn, i, this] { return fn(*cores[i]); };
+      out.push_back(co_await call(i, std::move(on_core)));
+    }
+    co_return out;
+  }
+};
+
+/*
+ * CoreLocal<T>
+ *
+ * one T per core, each only touched by its own core. use it for state
+ * that would otherwise be shared behind a lock, e.g. a
+ * Cache::ResponseCache per core. copies share the same slots.
+ */
+template <typename T>
+class CoreLocal {
+  struct alignas(KLEPTIC_CACHE_LINE) Slot {
+    T value;
+    template <typename... Args>
+    explicit Slot(Args &&... args) : value(std::forward<Args>(args)...) {}
+  };
+  std::shared_ptr<std::vector<std::unique_ptr<Slot>>> slots;
+
+ public:
+  template <typename... Args>
+  explicit CoreLocal(size_t num_cores, const Args &... args)
+      : slots(std::make_shared<std::vector<std::unique_ptr<Slot>>>()) {
+    for (size_t i = 0; i < num_cores; ++i) {
+      slots->push_back(std::make_unique<Slot>(args...));
+    }
+  }
+
+  T &local() const { return (*slots)[Core::current().id()]->value; }
+  T &on(size_t core) const { return (*slots)[core]->value; }
+  size_t size() const { return slots->size(); }
+};
+
+}  // namespace Kleptic::PerCore
+
+#endif  // KLEPTIC_PER_CORE_HXX_
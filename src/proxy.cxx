@@ -0,0 +1,542 @@
+#include "proxy.hxx"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <utility>
+
+#include "error.hxx"
+#include "strutil.hxx"
+#include "tcp_sock.hxx"
+
+namespace Kleptic::Proxy {
+
+static const char *hop_by_hop[] = {"connection", "keep-alive", "proxy-authenticate",
+                                   "proxy-authorization", "proxy-connection", "te",
+                                   "trailer", "transfer-encoding", "upgrade"};
+
+/* the lowercased tokens of a Connection header value */
+static std::vector<std::string> connection_tokens(const std::string &value) {
+  std::vector<std::string> tokens;
+  std::stringstream ss(value);
+  std::string token;
+  while (std::getline(ss, token, ',')) {
+    token = Util::to_lower(Util::trim(token));
+    if (!token.empty()) {
+      tokens.push_back(token);
+    }
+  }
+  return tokens;
+}
+
+bool is_hop_by_hop(const std::string &name, const std::vector<std::string> &connection_tokens) {
+  const std::string lower = Util::to_lower(name);
+  for (const char *h : hop_by_hop) {
+    if (lower == h) {
+      return true;
+    }
+  }
+  return std::find(connection_tokens.begin(), connection_tokens.end(), lower) !=
+         connection_tokens.end();
+}
+
+/* methods a request may be sent again with, RFC 9110 9.2.2 */
+static bool idempotent(const std::string &method) {
+  return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "PUT" ||
+         method == "DELETE";
+}
+
+/* the scheme the client used, https on a TLS socket or h2 stream over one */
+static std::string client_scheme(const HTTPConn &c) {
+  if (!c.http_protocol.empty()) {
+    return c.http_protocol;
+  }
+  return c.sock != nullptr && !c.sock->protocol().empty() ? "https" : "http";
+}
+
+std::string forward_request(HTTPConn &c) {
+  std::vector<std::string> tokens;
+  std::string forwarded_for;
+  std::string host = c.host;
+  bool has_host = false;
+  for (const auto &[name, value] : c.req_headers) {
+    const std::string lower = Util::to_lower(name);
+    if (lower == "connection") {
+      tokens = connection_tokens(value);
+    } else if (lower == "x-forwarded-for") {
+      forwarded_for = value;
+    } else if (lower == "host") {
+      has_host = true;
+      host = value;
+    }
+  }
+
+  std::stringstream ss;
+  ss << c.method << " " << c.req_path;
+  if (!c.raw_query_string.empty()) {
+    ss << "?" << c.raw_query_string;
+  }
+  ss << " HTTP/1.1\r\n";
+  for (const auto &[name, value] : c.req_headers) {
+    const std::string lower = Util::to_lower(name);
+    // framing is ours, the body was already read so nobody waits on a 100,
+    // and the client's X-Forwarded-Proto/Host aren't trusted, ours replace them
+    if (is_hop_by_hop(name, tokens) || lower == "content-length" || lower == "expect" ||
+        lower == "x-forwarded-for" || lower == "x-forwarded-proto" ||
+        lower == "x-forwarded-host") {
+      continue;
+    }
+    ss << name << ": " << value << "\r\n";
+  }
+  if (!has_host && !c.host.empty()) {
+    ss << "Host: " << c.host << "\r\n";
+  }
+  ss << "X-Forwarded-For: " << (forwarded_for.empty() ? "" : forwarded_for + ", ") << c.remote_ip
+     << "\r\n";
+  ss << "X-Forwarded-Proto: " << client_scheme(c) << "\r\n";
+  if (!host.empty()) {
+    ss << "X-Forwarded-Host: " << host << "\r\n";
+  }
+
+  const std::string body = c.req_body.str();
+  if (!body.empty() || c.method == "POST" || c.method == "PUT") {
+    ss << "Content-Length: " << body.size() << "\r\n";
+  }
+  ss << "Connection: keep-alive\r\n\r\n" << body;
+  return ss.str();
+}
+
+/*
+ * upstream_reader
+ *
+ * buffered reads off an upstream connection. reads block up to the
+ * connection's io timeout and throw SocketException past it.
+ */
+class upstream_reader {
+  Socket &s;
+  std::string buff;
+  size_t pos = 0;
+
+  size_t available() const { return buff.size() - pos; }
+
+  bool fill() {
+    char chunk[4 * TCP_BUFF_SIZE];
+    int ret = s.read(chunk, sizeof(chunk));
+    if (ret <= 0) {
+      return false;
+    }
+    got_data = true;
+    if (pos == buff.size()) {
+      buff.clear();
+      pos = 0;
+    }
+    buff.append(chunk, ret);
+    return true;
+  }
+
+ public:
+  /* set once anything came back, the request can't be retried after that */
+  bool got_data = false;
+
+  explicit upstream_reader(Socket &sock) : s(sock) {}
+
+  bool read_until(const char *delim, size_t delim_len, std::string &out, size_t max) {
+    while (true) {
+      size_t end = buff.find(delim, pos, delim_len);
+      if (end != std::string::npos) {
+        out.assign(buff, pos, end - pos);
+        pos = end + delim_len;
+        return true;
+      }
+      if (available() > max) {
+        throw SocketException("upstream response headers too long");
+      }
+      if (!fill()) {
+        return false;
+      }
+    }
+  }
+
+  /* passes the next n bytes to out, false if the upstream closed first */
+  template <typename F>
+  bool relay(size_t n, F &out) {
+    while (n > 0) {
+      if (available() == 0 && !fill()) {
+        return false;
+      }
+      size_t k = std::min(n, available());
+      out(buff.data() + pos, k);
+      pos += k;
+      n -= k;
+    }
+    return true;
+  }
+
+  template <typename F>
+  void relay_to_eof(F &out) {
+    do {
+      if (available() > 0) {
+        out(buff.data() + pos, available());
+        pos = buff.size();
+      }
+    } while (fill());
+  }
+};
+
+/*
+ * bool relay_response(HTTPConn &, upstream_reader &, max_header_size, out)
+ *
+ * reads one response off the upstream, sets c's status and end to end
+ * headers from it and passes the body to out as it arrives, decoding
+ * chunked transfer encoding. true if the connection can be reused.
+ */
+template <typename F>
+static bool relay_response(HTTPConn &c, upstream_reader &r, size_t max_header_size, F &out) {
+  std::string head;
+  std::string version;
+  int code = 0;
+  // interim 1xx responses are not passed on
+  do {
+    if (!r.read_until("\r\n\r\n", 4, head, max_header_size)) {
+      throw SocketException("upstream closed the connection");
+    }
+    std::stringstream status_line(head.substr(0, head.find("\r\n")));
+    status_line >> version >> code;
+    if (code < 100 || code > 999) {
+      throw SocketException("bad upstream status line");
+    }
+  } while (code < 200 && code != 101);
+
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::vector<std::string> tokens;
+  std::string transfer_encoding;
+  std::string content_length;
+  std::stringstream lines(head);
+  std::string line;
+  std::getline(lines, line);  // status line
+  while (std::getline(lines, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = Util::trim(line.substr(0, colon));
+    std::string value = Util::trim(line.substr(colon + 1));
+    const std::string lower = Util::to_lower(name);
+    if (lower == "connection") {
+      tokens = connection_tokens(value);
+    } else if (lower == "transfer-encoding") {
+      transfer_encoding = Util::to_lower(value);
+    } else if (lower == "content-length") {
+      content_length = value;
+    }
+    headers.emplace_back(std::move(name), std::move(value));
+  }
+
+  bool keep = version == "HTTP/1.1" &&
+              std::find(tokens.begin(), tokens.end(), "close") == tokens.end();
+
+  c.resp_status = code;
+  for (auto &[name, value] : headers) {
+    if (is_hop_by_hop(name, tokens) || Util::to_lower(name) == "content-length") {
+      continue;
+    }
+    // repeated fields stay separate lines, Set-Cookie can't be joined with commas
+    if (!c.resp_headers.emplace(name, value).second) {
+      c.resp_extra_headers.emplace_back(std::move(name), std::move(value));
+    }
+  }
+  // the client gets the status and headers now, the body follows as it comes
+  out(nullptr, 0);
+
+  if (code == 101) {
+    // the upstream speaks another protocol on this connection now, it can't go back to the pool
+    return false;
+  }
+  if (c.method == "HEAD" || code == 204 || code == 304) {
+    return keep;
+  }
+
+  if (transfer_encoding.find("chunked") != std::string::npos) {
+    while (true) {
+      if (!r.read_until("\r\n", 2, line, max_header_size)) {
+        throw SocketException("upstream closed mid body");
+      }
+      size_t n = std::strtoul(line.c_str(), nullptr, 16);
+      if (n == 0) {
+        // trailers, up to the closing empty line
+        do {
+          if (!r.read_until("\r\n", 2, line, max_header_size)) {
+            throw SocketException("upstream closed mid body");
+          }
+        } while (!line.empty());
+        return keep;
+      }
+      if (!r.relay(n, out) || !r.read_until("\r\n", 2, line, max_header_size)) {
+        throw SocketException("upstream closed mid body");
+      }
+    }
+  }
+
+  if (!content_length.empty()) {
+    if (!r.relay(std::strtoull(content_length.c_str(), nullptr, 10), out)) {
+      throw SocketException("upstream closed mid body");
+    }
+    return keep;
+  }
+
+  // neither, the body runs until the upstream closes
+  r.relay_to_eof(out);
+  return false;
+}
+
+static void set_timeouts(Socket &s, std::chrono::milliseconds timeout) {
+  struct timeval tv;
+  tv.tv_sec = timeout.count() / 1000;
+  tv.tv_usec = (timeout.count() % 1000) * 1000;
+  setsockopt(s._socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(s._socket_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* writes req, written counts what the upstream got even when it throws */
+static void send_request(Socket &s, const std::string &req, size_t &written) {
+  written = 0;
+  while (written < req.size()) {
+    ssize_t ret = send(s._socket_fd, req.data() + written, req.size() - written, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      throw SocketException("failed to write to upstream due to : " +
+                            std::string(strerror(errno)));
+    }
+    written += ret;
+  }
+}
+
+/* an idle connection the upstream closed (or wrote to) can't be reused */
+static bool still_open(Socket &s) {
+  char c;
+  ssize_t ret = recv(s._socket_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+Balancer::Balancer(std::vector<Upstream> upstreams, ProxyOptions o) : opts(std::move(o)) {
+  if (upstreams.empty()) {
+    throw SocketException("Proxy needs at least one upstream");
+  }
+  for (auto &up : upstreams) {
+    auto p = std::make_unique<Pool>();
+    p->name = up.host + ":" + std::to_string(up.port);
+    p->up = std::move(up);
+    pools.push_back(std::move(p));
+  }
+  health = std::thread([this] { health_loop(); });
+}
+
+Balancer::~Balancer() {
+  {
+    std::lock_guard<std::mutex> l(m);
+    stopping = true;
+  }
+  health_cv.notify_all();
+  if (health.joinable()) {
+    health.join();
+  }
+}
+
+/*
+ * Pool *pick()
+ *
+ * the healthy upstream with the fewest requests in flight. the scan
+ * starts one further each time, so ties take turns.
+ */
+Balancer::Pool *Balancer::pick() {
+  const size_t n = pools.size();
+  const size_t start = next.fetch_add(1, std::memory_order_relaxed);
+  Pool *best = nullptr;
+  for (size_t i = 0; i < n; ++i) {
+    Pool &p = *pools[(start + i) % n];
+    if (!p.healthy.load(std::memory_order_relaxed)) {
+      continue;
+    }
+    if (best == nullptr || p.outstanding.load(std::memory_order_relaxed) <
+                               best->outstanding.load(std::memory_order_relaxed)) {
+      best = &p;
+    }
+  }
+  return best;
+}
+
+sock_ptr Balancer::acquire(Pool &p, bool fresh, bool &reused) {
+  reused = false;
+  while (!fresh) {
+    sock_ptr s;
+    {
+      std::lock_guard<std::mutex> l(p.m);
+      if (p.idle.empty()) {
+        break;
+      }
+      // most recently used first, the oldest ones are the likeliest to be timed out
+      s = std::move(p.idle.back());
+      p.idle.pop_back();
+    }
+    if (still_open(*s)) {
+      reused = true;
+      return s;
+    }
+  }
+  sock_ptr s = tcp_connect(p.up.host, p.up.port, opts.connect_timeout);
+  set_timeouts(*s, opts.io_timeout);
+  return s;
+}
+
+void Balancer::release(Pool &p, sock_ptr s) {
+  std::lock_guard<std::mutex> l(p.m);
+  if (p.idle.size() < opts.max_idle) {
+    p.idle.push_back(std::move(s));
+  }
+}
+
+void Balancer::mark(Pool &p, bool healthy) {
+  if (healthy) {
+    p.connect_fails = 0;
+  }
+  if (p.healthy.exchange(healthy) != healthy) {
+    fprintf(stderr, "upstream %s is %s\n", p.name.c_str(), healthy ? "back up" : "down");
+  }
+  if (!healthy) {
+    std::lock_guard<std::mutex> l(p.m);
+    p.idle.clear();
+  }
+}
+
+void Balancer::forward(HTTPConn &c) {
+  Pool *p = pick();
+  if (p == nullptr) {
+    c.resp_status = 503;
+    c.send();
+    return;
+  }
+  p->outstanding++;
+  p->requests++;
+  struct done_t {
+    Pool *p;
+    ~done_t() { p->outstanding--; }
+  } done{p};
+
+  const std::string req = forward_request(c);
+  bool client_gone = false;
+  auto to_client = [&c, &client_gone](const char *data, size_t len) {
+    try {
+      c.stream(data, len);
+    } catch (SocketException &) {
+      client_gone = true;
+      throw;
+    }
+  };
+
+  for (int attempt = 0;; ++attempt) {
+    bool reused = false;
+    sock_ptr s;
+    try {
+      s = acquire(*p, attempt > 0, reused);
+      p->connect_fails = 0;
+    } catch (SocketException &e) {
+      fprintf(stderr, "%s\n", e.what());
+      p->failures++;
+      // one refused connect may be a blip, a few in a row take the upstream out
+      if (++p->connect_fails >= opts.max_fails) {
+        mark(*p, false);
+      }
+      c.resp_status = 502;
+      c.send();
+      return;
+    }
+
+    upstream_reader r(*s);
+    size_t written = 0;
+    try {
+      send_request(*s, req, written);
+      if (relay_response(c, r, opts.max_header_size, to_client)) {
+        release(*p, std::move(s));
+      }
+      return;
+    } catch (SocketException &e) {
+      if (client_gone) {
+        throw;
+      }
+      if (reused && attempt == 0 && !r.got_data && (written == 0 || idempotent(c.method))) {
+        // the upstream dropped the idle connection as we took it, a POST
+        // it may have started on isn't sent twice
+        continue;
+      }
+      fprintf(stderr, "upstream %s : %s\n", p->name.c_str(), e.what());
+      p->failures++;
+      if (!c.is_streaming()) {
+        c.resp_headers.clear();
+        c.resp_status = 502;
+        c.send();
+      }
+      // otherwise the client sees the response cut short
+      return;
+    }
+  }
+}
+
+bool Balancer::probe(Pool &p) {
+  try {
+    sock_ptr s = tcp_connect(p.up.host, p.up.port, opts.connect_timeout);
+    set_timeouts(*s, opts.connect_timeout);
+    s->write("GET " + opts.health_path + " HTTP/1.1\r\nHost: " + p.up.host +
+             "\r\nConnection: close\r\n\r\n");
+    upstream_reader r(*s);
+    std::string head;
+    if (!r.read_until("\r\n\r\n", 4, head, opts.max_header_size)) {
+      return false;
+    }
+    std::stringstream status_line(head);
+    std::string version;
+    int code = 0;
+    status_line >> version >> code;
+    return code >= 200 && code < 500;
+  } catch (SocketException &) {
+    return false;
+  }
+}
+
+void Balancer::health_loop() {
+  std::unique_lock<std::mutex> l(m);
+  while (!health_cv.wait_for(l, opts.health_interval, [this] { return stopping; })) {
+    l.unlock();
+    for (auto &p : pools) {
+      mark(*p, probe(*p));
+    }
+    l.lock();
+  }
+}
+
+std::vector<UpstreamStats> Balancer::stats() {
+  std::vector<UpstreamStats> out;
+  for (auto &p : pools) {
+    UpstreamStats s;
+    s.name = p->name;
+    s.healthy = p->healthy;
+    s.outstanding = p->outstanding;
+    s.requests = p->requests;
+    s.failures = p->failures;
+    {
+      std::lock_guard<std::mutex> l(p->m);
+      s.idle = p->idle.size();
+    }
+    out.push_back(s);
+  }
+  return out;
+}
+
+}  // namespace Kleptic::Proxy
@@ -0,0 +1,124 @@
+#ifndef KLEPTIC_PROXY_HXX_
+#define KLEPTIC_PROXY_HXX_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http.hxx"
+#include "socket.hxx"
+
+namespace Kleptic::Proxy {
+
+struct Upstream {
+  std::string host;
+  int port;
+};
+
+struct ProxyOptions {
+  /* idle keep-alive connections kept per upstream */
+  size_t max_idle = 16;
+  std::chrono::milliseconds connect_timeout{2000};
+  /* longest wait for a read or write on an upstream connection */
+  std::chrono::milliseconds io_timeout{30000};
+  /* how often every upstream is probed, a GET of health_path */
+  std::chrono::milliseconds health_interval{5000};
+  std::string health_path = "/";
+  /* most response header bytes accepted from an upstream */
+  size_t max_header_size = 64 * 1024;
+  /* failed connects in a row before an upstream is out until a health check passes */
+  unsigned max_fails = 3;
+};
+
+struct UpstreamStats {
+  std::string name;
+  bool healthy = true;
+  size_t outstanding = 0;
+  size_t idle = 0;
+  uint64_t requests = 0;
+  uint64_t failures = 0;
+};
+
+/*
+ * Balancer
+ *
+ * forwards requests to a set of upstreams, picking the healthy one with
+ * the fewest requests in flight. each upstream keeps a pool of idle
+ * HTTP/1.1 keep-alive connections, a request takes one (or connects)
+ * and hands it back once the response has been read to its end. an
+ * upstream that refuses max_fails connections in a row or fails its
+ * periodic health check gets no requests until a health check passes
+ * again.
+ */
+class Balancer {
+  struct Pool {
+    Upstream up;
+    std::string name;
+    std::mutex m;
+    std::deque<sock_ptr> idle;
+    std::atomic<size_t> outstanding{0};
+    std::atomic<bool> healthy{true};
+    std::atomic<unsigned> connect_fails{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> failures{0};
+  };
+
+  const ProxyOptions opts;
+  std::vector<std::unique_ptr<Pool>> pools;
+  std::atomic<size_t> next{0};
+
+  std::mutex m;
+  std::condition_variable health_cv;
+  bool stopping = false;
+  std::thread health;
+
+  Pool *pick();
+  sock_ptr acquire(Pool &p, bool fresh, bool &reused);
+  void release(Pool &p, sock_ptr s);
+  void mark(Pool &p, bool healthy);
+  bool probe(Pool &p);
+  void health_loop();
+
+ public:
+  Balancer(std::vector<Upstream> upstreams, ProxyOptions opts = ProxyOptions());
+  Balancer(const Balancer &) = delete;
+  Balancer &operator=(const Balancer &) = delete;
+  ~Balancer();
+
+  /*
+   * void forward(HTTPConn &)
+   *
+   * sends c's request to an upstream and streams the response back to
+   * the client as it arrives, 502 if the upstream fails before sending
+   * anything and 503 if no upstream is healthy. a request that fails on
+   * a reused connection before any response is retried once on a new
+   * one, if its method is idempotent or none of it was written.
+   */
+  void forward(HTTPConn &c);
+  std::vector<UpstreamStats> stats();
+};
+
+/*
+ * string forward_request(HTTPConn &)
+ *
+ * the request as it goes upstream: hop-by-hop headers (Connection,
+ * Keep-Alive, TE, Upgrade, ... and whatever Connection names) are
+ * dropped, the client's address is added to X-Forwarded-For,
+ * X-Forwarded-Proto and X-Forwarded-Host are set and the connection is
+ * kept alive.
+ */
+std::string forward_request(HTTPConn &c);
+
+/* true for headers that only concern one connection and aren't forwarded */
+bool is_hop_by_hop(const std::string &name, const std::vector<std::string> &connection_tokens);
+
+}  // namespace Kleptic::Proxy
+
+#endif  // KLEPTIC_PROXY_HXX_
@@ -0,0 +1,22 @@
+#ifndef KLEPTIC_QOS_HXX_
+#define KLEPTIC_QOS_HXX_
+
+namespace Kleptic::QoS {
+
+/*
+ * scheduling classes a route can be tagged with, e.g.
+ *
+ *   r.r_get("/cgi-bin", cgi_handler, QoS::BULK);
+ *
+ * untagged routes are STANDARD.
+ */
+enum class_t { INTERACTIVE = 0, STANDARD, BULK, COUNT };
+
+inline const char *to_string(class_t c) {
+  static const char *names[COUNT] = {"interactive", "standard", "bulk"};
+  return (c < COUNT) ? names[c] : "";
+}
+
+}  // namespace Kleptic::QoS
+
+#endif  // KLEPTIC_QOS_HXX_
@@ -1,129 +1,353 @@
 #include "router.hxx"
 
-#include <experimental/filesystem>
-
 #include <algorithm>
+#include <memory>
 #include <string>
-#include <vector>
+#include <string_view>
 #include <utility>
 
-namespace fs = std::experimental::filesystem;
+#include "error.hxx"
+#include "event_loop.hxx"
 
 namespace Kleptic {
 
-// Router::Router(RouteNode node) : _root_node(node) {}
+namespace Method {
+static const char *method_names[COUNT] = {"GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS"};
 
-auto route_to_vec(std::string rt) {
-  if (rt.back() == '/') {
-    rt.pop_back();
+method_t from_string(std::string_view m) {
+  for (int i = 0; i < COUNT; ++i) {
+    if (m == method_names[i]) {
+      return static_cast<method_t>(i);
+    }
   }
+  return COUNT;
+}
 
-  fs::path r_path(rt);
+const char *to_string(method_t m) { return (m < COUNT) ? method_names[m] : ""; }
+}  // namespace Method
 
-  std::vector<std::string> path_vec;
-  while (r_path != fs::path()) {
-    path_vec.push_back(r_path.filename());
-    r_path = r_path.parent_path();
+/*
+ * std::string_view trim_route(std::string_view)
+ *
+ * drops trailing slashes so "/a/" and "/a" name the same route.
+ * the root route becomes the empty string.
+ */
+static std::string_view trim_route(std::string_view rt) {
+  while (!rt.empty() && rt.back() == '/') {
+    rt.remove_suffix(1);
   }
-  if (path_vec.size() > 0) {
-    path_vec.pop_back();  // remove extraneous "/"
+  return rt;
+}
+
+/*
+ * size_t find_segment_token(std::string_view)
+ *
+ * returns the position of the first ':' or '*' that opens a path segment.
+ */
+static size_t find_segment_token(std::string_view rt) {
+  for (size_t i = 1; i < rt.size(); ++i) {
+    if ((rt[i] == ':' || rt[i] == '*') && rt[i - 1] == '/') {
+      return i;
+    }
   }
-  std::reverse(path_vec.begin(), path_vec.end());
+  return std::string_view::npos;
+}
 
-  return path_vec;
+/* every method of a route reports the route's pattern, the implied ones too */
+static method_handlers &name_slots(method_handlers &hs, const std::string &pattern) {
+  for (auto &slot : hs) {
+    slot.route = pattern;
+  }
+  return hs;
 }
 
-route_matches Router::search_route(std::string rt) {
-  auto path_vec = route_to_vec(rt);
-  route_matches matching;
-  search_route(path_vec.begin(), path_vec.end(), std::ref(_root_node),
-                          matching);
-  return matching;
+RouteNode *Router::insert_static(RouteNode *node, std::string_view rt) {
+  while (!rt.empty()) {
+    auto it = std::find_if(node->children.begin(), node->children.end(),
+                           [&](const auto &child) { return child->prefix[0] == rt[0]; });
+    if (it == node->children.end()) {
+      node->children.push_back(std::make_unique<RouteNode>(std::string(rt)));
+      return node->children.back().get();
+    }
+
+    const std::string &edge = (*it)->prefix;
+    size_t common = 0;
+    while (common < edge.size() && common < rt.size() && edge[common] == rt[common]) {
+      ++common;
+    }
+
+    if (common < edge.size()) {
+      // split the edge, the old node keeps its children and handlers
+      auto split = std::make_unique<RouteNode>(edge.substr(0, common));
+      (*it)->prefix.erase(0, common);
+      split->children.push_back(std::move(*it));
+      *it = std::move(split);
+    }
+
+    node = it->get();
+    rt.remove_prefix(common);
+  }
+  return node;
 }
 
-void Router::search_route(std::vector<std::string>::iterator path,
-                                     std::vector<std::string>::iterator path_end,
-                                     std::reference_wrapper<RouteNode> node,
-                                     route_matches& matching) {
-  if (node.get().endpoint) {
-    matching.push_back(node);
+method_handlers &Router::create_route(std::string_view route) {
+  std::string pattern(trim_route(route));
+  if (pattern.empty() || pattern[0] != '/') {
+    pattern.insert(0, "/");
   }
 
-  if (path == path_end) {
-    return;
+  RouteNode *node = &_root_node;
+  std::string_view rt = trim_route(pattern);
+  while (true) {
+    size_t tok = find_segment_token(rt);
+    node = insert_static(node, rt.substr(0, tok));
+    if (tok == std::string_view::npos) {
+      break;
+    }
+
+    if (rt[tok] == '*') {
+      std::string_view name = rt.substr(tok + 1);
+      if (node->wildcard && node->wildcard_name != name) {
+        throw RouteException("Conflicting wildcard names", std::string(route));
+      }
+      node->wildcard = true;
+      node->wildcard_name = name;
+      return name_slots(node->wildcard_handlers, pattern);
+    }
+
+    size_t seg_end = rt.find('/', tok);
+    std::string_view name = rt.substr(tok + 1, seg_end - tok - 1);
+    if (!node->param_child) {
+      node->param_child = std::make_unique<RouteNode>();
+      node->param_name = name;
+    } else if (node->param_name != name) {
+      throw RouteException("Conflicting parameter names", std::string(route));
+    }
+    node = node->param_child.get();
+
+    if (seg_end == std::string_view::npos) {
+      break;
+    }
+    rt = rt.substr(seg_end);
   }
 
-  if (node.get().next.find(*path) == node.get().next.end()) {
-    return;
+  node->endpoint = true;
+  return name_slots(node->handlers, pattern);
+}
+
+/*
+ * bool search_route(const RouteNode *, std::string_view, RouteMatch &)
+ *
+ * path is whatever is left after node's prefix has been consumed.
+ * returns true once m has been filled with the best match below node.
+ */
+bool Router::search_route(const RouteNode *node, std::string_view path, RouteMatch &m) const {
+  if (path.empty() && node->endpoint) {
+    m.handlers = &node->handlers;
+    m.unparsed = path;
+    return true;
   }
 
-  search_route(path + 1, path_end, std::ref(node.get().next[*path]), matching);
+  if (!path.empty()) {
+    for (const auto &child : node->children) {
+      const std::string &edge = child->prefix;
+      if (edge[0] != path[0]) {
+        continue;
+      }
+      if (path.compare(0, edge.size(), edge) == 0 &&
+          search_route(child.get(), path.substr(edge.size()), m)) {
+        return true;
+      }
+      break;
+    }
+  }
+
+  if (node->param_child && !path.empty() && m.num_params < KLEPTIC_ROUTE_MAX_PARAMS) {
+    size_t seg_end = path.find('/');
+    std::string_view seg = path.substr(0, seg_end);
+    if (!seg.empty()) {
+      size_t saved = m.num_params;
+      m.params[m.num_params++] = {node->param_name, seg};
+      if (search_route(node->param_child.get(), path.substr(seg.size()), m)) {
+        return true;
+      }
+      m.num_params = saved;
+    }
+  }
+
+  if (node->wildcard && !path.empty() && m.num_params < KLEPTIC_ROUTE_MAX_PARAMS) {
+    // a wildcard node always ends in '/', so the byte before path is a slash
+    m.params[m.num_params++] = {node->wildcard_name, path};
+    m.handlers = &node->wildcard_handlers;
+    m.unparsed = std::string_view(path.data() - 1, path.size() + 1);
+    return true;
+  }
+
+  if (node->endpoint && !path.empty() && path[0] == '/') {
+    m.handlers = &node->handlers;
+    m.unparsed = path;
+    return true;
+  }
+
+  return false;
 }
 
-std::reference_wrapper<RouteNode> Router::create_route(std::string rt) {
-  auto path_vec = route_to_vec(rt);
-  return create_route(path_vec.begin(), path_vec.end(), std::ref(_root_node));
+RouteMatch Router::match(std::string_view path) const {
+  RouteMatch m;
+  search_route(&_root_node, trim_route(path), m);
+  return m;
 }
 
-std::reference_wrapper<RouteNode> Router::create_route(path_iter path, path_iter path_end,
-                                                       std::reference_wrapper<RouteNode> node) {
-  if (path == path_end) {
-    node.get().endpoint = true;
-    return node;
-  }
-  return create_route(path + 1, path_end, node.get().next[*path]);
+HTTPConnHandler Router::compose(const std::vector<HTTPConnMiddleware> &route_mw,
+                                HTTPConnHandler handler) const {
+  // where a sampled request's middleware ends and its handler begins
+  HTTPConnHandler next = [handler = std::move(handler)](HTTPConn &c) {
+    c.timing.mark(RequestTiming::HANDLER);
+    handler(c);
+  };
+  auto wrap = [&next](const HTTPConnMiddleware &mw) {
+    next = [mw, next](HTTPConn &c) {
+      if (!c.is_set()) {
+        mw(c, next);
+      }
+    };
+  };
+  std::for_each(route_mw.rbegin(), route_mw.rend(), wrap);
+  std::for_each(middleware.rbegin(), middleware.rend(), wrap);
+  return next;
 }
 
-HTTPConnHandler Router::h_get(std::string rt) {
-  auto matches = search_route(rt);
-  if (matches.size() == 0) {
-    return Handler::not_found_handler;
+/*
+ * void compose_slots(method_handlers &)
+ *
+ * rebuilds the pipelines of one route. methods without a handler get the
+ * not found pipeline, HEAD falls back to GET and OPTIONS answers with the
+ * methods the route supports.
+ */
+void Router::compose_slots(method_handlers &hs) {
+  std::string allow;
+  for (int i = 0; i < Method::COUNT; ++i) {
+    auto mi = static_cast<Method::method_t>(i);
+    bool implied = (mi == Method::OPTIONS) || (mi == Method::HEAD && hs[Method::GET]);
+    if (hs[i] || implied) {
+      allow += (allow.empty() ? "" : ", ") + std::string(Method::to_string(mi));
+    }
   }
-  return matches.back().get().get_handler;
-}
 
-HTTPConnHandler Router::h_put(std::string rt) {
-  auto matches = search_route(rt);
-  if (matches.size() == 0) {
-    return Handler::not_found_handler;
+  for (int i = 0; i < Method::COUNT; ++i) {
+    if (hs[i]) {
+      hs[i].pipeline = compose(hs[i].middleware, hs[i].handler);
+    }
+  }
+  for (int i = 0; i < Method::COUNT; ++i) {
+    if (hs[i]) {
+      continue;
+    }
+    if (i == Method::HEAD && hs[Method::GET]) {
+      hs[i].pipeline = hs[Method::GET].pipeline;
+      hs[i].qos = hs[Method::GET].qos;
+    } else if (i == Method::OPTIONS) {
+      hs[i].pipeline = compose({}, [allow](HTTPConn &c) {
+        c.resp_status = 204;
+        c.resp_headers["Allow"] = allow;
+        c.send();
+      });
+    } else {
+      hs[i].pipeline = compose({}, Handler::not_found_handler);
+    }
   }
-  return matches.back().get().put_handler;
 }
 
-HTTPConnHandler Router::h_post(std::string rt) {
-  auto matches = search_route(rt);
-  if (matches.size() == 0) {
-    return Handler::not_found_handler;
+void Router::compose_node(RouteNode &node) {
+  if (node.endpoint) {
+    compose_slots(node.handlers);
+  }
+  if (node.wildcard) {
+    compose_slots(node.wildcard_handlers);
+  }
+  for (auto &child : node.children) {
+    compose_node(*child);
+  }
+  if (node.param_child) {
+    compose_node(*node.param_child);
   }
-  return matches.back().get().post_handler;
 }
 
-HTTPConnHandler Router::h_delete(std::string rt) {
-  auto matches = search_route(rt);
-  if (matches.size() == 0) {
-    return Handler::not_found_handler;
+const HTTPConnHandler &Router::h_method(Method::method_t method, const RouteMatch &m) const {
+  if (!m.found() || method == Method::COUNT) {
+    return not_found_pipeline;
   }
-  return matches.back().get().delete_handler;
+  return (*m.handlers)[method].pipeline;
+}
+
+const HTTPConnHandler &Router::h_method(Method::method_t method, std::string_view rt) const {
+  return h_method(method, match(rt));
+}
+
+const HTTPConnHandler &Router::h_get(std::string_view rt) const {
+  return h_method(Method::GET, rt);
+}
+const HTTPConnHandler &Router::h_head(std::string_view rt) const {
+  return h_method(Method::HEAD, rt);
+}
+const HTTPConnHandler &Router::h_put(std::string_view rt) const {
+  return h_method(Method::PUT, rt);
+}
+const HTTPConnHandler &Router::h_post(std::string_view rt) const {
+  return h_method(Method::POST, rt);
+}
+const HTTPConnHandler &Router::h_delete(std::string_view rt) const {
+  return h_method(Method::DELETE, rt);
+}
+const HTTPConnHandler &Router::h_options(std::string_view rt) const {
+  return h_method(Method::OPTIONS, rt);
 }
 
-void Router::handle(HTTPConn& c) {
+void Router::dispatch(HTTPConn &c) const {
   if (c.is_set()) {
     return;
   }
-  for (const auto& h : middleware) {
-    h(c);
-    if (c.is_set()) {
-      return;
-    }
+
+  auto method = Method::from_string(c.method);
+  if (method == Method::COUNT) {
+    not_implemented_pipeline(c);
+    return;
+  }
+
+  RouteMatch m = match(c.req_path);
+  c.timing.mark(RequestTiming::ROUTED);
+  c.route_params.clear();
+  for (size_t i = 0; i < m.num_params; ++i) {
+    c.route_params[std::string(m.params[i].first)] = std::string(m.params[i].second);
   }
-  if (!c.method.compare("GET")) {
-    h_get(c.req_path)(c);
-  } else if (!c.method.compare("POST")) {
-    h_post(c.req_path)(c);
-  } else if (!c.method.compare("PUT")) {
-    h_put(c.req_path)(c);
-  } else if (!c.method.compare("DELETE")) {
-    h_delete(c.req_path)(c);
+  c.route_unparsed_path = m.unparsed;
+  c.route = m.found() ? std::string_view((*m.handlers)[method].route) : std::string_view();
+
+  h_method(method, m)(c);
+}
+
+QoS::class_t Router::classify(const HTTPConn &c) const {
+  auto method = Method::from_string(c.method);
+  RouteMatch m = match(c.req_path);
+  if (!m.found() || method == Method::COUNT) {
+    return QoS::STANDARD;
+  }
+  return (*m.handlers)[method].qos;
+}
+
+void Router::handle(HTTPConn &c) const {
+  dispatch(c);
+  if (c.async_handler) {
+    auto h = std::move(c.async_handler);
+    Async::sync_wait((*h)(c));
+  }
+}
+
+Async::task<void> Router::handle_async(HTTPConn &c) const {
+  dispatch(c);
+  if (c.async_handler) {
+    auto h = std::move(c.async_handler);
+    co_await (*h)(c);
   }
 }
 
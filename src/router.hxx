@@ -1,78 +1,225 @@
 #ifndef KLEPTIC_ROUTER_HXX_
 #define KLEPTIC_ROUTER_HXX_
 
-#include <map>
+#include <array>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "handler.hxx"
 #include "http.hxx"
+#include "qos.hxx"
+
+#define KLEPTIC_ROUTE_MAX_PARAMS 16
 
 namespace Kleptic {
 
+namespace Method {
+enum method_t { GET = 0, HEAD, POST, PUT, DELETE, OPTIONS, COUNT };
+
+method_t from_string(std::string_view m);
+const char *to_string(method_t m);
+}  // namespace Method
+
+/*
+ * RouteSlot
+ *
+ * one method of one route. pipeline is the global middleware, the route
+ * middleware and the handler composed into a single callable when the
+ * route is registered, so dispatch only has to pick it. qos is the
+ * scheduling class the route was tagged with, route the pattern it was
+ * registered under.
+ */
+struct RouteSlot {
+  HTTPConnHandler handler;
+  std::vector<HTTPConnMiddleware> middleware;
+  HTTPConnHandler pipeline;
+  QoS::class_t qos = QoS::STANDARD;
+  std::string route;
+
+  explicit operator bool() const { return static_cast<bool>(handler); }
+};
+
+typedef std::array<RouteSlot, Method::COUNT> method_handlers;
+
+/*
+ * RouteNode
+ *
+ * one node of a compressed radix tree keyed on the raw path characters.
+ * static edges are stored in children (first characters are unique), a
+ * ":name" segment hangs off param_child and a "*name" tail is stored in
+ * the wildcard_* slots of the node whose prefix ends in '/'.
+ */
 struct RouteNode {
-  std::map<std::string, RouteNode> next;
-  HTTPConnHandler get_handler = Handler::not_found_handler;
-  HTTPConnHandler put_handler = Handler::not_found_handler;
-  HTTPConnHandler post_handler = Handler::not_found_handler;
-  HTTPConnHandler delete_handler = Handler::not_found_handler;
+  std::string prefix;
+  std::vector<std::unique_ptr<RouteNode>> children;
+
+  std::string param_name;
+  std::unique_ptr<RouteNode> param_child;
+
+  std::string wildcard_name;
+  method_handlers wildcard_handlers = {};
+  bool wildcard = false;
+
+  method_handlers handlers = {};
   bool endpoint = false;
+
   RouteNode() = default;
+  explicit RouteNode(std::string p) : prefix(std::move(p)) {}
+};
+
+typedef std::pair<std::string_view, std::string_view> route_param;
+
+/*
+ * RouteMatch
+ *
+ * result of a lookup. everything is a view into either the tree or the
+ * searched path, so a lookup never allocates.
+ */
+struct RouteMatch {
+  const method_handlers *handlers = nullptr;
+  std::array<route_param, KLEPTIC_ROUTE_MAX_PARAMS> params;
+  size_t num_params = 0;
+  std::string_view unparsed;
+
+  bool found() const { return handlers != nullptr; }
 };
 
-typedef std::vector<std::reference_wrapper<RouteNode>> route_matches;
-typedef std::vector<std::string>::iterator path_iter;
 class Router {
-  std::vector<HTTPConnHandler> middleware;
+  std::vector<HTTPConnMiddleware> middleware;
+  HTTPConnHandler not_found_pipeline = compose({}, Handler::not_found_handler);
+  HTTPConnHandler not_implemented_pipeline = compose({}, Handler::not_implemented_handler);
+
+  method_handlers &create_route(std::string_view);
+  RouteNode *insert_static(RouteNode *node, std::string_view rt);
+  bool search_route(const RouteNode *node, std::string_view path, RouteMatch &m) const;
 
-  route_matches search_route(std::string);
-  void search_route(std::vector<std::string>::iterator,
-                               std::vector<std::string>::iterator,
-                               std::reference_wrapper<RouteNode> r,
-                               route_matches& matching);
+  HTTPConnHandler compose(const std::vector<HTTPConnMiddleware> &route_mw,
+                          HTTPConnHandler handler) const;
+  void compose_slots(method_handlers &);
+  void compose_node(RouteNode &);
+
+  /*
+   * plain handlers run in front of the rest of the chain and stop it once
+   * the response is set. HTTPConnMiddleware style callables wrap it.
+   */
+  template <typename H>
+  static HTTPConnMiddleware derive_middleware(H handler) {
+    if constexpr (std::is_invocable_v<H, HTTPConn &, const HTTPConnHandler &>) {
+      return handler;
+    } else {
+      return Handler::wrap_middleware(Handler::derive_http_handler(handler));
+    }
+  }
+
+  /*
+   * coroutine handlers sit behind a plain stub that parks them on the
+   * connection, the middleware in front runs as usual and handle or
+   * handle_async finishes the request. middleware therefore sees the
+   * response of a coroutine route only after the chain has returned.
+   */
+  template <typename H>
+  static HTTPConnHandler derive_handler(H handler) {
+    if constexpr (std::is_invocable_r_v<Async::task<void>, H, HTTPConn &>) {
+      auto h = std::make_shared<const HTTPConnAsyncHandler>(std::move(handler));
+      return [h](HTTPConn &c) { c.async_handler = h; };
+    } else {
+      return Handler::derive_http_handler(handler);
+    }
+  }
+
+  /* route arguments after the handler are middleware or a QoS class */
+  template <typename M>
+  static void add_route_arg(RouteSlot &slot, M arg) {
+    if constexpr (std::is_same_v<M, QoS::class_t>) {
+      slot.qos = arg;
+    } else {
+      slot.middleware.push_back(derive_middleware(arg));
+    }
+  }
+
+  void dispatch(HTTPConn &) const;
 
-  std::reference_wrapper<RouteNode> create_route(std::string);
-  std::reference_wrapper<RouteNode> create_route(path_iter, path_iter,
-                                                 std::reference_wrapper<RouteNode> r);
   RouteNode _root_node = {};
 
  public:
   Router() = default;
-  // Router(RouteNode node);
-  template <typename H>
-  void r_get(std::string rt, H handler) {
-    auto route = create_route(rt);
-    route.get().get_handler = Handler::derive_http_handler(handler);
+
+  template <typename H, typename... M>
+  void add_route(Method::method_t m, std::string_view rt, H handler, M... route_mw) {
+    method_handlers &slots = create_route(rt);
+    slots[m].handler = derive_handler(handler);
+    slots[m].middleware.clear();
+    slots[m].qos = QoS::STANDARD;
+    (add_route_arg(slots[m], route_mw), ...);
+    compose_slots(slots);
   }
-  template <typename H>
-  void r_put(std::string rt, H handler) {
-    auto route = create_route(rt);
-    route.get().put_handler = Handler::derive_http_handler(handler);
+  template <typename H, typename... M>
+  void r_get(std::string rt, H handler, M... route_mw) {
+    add_route(Method::GET, rt, handler, route_mw...);
   }
-  template <typename H>
-  void r_post(std::string rt, H handler) {
-    auto route = create_route(rt);
-    route.get().post_handler = Handler::derive_http_handler(handler);
+  template <typename H, typename... M>
+  void r_head(std::string rt, H handler, M... route_mw) {
+    add_route(Method::HEAD, rt, handler, route_mw...);
   }
-  template <typename H>
-  void r_delete(std::string rt, H handler) {
-    auto route = create_route(rt);
-    route.get().delete_handler = Handler::derive_http_handler(handler);
+  template <typename H, typename... M>
+  void r_put(std::string rt, H handler, M... route_mw) {
+    add_route(Method::PUT, rt, handler, route_mw...);
+  }
+  template <typename H, typename... M>
+  void r_post(std::string rt, H handler, M... route_mw) {
+    add_route(Method::POST, rt, handler, route_mw...);
   }
+  template <typename H, typename... M>
+  void r_delete(std::string rt, H handler, M... route_mw) {
+    add_route(Method::DELETE, rt, handler, route_mw...);
+  }
+  template <typename H, typename... M>
+  void r_options(std::string rt, H handler, M... route_mw) {
+    add_route(Method::OPTIONS, rt, handler, route_mw...);
+  }
+
+  /*
+   * global middleware runs in front of every route (and of the not found
+   * and not implemented handlers), after any middleware added before it.
+   */
   template <typename H>
   void add_middleware(H handler) {
-    middleware.push_back(Handler::derive_http_handler(handler));
+    middleware.push_back(derive_middleware(handler));
+    compose_node(_root_node);
+    not_found_pipeline = compose({}, Handler::not_found_handler);
+    not_implemented_pipeline = compose({}, Handler::not_implemented_handler);
   }
 
-  // TODO : Middleware handling
+  /*
+   * routes are matched segment-wise in priority static > :param > *wildcard.
+   * a route with no deeper match also serves every path below it, with the
+   * remainder left in RouteMatch::unparsed.
+   */
+  RouteMatch match(std::string_view) const;
+
+  /*
+   * the h_* lookups return the composed pipeline for the route, the
+   * reference stays valid until the router is modified.
+   */
+  const HTTPConnHandler &h_method(Method::method_t, const RouteMatch &) const;
+  const HTTPConnHandler &h_method(Method::method_t, std::string_view) const;
+  const HTTPConnHandler &h_get(std::string_view) const;
+  const HTTPConnHandler &h_head(std::string_view) const;
+  const HTTPConnHandler &h_put(std::string_view) const;
+  const HTTPConnHandler &h_post(std::string_view) const;
+  const HTTPConnHandler &h_delete(std::string_view) const;
+  const HTTPConnHandler &h_options(std::string_view) const;
 
-  HTTPConnHandler h_get(std::string);
-  HTTPConnHandler h_put(std::string);
-  HTTPConnHandler h_post(std::string);
-  HTTPConnHandler h_delete(std::string);
+  /* scheduling class of the route c would be dispatched to */
+  QoS::class_t classify(const HTTPConn &c) const;
 
-  // TODO : Populate router unparsed path in conn
-  void handle(HTTPConn&);
+  /* runs a matched coroutine handler to completion on the calling thread */
+  void handle(HTTPConn &) const;
+  Async::task<void> handle_async(HTTPConn &) const;
 };
 }  // namespace Kleptic
 
@@ -1,6 +1,5 @@
 #include "server.hxx"
 
-#include <future>
 #include <memory>
 #include <string>
 #include <utility>
@@ -9,10 +8,15 @@ namespace Kleptic {
 SocketServer::SocketServer(s_acceptor_t s, const Concurrency::runner_t &r)
     : _s_acceptor(std::move(s)), _runner(r) {}
 
-TCPServer::TCPServer(std::string ip, int port, const Concurrency::runner_t &r)
-    : SocketServer(std::make_unique<TCPAcceptor>(ip, port), r) {}
+TCPServer::TCPServer(std::string ip, int port, const Concurrency::runner_t &r, bool reuse_port)
+    : SocketServer(std::make_unique<TCPAcceptor>(ip, port, reuse_port), r) {}
 
 TLSServer::TLSServer(std::string ip, int port, const Concurrency::runner_t &r,
-                     tls_cert_key_pair &conf)
-    : SocketServer(std::make_unique<TLSAcceptor>(ip, port, conf), r) {}
+                     tls_cert_key_pair &conf, const TLS::SessionOptions &sessions,
+                     const TLS::HandshakeOptions &handshakes)
+    : SocketServer(std::make_unique<TLSAcceptor>(ip, port, conf, sessions, handshakes), r) {}
+
+TLS::Stats TLSServer::tls_stats() const {
+  return static_cast<const TLSAcceptor &>(*_s_acceptor).session_stats();
+}
 }  // namespace Kleptic
@@ -2,13 +2,20 @@
 #define KLEPTIC_SERVER_HXX_
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 
+#include <chrono>
+#include <cstdio>
+#include <exception>
 #include <functional>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "concurrency.hxx"
+#include "error.hxx"
+#include "event_loop.hxx"
 #include "socket.hxx"
 #include "tcp_sock.hxx"
 #include "tls_sock.hxx"
@@ -23,18 +30,95 @@ class SocketServer {
   const Concurrency::runner_t &_runner;
   SocketServer(s_acceptor_t s, const Concurrency::runner_t &r);
 
+  template <typename F>
+  Async::task<void> accept_async(F handle) {
+    const int fd = _s_acceptor->listen_fd();
+    if (fd >= 0) {
+      // another process may win the accept, don't block the loop on it
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    auto accept = [this] { return _s_acceptor->accept_conn(); };
+    while (1) {
+      conn_t c;
+      try {
+        if (fd >= 0) {
+          co_await Async::readable(fd);
+          c = accept();
+        } else {
+          c = co_await Async::offload(accept);
+        }
+      } catch (SocketException &) {
+        continue;
+      }
+      c->accepted_at = std::chrono::steady_clock::now();
+      Async::spawn(establish(std::move(c), handle));
+    }
+  }
+
+  /* handle runs once the connection's handshake, if it has one, is through */
+  template <typename F>
+  static Async::task<void> establish(conn_t c, F &handle) {
+    c->started_at = std::chrono::steady_clock::now();
+    // bound to a name, gcc 12 never starts a co_await inside the if condition
+    const bool ok = co_await Async::handshake(*c->socket);
+    if (!ok) {
+      co_return;
+    }
+    c->handshaken_at = std::chrono::steady_clock::now();
+    co_await handle(std::move(c));
+  }
+
  public:
+  Concurrency::ConcurrentRunner &runner() const { return *_runner; }
+  /* ALPN protocols, most preferred first, see SockAcceptor::set_protocols */
+  void set_protocols(const std::vector<std::string> &protocols) {
+    _s_acceptor->set_protocols(protocols);
+  }
+
   template <typename F>
   void run(F handle) {
-    while (1) {
-      conn_t c = _s_acceptor->accept_conn();
-      // std::cout << "Accepted Connection" << std::endl;
+    _runner->serve([&] {
+      while (1) {
+        conn_t c;
+        try {
+          c = _s_acceptor->accept_conn();
+        } catch (SocketException &) {
+          continue;
+        }
+        c->accepted_at = std::chrono::steady_clock::now();
+        // std::cout << "Accepted Connection" << std::endl;
 
-      auto task_lambda = [&, c = std::move(c)]() mutable { handle(std::move(c)); };
+        auto task_lambda = [&, c = std::move(c)]() mutable {
+          try {
+            c->started_at = std::chrono::steady_clock::now();
+            // on the worker, a slow handshake only holds up its own connection
+            if (!handshake(*c->socket)) {
+              return;
+            }
+            c->handshaken_at = std::chrono::steady_clock::now();
+            handle(std::move(c));
+          } catch (SocketException &) {
+            // the client went away, drop the connection
+          } catch (const std::exception &e) {
+            fprintf(stderr, "Unhandled exception serving a connection : %s\n", e.what());
+          }
+        };
+        _runner->dispatch(Concurrency::task_t(std::move(task_lambda)));
+      }
+    });
+  }
 
-      std::packaged_task<void()> task{std::move(task_lambda)};
-      _runner->dispatch(std::move(task));
-    }
+  /* handle returns an Async::task<void> for each connection */
+  template <typename F>
+  void run_async(Async::EventLoop &loop, F handle) {
+    listen_async(loop, std::move(handle));
+    loop.run();
+  }
+
+  /* same, but only starts accepting on loop, whoever owns it runs it */
+  template <typename F>
+  void listen_async(Async::EventLoop &loop, F handle) {
+    loop.spawn(accept_async(std::move(handle)));
   }
 };
 
@@ -42,12 +126,15 @@ typedef std::unique_ptr<SocketServer> socket_server_t;
 
 class TCPServer : public SocketServer {
  public:
-  TCPServer(std::string ip, int port, const Concurrency::runner_t &r);
+  TCPServer(std::string ip, int port, const Concurrency::runner_t &r, bool reuse_port = false);
 };
 
 class TLSServer : public SocketServer {
  public:
-  TLSServer(std::string ip, int port, const Concurrency::runner_t &r, tls_cert_key_pair &);
+  TLSServer(std::string ip, int port, const Concurrency::runner_t &r, tls_cert_key_pair &,
+            const TLS::SessionOptions &sessions = TLS::SessionOptions(),
+            const TLS::HandshakeOptions &handshakes = TLS::HandshakeOptions());
+  TLS::Stats tls_stats() const;
 };
 
 }  // namespace Kleptic
@@ -1,7 +1,17 @@
 #include "socket.hxx"
 
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <string>
 
+#include "error.hxx"
+
 namespace Kleptic {
 
 std::string Conn::getIP4() {
@@ -13,4 +23,60 @@ std::string Conn::getIP4() {
   return std::string(ip_str);
 }
 
+int Socket::try_read(char *buff, const int size) { return recv(_socket_fd, buff, size, MSG_DONTWAIT); }
+
+int Socket::try_write(const char *buff, const int len) {
+  return send(_socket_fd, buff, len, MSG_DONTWAIT);
+}
+
+void Socket::send_file(int fd, off_t offset, size_t count) {
+  while (count > 0) {
+    ssize_t ret = sendfile(_socket_fd, fd, &offset, count);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      throw SocketException("sendfile failed due to : " + std::string(strerror(errno)));
+    }
+    if (ret == 0) {
+      throw SocketException("file ended " + std::to_string(count) + " bytes early");
+    }
+    count -= ret;
+  }
+}
+
+int BufferSocket::try_write(const char *buff, const int len) {
+  data.append(buff, len);
+  return len;
+}
+
+void BufferSocket::send_file(int fd, off_t offset, size_t count) {
+  const size_t start = data.size();
+  data.resize(start + count);
+  ssize_t ret = pread(fd, data.data() + start, count, offset);
+  if (ret != static_cast<ssize_t>(count)) {
+    data.resize(start);
+    throw SocketException("file ended " + std::to_string(count) + " bytes early");
+  }
+}
+
+bool handshake(Socket &s) {
+  typedef std::chrono::steady_clock clock;
+  handshake_t step;
+  while ((step = s.try_handshake()) == HANDSHAKE_WANT_READ || step == HANDSHAKE_WANT_WRITE) {
+    int timeout = -1;
+    if (s.handshake_deadline != clock::time_point::max()) {
+      auto left = std::chrono::ceil<std::chrono::milliseconds>(s.handshake_deadline - clock::now());
+      // the step after the deadline fails, no need to wait for it
+      timeout = static_cast<int>(std::max<int64_t>(left.count(), 0));
+    }
+    const short events = step == HANDSHAKE_WANT_READ ? POLLIN : POLLOUT;
+    struct pollfd p = {s._socket_fd, events, 0};
+    if (poll(&p, 1, timeout) < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+  return step == HANDSHAKE_DONE;
+}
+
 }  // namespace Kleptic
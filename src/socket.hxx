@@ -2,13 +2,20 @@
 #define KLEPTIC_SOCKET_HXX_
 
 #include <arpa/inet.h>
+#include <sys/types.h>
 
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 
 namespace Kleptic {
+
+/* where a non-blocking handshake stands after a step */
+enum handshake_t { HANDSHAKE_DONE, HANDSHAKE_WANT_READ, HANDSHAKE_WANT_WRITE, HANDSHAKE_FAILED };
+
 class Socket {
   /*protected:
     virtual Socket* clone_impl() const = 0;*/
@@ -20,9 +27,58 @@ class Socket {
   virtual int read(char *buff, const int size) = 0;
   virtual void write(std::string const &data) = 0;
   virtual void write(const char *buff, int len) = 0;
+  /* non-blocking variants, -1 with errno EAGAIN when the socket isn't ready */
+  virtual int try_read(char *buff, const int size);
+  virtual int try_write(const char *buff, const int len);
+  /*
+   * writes count bytes of the file fd from offset on, blocking. plain
+   * sockets hand it to sendfile(2) so the bytes never reach userspace.
+   * throws SocketException, also if the file ends early.
+   */
+  virtual void send_file(int fd, off_t offset, size_t count);
+  /*
+   * one non-blocking step of the setup a protocol does before any data
+   * (the TLS handshake), plain sockets are done right away. a step taken
+   * after handshake_deadline fails.
+   */
+  virtual handshake_t try_handshake() { return HANDSHAKE_DONE; }
+  /* the application protocol the handshake agreed on (ALPN), empty if nothing was negotiated */
+  virtual std::string protocol() const { return ""; }
+  std::chrono::steady_clock::time_point handshake_deadline =
+      std::chrono::steady_clock::time_point::max();
   explicit Socket(int fd) : _socket_fd(fd) {}
 };
 
+/*
+ * BufferSocket
+ *
+ * a socket with no connection behind it, for running a handler whose
+ * response isn't going straight to a client: whatever it writes, files
+ * included, is kept in data. reads see the end of the stream.
+ */
+class BufferSocket : public Socket {
+ public:
+  std::string data;
+
+  BufferSocket() : Socket(-1) {}
+  std::stringstream read_all() override { return std::stringstream(); }
+  int read(char *, const int) override { return 0; }
+  void write(std::string const &d) override { data += d; }
+  void write(const char *buff, int len) override { data.append(buff, len); }
+  int try_read(char *, const int) override { return 0; }
+  int try_write(const char *buff, const int len) override;
+  void send_file(int fd, off_t offset, size_t count) override;
+};
+
+/*
+ * bool handshake(Socket &)
+ *
+ * drives try_handshake to the end on the calling thread, polling for
+ * whatever it waits on until the socket's deadline. false if it failed
+ * or timed out, the connection should just be dropped then.
+ */
+bool handshake(Socket &s);
+
 typedef std::unique_ptr<Socket> sock_ptr;
 
 struct Conn {
@@ -30,6 +86,11 @@ struct Conn {
   struct sockaddr_in addr;
   std::string getIP4();
 
+  /* stamped by SocketServer: accepted, picked up by a worker, handshake done */
+  std::chrono::steady_clock::time_point accepted_at;
+  std::chrono::steady_clock::time_point started_at;
+  std::chrono::steady_clock::time_point handshaken_at;
+
   Conn() = default;
   ~Conn() = default;
 
@@ -52,6 +113,10 @@ typedef std::unique_ptr<Conn> conn_t;
 class SockAcceptor {
  public:
   virtual conn_t accept_conn() const = 0;
+  /* pollable listening fd, -1 if accept_conn may block after it polls ready */
+  virtual int listen_fd() const { return -1; }
+  /* application protocols to offer through ALPN, most preferred first. only TLS negotiates */
+  virtual void set_protocols(const std::vector<std::string> &) {}
   virtual ~SockAcceptor() = default;
 };
 
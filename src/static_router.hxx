@@ -0,0 +1,260 @@
+#ifndef KLEPTIC_STATIC_ROUTER_HXX_
+#define KLEPTIC_STATIC_ROUTER_HXX_
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "handler.hxx"
+#include "http.hxx"
+#include "router.hxx"
+
+/*
+ * Compile time route tables.
+ *
+ * routes are declared as types, the paths are hashed at compile time into a
+ * collision free table and dispatch is a fold over the route list, so the
+ * handlers are called directly and can be inlined. the table is built by
+ * hash and displace: routes are hashed into buckets, and each bucket,
+ * biggest first, looks for a displacement that puts all of its routes in
+ * free slots. that takes time linear in the number of routes, so large
+ * tables stay within the compiler's constexpr limits.
+ *
+ *   static constexpr char stats_path[] = "/stats";
+ *   void stats(HTTPConn &);
+ *
+ *   using api = Static::StaticRouter<Static::Get<stats_path, stats>,
+ *                                    Static::Post<stats_path, stats>>;
+ *   server.run(api{});            // or r.r_get("/api", api{});
+ *
+ * a StaticRouter matches against HTTPConn::route_unparsed_path, which holds
+ * the full path before routing and the remaining tail when mounted below a
+ * dynamic Router. like Router, a route also serves the paths below it.
+ */
+
+namespace Kleptic::Static {
+
+constexpr std::string_view trim_route(std::string_view rt) {
+  while (!rt.empty() && rt.back() == '/') {
+    rt.remove_suffix(1);
+  }
+  return rt;
+}
+
+/* hashed once per lookup, displace then picks the bucket and the slot */
+constexpr uint64_t hash_route(Method::method_t m, std::string_view path) {
+  uint64_t h = 14695981039346656037ull;
+  h = (h ^ static_cast<uint64_t>(m)) * 1099511628211ull;
+  for (char ch : path) {
+    h = (h ^ static_cast<unsigned char>(ch)) * 1099511628211ull;
+  }
+  return h;
+}
+
+constexpr uint64_t displace(uint64_t h, uint64_t d) {
+  h += d * 0x9E3779B97F4A7C15ull;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+  return h ^ (h >> 31);
+}
+
+template <const char *Path, auto Fn, Method::method_t M = Method::GET>
+struct Route {
+  static constexpr std::string_view path = trim_route(Path);
+  static constexpr Method::method_t method = M;
+  static void invoke(HTTPConn &c) { Fn(c); }
+};
+
+template <const char *Path, typename H, Method::method_t M = Method::GET>
+struct HandlerRoute {
+  static constexpr std::string_view path = trim_route(Path);
+  static constexpr Method::method_t method = M;
+  static void invoke(HTTPConn &c) { H{}(c); }
+};
+
+template <const char *Path, auto Fn>
+using Get = Route<Path, Fn, Method::GET>;
+template <const char *Path, auto Fn>
+using Head = Route<Path, Fn, Method::HEAD>;
+template <const char *Path, auto Fn>
+using Post = Route<Path, Fn, Method::POST>;
+template <const char *Path, auto Fn>
+using Put = Route<Path, Fn, Method::PUT>;
+template <const char *Path, auto Fn>
+using Delete = Route<Path, Fn, Method::DELETE>;
+template <const char *Path, auto Fn>
+using Options = Route<Path, Fn, Method::OPTIONS>;
+
+namespace detail {
+
+constexpr size_t table_size(size_t n) {
+  size_t s = 1;
+  while (s < 2 * n) {
+    s <<= 1;
+  }
+  return s;
+}
+
+/* about two routes a bucket */
+constexpr size_t bucket_count(size_t n) { return n / 2 + 1; }
+
+/* displacements a bucket tries before the table is given up on */
+constexpr uint32_t max_displacement = 1 << 16;
+
+template <size_t N, size_t B, size_t T>
+struct Table {
+  /* bucket b's routes sit at displace(h, disp[b] + 1) */
+  std::array<uint32_t, B> disp = {};
+  std::array<int, T> slots = {};
+  /* the same method and path twice, they can't both have a slot */
+  bool duplicate = false;
+  bool placed = false;
+};
+
+template <size_t N, size_t B, size_t T>
+constexpr Table<N, B, T> build_table(const std::array<std::string_view, N> &paths,
+                                     const std::array<Method::method_t, N> &methods) {
+  Table<N, B, T> t;
+  for (auto &s : t.slots) {
+    s = -1;
+  }
+
+  // the routes grouped by bucket: bucket b holds members[start[b] .. start[b + 1])
+  std::array<uint64_t, N> hashes = {};
+  std::array<size_t, B + 1> start = {};
+  for (size_t i = 0; i < N; ++i) {
+    hashes[i] = hash_route(methods[i], paths[i]);
+    ++start[displace(hashes[i], 0) % B + 1];
+  }
+  size_t largest = 0;
+  for (size_t b = 0; b < B; ++b) {
+    largest = std::max(largest, start[b + 1]);
+    start[b + 1] += start[b];
+  }
+  std::array<size_t, N> members = {};
+  std::array<size_t, B> filled = {};
+  for (size_t i = 0; i < N; ++i) {
+    const size_t b = displace(hashes[i], 0) % B;
+    members[start[b] + filled[b]++] = i;
+  }
+
+  // duplicates share a bucket, so they show up there
+  for (size_t b = 0; b < B; ++b) {
+    for (size_t x = start[b]; x < start[b + 1]; ++x) {
+      for (size_t y = x + 1; y < start[b + 1]; ++y) {
+        const size_t i = members[x];
+        const size_t j = members[y];
+        if (methods[i] == methods[j] && paths[i] == paths[j]) {
+          t.duplicate = true;
+          return t;
+        }
+      }
+    }
+  }
+
+  std::array<size_t, N> tried = {};
+  for (size_t size = largest; size > 0; --size) {
+    for (size_t b = 0; b < B; ++b) {
+      if (start[b + 1] - start[b] != size) {
+        continue;
+      }
+      uint32_t d = 0;
+      for (; d < max_displacement; ++d) {
+        size_t n = 0;
+        for (; n < size; ++n) {
+          const size_t i = members[start[b] + n];
+          const size_t slot = displace(hashes[i], d + 1ull) & (T - 1);
+          if (t.slots[slot] >= 0) {
+            break;
+          }
+          t.slots[slot] = static_cast<int>(i);
+          tried[n] = slot;
+        }
+        if (n == size) {
+          break;
+        }
+        // undo the routes of this bucket placed so far and try the next displacement
+        while (n > 0) {
+          t.slots[tried[--n]] = -1;
+        }
+      }
+      if (d == max_displacement) {
+        return t;
+      }
+      t.disp[b] = d;
+    }
+  }
+  t.placed = true;
+  return t;
+}
+
+}  // namespace detail
+
+template <typename... Routes>
+class StaticRouter {
+  static constexpr size_t num_routes = sizeof...(Routes);
+  static constexpr size_t num_buckets = detail::bucket_count(num_routes);
+  static constexpr size_t num_slots = detail::table_size(num_routes);
+
+  static constexpr std::array<std::string_view, num_routes> paths = {Routes::path...};
+  static constexpr std::array<Method::method_t, num_routes> methods = {Routes::method...};
+
+  static constexpr detail::Table<num_routes, num_buckets, num_slots> table =
+      detail::build_table<num_routes, num_buckets, num_slots>(paths, methods);
+  static_assert(!table.duplicate, "StaticRouter has the same method and path twice");
+  static_assert(table.duplicate || table.placed, "StaticRouter found no collision free table");
+
+  template <size_t... I>
+  static void invoke(size_t idx, HTTPConn &c, std::index_sequence<I...>) {
+    ((idx == I && (Routes::invoke(c), true)) || ...);
+  }
+
+ public:
+  static constexpr int lookup(Method::method_t m, std::string_view path) {
+    const uint64_t h = hash_route(m, path);
+    const uint64_t d = table.disp[displace(h, 0) % num_buckets];
+    int idx = table.slots[displace(h, d + 1) & (num_slots - 1)];
+    if (idx < 0 || methods[idx] != m || paths[idx] != path) {
+      return -1;
+    }
+    return idx;
+  }
+
+  static void handle(HTTPConn &c) {
+    if (c.is_set()) {
+      return;
+    }
+    auto m = Method::from_string(c.method);
+    std::string_view path = trim_route(c.route_unparsed_path);
+    std::string_view prefix = path;
+
+    // try the full path first, then each parent segment
+    while (true) {
+      int idx = lookup(m, prefix);
+      if (idx < 0 && m == Method::HEAD) {
+        idx = lookup(Method::GET, prefix);
+      }
+      if (idx >= 0) {
+        c.route_unparsed_path = std::string(path.substr(prefix.size()));
+        invoke(static_cast<size_t>(idx), c, std::index_sequence_for<Routes...>{});
+        return;
+      }
+      if (prefix.empty()) {
+        break;
+      }
+      size_t cut = prefix.rfind('/');
+      prefix = (cut == std::string_view::npos) ? std::string_view() : prefix.substr(0, cut);
+    }
+
+    Handler::not_found_handler(c);
+  }
+
+  void operator()(HTTPConn &c) const { handle(c); }
+};
+
+}  // namespace Kleptic::Static
+
+#endif  // KLEPTIC_STATIC_ROUTER_HXX_
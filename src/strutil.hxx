@@ -27,6 +27,12 @@ static inline std::string trim(std::string s) {
   s = rtrim(s);
   return s;
 }
+
+// lowercase ascii copy
+static inline std::string to_lower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), [](unsigned char ch) { return std::tolower(ch); });
+  return s;
+}
 }  // namespace Kleptic::Util
 
 #endif  // KLEPTIC_STRUTIL_HXX_
@@ -0,0 +1,129 @@
+#ifndef KLEPTIC_TASK_HXX_
+#define KLEPTIC_TASK_HXX_
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace Kleptic::Async {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr error;
+
+  /* hands control straight back to whoever awaited the task */
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      return h.promise().continuation;
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+  std::optional<T> value;
+
+  task<T> get_return_object();
+  template <typename U>
+  void return_value(U &&v) {
+    value.emplace(std::forward<U>(v));
+  }
+  T result() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return std::move(*value);
+  }
+};
+
+template <>
+struct promise<void> : promise_base {
+  task<void> get_return_object();
+  void return_void() {}
+  void result() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+}  // namespace detail
+
+/*
+ * task<T>
+ *
+ * lazily started coroutine. nothing runs until the task is co_awaited (or
+ * handed to EventLoop::spawn), the awaiting coroutine is resumed when it
+ * finishes and gets its value or exception.
+ */
+template <typename T>
+class task {
+ public:
+  typedef detail::promise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> handle_t;
+
+  task() = default;
+  explicit task(handle_t h) : h(h) {}
+  task(task &&other) noexcept : h(std::exchange(other.h, {})) {}
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (h) {
+        h.destroy();
+      }
+      h = std::exchange(other.h, {});
+    }
+    return *this;
+  }
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+  ~task() {
+    if (h) {
+      h.destroy();
+    }
+  }
+
+  bool done() const { return !h || h.done(); }
+
+  auto operator co_await() && noexcept {
+    struct awaiter {
+      handle_t h;
+      bool await_ready() noexcept { return !h || h.done(); }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+        h.promise().continuation = cont;
+        return h;
+      }
+      T await_resume() { return h.promise().result(); }
+    };
+    return awaiter{h};
+  }
+
+ private:
+  handle_t h;
+};
+
+namespace detail {
+template <typename T>
+task<T> promise<T>::get_return_object() {
+  return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+inline task<void> promise<void>::get_return_object() {
+  return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+}  // namespace detail
+
+}  // namespace Kleptic::Async
+
+#endif  // KLEPTIC_TASK_HXX_
@@ -1,6 +1,11 @@
 #include "tcp_sock.hxx"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -95,7 +100,7 @@ TCPSocket::~TCPSocket() {
   close(_socket_fd);
 }
 
-TCPAcceptor::TCPAcceptor(const std::string &ip, const int port) {
+TCPAcceptor::TCPAcceptor(const std::string &ip, const int port, bool reuse_port) {
   int optval = 1;
 
   if ((_server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -106,6 +111,11 @@ TCPAcceptor::TCPAcceptor(const std::string &ip, const int port) {
     throw SocketException("Failed to Set Socket Opt : " + std::string(strerror(errno)));
   }
 
+  if (reuse_port &&
+      setsockopt(_server_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+    throw SocketException("Failed to Set Socket Opt : " + std::string(strerror(errno)));
+  }
+
   _addr.sin_family = AF_INET;
   inet_pton(AF_INET, ip.c_str(), &(_addr.sin_addr));
   _addr.sin_port = htons(port);
@@ -119,19 +129,66 @@ TCPAcceptor::TCPAcceptor(const std::string &ip, const int port) {
   }
 }
 
-conn_t TCPAcceptor::accept_conn() const {
-  struct sockaddr_in _addr_new = _addr;
-  int addrlen = sizeof(_addr_new);
+int TCPAcceptor::accept_fd(struct sockaddr_in &addr, int flags) const {
+  addr = _addr;
+  socklen_t addrlen = sizeof(addr);
   int sock_fd;
-  if ((sock_fd = accept(_server_fd, reinterpret_cast<struct sockaddr *>(&_addr_new),
-          reinterpret_cast<socklen_t *>(&addrlen))) < 0) {
+  if ((sock_fd = accept4(_server_fd, reinterpret_cast<struct sockaddr *>(&addr), &addrlen,
+                         flags)) < 0) {
     throw SocketException("Failed to accept client : " + std::string(strerror(errno)));
   }
+  return sock_fd;
+}
+
+conn_t TCPAcceptor::accept_conn() const {
   conn_t c = std::make_unique<Conn>();
-  c->socket = std::make_unique<TCPSocket>(sock_fd);
-  c->addr = _addr_new;
+  c->socket = std::make_unique<TCPSocket>(accept_fd(c->addr));
   return c;
 }
 
 TCPAcceptor::~TCPAcceptor() noexcept { close(_server_fd); }
+sock_ptr tcp_connect(const std::string &host, int port, std::chrono::milliseconds timeout) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addrs = nullptr;
+  int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addrs);
+  if (err != 0) {
+    throw SocketException("Failed to resolve " + host + " : " + gai_strerror(err));
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    freeaddrinfo(addrs);
+    throw SocketException("Failed to Create Socket : " + std::string(strerror(errno)));
+  }
+  int ret = connect(fd, addrs->ai_addr, addrs->ai_addrlen);
+  freeaddrinfo(addrs);
+  if (ret < 0 && errno == EINPROGRESS) {
+    struct pollfd p = {fd, POLLOUT, 0};
+    ret = poll(&p, 1, static_cast<int>(timeout.count()));
+    if (ret == 0) {
+      errno = ETIMEDOUT;
+      ret = -1;
+    } else if (ret > 0) {
+      socklen_t len = sizeof(err);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      errno = err;
+      ret = (err == 0) ? 0 : -1;
+    }
+  }
+  if (ret < 0) {
+    std::string reason = strerror(errno);
+    close(fd);
+    throw SocketException("Failed to connect to " + host + ":" + std::to_string(port) + " : " +
+                          reason);
+  }
+
+  // connected, reads and writes block like an accepted socket's
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return std::make_unique<TCPSocket>(fd);
+}
+
 }  // namespace Kleptic
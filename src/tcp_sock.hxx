@@ -3,6 +3,7 @@
 
 #include <sys/socket.h>
 
+#include <chrono>
 #include <string>
 
 #include "socket.hxx"
@@ -29,11 +30,24 @@ class TCPAcceptor : public SockAcceptor {
   struct sockaddr_in _addr;
   int _server_fd;
 
+  /* accept4 with flags, the client's address goes to addr. throws SocketException */
+  int accept_fd(struct sockaddr_in &addr, int flags = 0) const;
+
  public:
-  TCPAcceptor(const std::string &ip, const int port);
+  /* reuse_port lets several acceptors bind the same port, the kernel spreads connections */
+  TCPAcceptor(const std::string &ip, const int port, bool reuse_port = false);
   conn_t accept_conn() const override;
+  int listen_fd() const override { return _server_fd; }
   ~TCPAcceptor() noexcept;
 };
+
+/*
+ * sock_ptr tcp_connect(host, port, timeout)
+ *
+ * client side: connects to host (a name or an IPv4 address), giving up
+ * after timeout. throws SocketException.
+ */
+sock_ptr tcp_connect(const std::string &host, int port, std::chrono::milliseconds timeout);
 }  // namespace Kleptic
 
 #endif  // KLEPTIC_TCP_SOCK_HXX_
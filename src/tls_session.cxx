@@ -0,0 +1,366 @@
+#include "tls_session.hxx"
+
+#include <errno.h>
+#include <openssl/bio.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/params.h>
+#include <openssl/rand.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <new>
+#include <string>
+
+#include "error.hxx"
+
+namespace Kleptic::TLS {
+
+/* sessions in a set, a new one replaces the set's oldest when it's full */
+static constexpr int set_ways = 4;
+/* encoded sessions bigger than this (e.g. with a client cert) aren't shared */
+static constexpr size_t max_session_der = 1024;
+
+struct SessionStore::Set {
+  struct Slot {
+    int64_t expires;
+    uint32_t id_len;
+    uint32_t der_len;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char der[max_session_der];
+  };
+
+  pthread_mutex_t lock;
+  Slot slots[set_ways];
+};
+
+static int64_t now_s() {
+  // CLOCK_MONOTONIC is system wide, every worker process reads the same clock
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void init_shared_mutex(pthread_mutex_t *m) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  // a worker killed while holding it mustn't wedge the others
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(m, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * bool lock_shared_mutex(pthread_mutex_t *)
+ *
+ * returns false when the previous owner died holding it, what it guards
+ * may be half written.
+ */
+static bool lock_shared_mutex(pthread_mutex_t *m) {
+  if (pthread_mutex_lock(m) == EOWNERDEAD) {
+    pthread_mutex_consistent(m);
+    return false;
+  }
+  return true;
+}
+
+static int ex_index() {
+  static const int idx = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return idx;
+}
+
+SessionStore::SessionStore(SessionOptions opts) : opts(opts) {
+  map_size = sizeof(Shared);
+  if (opts.cache == CACHE_SHARED) {
+    num_sets = (opts.cache_size + set_ways - 1) / set_ways;
+    if (num_sets == 0) {
+      num_sets = 1;
+    }
+    // sets start on their own cache line
+    map_size = (map_size + 63) / 64 * 64;
+    map_size += num_sets * sizeof(Set);
+  }
+  // mapped before the runner forks, so every worker shares the same pages
+  void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    throw SocketException("Failed to map the TLS session store : " +
+                          std::string(strerror(errno)));
+  }
+  shared = new (p) Shared();
+  init_shared_mutex(&shared->keys_lock);
+  // every slot of the ring gets a key, so no ticket name matches an empty one
+  RAND_bytes(reinterpret_cast<unsigned char *>(shared->keys), sizeof(shared->keys));
+  shared->rotated_at = now_s();
+
+  if (num_sets > 0) {
+    sets = reinterpret_cast<Set *>(static_cast<char *>(p) + map_size - num_sets * sizeof(Set));
+    for (size_t i = 0; i < num_sets; ++i) {
+      // the anonymous mapping is zeroed, slots start out empty
+      init_shared_mutex(&sets[i].lock);
+    }
+  }
+}
+
+SessionStore::~SessionStore() {
+  OPENSSL_cleanse(shared->keys, sizeof(shared->keys));
+  munmap(shared, map_size);
+}
+
+void SessionStore::attach(SSL_CTX *ctx) {
+  SSL_CTX_set_ex_data(ctx, ex_index(), this);
+  SSL_CTX_set_timeout(ctx, opts.timeout.count());
+  static const unsigned char sid_ctx[] = "kleptic";
+  SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+
+  switch (opts.cache) {
+    case CACHE_NONE:
+      SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+      break;
+    case CACHE_INTERNAL:
+      SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+      SSL_CTX_sess_set_cache_size(ctx, opts.cache_size);
+      break;
+    case CACHE_SHARED:
+      // every lookup goes to the shared cache, a per process copy would go stale
+      SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+      SSL_CTX_sess_set_new_cb(ctx, new_session);
+      SSL_CTX_sess_set_get_cb(ctx, get_session);
+      SSL_CTX_sess_set_remove_cb(ctx, remove_session);
+      break;
+  }
+
+  if (opts.tickets) {
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_callback);
+  } else {
+    // TLS 1.3 falls back to tickets that only carry a session id
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+  }
+}
+
+SessionStore *SessionStore::of(const SSL_CTX *ctx) {
+  return static_cast<SessionStore *>(SSL_CTX_get_ex_data(ctx, ex_index()));
+}
+
+void SessionStore::record_handshake(SSL *ssl, int ret) {
+  Counters &c = shared->counters;
+  if (ret <= 0) {
+    c.failed.fetch_add(1, std::memory_order_relaxed);
+  } else if (SSL_session_reused(ssl)) {
+    c.resumed.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    c.full.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (ret > 0 && BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+    c.ktls.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void SessionStore::record_timeout() {
+  shared->counters.timeouts.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SessionStore::record_refused() {
+  shared->counters.refused.fetch_add(1, std::memory_order_relaxed);
+}
+
+Stats SessionStore::stats() const {
+  const Counters &c = shared->counters;
+  Stats s;
+  s.full_handshakes = c.full.load(std::memory_order_relaxed);
+  s.resumed_handshakes = c.resumed.load(std::memory_order_relaxed);
+  s.failed_handshakes = c.failed.load(std::memory_order_relaxed);
+  s.handshake_timeouts = c.timeouts.load(std::memory_order_relaxed);
+  s.refused_handshakes = c.refused.load(std::memory_order_relaxed);
+  s.ktls_connections = c.ktls.load(std::memory_order_relaxed);
+  s.cache_hits = c.hits.load(std::memory_order_relaxed);
+  s.cache_misses = c.misses.load(std::memory_order_relaxed);
+  s.ticket_key_rotations = c.rotations.load(std::memory_order_relaxed);
+  return s;
+}
+
+/* ticket keys */
+
+void SessionStore::rotate_keys(int64_t now) {
+  memmove(&shared->keys[1], &shared->keys[0], sizeof(TicketKey) * (ticket_keys - 1));
+  RAND_bytes(reinterpret_cast<unsigned char *>(&shared->keys[0]), sizeof(TicketKey));
+  shared->rotated_at = now;
+  shared->counters.rotations.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * bool ticket_key(name, TicketKey &key, bool &current)
+ *
+ * copies the key called name, or the current one when name is null,
+ * rotating first if it's due. false if no key in the ring has that name.
+ */
+bool SessionStore::ticket_key(const unsigned char *name, TicketKey &key, bool &current) {
+  const int64_t now = now_s();
+  bool found = false;
+  if (!lock_shared_mutex(&shared->keys_lock)) {
+    // a rotation may have been cut short, start over with a fresh ring
+    RAND_bytes(reinterpret_cast<unsigned char *>(shared->keys), sizeof(shared->keys));
+    shared->rotated_at = now;
+  }
+  // rotation is lazy, after an idle stretch catch up on the missed ones
+  const int64_t interval = std::max<int64_t>(opts.ticket_key_rotation.count(), 1);
+  const int64_t due = (now - shared->rotated_at) / interval;
+  for (int64_t i = 0; i < std::min<int64_t>(due, ticket_keys); ++i) {
+    rotate_keys(now);
+  }
+  for (int i = 0; i < ticket_keys; ++i) {
+    if (name == nullptr || memcmp(shared->keys[i].name, name, sizeof(key.name)) == 0) {
+      key = shared->keys[i];
+      current = i == 0;
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shared->keys_lock);
+  return found;
+}
+
+int SessionStore::ticket_callback(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+                                  EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc) {
+  SessionStore *store = of(SSL_get_SSL_CTX(ssl));
+  TicketKey key;
+  bool current = false;
+  int ret = enc ? 1 : 2;
+  if (enc) {
+    store->ticket_key(nullptr, key, current);
+    memcpy(key_name, key.name, sizeof(key.name));
+    if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) <= 0 ||
+        !EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.aes, iv)) {
+      ret = -1;
+    }
+  } else if (!store->ticket_key(key_name, key, current)) {
+    // rotated out, the client gets a full handshake and a new ticket
+    return 0;
+  } else if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.aes, iv)) {
+    ret = -1;
+  } else if (current) {
+    ret = 1;
+  }
+  // 2 above: an older key decrypted it, a ticket under the current one is sent
+
+  if (ret != -1) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0),
+        OSSL_PARAM_construct_end()};
+    if (!EVP_MAC_CTX_set_params(hctx, params)) {
+      ret = -1;
+    }
+  }
+  OPENSSL_cleanse(&key, sizeof(key));
+  return ret;
+}
+
+/* shared session cache */
+
+SessionStore::Set &SessionStore::set_for(const unsigned char *id, unsigned int id_len) {
+  // session ids are random already, FNV-1a just folds them down
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned int i = 0; i < id_len; ++i) {
+    h = (h ^ id[i]) * 1099511628211ULL;
+  }
+  return sets[h % num_sets];
+}
+
+static void lock_set(pthread_mutex_t *m, void *slots, size_t size) {
+  if (!lock_shared_mutex(m)) {
+    // the owner died mid write, the set's sessions can't be trusted
+    memset(slots, 0, size);
+  }
+}
+
+int SessionStore::new_session(SSL *ssl, SSL_SESSION *sess) {
+  SessionStore *store = of(SSL_get_SSL_CTX(ssl));
+  unsigned int id_len;
+  const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+  const int der_len = i2d_SSL_SESSION(sess, nullptr);
+  if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH || der_len <= 0 ||
+      static_cast<size_t>(der_len) > max_session_der) {
+    return 0;
+  }
+
+  Set &set = store->set_for(id, id_len);
+  const int64_t now = now_s();
+  lock_set(&set.lock, set.slots, sizeof(set.slots));
+  Set::Slot *victim = &set.slots[0];
+  for (auto &slot : set.slots) {
+    if (slot.id_len == id_len && memcmp(slot.id, id, id_len) == 0) {
+      victim = &slot;
+      break;
+    }
+    if (slot.id_len == 0 || slot.expires < victim->expires) {
+      victim = &slot;
+    }
+  }
+  unsigned char *p = victim->der;
+  i2d_SSL_SESSION(sess, &p);
+  memcpy(victim->id, id, id_len);
+  victim->id_len = id_len;
+  victim->der_len = der_len;
+  victim->expires = now + SSL_SESSION_get_timeout(sess);
+  pthread_mutex_unlock(&set.lock);
+  // the session was copied out, openssl keeps no extra reference for us
+  return 0;
+}
+
+SSL_SESSION *SessionStore::get_session(SSL *ssl, const unsigned char *id, int id_len, int *copy) {
+  SessionStore *store = of(SSL_get_SSL_CTX(ssl));
+  *copy = 0;
+  if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+    return nullptr;
+  }
+  unsigned char der[max_session_der];
+  uint32_t der_len = 0;
+
+  Set &set = store->set_for(id, id_len);
+  const int64_t now = now_s();
+  lock_set(&set.lock, set.slots, sizeof(set.slots));
+  for (auto &slot : set.slots) {
+    if (slot.id_len == static_cast<uint32_t>(id_len) && memcmp(slot.id, id, id_len) == 0) {
+      if (slot.expires > now) {
+        der_len = slot.der_len;
+        memcpy(der, slot.der, der_len);
+      } else {
+        slot.id_len = 0;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&set.lock);
+
+  SSL_SESSION *sess = nullptr;
+  if (der_len > 0) {
+    const unsigned char *p = der;
+    sess = d2i_SSL_SESSION(nullptr, &p, der_len);
+  }
+  Counters &c = store->shared->counters;
+  (sess != nullptr ? c.hits : c.misses).fetch_add(1, std::memory_order_relaxed);
+  OPENSSL_cleanse(der, der_len);
+  return sess;
+}
+
+void SessionStore::remove_session(SSL_CTX *ctx, SSL_SESSION *sess) {
+  SessionStore *store = of(ctx);
+  unsigned int id_len;
+  const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+  if (store == nullptr || id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+    return;
+  }
+  Set &set = store->set_for(id, id_len);
+  lock_set(&set.lock, set.slots, sizeof(set.slots));
+  for (auto &slot : set.slots) {
+    if (slot.id_len == id_len && memcmp(slot.id, id, id_len) == 0) {
+      slot.id_len = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&set.lock);
+}
+
+}  // namespace Kleptic::TLS
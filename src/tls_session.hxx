@@ -0,0 +1,138 @@
+#ifndef KLEPTIC_TLS_SESSION_HXX_
+#define KLEPTIC_TLS_SESSION_HXX_
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace Kleptic::TLS {
+
+enum session_cache_t {
+  /* no session ids, only tickets can resume */
+  CACHE_NONE,
+  /* openssl's cache in this process, enough when one process accepts */
+  CACHE_INTERNAL,
+  /* a cache in shared memory, for prefork and fork per request workers */
+  CACHE_SHARED,
+};
+
+struct SessionOptions {
+  session_cache_t cache = CACHE_INTERNAL;
+  /* sessions held by the cache, shared caches are sized up front */
+  size_t cache_size = 4096;
+  /* how long a session (id or ticket) can be resumed */
+  std::chrono::seconds timeout{300};
+  /* stateless session tickets */
+  bool tickets = true;
+  /* a new ticket key is made this often, older ones still decrypt */
+  std::chrono::seconds ticket_key_rotation{3600};
+};
+
+struct Stats {
+  uint64_t full_handshakes = 0;
+  uint64_t resumed_handshakes = 0;
+  uint64_t failed_handshakes = 0;
+  /* not through by the deadline, and refused for too many under way */
+  uint64_t handshake_timeouts = 0;
+  uint64_t refused_handshakes = 0;
+  /* finished handshakes that left encryption of what's sent to the kernel */
+  uint64_t ktls_connections = 0;
+  /* session id lookups in the shared cache */
+  uint64_t cache_hits = 0;
+  uint64_t cache_misses = 0;
+  uint64_t ticket_key_rotations = 0;
+};
+
+/*
+ * SessionStore
+ *
+ * session resumption for an SSL_CTX. session ids go to openssl's own
+ * cache or a shared memory one, tickets are encrypted with keys from a
+ * small ring: the newest key encrypts, the older ones only decrypt and
+ * get the ticket renewed. the keys and the counters live in memory
+ * mapped shared before any worker is forked, so every process of a
+ * server resumes the others' sessions and stats() counts all of them.
+ */
+class SessionStore {
+ public:
+  /* keys kept, a ticket resumes until its key is this many rotations old */
+  static constexpr int ticket_keys = 3;
+
+ private:
+  struct TicketKey {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+  };
+
+  struct Counters {
+    std::atomic<uint64_t> full{0};
+    std::atomic<uint64_t> resumed{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> timeouts{0};
+    std::atomic<uint64_t> refused{0};
+    std::atomic<uint64_t> ktls{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> rotations{0};
+  };
+
+  /* the start of the shared mapping, the cache's sets follow it */
+  struct Shared {
+    Counters counters;
+    pthread_mutex_t keys_lock;
+    /* keys[0] is the current one */
+    TicketKey keys[ticket_keys];
+    int64_t rotated_at;
+  };
+
+  struct Set;
+
+  const SessionOptions opts;
+  Shared *shared = nullptr;
+  Set *sets = nullptr;
+  size_t num_sets = 0;
+  size_t map_size = 0;
+
+  void rotate_keys(int64_t now);
+  bool ticket_key(const unsigned char *name, TicketKey &key, bool &current);
+  Set &set_for(const unsigned char *id, unsigned int id_len);
+
+  static int new_session(SSL *ssl, SSL_SESSION *sess);
+  static SSL_SESSION *get_session(SSL *ssl, const unsigned char *id, int id_len, int *copy);
+  static void remove_session(SSL_CTX *ctx, SSL_SESSION *sess);
+  static int ticket_callback(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+                             EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc);
+
+ public:
+  explicit SessionStore(SessionOptions opts = SessionOptions());
+  SessionStore(const SessionStore &) = delete;
+  SessionStore &operator=(const SessionStore &) = delete;
+  ~SessionStore();
+
+  /*
+   * void attach(SSL_CTX *)
+   *
+   * configures ctx's session cache and ticket callback to use this store.
+   * the store has to outlive ctx.
+   */
+  void attach(SSL_CTX *ctx);
+
+  /* counts a finished SSL_accept, ret is what it returned */
+  void record_handshake(SSL *ssl, int ret);
+  void record_timeout();
+  void record_refused();
+  Stats stats() const;
+
+  /* the store attached to ctx, nullptr if there is none */
+  static SessionStore *of(const SSL_CTX *ctx);
+};
+
+}  // namespace Kleptic::TLS
+
+#endif  // KLEPTIC_TLS_SESSION_HXX_
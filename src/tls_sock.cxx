@@ -1,8 +1,11 @@
 #include "tls_sock.hxx"
 
+#include <errno.h>
 #include <openssl/err.h>
+#include <poll.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 
@@ -10,8 +13,14 @@
 
 namespace Kleptic {
 
-TLSAcceptor::TLSAcceptor(const std::string &ip, const int port, tls_cert_key_pair &conf)
-    : TCPAcceptor(ip, port), ctx((init_ssl(), SSL_CTX_new(SSLv23_server_method())), SSL_CTX_free) {
+TLSAcceptor::TLSAcceptor(const std::string &ip, const int port, tls_cert_key_pair &conf,
+                         const TLS::SessionOptions &session_opts,
+                         const TLS::HandshakeOptions &handshakes)
+    : TCPAcceptor(ip, port),
+      sessions(std::make_unique<TLS::SessionStore>(session_opts)),
+      ctx((init_ssl(), SSL_CTX_new(SSLv23_server_method())), SSL_CTX_free),
+      handshakes(handshakes),
+      pending(std::make_shared<std::atomic<size_t>>(0)) {
   /* configure SSL certificate */
   SSL_CTX_set_ecdh_auto(ctx.get(), 1);
   if (SSL_CTX_use_certificate_file(ctx.get(), conf.first.c_str(), SSL_FILETYPE_PEM) <= 0) {
@@ -22,12 +31,56 @@ TLSAcceptor::TLSAcceptor(const std::string &ip, const int port, tls_cert_key_pai
     ERR_print_errors_fp(stderr);
     exit(EXIT_FAILURE);
   }
+  sessions->attach(ctx.get());
+  SSL_CTX_set_alpn_select_cb(ctx.get(), select_protocol, this);
+#ifdef SSL_OP_ENABLE_KTLS
+  if (handshakes.ktls) {
+    // openssl only turns it on where the kernel and cipher allow, else records stay in userspace
+    SSL_CTX_set_options(ctx.get(), SSL_OP_ENABLE_KTLS);
+  }
+#endif
 }
 
 conn_t TLSAcceptor::accept_conn() const {
-  auto conn = TCPAcceptor::accept_conn();
-  conn->socket = std::make_unique<TLSSocket>(dup(conn->socket->_socket_fd), ctx);
-  return conn;
+  conn_t c = std::make_unique<Conn>();
+  const int fd = accept_fd(c->addr, SOCK_NONBLOCK);
+  if (pending->load(std::memory_order_relaxed) >= handshakes.max_pending) {
+    close(fd);
+    sessions->record_refused();
+    throw SocketException("Too many TLS handshakes in progress");
+  }
+  c->socket = std::make_unique<TLSSocket>(fd, ctx, pending);
+  c->socket->handshake_deadline = std::chrono::steady_clock::now() + handshakes.timeout;
+  return c;
+}
+
+void TLSAcceptor::set_protocols(const std::vector<std::string> &protocols) {
+  std::string wire;
+  for (const auto &p : protocols) {
+    wire.push_back(static_cast<char>(p.size()));
+    wire += p;
+  }
+  alpn = wire;
+}
+
+/*
+ * int select_protocol(...)
+ *
+ * ALPN callback, the first of our protocols the client also offers.
+ * without a match the extension isn't answered and the client falls
+ * back to HTTP/1.1.
+ */
+int TLSAcceptor::select_protocol(SSL *, const unsigned char **out, unsigned char *outlen,
+                                 const unsigned char *in, unsigned int inlen, void *arg) {
+  const std::string &alpn = static_cast<const TLSAcceptor *>(arg)->alpn;
+  unsigned char *selected;
+  if (alpn.empty() ||
+      SSL_select_next_proto(&selected, outlen, reinterpret_cast<const unsigned char *>(alpn.data()),
+                            alpn.size(), in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
 }
 
 void TLSAcceptor::init_ssl() {
@@ -37,14 +90,100 @@ void TLSAcceptor::init_ssl() {
 
 void TLSAcceptor::cleanup_ssl() { EVP_cleanup(); }
 
-TLSSocket::TLSSocket(const int sfd, const ssl_ctx_t &ctx)
-    : TCPSocket(sfd), ssl(SSL_new(ctx.get()), SSL_free) {
+TLSSocket::TLSSocket(const int sfd, const ssl_ctx_t &ctx,
+                     std::shared_ptr<std::atomic<size_t>> pending)
+    : TCPSocket(sfd), ssl(SSL_new(ctx.get()), SSL_free), pending(std::move(pending)) {
   SSL_set_fd(ssl.get(), _socket_fd);
-  if (SSL_accept(ssl.get()) <= 0) {
-    ERR_print_errors_fp(stderr);
+  SSL_set_accept_state(ssl.get());
+  // try_write may send part of a buffer, and be called again with what's left from elsewhere
+  SSL_set_mode(ssl.get(), SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if (this->pending) {
+    this->pending->fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/*
+ * ~TLSSocket()
+ *
+ * sends close_notify if it fits in the send buffer right away, without
+ * waiting for the peer's. openssl drops the session from the cache when
+ * a connection ends without one, and the client couldn't resume it.
+ */
+TLSSocket::~TLSSocket() {
+  end_handshake(state);
+  if (SSL_is_init_finished(ssl.get())) {
+    SSL_shutdown(ssl.get());
+  }
+}
+
+handshake_t TLSSocket::end_handshake(handshake_t result) {
+  state = result;
+  if (pending) {
+    pending->fetch_sub(1, std::memory_order_relaxed);
+    pending.reset();
+  }
+  return state;
+}
+
+handshake_t TLSSocket::try_handshake() {
+  if (state == HANDSHAKE_DONE || state == HANDSHAKE_FAILED) {
+    return state;
+  }
+  TLS::SessionStore *store = TLS::SessionStore::of(SSL_get_SSL_CTX(ssl.get()));
+  if (std::chrono::steady_clock::now() >= handshake_deadline) {
+    if (store != nullptr) {
+      store->record_timeout();
+    }
+    return end_handshake(HANDSHAKE_FAILED);
+  }
+
+  ERR_clear_error();
+  const int ret = SSL_accept(ssl.get());
+  if (ret == 1) {
+    if (store != nullptr) {
+      store->record_handshake(ssl.get(), ret);
+    }
+    return end_handshake(HANDSHAKE_DONE);
+  }
+  switch (SSL_get_error(ssl.get(), ret)) {
+    case SSL_ERROR_WANT_READ:
+      return state = HANDSHAKE_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+      return state = HANDSHAKE_WANT_WRITE;
+    default:
+      // a broken or vanished client, openssl has sent it an alert if it could
+      ERR_clear_error();
+      if (store != nullptr) {
+        store->record_handshake(ssl.get(), ret);
+      }
+      return end_handshake(HANDSHAKE_FAILED);
   }
 }
 
+/*
+ * bool wait_for(int ret)
+ *
+ * the socket stays non-blocking after the handshake, the blocking calls
+ * wait here for what openssl needs before trying again. false if ret
+ * wasn't a WANT_READ or WANT_WRITE.
+ *
+ */
+bool TLSSocket::wait_for(int ret) {
+  short events;
+  switch (SSL_get_error(ssl.get(), ret)) {
+    case SSL_ERROR_WANT_READ:
+      events = POLLIN;
+      break;
+    case SSL_ERROR_WANT_WRITE:
+      events = POLLOUT;
+      break;
+    default:
+      return false;
+  }
+  struct pollfd p = {_socket_fd, events, 0};
+  return poll(&p, 1, -1) >= 0 || errno == EINTR;
+}
+
 /*
  * int read(char * buff, const int size)
  *
@@ -54,11 +193,15 @@ TLSSocket::TLSSocket(const int sfd, const ssl_ctx_t &ctx)
  *
  */
 int TLSSocket::read(char *buff, const int size) {
-  int ret = SSL_read(ssl.get(), buff, size);
-  if (ret < 0) {
-    throw SocketException("unable to read character");
+  while (1) {
+    int ret = SSL_read(ssl.get(), buff, size);
+    if (ret > 0 || SSL_get_error(ssl.get(), ret) == SSL_ERROR_ZERO_RETURN) {
+      return std::max(ret, 0);
+    }
+    if (!wait_for(ret)) {
+      throw SocketException("unable to read character");
+    }
   }
-  return ret;
 }
 
 /*
@@ -69,13 +212,114 @@ int TLSSocket::read(char *buff, const int size) {
  *
  */
 void TLSSocket::write(const char *buff, int len) {
+  int done = 0;
+  while (done < len) {
+    int ret = SSL_write(ssl.get(), buff + done, len - done);
+    if (ret > 0) {
+      done += ret;
+    } else if (!wait_for(ret)) {
+      throw SocketException("failed to write characters due to : " + std::string(strerror(errno)));
+    }
+  }
+}
+
+/*
+ * int try_read(char * buff, const int size)
+ *
+ * SSL_read on the non-blocking socket. a partial record, or a
+ * renegotiation that needs to write, comes back as EAGAIN.
+ *
+ */
+int TLSSocket::try_read(char *buff, const int size) {
+  int ret = SSL_read(ssl.get(), buff, size);
+  if (ret > 0) {
+    return ret;
+  }
+  switch (SSL_get_error(ssl.get(), ret)) {
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    default:
+      errno = EIO;
+      return -1;
+  }
+}
+
+/*
+ * int try_write(const char * buff, const int len)
+ *
+ * SSL_write on the non-blocking socket, as much as the socket takes.
+ * EAGAIN when it's full, the rest goes in a later call.
+ *
+ */
+int TLSSocket::try_write(const char *buff, const int len) {
   int ret = SSL_write(ssl.get(), buff, len);
-  if (ret < 0) {
-    throw SocketException("failed to write characters due to : " + std::string(strerror(errno)));
+  if (ret > 0) {
+    return ret;
+  }
+  switch (SSL_get_error(ssl.get(), ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    default:
+      errno = EIO;
+      return -1;
+  }
+}
+
+std::string TLSSocket::protocol() const {
+  const unsigned char *p;
+  unsigned int len;
+  SSL_get0_alpn_selected(ssl.get(), &p, &len);
+  return len > 0 ? std::string(reinterpret_cast<const char *>(p), len) : "http/1.1";
+}
+
+bool TLSSocket::ktls_send() const { return BIO_get_ktls_send(SSL_get_wbio(ssl.get())); }
+
+/*
+ * void send_file(int fd, off_t offset, size_t count)
+ *
+ * with kTLS the kernel reads the file and encrypts it on its way out,
+ * otherwise it's read into a buffer one TLS record's worth at a time.
+ *
+ */
+void TLSSocket::send_file(int fd, off_t offset, size_t count) {
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ktls_send()) {
+    while (count > 0) {
+      ossl_ssize_t ret = SSL_sendfile(ssl.get(), fd, offset, count, 0);
+      if (ret <= 0 && wait_for(static_cast<int>(ret))) {
+        continue;
+      }
+      if (ret <= 0) {
+        throw SocketException("sendfile over kTLS failed due to : " +
+                              std::string(strerror(errno)));
+      }
+      offset += ret;
+      count -= ret;
+    }
+    return;
   }
-  if (ret < len) {
-    throw SocketException("only managed to write " + std::to_string(ret) + "/" +
-                          std::to_string(len) + " bytes.");
+#endif
+  char buff[SSL3_RT_MAX_PLAIN_LENGTH];
+  while (count > 0) {
+    ssize_t ret = pread(fd, buff, std::min(count, sizeof(buff)), offset);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      throw SocketException("failed to read the file due to : " + std::string(strerror(errno)));
+    }
+    if (ret == 0) {
+      throw SocketException("file ended " + std::to_string(count) + " bytes early");
+    }
+    write(buff, static_cast<int>(ret));
+    offset += ret;
+    count -= ret;
   }
 }
 
@@ -3,11 +3,16 @@
 
 #include <openssl/ssl.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "tcp_sock.hxx"
+#include "tls_session.hxx"
 
 namespace Kleptic {
 
@@ -15,13 +20,50 @@ typedef std::unique_ptr<SSL_CTX, decltype((SSL_CTX_free))> ssl_ctx_t;
 typedef std::unique_ptr<SSL, decltype((SSL_free))> ssl_t;
 typedef std::pair<std::string, std::string> tls_cert_key_pair;
 
+namespace TLS {
+struct HandshakeOptions {
+  /* from accept to the end of the handshake, slower clients are dropped */
+  std::chrono::milliseconds timeout{10000};
+  /* connections accepted but not through their handshake, more are refused */
+  size_t max_pending = 1024;
+  /*
+   * hand record encryption to the kernel (kTLS) once a handshake is
+   * through, if the kernel has the tls module and knows the cipher.
+   * files then go out with sendfile, see TLSSocket::send_file.
+   */
+  bool ktls = true;
+};
+}  // namespace TLS
+
 class TLSSocket : public TCPSocket {
   const ssl_t ssl;
+  handshake_t state = HANDSHAKE_WANT_READ;
+  /* the acceptor's count of handshakes under way, held until this one ends */
+  std::shared_ptr<std::atomic<size_t>> pending;
+
+  handshake_t end_handshake(handshake_t result);
+  bool wait_for(int ret);
 
  public:
   int read(char *buff, const int size) override;
   void write(const char *buff, const int len) override;
-  TLSSocket(const int sfd, const ssl_ctx_t &ctx);
+  int try_read(char *buff, const int size) override;
+  int try_write(const char *buff, const int len) override;
+  /*
+   * sendfile over the kTLS socket when the kernel encrypts what's sent,
+   * else the file is read a record at a time and goes through SSL_write.
+   */
+  void send_file(int fd, off_t offset, size_t count) override;
+  /* true if the kernel encrypts what this connection sends */
+  bool ktls_send() const;
+  /* what ALPN picked, http/1.1 when the client offered nothing */
+  std::string protocol() const override;
+  /* steps SSL_accept on the non-blocking socket */
+  handshake_t try_handshake() override;
+  /* takes sfd over, non-blocking: read and write wait in poll, try_ ones give EAGAIN */
+  TLSSocket(const int sfd, const ssl_ctx_t &ctx,
+            std::shared_ptr<std::atomic<size_t>> pending = nullptr);
+  ~TLSSocket();
   // protected:
   // virtual TLSSocket* clone_impl() const override { return new
   // TLSSocket(*this); };
@@ -29,13 +71,33 @@ class TLSSocket : public TCPSocket {
 
 class TLSAcceptor : public TCPAcceptor {
  protected:
+  /* before ctx, so it's still there while ctx is freed */
+  const std::unique_ptr<TLS::SessionStore> sessions;
   const ssl_ctx_t ctx;
+  const TLS::HandshakeOptions handshakes;
+  const std::shared_ptr<std::atomic<size_t>> pending;
+  /* the protocols offered through ALPN, in its wire format */
+  std::string alpn;
+
+  static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                             const unsigned char *in, unsigned int inlen, void *arg);
 
  public:
   static void init_ssl();
   static void cleanup_ssl();
-  TLSAcceptor(const std::string &ip, const int port, tls_cert_key_pair &);
+  TLSAcceptor(const std::string &ip, const int port, tls_cert_key_pair &,
+              const TLS::SessionOptions &sessions = TLS::SessionOptions(),
+              const TLS::HandshakeOptions &handshakes = TLS::HandshakeOptions());
+  /*
+   * only accepts, the handshake is left to whoever serves the connection
+   * (see handshake and Async::handshake). throws SocketException when
+   * max_pending handshakes are already under way.
+   */
   conn_t accept_conn() const override;
+  /* set before accepting, connections handshaking meanwhile may see either list */
+  void set_protocols(const std::vector<std::string> &protocols) override;
+  /* handshake and session cache counters, across every worker process */
+  TLS::Stats session_stats() const { return sessions->stats(); }
   // ~TLSAcceptor();
 };
 }  // namespace Kleptic
@@ -0,0 +1,130 @@
+#ifndef KLEPTIC_UNIQUE_FUNCTION_HXX_
+#define KLEPTIC_UNIQUE_FUNCTION_HXX_
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/* room for a few captured pointers, e.g. a reference, a conn_t and a this */
+#define KLEPTIC_FUNCTION_INLINE_SIZE (6 * sizeof(void *))
+
+namespace Kleptic {
+
+template <typename Sig>
+class unique_function;
+
+/*
+ * unique_function<R(Args...)>
+ *
+ * move only std::function. callables up to KLEPTIC_FUNCTION_INLINE_SIZE
+ * that move without throwing are stored in place, bigger ones on the heap.
+ * unlike std::function it takes move only callables (a lambda owning a
+ * conn_t) and doesn't copy, so handing one over never allocates.
+ */
+template <typename R, typename... Args>
+class unique_function<R(Args...)> {
+  struct ops_t {
+    R (*invoke)(void *, Args &&...);
+    /* move constructs src into dst and destroys src */
+    void (*move)(void *dst, void *src) noexcept;
+    void (*destroy)(void *) noexcept;
+  };
+
+  template <typename F>
+  static constexpr bool fits_inline = sizeof(F) <= KLEPTIC_FUNCTION_INLINE_SIZE &&
+                                      alignof(F) <= alignof(std::max_align_t) &&
+                                      std::is_nothrow_move_constructible_v<F>;
+
+  template <typename F>
+  static const ops_t *ops_for() {
+    if constexpr (fits_inline<F>) {
+      static constexpr ops_t ops = {
+          [](void *p, Args &&... args) -> R {
+            return std::invoke(*static_cast<F *>(p), std::forward<Args>(args)...);
+          },
+          [](void *dst, void *src) noexcept {
+            ::new (dst) F(std::move(*static_cast<F *>(src)));
+            static_cast<F *>(src)->~F();
+          },
+          [](void *p) noexcept { static_cast<F *>(p)->~F(); }};
+      return &ops;
+    } else {
+      static constexpr ops_t ops = {
+          [](void *p, Args &&... args) -> R {
+            return std::invoke(**static_cast<F **>(p), std::forward<Args>(args)...);
+          },
+          [](void *dst, void *src) noexcept { *static_cast<F **>(dst) = *static_cast<F **>(src); },
+          [](void *p) noexcept { delete *static_cast<F **>(p); }};
+      return &ops;
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char buff[KLEPTIC_FUNCTION_INLINE_SIZE];
+  const ops_t *ops = nullptr;
+
+  void reset() noexcept {
+    if (ops != nullptr) {
+      ops->destroy(buff);
+      ops = nullptr;
+    }
+  }
+
+ public:
+  unique_function() noexcept = default;
+  unique_function(std::nullptr_t) noexcept {}
+
+  template <typename F, typename D = std::decay_t<F>,
+            typename = std::enable_if_t<!std::is_same_v<D, unique_function> &&
+                                        std::is_invocable_r_v<R, D &, Args...>>>
+  unique_function(F &&fn) {
+    if constexpr (fits_inline<D>) {
+      ::new (static_cast<void *>(buff)) D(std::forward<F>(fn));
+    } else {
+      *reinterpret_cast<D **>(buff) = new D(std::forward<F>(fn));
+    }
+    ops = ops_for<D>();
+  }
+
+  unique_function(unique_function &&o) noexcept : ops(o.ops) {
+    if (ops != nullptr) {
+      ops->move(buff, o.buff);
+      o.ops = nullptr;
+    }
+  }
+
+  unique_function &operator=(unique_function &&o) noexcept {
+    if (this != &o) {
+      reset();
+      if (o.ops != nullptr) {
+        o.ops->move(buff, o.buff);
+        ops = std::exchange(o.ops, nullptr);
+      }
+    }
+    return *this;
+  }
+
+  unique_function &operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  unique_function(const unique_function &) = delete;
+  unique_function &operator=(const unique_function &) = delete;
+
+  ~unique_function() { reset(); }
+
+  explicit operator bool() const noexcept { return ops != nullptr; }
+
+  R operator()(Args... args) {
+    if (ops == nullptr) {
+      throw std::bad_function_call();
+    }
+    return ops->invoke(buff, std::forward<Args>(args)...);
+  }
+};
+
+}  // namespace Kleptic
+
+#endif  // KLEPTIC_UNIQUE_FUNCTION_HXX_
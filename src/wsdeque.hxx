@@ -0,0 +1,125 @@
+#ifndef KLEPTIC_WSDEQUE_HXX_
+#define KLEPTIC_WSDEQUE_HXX_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#define KLEPTIC_CACHE_LINE 64
+
+namespace Kleptic {
+
+/*
+ * WorkStealingDeque
+ *
+ * Chase-Lev deque (Le et al. 2013, "Correct and Efficient Work-Stealing for
+ * Weak Memory Models"). the owning thread pushes and pops at the bottom,
+ * any other thread may steal from the top. T has to be trivially copyable,
+ * the runners store pointers.
+ *
+ * arrays replaced when growing are kept until the deque is destroyed, a
+ * thief may still be reading from them.
+ */
+template <typename T>
+class WorkStealingDeque {
+  struct Array {
+    const int64_t cap;
+    const int64_t mask;
+    std::unique_ptr<std::atomic<T>[]> buf;
+
+    explicit Array(int64_t c) : cap(c), mask(c - 1), buf(new std::atomic<T>[c]) {}
+    T get(int64_t i) const { return buf[i & mask].load(std::memory_order_relaxed); }
+    void put(int64_t i, T x) { buf[i & mask].store(x, std::memory_order_relaxed); }
+  };
+
+  alignas(KLEPTIC_CACHE_LINE) std::atomic<int64_t> top{0};
+  alignas(KLEPTIC_CACHE_LINE) std::atomic<int64_t> bottom{0};
+  alignas(KLEPTIC_CACHE_LINE) std::atomic<Array *> array;
+  std::vector<std::unique_ptr<Array>> arrays;
+
+ public:
+  explicit WorkStealingDeque(int64_t initial_cap = 256) {
+    int64_t cap = 1;
+    while (cap < initial_cap) {
+      cap <<= 1;
+    }
+    arrays.push_back(std::make_unique<Array>(cap));
+    array.store(arrays.back().get(), std::memory_order_relaxed);
+  }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  /* owner only */
+  void push(T x) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Array *a = array.load(std::memory_order_relaxed);
+    if (b - t > a->cap - 1) {
+      auto bigger = std::make_unique<Array>(a->cap * 2);
+      for (int64_t i = t; i < b; ++i) {
+        bigger->put(i, a->get(i));
+      }
+      a = bigger.get();
+      arrays.push_back(std::move(bigger));
+      array.store(a, std::memory_order_release);
+    }
+    a->put(b, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  /* owner only */
+  bool pop(T &out) {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array *a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    out = a->get(b);
+    if (t == b) {
+      // last element, race the thieves for it
+      bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed);
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  /* any thread */
+  bool steal(T &out) {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+    Array *a = array.load(std::memory_order_acquire);
+    T x = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return false;
+    }
+    out = x;
+    return true;
+  }
+
+  bool empty() const {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_relaxed);
+    return b <= t;
+  }
+};
+
+}  // namespace Kleptic
+
+#endif  // KLEPTIC_WSDEQUE_HXX_
@@ -0,0 +1,87 @@
+/**
+ * The HPACK decoder against header blocks that expand: a few KB of
+ * one byte references to a big dynamic table entry must stop at the
+ * header list limit instead of copying the entry for every reference.
+ */
+
+#include <cstdio>
+#include <string>
+
+#include "error.hxx"
+#include "hpack.hxx"
+#include "http2.hxx"
+
+using namespace Kleptic;
+
+static int failures = 0;
+
+#define CHECK(cond)                                              \
+  do {                                                           \
+    if (!(cond)) {                                               \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                \
+    }                                                            \
+  } while (0)
+
+/* a literal with incremental indexing, new name, then refs indexed references to it */
+static std::string expanding_block(size_t value_size, size_t refs) {
+  std::string block;
+  HPACK::encode_int(block, 0x40, 6, 0);
+  HPACK::encode_int(block, 0x00, 7, 1);
+  block += "x";
+  HPACK::encode_int(block, 0x00, 7, value_size);
+  block += std::string(value_size, 'a');
+  // index 62 is the newest dynamic entry
+  block.append(refs, static_cast<char>(0x80 | 62));
+  return block;
+}
+
+static const uint8_t *bytes(const std::string &s) {
+  return reinterpret_cast<const uint8_t *>(s.data());
+}
+
+int main() {
+  const size_t limit = 64 * 1024;
+
+  {
+    // 16 KB of references to a 4000 byte entry would be 64 MB decoded
+    std::string block = expanding_block(4000, 16 * 1024);
+    HPACK::Decoder d;
+    bool thrown = false;
+    try {
+      d.decode(bytes(block), block.size(), limit);
+    } catch (HTTP2Exception &e) {
+      thrown = true;
+      CHECK(e.err_code == HTTP2::ENHANCE_YOUR_CALM);
+      CHECK(e.stream_id == 0);
+    }
+    CHECK(thrown);
+  }
+
+  {
+    // just under the limit still decodes: (1 + 4000 + 32) * 16 < 64 KB
+    std::string block = expanding_block(4000, 15);
+    HPACK::Decoder d;
+    HPACK::header_list headers = d.decode(bytes(block), block.size(), limit);
+    CHECK(headers.size() == 16);
+    CHECK(headers.back().first == "x" && headers.back().second.size() == 4000);
+  }
+
+  {
+    // one more reference is over
+    std::string block = expanding_block(4000, 16);
+    HPACK::Decoder d;
+    bool thrown = false;
+    try {
+      d.decode(bytes(block), block.size(), limit);
+    } catch (HTTP2Exception &) {
+      thrown = true;
+    }
+    CHECK(thrown);
+  }
+
+  if (failures == 0) {
+    printf("hpack_test: ok\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
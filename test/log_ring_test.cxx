@@ -0,0 +1,78 @@
+/**
+ * LogRing claims that are never written: the consumer gives up on them
+ * after stall_timeout and carries on with the records behind them, and
+ * the producer that shows up late finds its claim gone and drops its
+ * record, also once a newer record has been claimed in the same place.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "log_ring.hxx"
+
+using namespace Kleptic;
+
+static int failures = 0;
+
+#define CHECK(cond)                                              \
+  do {                                                           \
+    if (!(cond)) {                                               \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                \
+    }                                                            \
+  } while (0)
+
+static const auto wait = IPC::LogRing::stall_timeout + std::chrono::milliseconds(500);
+
+int main() {
+  uint16_t type;
+  std::string record;
+
+  {
+    IPC::LogRing ring(1024);
+    CHECK(ring.push(1, "first"));
+    CHECK(ring.pop(type, record, wait) && type == 1 && record == "first");
+
+    // a producer that stalls before writing holds up everything behind it
+    IPC::LogRing::Claim late = ring.claim(2, 4);
+    CHECK(late);
+    CHECK(ring.push(3, "behind"));
+    auto start = std::chrono::steady_clock::now();
+    CHECK(ring.pop(type, record, wait) && type == 3 && record == "behind");
+    CHECK(std::chrono::steady_clock::now() - start >= IPC::LogRing::stall_timeout);
+    CHECK(ring.dropped() == 1);
+
+    CHECK(!ring.commit(late, "late"));
+    CHECK(ring.push(4, "after"));
+    CHECK(ring.pop(type, record, wait) && type == 4 && record == "after");
+    CHECK(!ring.pop(type, record, std::chrono::milliseconds(10)));
+  }
+
+  {
+    // 16 bytes of header and 16 of payload, 8 records go round once
+    IPC::LogRing ring(256);
+    const std::string payload(16, 'x');
+    IPC::LogRing::Claim late = ring.claim(1, payload.size());
+    CHECK(late);
+    CHECK(!ring.pop(type, record, wait));
+    CHECK(ring.dropped() == 1);
+    for (int i = 0; i < 7; ++i) {
+      CHECK(ring.push(2, payload));
+      CHECK(ring.pop(type, record, wait) && type == 2);
+    }
+
+    // a new claim where the abandoned one was, a lap later
+    IPC::LogRing::Claim next = ring.claim(3, payload.size());
+    CHECK(next && next.pos == late.pos + 256);
+    CHECK(!ring.commit(late, std::string(16, 'l')));
+    CHECK(ring.commit(next, payload));
+    CHECK(ring.pop(type, record, wait) && type == 3 && record == payload);
+    CHECK(ring.dropped() == 1);
+  }
+
+  if (failures == 0) {
+    printf("log_ring_test: ok\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
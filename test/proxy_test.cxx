@@ -0,0 +1,302 @@
+/**
+ * The proxy between a client and two keep-alive upstreams, all running in
+ * this process: which headers make it through either way, how each kind
+ * of body is relayed, that upstream connections are pooled and a request
+ * whose pooled connection drops is sent again, and that an upstream
+ * failing its health check stops getting requests.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "concurrency.hxx"
+#include "error.hxx"
+#include "http.hxx"
+#include "proxy.hxx"
+#include "server.hxx"
+#include "strutil.hxx"
+#include "tcp_sock.hxx"
+
+using namespace Kleptic;
+
+static int failures = 0;
+
+#define CHECK(cond)                                              \
+  do {                                                           \
+    if (!(cond)) {                                               \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                \
+    }                                                            \
+  } while (0)
+
+static std::atomic<int> connections{0};
+static std::atomic<int> dropped{0};
+static std::atomic<bool> down[2];
+
+/* reads one request head and its body off s, false at EOF */
+static bool read_request(Socket &s, std::string &buff, std::string &head) {
+  char chunk[TCP_BUFF_SIZE];
+  size_t end;
+  while ((end = buff.find("\r\n\r\n")) == std::string::npos) {
+    int ret = s.read(chunk, sizeof(chunk));
+    if (ret <= 0) {
+      return false;
+    }
+    buff.append(chunk, ret);
+  }
+  head = buff.substr(0, end);
+  size_t body_len = 0;
+  const std::string lower = Util::to_lower(head);
+  size_t pos = lower.find("\r\ncontent-length:");
+  if (pos != std::string::npos) {
+    body_len = std::stoul(lower.substr(pos + 17));
+  }
+  while (buff.size() < end + 4 + body_len) {
+    int ret = s.read(chunk, sizeof(chunk));
+    if (ret <= 0) {
+      return false;
+    }
+    buff.append(chunk, ret);
+  }
+  buff.erase(0, end + 4 + body_len);
+  return true;
+}
+
+/*
+ * answers /echo with the request head it got, /chunked and /close with
+ * chunked and close delimited bodies, /health with 503 while down[id] is
+ * set. after /drop-next the next request on that connection is read and
+ * the connection closed without an answer.
+ */
+static void upstream(int id, int port) {
+  static Concurrency::runner_t exec = std::make_unique<Concurrency::ThreadRunner>();
+  TCPServer server("127.0.0.1", port, exec);
+  server.run([id, port](conn_t conn) {
+    const int serial = ++connections;
+    std::string buff;
+    std::string head;
+    int served = 0;
+    bool drop_next = false;
+    while (read_request(*conn->socket, buff, head)) {
+      if (drop_next) {
+        ++dropped;
+        return;
+      }
+      std::string path = head.substr(head.find(' ') + 1);
+      path = path.substr(0, path.find(' '));
+      if (path.rfind("/two", 0) == 0) {
+        path = path.substr(4);
+      }
+      ++served;
+      std::stringstream resp;
+      std::string common = "X-Port: " + std::to_string(port) +
+                           "\r\nX-Conn: " + std::to_string(serial) +
+                           "\r\nX-Served: " + std::to_string(served) + "\r\n";
+      if (path == "/health") {
+        resp << (down[id] ? "HTTP/1.1 503 Down\r\n" : "HTTP/1.1 200 OK\r\n")
+             << "Content-Length: 0\r\n\r\n";
+      } else if (path == "/chunked") {
+        resp << "HTTP/1.1 200 OK\r\n" << common << "Transfer-Encoding: chunked\r\n\r\n";
+        for (int i = 0; i < 3; ++i) {
+          std::string piece = "piece " + std::to_string(i) + "\n";
+          resp << std::hex << piece.size() << std::dec << "\r\n" << piece << "\r\n";
+        }
+        resp << "0\r\n\r\n";
+      } else if (path == "/close") {
+        resp << "HTTP/1.1 200 OK\r\n" << common << "Connection: close\r\n\r\nuntil the end\n";
+        conn->socket->write(resp.str());
+        return;
+      } else {
+        drop_next = path == "/drop-next";
+        resp << "HTTP/1.1 200 OK\r\n"
+             << common << "Connection: X-Up-Private\r\nX-Up-Private: 1\r\nX-Up-Public: 1\r\n"
+             << "Keep-Alive: timeout=5\r\nContent-Length: " << head.size() << "\r\n\r\n"
+             << head;
+      }
+      conn->socket->write(resp.str());
+    }
+  });
+}
+
+/* the whole response to request from the proxy, which closes after a relayed one */
+static std::string fetch(int port, const std::string &request) {
+  sock_ptr s = tcp_connect("127.0.0.1", port, std::chrono::milliseconds(2000));
+  struct timeval tv = {5, 0};
+  setsockopt(s->_socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  s->write(request);
+  std::string resp;
+  char buff[4096];
+  try {
+    int ret;
+    while ((ret = s->read(buff, sizeof(buff))) > 0) {
+      resp.append(buff, ret);
+    }
+  } catch (SocketException &) {
+    // timed out, what came so far is checked
+  }
+  return resp;
+}
+
+static std::string get(int port, const std::string &path, const std::string &headers = "") {
+  return fetch(port, "GET " + path + " HTTP/1.1\r\nHost: test\r\n" + headers +
+                         "Connection: close\r\n\r\n");
+}
+
+static int status(const std::string &resp) {
+  return resp.size() > 12 ? std::atoi(resp.c_str() + 9) : 0;
+}
+
+/* the value of a response header, empty if it isn't there */
+static std::string header(const std::string &resp, const std::string &name) {
+  const std::string head = Util::to_lower(resp.substr(0, resp.find("\r\n\r\n")));
+  size_t pos = head.find("\r\n" + Util::to_lower(name) + ":");
+  if (pos == std::string::npos) {
+    return "";
+  }
+  pos += name.size() + 3;
+  return Util::trim(resp.substr(pos, resp.find("\r\n", pos) - pos));
+}
+
+static std::string body(const std::string &resp) {
+  size_t end = resp.find("\r\n\r\n");
+  return end == std::string::npos ? "" : resp.substr(end + 4);
+}
+
+static bool has(const std::string &s, const std::string &what) {
+  return Util::to_lower(s).find(Util::to_lower(what)) != std::string::npos;
+}
+
+static void wait_for_port(int port) {
+  for (int i = 0; i < 100; ++i) {
+    try {
+      tcp_connect("127.0.0.1", port, std::chrono::milliseconds(100));
+      return;
+    } catch (SocketException &) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+  }
+}
+
+int main() {
+  const int base = 40000 + (getpid() % 1000) * 8;
+  const int proxy_port = base;
+  const int up_ports[2] = {base + 1, base + 2};
+
+  for (int id = 0; id < 2; ++id) {
+    std::thread(upstream, id, up_ports[id]).detach();
+  }
+
+  // one upstream for the request tests, both behind /two with quick health checks
+  Proxy::Balancer one({{"127.0.0.1", up_ports[0]}});
+  Proxy::ProxyOptions opts;
+  opts.health_path = "/two/health";
+  opts.health_interval = std::chrono::milliseconds(100);
+  Proxy::Balancer two({{"127.0.0.1", up_ports[0]}, {"127.0.0.1", up_ports[1]}}, opts);
+
+  static Concurrency::runner_t exec = std::make_unique<Concurrency::ThreadPoolRunner>(4);
+  static HTTPServer server("127.0.0.1", proxy_port, exec, "");
+  std::thread([&one, &two] {
+    server.run([&one, &two](HTTPConn &c) {
+      (c.req_path.rfind("/two", 0) == 0 ? two : one).forward(c);
+    });
+  }).detach();
+  wait_for_port(proxy_port);
+  wait_for_port(up_ports[0]);
+  wait_for_port(up_ports[1]);
+
+  {
+    // hop-by-hop headers and the ones Connection names stay on their side
+    std::string resp = get(proxy_port, "/echo",
+                           "Keep-Alive: timeout=1\r\nTE: trailers\r\nX-Secret: 1\r\n"
+                           "Connection: X-Secret\r\nX-Kept: yes\r\n"
+                           "X-Forwarded-For: 10.0.0.1\r\n");
+    const std::string seen = body(resp);
+    CHECK(status(resp) == 200);
+    CHECK(has(seen, "\r\nx-kept: yes"));
+    CHECK(!has(seen, "x-secret"));
+    CHECK(!has(seen, "\r\nkeep-alive:"));
+    CHECK(!has(seen, "\r\nte:"));
+    CHECK(has(seen, "\r\nconnection: keep-alive"));
+    CHECK(has(seen, "\r\nx-forwarded-for: 10.0.0.1, 127.0.0.1"));
+    CHECK(header(resp, "X-Up-Public") == "1");
+    CHECK(header(resp, "X-Up-Private").empty());
+    CHECK(header(resp, "Keep-Alive").empty());
+  }
+
+  {
+    // every way of ending a body
+    std::string resp = get(proxy_port, "/chunked");
+    CHECK(status(resp) == 200 && body(resp) == "piece 0\npiece 1\npiece 2\n");
+    resp = get(proxy_port, "/close");
+    CHECK(status(resp) == 200 && body(resp) == "until the end\n");
+    resp = get(proxy_port, "/echo");
+    CHECK(status(resp) == 200 && body(resp).rfind("GET /echo HTTP/1.1\r\n", 0) == 0);
+    CHECK(body(resp).size() > 2 && body(resp).compare(body(resp).size() - 2, 2, "\r\n") != 0);
+  }
+
+  {
+    // back to back requests share one upstream connection
+    std::string first = get(proxy_port, "/echo");
+    std::string second = get(proxy_port, "/echo");
+    CHECK(!header(first, "X-Conn").empty());
+    CHECK(header(first, "X-Conn") == header(second, "X-Conn"));
+    CHECK(std::stoi(header(second, "X-Served")) == std::stoi(header(first, "X-Served")) + 1);
+  }
+
+  {
+    // the pooled connection drops the next request, a GET goes again on a new one
+    std::string armed = get(proxy_port, "/drop-next");
+    std::string resp = get(proxy_port, "/echo");
+    CHECK(status(resp) == 200);
+    CHECK(dropped == 1);
+    CHECK(header(resp, "X-Conn") != header(armed, "X-Conn"));
+    CHECK(header(resp, "X-Served") == "1");
+
+    // a POST the upstream may have acted on isn't sent twice
+    get(proxy_port, "/drop-next");
+    resp = fetch(proxy_port,
+                 "POST /echo HTTP/1.1\r\nHost: test\r\nContent-Length: 2\r\n"
+                 "Connection: close\r\n\r\nhi");
+    CHECK(status(resp) == 502);
+    CHECK(dropped == 2);
+  }
+
+  {
+    // both upstreams take turns, until one fails its health check
+    bool seen[2] = {false, false};
+    for (int i = 0; i < 6; ++i) {
+      const int port = std::stoi("0" + header(get(proxy_port, "/two/echo"), "X-Port"));
+      seen[0] = seen[0] || port == up_ports[0];
+      seen[1] = seen[1] || port == up_ports[1];
+    }
+    CHECK(seen[0] && seen[1]);
+
+    down[1] = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    CHECK(!two.stats()[1].healthy);
+    for (int i = 0; i < 6; ++i) {
+      std::string resp = get(proxy_port, "/two/echo");
+      CHECK(status(resp) == 200 && header(resp, "X-Port") == std::to_string(up_ports[0]));
+    }
+
+    down[1] = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    CHECK(two.stats()[1].healthy);
+  }
+
+  if (failures == 0) {
+    printf("proxy_test: ok\n");
+  }
+  // the servers never return, leave without unwinding them
+  fflush(stdout);
+  _exit(failures == 0 ? 0 : 1);
+}
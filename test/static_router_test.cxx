@@ -0,0 +1,100 @@
+/**
+ * A StaticRouter with more routes than a brute force seed search could
+ * place (it gave up around 40 and hit the constexpr limit at 64): every
+ * route must get its own slot, found at compile time, and dispatch to
+ * its own handler.
+ */
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include "http.hxx"
+#include "static_router.hxx"
+
+using namespace Kleptic;
+
+static int failures = 0;
+
+#define CHECK(cond)                                              \
+  do {                                                           \
+    if (!(cond)) {                                               \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                \
+    }                                                            \
+  } while (0)
+
+static int last_get = -1;
+static int last_post = -1;
+
+template <int I>
+void get_route(HTTPConn &) {
+  last_get = I;
+}
+
+template <int I>
+void post_route(HTTPConn &) {
+  last_post = I;
+}
+
+#define PATH(n) static constexpr char path_##n[] = "/api/v1/resource" #n;
+#define TEN(d) PATH(d##0) PATH(d##1) PATH(d##2) PATH(d##3) PATH(d##4) \
+               PATH(d##5) PATH(d##6) PATH(d##7) PATH(d##8) PATH(d##9)
+TEN(1) TEN(2) TEN(3) TEN(4) TEN(5) TEN(6) TEN(7) TEN(8)
+
+#define GET(n) Static::Get<path_##n, get_route<n>>
+#define GET_TEN(d) GET(d##0), GET(d##1), GET(d##2), GET(d##3), GET(d##4), \
+                   GET(d##5), GET(d##6), GET(d##7), GET(d##8), GET(d##9)
+#define POST(n) Static::Post<path_##n, post_route<n>>
+#define POST_TEN(d) POST(d##0), POST(d##1), POST(d##2), POST(d##3), POST(d##4), \
+                    POST(d##5), POST(d##6), POST(d##7), POST(d##8), POST(d##9)
+
+// 80 GETs and 20 POSTs on the same paths
+using api = Static::StaticRouter<GET_TEN(1), GET_TEN(2), GET_TEN(3), GET_TEN(4), GET_TEN(5),
+                                 GET_TEN(6), GET_TEN(7), GET_TEN(8), POST_TEN(1), POST_TEN(2)>;
+
+static_assert(api::lookup(Method::GET, "/api/v1/resource10") == 0);
+static_assert(api::lookup(Method::GET, "/api/v1/resource89") == 79);
+static_assert(api::lookup(Method::POST, "/api/v1/resource10") == 80);
+static_assert(api::lookup(Method::POST, "/api/v1/resource30") == -1);
+static_assert(api::lookup(Method::GET, "/api/v1/resource90") == -1);
+
+// a route given twice is told apart from a table that can't be built
+constexpr std::array<std::string_view, 3> dup_paths = {"/a", "/b", "/a"};
+constexpr std::array<Method::method_t, 3> dup_methods = {Method::GET, Method::GET, Method::GET};
+static_assert(Static::detail::build_table<3, 2, 8>(dup_paths, dup_methods).duplicate);
+constexpr std::array<Method::method_t, 3> other_methods = {Method::GET, Method::GET, Method::POST};
+static_assert(Static::detail::build_table<3, 2, 8>(dup_paths, other_methods).placed);
+
+static int dispatch(const std::string &method, const std::string &path) {
+  HTTPConn c;
+  c.method = method;
+  c.route_unparsed_path = path;
+  last_get = -1;
+  last_post = -1;
+  api::handle(c);
+  return method == "POST" ? last_post : last_get;
+}
+
+int main() {
+  for (int n = 10; n < 90; ++n) {
+    const std::string path = "/api/v1/resource" + std::to_string(n);
+    CHECK(api::lookup(Method::GET, path) == n - 10);
+    CHECK(dispatch("GET", path) == n);
+    // HEAD falls back to GET, and paths below a route are served by it
+    CHECK(dispatch("HEAD", path) == n);
+    CHECK(dispatch("GET", path + "/below") == n);
+    if (n < 30) {
+      CHECK(dispatch("POST", path) == n);
+    } else {
+      CHECK(dispatch("POST", path) == -1);
+    }
+  }
+  CHECK(dispatch("GET", "/api/v1/resource9") == -1);
+  CHECK(dispatch("GET", "/elsewhere") == -1);
+
+  if (failures == 0) {
+    printf("static_router_test: ok\n");
+  }
+  return failures == 0 ? 0 : 1;
+}